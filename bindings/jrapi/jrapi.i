@@ -11,12 +11,17 @@ or they won't have effect.
 */
 
 %rename("AlignerState") "rapi_aligner_state";
+%rename("AlignJob")     "rapi_align_job";
+%rename("CompetitiveResult") "rapi_competitive_result";
 %rename("Alignment")    "rapi_alignment";
 %rename("Batch")        "rapi_batch_wrap";
+%rename("Flagstat")     "rapi_flagstat";
+%rename("Metrics")      "rapi_metrics";
 %rename("Contig")       "rapi_contig";
 %rename("Opts")         "rapi_opts";
 %rename("Read")         "rapi_read";
 %rename("Ref")          "rapi_ref";
+%rename("RefHit")       "rapi_ref_hit";
 
 %rename("getAlignerName")    "rapi_aligner_name";
 %rename("getAlignerVersion") "rapi_aligner_version";
@@ -43,6 +48,7 @@ or they won't have effect.
 #include <stddef.h>
 #include <stdio.h>
 #include <rapi.h>
+#include <rapi_metrics.h>
 #include <rapi_utils.h>
 %}
 
@@ -67,6 +73,9 @@ const char* rapi_err_to_except(rapi_error_t error_code)
     case RAPI_TYPE_ERROR:
       return FQ_EXCEPTION_NAME(RapiInvalidTypeException);
 
+    case RAPI_CANCELLED:
+      return FQ_EXCEPTION_NAME(RapiCancelledException);
+
     default:
     case RAPI_GENERIC_ERROR:
       return FQ_EXCEPTION_NAME(RapiException);
@@ -268,6 +277,14 @@ typedef struct rapi_contig {
 public java.util.Iterator<Contig> iterator() {
   return new RefIterator(this);
 }
+
+// for the Ref[] arguments of the native methods
+static long[] cPtrs(Ref[] refs) {
+  long[] ptrs = new long[refs.length];
+  for (int i = 0; i < refs.length; ++i)
+    ptrs[i] = getCPtr(refs[i]);
+  return ptrs;
+}
 ";
 
 /**
@@ -612,6 +629,7 @@ typedef struct rapi_alignment {
     rapi_bool mapped;
     rapi_bool reverseStrand;
     rapi_bool secondaryAln;
+    rapi_bool duplicate;
 
     /** Get the alignment as an array of AlignOp */
     rapi_cigar_ops getCigarOps(void) const {
@@ -659,6 +677,10 @@ rapi_bool rapi_alignment_reverseStrand_get(const rapi_alignment* aln) {
 rapi_bool rapi_alignment_secondaryAln_get(const rapi_alignment* aln) {
     return aln->secondary_aln != 0;
 }
+
+rapi_bool rapi_alignment_duplicate_get(const rapi_alignment* aln) {
+    return aln->duplicate != 0;
+}
 %}
 
 
@@ -955,6 +977,303 @@ Set_exception_from_error_t(rapi_batch_wrap::setRead);
 */
 }
 
+/***************************************/
+/*      Asynchronous alignment jobs    */
+/***************************************/
+
+%{ // forward declaration of opaque structure (in C-code)
+struct rapi_align_job;
+%}
+
+%nodefaultctor rapi_align_job;
+
+// The job keeps the aligner, ref and batch it uses referenced until it's
+// deleted, so that the collector can't free them while it runs.
+%typemap(javacode) struct rapi_align_job "
+private Object[] owners;
+
+void keep(Object... objects) {
+  owners = objects;
+}
+";
+
+%typemap(javadestruct, methodname="delete", methodmodifiers="public synchronized") struct rapi_align_job {
+    if (swigCPtr != 0) {
+      if (swigCMemOwn) {
+        swigCMemOwn = false;
+        $jnicall;
+      }
+      swigCPtr = 0;
+    }
+    owners = null;
+  }
+
+typedef struct rapi_align_job {} rapi_align_job;
+
+Set_exception_from_error_t(rapi_align_job::waitFor);
+
+%extend rapi_align_job {
+  ~rapi_align_job(void) {
+    rapi_align_job_free($self);
+  }
+
+  // throws if the alignment failed
+  rapi_error_t waitFor(void)
+  {
+    return rapi_align_job_wait($self);
+  }
+
+  rapi_bool isDone(void)
+  {
+    int done = 0;
+    rapi_align_job_poll($self, &done);
+    return done;
+  }
+};
+
+/***************************************/
+/*      QC metrics                     */
+/***************************************/
+
+%typemap(jni) rapi_uint64_array  "jlongArray";
+%typemap(jstype) rapi_uint64_array  "long[]"
+%typemap(jtype) rapi_uint64_array  "long[]"
+
+// Map rapi_uint64_array to a long[].  A NULL array means an exception has already been thrown.
+%typemap(out) rapi_uint64_array {
+    if (NULL == $1.values)
+      return $null;
+
+    jlongArray array = (*jenv)->NewLongArray(jenv, $1.len);
+    if (!array) {
+      do_rapi_throw(jenv, RAPI_MEMORY_ERROR, "Failed to allocate array for counts");
+      return $null;
+    }
+    for (rapi_ssize_t i = 0; i < $1.len; ++i) {
+      jlong v = (jlong)$1.values[i];
+      (*jenv)->SetLongArrayRegion(jenv, array, i, 1, &v);
+    }
+    $result = array;
+}
+
+%typemap(javaout) rapi_uint64_array {
+    return $jnicall;
+}
+
+%{
+typedef struct {
+    const uint64_t* values;
+    rapi_ssize_t len;
+} rapi_uint64_array;
+
+struct rapi_metrics;
+%}
+
+// The counts are uint64_t;  declare them as long long so that Java sees them as long.
+typedef struct {
+  long long n_records;
+  long long n_secondary;
+  long long n_supplementary;
+  long long n_duplicates;
+  long long n_mapped;
+  long long n_paired;
+  long long n_read1;
+  long long n_read2;
+  long long n_proper_pairs;
+  long long n_both_mapped;
+  long long n_singletons;
+  long long n_mate_other_contig;
+  long long n_mate_other_contig_q5;
+} rapi_flagstat;
+
+%nodefaultctor rapi_metrics;
+
+// inject default contructor into Java class
+%typemap(javacode) struct rapi_metrics "
+public Metrics(Ref ref) {
+  this(ref, 1000, 2000);
+}
+";
+
+typedef struct rapi_metrics {} rapi_metrics;
+
+Set_exception_from_error_t(rapi_metrics::clear);
+%javaexception("RapiException") rapi_metrics::getCoverage {
+  $action
+}
+
+// The caller must keep ref referenced for as long as the Metrics object is used.
+%extend rapi_metrics {
+  rapi_metrics(JNIEnv* jenv, const rapi_ref* ref, int coverageBinSize, int maxInsertSize)
+  {
+    rapi_metrics* metrics;
+    rapi_error_t error = rapi_metrics_init(&metrics, ref, coverageBinSize, maxInsertSize);
+    if (RAPI_NO_ERROR != error) {
+      do_rapi_throw(jenv, error, "Failed to create metrics");
+      return NULL;
+    }
+    return metrics;
+  }
+
+  ~rapi_metrics(void) {
+    rapi_metrics_free($self);
+  }
+
+  rapi_error_t clear(void)
+  {
+    return rapi_metrics_clear($self);
+  }
+
+  // samtools flagstat counts.  Valid until the Metrics object is collected.
+  const rapi_flagstat* getFlagstat(void) const
+  {
+    return rapi_metrics_flagstat($self);
+  }
+
+  // number of primary mapped reads for each MAPQ
+  rapi_uint64_array getMapqHistogram(void) const
+  {
+    rapi_uint64_array a = { rapi_metrics_mapq_histogram($self), RAPI_METRICS_MAPQ_BINS };
+    return a;
+  }
+
+  // number of pairs for each insert size;  the last bin also counts larger ones
+  rapi_uint64_array getInsertSizeHistogram(void) const
+  {
+    int n_bins;
+    rapi_uint64_array a;
+    a.values = rapi_metrics_insert_size_histogram($self, &n_bins);
+    a.len = n_bins;
+    return a;
+  }
+
+  // aligned bases in each bin of the contig with index `contig`
+  rapi_uint64_array getCoverage(JNIEnv* jenv, int contig) const
+  {
+    rapi_uint64_array a;
+    a.values = rapi_metrics_coverage($self, contig, &a.len);
+    if (NULL == a.values)
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "contig index out of range");
+    return a;
+  }
+
+  int getCoverageBinSize(void) const
+  {
+    return rapi_metrics_coverage_bin_size($self);
+  }
+};
+
+/***************************************/
+/*      Competitive alignment          */
+/***************************************/
+
+// A Ref[] argument becomes the array of references (copies sharing their
+// loaded data) and its length.  The Java array keeps the Refs referenced
+// during the call.
+%typemap(jni) (const rapi_ref* refs, int n_refs) "jlongArray"
+%typemap(jtype) (const rapi_ref* refs, int n_refs) "long[]"
+%typemap(jstype) (const rapi_ref* refs, int n_refs) "Ref[]"
+%typemap(javain) (const rapi_ref* refs, int n_refs) "Ref.cPtrs($javainput)"
+%typemap(in) (const rapi_ref* refs, int n_refs) {
+  if (NULL == $input) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "refs must not be null");
+    return $null;
+  }
+  $2 = (*jenv)->GetArrayLength(jenv, $input);
+  rapi_ref* array = rapi_malloc(jenv, ($2 > 0 ? $2 : 1) * sizeof(rapi_ref));
+  if (NULL == array)
+    return $null;
+  jlong* ptrs = (*jenv)->GetLongArrayElements(jenv, $input, NULL);
+  int null_ref = 0;
+  for (int i = 0; i < $2; ++i) {
+    if (0 == ptrs[i])
+      null_ref = 1;
+    else
+      array[i] = *(rapi_ref*)(intptr_t)ptrs[i];
+  }
+  (*jenv)->ReleaseLongArrayElements(jenv, $input, ptrs, JNI_ABORT);
+  if (null_ref) {
+    free(array);
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "refs must not contain null");
+    return $null;
+  }
+  $1 = array;
+}
+%typemap(freearg) (const rapi_ref* refs, int n_refs) {
+  free((rapi_ref*)$1);
+}
+
+%{
+/* The result of rapi_align_reads_competitive on a Batch. */
+typedef struct {
+  rapi_ssize_t n_frags;
+  int n_reads_frag;
+  int n_refs;
+  int* classes;
+  rapi_ref_hit* hits;
+} rapi_competitive_result;
+
+rapi_bool rapi_ref_hit_reverseStrand_get(const rapi_ref_hit* hit) {
+    return hit->reverse_strand != 0;
+}
+%}
+
+%nodefaultctor rapi_ref_hit;
+
+/** The primary alignment of a read to one of the references. */
+typedef struct rapi_ref_hit {
+  int contig; // index in the reference;  -1 if the read isn't mapped there
+  rapi_ssize_t pos;
+  int score;
+  uint8_t mapq;
+} rapi_ref_hit;
+
+%extend rapi_ref_hit {
+  rapi_bool reverseStrand;
+};
+
+%nodefaultctor rapi_competitive_result;
+
+typedef struct {} rapi_competitive_result;
+
+%exception rapi_competitive_result::getHit {
+  $action
+  if (result == NULL) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "index out of bounds");
+  }
+}
+%javaexception("RapiException") rapi_competitive_result::getFragmentClass {
+  $action
+}
+
+%extend rapi_competitive_result {
+  ~rapi_competitive_result(void) {
+    free($self->hits);
+    free($self->classes);
+    free($self);
+  }
+
+  rapi_ssize_t getNFragments(void) const { return $self->n_frags; }
+
+  int getNRefs(void) const { return $self->n_refs; }
+
+  /** The index of the fragment's best Ref, or REF_UNMAPPED or REF_AMBIGUOUS. */
+  int getFragmentClass(JNIEnv* jenv, rapi_ssize_t frag) const {
+    if (frag < 0 || frag >= $self->n_frags) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "fragment index out of bounds");
+      return 0;
+    }
+    return $self->classes[frag];
+  }
+
+  /** The primary alignment of read `read` of fragment `frag` to Ref `ref`.  Valid until this object is collected. */
+  const rapi_ref_hit* getHit(rapi_ssize_t frag, int read, int ref) const {
+    if (frag < 0 || frag >= $self->n_frags || read < 0 || read >= $self->n_reads_frag || ref < 0 || ref >= $self->n_refs)
+      return NULL; // exception raised in %exception block
+    return &$self->hits[(frag * $self->n_reads_frag + read) * $self->n_refs + ref];
+  }
+};
+
 /***************************************/
 /*      The aligner                    */
 /***************************************/
@@ -970,11 +1289,32 @@ struct rapi_aligner_state;
 public AlignerState() {
   this(null);
 }
+
+public CompetitiveResult alignReadsCompetitive(Ref[] refs, Batch batch) throws RapiException {
+  return alignReadsCompetitive(refs, batch, 0);
+}
+
+public AlignJob alignReadsAsync(Ref ref, Batch batch) throws RapiException {
+  AlignJob job = submitAlignJob(ref, batch);
+  job.keep(this, ref, batch);
+  return job;
+}
 ";
 
 typedef struct rapi_aligner_state {} rapi_aligner_state; //< opaque structure.  Aligner can use for whatever it wants.
 
 Set_exception_from_error_t(rapi_aligner_state::alignReads);
+Set_exception_from_error_t(rapi_aligner_state::cancel);
+Set_exception_from_error_t(rapi_aligner_state::setMetrics);
+%javamethodmodifiers rapi_aligner_state::submitAlignJob "private";
+%newobject rapi_aligner_state::submitAlignJob;
+%javaexception("RapiException") rapi_aligner_state::submitAlignJob {
+  $action
+}
+%newobject rapi_aligner_state::alignReadsCompetitive;
+%javaexception("RapiException") rapi_aligner_state::alignReadsCompetitive {
+  $action
+}
 
 %extend rapi_aligner_state {
   rapi_aligner_state(JNIEnv* jenv, const rapi_opts* opts)
@@ -1012,6 +1352,78 @@ Set_exception_from_error_t(rapi_aligner_state::alignReads);
     rapi_ssize_t end_fragment = batch->len / batch->batch->n_reads_frag;
     return rapi_align_reads(ref, batch->batch, start_fragment, end_fragment, $self);
   }
+
+  // Align batch to each of refs (see rapi_align_reads_competitive).  The
+  // reads keep their alignments to their fragment's best Ref.
+  rapi_competitive_result* alignReadsCompetitive(JNIEnv* jenv, const rapi_ref* refs, int n_refs,
+      rapi_batch_wrap* batch, int minScoreMargin)
+  {
+    if (NULL == batch) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "batch argument must not be null");
+      return NULL;
+    }
+
+    if (batch->len % batch->batch->n_reads_frag != 0) {
+      do_rapi_throw(jenv, RAPI_GENERIC_ERROR, "Incomplete fragment in batch");
+      return NULL;
+    }
+
+    rapi_competitive_result* result = rapi_malloc(jenv, sizeof(rapi_competitive_result));
+    if (NULL == result)
+      return NULL;
+    result->n_frags = batch->len / batch->batch->n_reads_frag;
+    result->n_reads_frag = batch->batch->n_reads_frag;
+    result->n_refs = n_refs;
+    result->classes = calloc(result->n_frags + 1, sizeof(int));
+    result->hits = calloc(result->n_frags * result->n_reads_frag * n_refs + 1, sizeof(rapi_ref_hit));
+    rapi_error_t error = RAPI_MEMORY_ERROR;
+    if (result->classes && result->hits)
+      error = rapi_align_reads_competitive(refs, n_refs, batch->batch, 0, result->n_frags, $self,
+          minScoreMargin, result->hits, result->classes);
+    if (RAPI_NO_ERROR != error) {
+      free(result->hits);
+      free(result->classes);
+      free(result);
+      do_rapi_throw(jenv, error, "Competitive alignment failed");
+      return NULL;
+    }
+    return result;
+  }
+
+  rapi_error_t cancel(void)
+  {
+    return rapi_aligner_state_cancel($self);
+  }
+
+  // Collect QC metrics of the following alignments into metrics, or stop with null.
+  // The caller must keep metrics referenced while it's attached.
+  rapi_error_t setMetrics(rapi_metrics* metrics)
+  {
+    return rapi_aligner_state_set_metrics($self, metrics);
+  }
+
+  // Use alignReadsAsync, which makes the job keep ref and batch referenced.
+  rapi_align_job* submitAlignJob(JNIEnv* jenv, const rapi_ref* ref, rapi_batch_wrap* batch)
+  {
+    if (NULL == ref || NULL == batch) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "ref and batch arguments must not be NULL");
+      return NULL;
+    }
+
+    if (batch->len % batch->batch->n_reads_frag != 0) {
+      do_rapi_throw(jenv, RAPI_GENERIC_ERROR, "Incomplete fragment in batch");
+      return NULL;
+    }
+
+    rapi_ssize_t end_fragment = batch->len / batch->batch->n_reads_frag;
+    rapi_align_job* job = NULL;
+    rapi_error_t error = rapi_align_reads_async(ref, batch->batch, 0, end_fragment, $self, NULL, NULL, &job);
+    if (RAPI_NO_ERROR != error) {
+      do_rapi_throw(jenv, error, "Failed to submit alignment job");
+      return NULL;
+    }
+    return job;
+  }
 };
 
 /***************************************/
@@ -131,6 +131,7 @@ public class TestRapiAligner
     assertTrue(aln.getMapped());
     assertFalse(aln.getReverseStrand());
     assertFalse(aln.getSecondaryAln());
+    assertFalse(aln.getDuplicate());
     assertEquals(0, aln.getNMismatches());
     assertEquals(0, aln.getNGapOpens());
     assertEquals(0, aln.getNGapExtensions());
@@ -194,6 +195,101 @@ public class TestRapiAligner
     assertEquals(0L, Rapi.getInsertSize(aln1, aln1));
   }
 
+  @Test
+  public void testMetrics() throws RapiException
+  {
+    Metrics metrics = new Metrics(refObj, 1000, 500);
+    aligner = new AlignerState(rapiOpts);
+    aligner.setMetrics(metrics);
+    aligner.alignReads(refObj, reads);
+    aligner.setMetrics(null);
+
+    Flagstat flagstat = metrics.getFlagstat();
+    assertEquals(reads.getNFragments(), flagstat.getNRead1());
+    assertEquals(reads.getNFragments(), flagstat.getNRead2());
+    assertTrue(flagstat.getNMapped() > 0);
+    assertTrue(flagstat.getNMapped() <= flagstat.getNRecords());
+    long mapped = flagstat.getNMapped();
+
+    long[] mapq = metrics.getMapqHistogram();
+    assertEquals(256, mapq.length);
+    assertTrue(mapq[60] > 0);
+    // read_00 is a pair 121 bases long, at 32461 on chr1
+    long[] isize = metrics.getInsertSizeHistogram();
+    assertEquals(501, isize.length);
+    assertTrue(isize[121] > 0);
+    assertEquals(1000, metrics.getCoverageBinSize());
+    assertTrue(metrics.getCoverage(0)[32] >= 120);
+
+    // nothing is collected once detached
+    aligner.alignReads(refObj, reads);
+    assertEquals(mapped, metrics.getFlagstat().getNMapped());
+    metrics.clear();
+    assertEquals(0, metrics.getFlagstat().getNRecords());
+  }
+
+  @Test
+  public void testAlignReadsCompetitive() throws RapiException, IOException
+  {
+    Batch batch = new Batch(2);
+    TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), batch);
+    aligner = new AlignerState(rapiOpts);
+    // the same reference twice:  the scores tie
+    CompetitiveResult result = aligner.alignReadsCompetitive(new Ref[] { refObj, refObj }, batch);
+    assertEquals(batch.getNFragments(), result.getNFragments());
+    assertEquals(2, result.getNRefs());
+    assertEquals(RapiConstants.REF_AMBIGUOUS, result.getFragmentClass(0));
+
+    Alignment expected = reads.getRead(0, 0).getAln(0);
+    RefHit hit = result.getHit(0, 0, 1);
+    assertEquals("chr1", refObj.getContig(hit.getContig()).getName());
+    assertEquals(expected.getPos(), hit.getPos());
+    assertEquals(expected.getScore(), hit.getScore());
+    assertEquals(expected.getReverseStrand(), hit.getReverseStrand());
+    assertEquals(result.getHit(0, 0, 0).getPos(), hit.getPos());
+    // the reads keep the alignments to the best reference
+    assertEquals(expected.getPos(), batch.getRead(0, 0).getAln(0).getPos());
+
+    result = aligner.alignReadsCompetitive(new Ref[] { refObj }, batch, 10);
+    assertEquals(0, result.getFragmentClass(0));
+    batch.clear();
+  }
+
+  @Test
+  public void testAlignReadsAsync() throws RapiException, IOException
+  {
+    Batch batch = new Batch(2);
+    TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), batch);
+    AlignJob job = new AlignerState(rapiOpts).alignReadsAsync(refObj, batch);
+    // the job keeps its aligner from being collected while it runs
+    System.gc();
+    job.waitFor();
+    assertTrue(job.isDone());
+    assertEquals(reads.getRead(0, 0).getAln(0).getPos(), batch.getRead(0, 0).getAln(0).getPos());
+    job.delete();
+    batch.clear();
+  }
+
+  @Test(expected=RapiInvalidParamException.class)
+  public void testAlignReadsCompetitiveNoRefs() throws RapiException
+  {
+    aligner.alignReadsCompetitive(new Ref[0], reads);
+  }
+
+  @Test(expected=RapiInvalidParamException.class)
+  public void testAlignReadsCompetitiveHitOOB() throws RapiException
+  {
+    CompetitiveResult result = aligner.alignReadsCompetitive(new Ref[] { refObj }, reads);
+    result.getHit(0, 0, 1);
+  }
+
+  @Test(expected=RapiInvalidParamException.class)
+  public void testMetricsCoverageOOB() throws RapiException
+  {
+    Metrics metrics = new Metrics(refObj);
+    metrics.getCoverage(1);
+  }
+
   @Test
   public void testAlnIterator() throws RapiException
   {
@@ -29,6 +29,7 @@ started calling swig with the "-builtin" option.
 #include <stddef.h>
 #include <stdio.h>
 #include <rapi.h>
+#include <rapi_metrics.h>
 #include <rapi_utils.h>
 
 /* Then we define some helpers convert RAPI errors to swig errors */
@@ -647,6 +648,7 @@ typedef struct {
     rapi_bool mapped;
     rapi_bool reverse_strand;
     rapi_bool secondary_aln;
+    rapi_bool duplicate;
 
     rapi_cigar_ops get_cigar_ops(void) const {
         rapi_cigar_ops array;
@@ -692,6 +694,10 @@ rapi_bool rapi_alignment_reverse_strand_get(const rapi_alignment* aln) {
 rapi_bool rapi_alignment_secondary_aln_get(const rapi_alignment* aln) {
     return aln->secondary_aln != 0;
 }
+
+rapi_bool rapi_alignment_duplicate_get(const rapi_alignment* aln) {
+    return aln->duplicate != 0;
+}
 %}
 
 
@@ -1091,14 +1097,233 @@ typedef struct read_batch_iter {
   }
 }
 
+/***************************************
+ ****** rapi_align_job           *******
+ ***************************************/
+
+%{ // forward declaration of opaque structure (in C-code)
+struct rapi_align_job;
+
+/*
+ * The job handle, with the Python objects the job uses:  the aligner, the
+ * ref and the batch must outlive the alignment, so the job keeps them
+ * referenced until it's released.
+ */
+typedef struct rapi_py_align_job {
+  rapi_align_job* job;
+  PyObject* owners; // (aligner, ref, batch)
+} rapi_py_align_job;
+%}
+
+%rename(align_job) rapi_py_align_job;
+
+typedef struct {
+} rapi_py_align_job;
+
+%extend rapi_py_align_job {
+  ~rapi_py_align_job(void) {
+    Py_BEGIN_ALLOW_THREADS
+    rapi_align_job_free($self->job);
+    Py_END_ALLOW_THREADS
+    Py_XDECREF($self->owners);
+    free($self);
+  }
+
+  // raises an exception if the alignment failed
+  rapi_error_t wait(void) {
+    rapi_error_t error;
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_align_job_wait($self->job);
+    Py_END_ALLOW_THREADS
+    return error;
+  }
+
+  rapi_bool done;
+}
+
+%{
+rapi_bool rapi_py_align_job_done_get(rapi_py_align_job* py_job) {
+    int done = 0;
+    rapi_align_job_poll(py_job->job, &done);
+    return done;
+}
+%}
+
+/***************************************
+ ****** rapi_metrics             *******
+ ***************************************/
+
+%{ // forward declaration of opaque structure (in C-code)
+struct rapi_metrics;
+
+static PyObject* rapi_py_uint64_list(const uint64_t* values, rapi_ssize_t n) {
+  PyObject* list = PyList_New(n);
+  if (NULL == list)
+    return NULL;
+  for (rapi_ssize_t i = 0; i < n; ++i) {
+    PyObject* item = PyLong_FromUnsignedLongLong(values[i]);
+    if (NULL == item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, item); // steals the reference
+  }
+  return list;
+}
+%}
+
+%exception rapi_metrics::flagstat {
+  $action
+  if (NULL == result) SWIG_fail;
+}
+%exception rapi_metrics::mapq_histogram {
+  $action
+  if (NULL == result) SWIG_fail;
+}
+%exception rapi_metrics::insert_size_histogram {
+  $action
+  if (NULL == result) SWIG_fail;
+}
+%exception rapi_metrics::coverage {
+  $action
+  if (NULL == result) SWIG_fail;
+}
+
+typedef struct {
+} rapi_metrics;
+
+%extend rapi_metrics {
+  rapi_metrics(const rapi_ref* ref, int coverage_bin_size=1000, int max_insert_size=2000) {
+    rapi_metrics* metrics;
+    rapi_error_t error = rapi_metrics_init(&metrics, ref, coverage_bin_size, max_insert_size);
+    if (error != RAPI_NO_ERROR) {
+      SWIG_Error(rapi_swig_error_type(error), "Error initializing metrics");
+      return NULL;
+    }
+    return metrics;
+  }
+
+  ~rapi_metrics(void) {
+    rapi_metrics_free($self);
+  }
+
+  rapi_error_t clear(void) {
+    return rapi_metrics_clear($self);
+  }
+
+  // samtools flagstat counts, as a dict
+  PyObject* flagstat(void) const {
+    const rapi_flagstat* fs = rapi_metrics_flagstat($self);
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+        "records", fs->n_records, "secondary", fs->n_secondary,
+        "supplementary", fs->n_supplementary, "duplicates", fs->n_duplicates,
+        "mapped", fs->n_mapped, "paired", fs->n_paired, "read1", fs->n_read1,
+        "read2", fs->n_read2, "proper_pairs", fs->n_proper_pairs,
+        "both_mapped", fs->n_both_mapped, "singletons", fs->n_singletons,
+        "mate_other_contig", fs->n_mate_other_contig,
+        "mate_other_contig_q5", fs->n_mate_other_contig_q5);
+  }
+
+  // number of primary mapped reads for each MAPQ
+  PyObject* mapq_histogram(void) const {
+    return rapi_py_uint64_list(rapi_metrics_mapq_histogram($self), RAPI_METRICS_MAPQ_BINS);
+  }
+
+  // number of pairs for each insert size;  the last bin also counts larger ones
+  PyObject* insert_size_histogram(void) const {
+    int n_bins;
+    const uint64_t* hist = rapi_metrics_insert_size_histogram($self, &n_bins);
+    return rapi_py_uint64_list(hist, n_bins);
+  }
+
+  // aligned bases in each bin of the contig with index `contig`
+  PyObject* coverage(int contig) const {
+    rapi_ssize_t n_bins;
+    const uint64_t* bins = rapi_metrics_coverage($self, contig, &n_bins);
+    if (NULL == bins) {
+      PyErr_SetString(PyExc_IndexError, "contig index out of range");
+      return NULL;
+    }
+    return rapi_py_uint64_list(bins, n_bins);
+  }
+
+  int coverage_bin_size;
+}
+
+%{
+int rapi_metrics_coverage_bin_size_get(const rapi_metrics* metrics) {
+    return rapi_metrics_coverage_bin_size(metrics);
+}
+%}
+
+
 /***************************************
  ****** rapi_aligner             *******
  ***************************************/
 
 %{ // forward declaration of opaque structure (in C-code)
 struct rapi_aligner_state;
+
+// (contig, pos, score, mapq, reverse_strand), or None if the read isn't mapped there
+static PyObject* rapi_py_ref_hit(const rapi_ref_hit* hit) {
+  if (hit->contig < 0)
+    Py_RETURN_NONE;
+  return Py_BuildValue("(iLiiO)", hit->contig, (long long)hit->pos, hit->score, (int)hit->mapq,
+      hit->reverse_strand ? Py_True : Py_False);
+}
+
+// ([class per fragment], [per fragment, a tuple per read of its hit on each reference])
+static PyObject* rapi_py_competitive_result(const int* classes, const rapi_ref_hit* hits,
+    rapi_ssize_t n_frags, int n_reads_frag, int n_refs) {
+  PyObject* py_classes = PyList_New(n_frags);
+  PyObject* py_hits = PyList_New(n_frags);
+  if (NULL == py_classes || NULL == py_hits)
+    goto fail;
+  for (rapi_ssize_t f = 0; f < n_frags; ++f) {
+    PyObject* item = PyInt_FromLong(classes[f]);
+    if (NULL == item)
+      goto fail;
+    PyList_SET_ITEM(py_classes, f, item); // steals the reference
+    PyObject* frag = PyTuple_New(n_reads_frag);
+    if (NULL == frag)
+      goto fail;
+    PyList_SET_ITEM(py_hits, f, frag);
+    for (int r = 0; r < n_reads_frag; ++r) {
+      PyObject* read = PyTuple_New(n_refs);
+      if (NULL == read)
+        goto fail;
+      PyTuple_SET_ITEM(frag, r, read);
+      for (int i = 0; i < n_refs; ++i) {
+        PyObject* hit = rapi_py_ref_hit(&hits[(f * n_reads_frag + r) * n_refs + i]);
+        if (NULL == hit)
+          goto fail;
+        PyTuple_SET_ITEM(read, i, hit);
+      }
+    }
+  }
+  return Py_BuildValue("(NN)", py_classes, py_hits); // N:  the tuple takes our references
+
+fail:
+  Py_XDECREF(py_classes);
+  Py_XDECREF(py_hits);
+  return NULL;
+}
 %}
 
+// align_reads_async's job references the aligner's own object (in -builtin
+// mode, the wrapper's self)
+%typemap(in, numinputs=0) PyObject* self_obj "$1 = self;";
+
+%newobject rapi_aligner_state::align_reads_async;
+%exception rapi_aligner_state::align_reads_async {
+  $action
+  if (NULL == result) SWIG_fail;
+}
+%exception rapi_aligner_state::align_reads_competitive {
+  $action
+  if (NULL == result) SWIG_fail;
+}
+
 // declare the structure to SWIG as an empty struct
 typedef struct {
 } rapi_aligner_state;
@@ -1135,7 +1360,136 @@ typedef struct {
 
     rapi_ssize_t start_fragment = 0;
     rapi_ssize_t end_fragment = batch->len / batch->batch->n_reads_frag;
-    return rapi_align_reads(ref, batch->batch, start_fragment, end_fragment, $self);
+    rapi_error_t error;
+    // release the GIL so that other Python threads can call cancel()
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_align_reads(ref, batch->batch, start_fragment, end_fragment, $self);
+    Py_END_ALLOW_THREADS
+    return error;
+  }
+
+  // Align the batch to each reference in the sequence `refs` (see
+  // rapi_align_reads_competitive).  Returns (classes, hits):  the index of
+  // each fragment's best reference, or REF_UNMAPPED or REF_AMBIGUOUS, and
+  // for each fragment a tuple per read of its primary alignment to each
+  // reference, as (contig, pos, score, mapq, reverse_strand) or None.  The
+  // reads keep their alignments to the best reference.
+  PyObject* align_reads_competitive(PyObject* refs, rapi_batch_wrap* batch, int min_score_margin=0) {
+    if (NULL == batch) {
+      SWIG_Error(SWIG_ValueError, "batch argument must not be None");
+      return NULL;
+    }
+    if (batch->len % batch->batch->n_reads_frag != 0) {
+      SWIG_Error(SWIG_RuntimeError, "Incomplete fragment in batch");
+      return NULL;
+    }
+    PyObject* seq = PySequence_Fast(refs, "Expected a sequence of references");
+    if (NULL == seq)
+      return NULL;
+
+    // the references side by side, as the aligner wants them;  the copies share the loaded indices
+    const Py_ssize_t n_refs = PySequence_Fast_GET_SIZE(seq);
+    const rapi_ssize_t n_frags = batch->len / batch->batch->n_reads_frag;
+    rapi_ref* ref_array = calloc(n_refs > 0 ? n_refs : 1, sizeof(rapi_ref));
+    rapi_ref_hit* hits = calloc(n_frags * batch->batch->n_reads_frag * n_refs + 1, sizeof(rapi_ref_hit));
+    int* classes = calloc(n_frags + 1, sizeof(int));
+    PyObject* retval = NULL;
+    if (NULL == ref_array || NULL == hits || NULL == classes) {
+      SWIG_Error(SWIG_MemoryError, "Failed to allocate memory");
+      goto clean;
+    }
+    for (Py_ssize_t i = 0; i < n_refs; ++i) {
+      rapi_ref* ref = NULL;
+      if (!SWIG_IsOK(SWIG_ConvertPtr(PySequence_Fast_GET_ITEM(seq, i), (void**)&ref, SWIGTYPE_p_rapi_ref, 0)) || NULL == ref) {
+        SWIG_Error(SWIG_TypeError, "Expected a sequence of references");
+        goto clean;
+      }
+      ref_array[i] = *ref;
+    }
+
+    rapi_error_t error;
+    // release the GIL so that other Python threads can call cancel()
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_align_reads_competitive(ref_array, n_refs, batch->batch, 0, n_frags, $self,
+        min_score_margin, hits, classes);
+    Py_END_ALLOW_THREADS
+    if (error != RAPI_NO_ERROR)
+      SWIG_Error(rapi_swig_error_type(error), "Error in competitive alignment");
+    else
+      retval = rapi_py_competitive_result(classes, hits, n_frags, batch->batch->n_reads_frag, n_refs);
+
+clean:
+    free(classes);
+    free(hits);
+    free(ref_array);
+    Py_DECREF(seq);
+    return retval;
+  }
+
+  rapi_error_t cancel(void) {
+    return rapi_aligner_state_cancel($self);
+  }
+
+  // collect QC metrics of the following alignments into `metrics`, or stop with None.
+  // Keep a reference to the metrics object while it's attached.
+  rapi_error_t set_metrics(rapi_metrics* metrics) {
+    return rapi_aligner_state_set_metrics($self, metrics);
+  }
+
+  // snapshot for restore_state, as a byte string (see rapi_checkpoint.h)
+  PyObject* save_state(void) {
+    kstring_t buf = { 0, 0, NULL };
+    rapi_error_t error = rapi_aligner_state_save($self, &buf);
+    if (error != RAPI_NO_ERROR) {
+      free(buf.s);
+      SWIG_Error(rapi_swig_error_type(error), "Error saving the aligner state");
+      return NULL;
+    }
+    PyObject* retval = PyString_FromStringAndSize(buf.s, buf.l);
+    free(buf.s);
+    return retval;
+  }
+
+  rapi_error_t restore_state(PyObject* data) {
+    if (!PyString_Check(data))
+      return RAPI_TYPE_ERROR;
+    return rapi_aligner_state_restore($self, PyString_AS_STRING(data), PyString_GET_SIZE(data));
+  }
+
+  // The job keeps the aligner, ref and batch alive until it's released.
+  rapi_py_align_job* align_reads_async(PyObject* self_obj, PyObject* ref_obj, PyObject* batch_obj) {
+    const rapi_ref* ref = NULL;
+    rapi_batch_wrap* batch = NULL;
+    if (!SWIG_IsOK(SWIG_ConvertPtr(ref_obj, (void**)&ref, SWIGTYPE_p_rapi_ref, 0)) || NULL == ref
+        || !SWIG_IsOK(SWIG_ConvertPtr(batch_obj, (void**)&batch, SWIGTYPE_p_rapi_batch_wrap, 0)) || NULL == batch) {
+      SWIG_Error(SWIG_ValueError, "Expected a ref and a read_batch");
+      return NULL;
+    }
+
+    if (batch->len % batch->batch->n_reads_frag != 0) {
+      SWIG_Error(SWIG_RuntimeError, "Incomplete fragment in batch");
+      return NULL;
+    }
+
+    rapi_py_align_job* py_job = malloc(sizeof(*py_job));
+    PyObject* owners = Py_BuildValue("(OOO)", self_obj, ref_obj, batch_obj);
+    if (NULL == py_job || NULL == owners) {
+      free(py_job);
+      Py_XDECREF(owners);
+      SWIG_Error(SWIG_MemoryError, "Error allocating alignment job");
+      return NULL;
+    }
+
+    rapi_ssize_t end_fragment = batch->len / batch->batch->n_reads_frag;
+    rapi_error_t error = rapi_align_reads_async(ref, batch->batch, 0, end_fragment, $self, NULL, NULL, &py_job->job);
+    if (error != RAPI_NO_ERROR) {
+      free(py_job);
+      Py_DECREF(owners);
+      SWIG_Error(rapi_swig_error_type(error), "Error submitting alignment job");
+      return NULL;
+    }
+    py_job->owners = owners;
+    return py_job;
   }
 }
 
@@ -375,6 +375,7 @@ class TestPyrapiAlignment(unittest.TestCase):
         self.assertTrue(aln.mapped)
         self.assertFalse(aln.reverse_strand)
         self.assertFalse(aln.secondary_aln)
+        self.assertFalse(aln.duplicate)
         self.assertEqual(0, aln.n_mismatches)
         self.assertEqual(0, aln.n_gap_opens)
         self.assertEqual(0, aln.n_gap_extensions)
@@ -499,6 +500,114 @@ class TestPyrapiAlignment(unittest.TestCase):
         # following assertion should hold:
         self.assertGreater(sys.getrefcount(next_ref), first_ref_count)
 
+    def test_cancel(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        # a cancellation requested while no call is running does nothing
+        aligner.cancel()
+        aligner.align_reads(self.ref, batch)
+        self.assertTrue(batch.get_read(0, 0).mapped)
+
+    def test_align_reads_async(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        job = aligner.align_reads_async(self.ref, batch)
+        job.wait()
+        self.assertTrue(job.done)
+        # same result as the synchronous call
+        for n_read in 0, 1:
+            self.assertEqual(
+                    self.batch.get_read(0, n_read).get_aln(0).pos,
+                    batch.get_read(0, n_read).get_aln(0).pos)
+
+    def test_align_reads_async_keeps_objects(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        aligner_refs, batch_refs = sys.getrefcount(aligner), sys.getrefcount(batch)
+        job = aligner.align_reads_async(self.ref, batch)
+        # the job holds on to the aligner and the batch while it runs
+        self.assertEqual(aligner_refs + 1, sys.getrefcount(aligner))
+        self.assertEqual(batch_refs + 1, sys.getrefcount(batch))
+        del aligner
+        job.wait()
+        del job
+        self.assertEqual(batch_refs, sys.getrefcount(batch))
+        self.assertTrue(batch.get_read(0, 0).mapped)
+
+    def test_align_reads_competitive(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        # the same reference twice:  the scores tie
+        classes, hits = aligner.align_reads_competitive([self.ref, self.ref], batch)
+        self.assertEqual(batch.n_fragments, len(classes))
+        self.assertEqual(batch.n_fragments, len(hits))
+        self.assertEqual(rapi.REF_AMBIGUOUS, classes[0])
+        self.assertEqual(2, len(hits[0]))
+        self.assertEqual(hits[0][0][0], hits[0][0][1])
+        contig, pos, score, mapq, reverse_strand = hits[0][0][0]
+        expected = self.batch.get_read(0, 0).get_aln(0)
+        self.assertEqual('chr1', self.ref[contig].name)
+        self.assertEqual(expected.pos, pos)
+        self.assertEqual(expected.score, score)
+        # the reads keep the alignments to the best reference
+        self.assertEqual(expected.pos, batch.get_read(0, 0).get_aln(0).pos)
+
+        classes, hits = aligner.align_reads_competitive([self.ref], batch, 10)
+        self.assertEqual(0, classes[0])
+        self.assertEqual(1, len(hits[0][0]))
+        self.assertRaises(ValueError, aligner.align_reads_competitive, [], batch)
+        self.assertRaises(TypeError, aligner.align_reads_competitive, [self.ref, 'chr1'], batch)
+
+    def test_save_restore_state(self):
+        aligner = rapi.aligner(self.opts)
+        aligner.align_reads(self.ref, self.batch)
+        snapshot = aligner.save_state()
+        resumed = rapi.aligner(self.opts)
+        resumed.restore_state(snapshot)
+        self.assertEqual(snapshot, resumed.save_state())
+        self.assertRaises(ValueError, resumed.restore_state, snapshot[:-1])
+
+    def test_metrics(self):
+        aligner = rapi.aligner(self.opts)
+        metrics = rapi.metrics(self.ref, 1000, 500)
+        aligner.set_metrics(metrics)
+        aligner.align_reads(self.ref, self.batch)
+        aligner.set_metrics(None)
+
+        flagstat = metrics.flagstat()
+        self.assertEqual(self.batch.n_fragments, flagstat['read1'])
+        self.assertEqual(self.batch.n_fragments, flagstat['read2'])
+        self.assertGreater(flagstat['mapped'], 0)
+        self.assertLessEqual(flagstat['mapped'], flagstat['records'])
+        self.assertEqual(256, len(metrics.mapq_histogram()))
+        self.assertGreater(metrics.mapq_histogram()[60], 0)
+        # read_00 is a pair 121 bases long, at 32461 on chr1
+        isize = metrics.insert_size_histogram()
+        self.assertEqual(501, len(isize))
+        self.assertGreater(isize[121], 0)
+        self.assertEqual(1000, metrics.coverage_bin_size)
+        chr1 = [ c.name for c in self.ref ].index('chr1')
+        self.assertGreaterEqual(metrics.coverage(chr1)[32], 120)
+        self.assertRaises(IndexError, metrics.coverage, len(self.ref))
+
+        # nothing is collected once detached
+        aligner.align_reads(self.ref, self.batch)
+        self.assertEqual(flagstat, metrics.flagstat())
+        metrics.clear()
+        self.assertEqual(0, metrics.flagstat()['records'])
+
 
 #    def test_align_se(self):
 #        aligner = rapi.aligner(self.opts)
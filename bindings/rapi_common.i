@@ -3,3 +3,7 @@
 // a couple of constants
 #define QENC_SANGER   33
 #define QENC_ILLUMINA 64
+
+// classes of rapi_align_reads_competitive besides the index of a reference
+#define REF_UNMAPPED  -1
+#define REF_AMBIGUOUS -2
@@ -0,0 +1,492 @@
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * rapi_daemon:  keeps references loaded and aligns batches sent by
+ * rapi_client over a Unix domain socket (see rapi_wire.h for the protocol).
+ *
+ *   rapi_daemon -s SOCKET [-t N_THREADS] [-j N_JOBS] [-v] [-p NAME=VALUE ...]
+ *
+ * Each connection is served by its own thread with its own aligner state.
+ * At most N_JOBS batches (default 1) are aligned at the same time, each with
+ * N_THREADS / N_JOBS worker threads, so the daemon never runs more than
+ * N_THREADS workers however many clients are connected.
+ *
+ * References are loaded on first request and kept until the daemon exits.
+ * A reference is loaded without holding up the clients using the others.
+ *
+ * The socket is created with mode 0600, so only the daemon's user can
+ * connect;  to share the daemon, change the socket's group and mode after
+ * it starts, or put it in a directory whose permissions allow the users in.
+ *
+ * On SIGINT or SIGTERM the daemon stops accepting connections, disconnects
+ * the clients once their current request is answered, and waits for their
+ * threads before releasing the parameters and references they use.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi.h>
+#include <rapi_utils.h>
+#include "rapi_wire.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_REFS 64
+
+enum { REF_LOADING, REF_LOADED, REF_FAILED };
+
+/*
+ * A slot is claimed under the lock and the reference is loaded outside it;
+ * clients asking for a reference that is being loaded wait on `changed`.
+ * Once loaded, a slot never changes, so its rapi_ref can be used without
+ * the lock.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed; // a slot finished loading
+	int n;
+	struct {
+		char* path;
+		int status;
+		rapi_ref ref;
+	} slots[MAX_REFS];
+} loaded_refs = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+/* Alignment jobs:  at most `n_jobs` rapi_align_reads calls run at a time. */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	int n_free;
+} jobs = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 1 };
+
+/*
+ * Connected clients, so that the daemon can disconnect them and wait for
+ * their threads when it shuts down.  A client thread removes its socket
+ * under the lock before closing it, so a socket in the list is never one
+ * reused by a later accept.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t gone; // a client thread finished
+	int n, capacity;
+	int* fds;
+} clients = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL };
+
+static rapi_opts state_opts; // for the connections' aligner states
+static int verbose = 0;
+static volatile sig_atomic_t shutting_down = 0;
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s -s SOCKET [-t N_THREADS] [-j N_JOBS] [-v] [-p NAME=VALUE ...]\n", prog);
+	exit(1);
+}
+
+/*
+ * Return the id of the reference at `path`, loading it if needed.
+ */
+static rapi_error_t _get_ref(const char* path, uint32_t* id)
+{
+	pthread_mutex_lock(&loaded_refs.lock);
+	int i;
+	for (i = 0; i < loaded_refs.n; ++i) {
+		if (strcmp(loaded_refs.slots[i].path, path) == 0)
+			break;
+	}
+	if (i < loaded_refs.n) {
+		while (loaded_refs.slots[i].status == REF_LOADING)
+			pthread_cond_wait(&loaded_refs.changed, &loaded_refs.lock);
+		if (loaded_refs.slots[i].status == REF_LOADED) {
+			pthread_mutex_unlock(&loaded_refs.lock);
+			*id = i;
+			return RAPI_NO_ERROR;
+		}
+		loaded_refs.slots[i].status = REF_LOADING; // failed before;  try again
+	}
+	else if (loaded_refs.n == MAX_REFS) {
+		pthread_mutex_unlock(&loaded_refs.lock);
+		PERROR("Too many references loaded (max %d)\n", MAX_REFS);
+		return RAPI_GENERIC_ERROR;
+	}
+	else {
+		char* copy = strdup(path);
+		if (NULL == copy) {
+			pthread_mutex_unlock(&loaded_refs.lock);
+			return RAPI_MEMORY_ERROR;
+		}
+		loaded_refs.slots[i].path = copy;
+		loaded_refs.slots[i].status = REF_LOADING;
+		loaded_refs.n += 1;
+	}
+	pthread_mutex_unlock(&loaded_refs.lock);
+
+	if (verbose)
+		fprintf(stderr, "Loading reference %s\n", path);
+	rapi_ref ref;
+	rapi_error_t error = rapi_ref_load(path, &ref);
+
+	pthread_mutex_lock(&loaded_refs.lock);
+	if (error == RAPI_NO_ERROR)
+		loaded_refs.slots[i].ref = ref;
+	loaded_refs.slots[i].status = error == RAPI_NO_ERROR ? REF_LOADED : REF_FAILED;
+	pthread_cond_broadcast(&loaded_refs.changed);
+	pthread_mutex_unlock(&loaded_refs.lock);
+
+	*id = i;
+	return error;
+}
+
+static const rapi_ref* _ref_by_id(uint32_t id)
+{
+	pthread_mutex_lock(&loaded_refs.lock);
+	const rapi_ref* ref = id < (uint32_t)loaded_refs.n && loaded_refs.slots[id].status == REF_LOADED
+		? &loaded_refs.slots[id].ref : NULL;
+	pthread_mutex_unlock(&loaded_refs.lock);
+	return ref;
+}
+
+static rapi_error_t _align_job(const rapi_ref* ref, rapi_batch* batch, rapi_ssize_t n_frags, rapi_aligner_state* state)
+{
+	pthread_mutex_lock(&jobs.lock);
+	while (jobs.n_free == 0)
+		pthread_cond_wait(&jobs.available, &jobs.lock);
+	jobs.n_free -= 1;
+	pthread_mutex_unlock(&jobs.lock);
+
+	rapi_error_t error = rapi_align_reads(ref, batch, 0, n_frags, state);
+
+	pthread_mutex_lock(&jobs.lock);
+	jobs.n_free += 1;
+	pthread_cond_signal(&jobs.available);
+	pthread_mutex_unlock(&jobs.lock);
+	return error;
+}
+
+static rapi_error_t _handle_ref_load(rapi_wire_cursor* in, kstring_t* out, int* reply_type)
+{
+	const char* s;
+	uint32_t len;
+	rapi_error_t error = rapi_wire_get_str(in, &s, &len);
+	if (error) return error;
+	if (NULL == s)
+		return RAPI_PARAM_ERROR;
+
+	char* path = malloc(len + 1);
+	if (NULL == path)
+		return RAPI_MEMORY_ERROR;
+	memcpy(path, s, len);
+	path[len] = '\0';
+
+	uint32_t id;
+	error = _get_ref(path, &id);
+	free(path);
+	if (error) return error;
+
+	out->l = 0;
+	rapi_wire_put_u32(out, id);
+	rapi_wire_put_contigs(out, _ref_by_id(id));
+	*reply_type = RAPI_MSG_REF_INFO;
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t _handle_align(rapi_wire_cursor* in, int flags, rapi_aligner_state* state,
+		rapi_batch* batch, kstring_t* out, int* reply_type)
+{
+	uint32_t ref_id, n_reads_frag;
+	int64_t n_frags;
+	rapi_error_t error;
+
+	if ((error = rapi_wire_get_u32(in, &ref_id)) || (error = rapi_wire_get_u32(in, &n_reads_frag))
+	    || (error = rapi_wire_get_i64(in, &n_frags)))
+		return error;
+
+	const rapi_ref* ref = _ref_by_id(ref_id);
+	if (NULL == ref || n_reads_frag < 1 || n_reads_frag > 2 || n_frags < 0)
+		return RAPI_PARAM_ERROR;
+
+	// reuse the connection's batch across requests
+	if (batch->n_reads_frag != (int)n_reads_frag) {
+		rapi_reads_free(batch);
+		if ((error = rapi_reads_alloc(batch, n_reads_frag, n_frags > 0 ? n_frags : 1)))
+			return error;
+	}
+	else {
+		rapi_reads_clear(batch);
+		if ((error = rapi_reads_reserve(batch, n_frags)))
+			return error;
+	}
+
+	if ((error = rapi_wire_get_reads(in, batch, n_frags)))
+		return error;
+	if ((error = _align_job(ref, batch, n_frags, state)))
+		return error;
+
+	out->l = 0;
+	if (flags & RAPI_WIRE_F_SAM) {
+		for (rapi_ssize_t f = 0; f < n_frags && !error; ++f) {
+			error = rapi_format_sam_b(batch, f, out);
+			kputc('\n', out);
+		}
+		*reply_type = RAPI_MSG_SAM;
+	}
+	else {
+		rapi_wire_put_alignments(out, ref, batch, 0, n_frags);
+		*reply_type = RAPI_MSG_ALIGNMENTS;
+	}
+	if (error == RAPI_NO_ERROR && NULL == out->s && n_frags > 0)
+		error = RAPI_MEMORY_ERROR;
+	return error;
+}
+
+static int _add_client(int fd)
+{
+	pthread_mutex_lock(&clients.lock);
+	if (clients.n == clients.capacity) {
+		const int capacity = clients.capacity > 0 ? clients.capacity * 2 : 16;
+		int* fds = realloc(clients.fds, capacity * sizeof(fds[0]));
+		if (NULL == fds) {
+			pthread_mutex_unlock(&clients.lock);
+			return -1;
+		}
+		clients.fds = fds;
+		clients.capacity = capacity;
+	}
+	clients.fds[clients.n++] = fd;
+	pthread_mutex_unlock(&clients.lock);
+	return 0;
+}
+
+/* Forget the client on `fd` and close its socket. */
+static void _remove_client(int fd)
+{
+	pthread_mutex_lock(&clients.lock);
+	for (int i = 0; i < clients.n; ++i) {
+		if (clients.fds[i] == fd) {
+			clients.fds[i] = clients.fds[--clients.n];
+			break;
+		}
+	}
+	close(fd);
+	pthread_cond_signal(&clients.gone);
+	pthread_mutex_unlock(&clients.lock);
+}
+
+/*
+ * Shut down the clients' sockets, so that their threads stop waiting for
+ * requests, and wait for the threads to finish.
+ */
+static void _disconnect_clients(void)
+{
+	pthread_mutex_lock(&clients.lock);
+	for (int i = 0; i < clients.n; ++i)
+		shutdown(clients.fds[i], SHUT_RDWR);
+	while (clients.n > 0)
+		pthread_cond_wait(&clients.gone, &clients.lock);
+	pthread_mutex_unlock(&clients.lock);
+	free(clients.fds);
+}
+
+static void* _serve_client(void* arg)
+{
+	const int fd = (int)(intptr_t)arg;
+	rapi_aligner_state* state = NULL;
+	rapi_batch batch;
+	kstring_t in_buf = { 0, 0, NULL }, out_buf = { 0, 0, NULL };
+	memset(&batch, 0, sizeof(batch));
+
+	if (rapi_aligner_state_init(&state, &state_opts) != RAPI_NO_ERROR) {
+		PERROR("Couldn't create an aligner state for a new client\n");
+		_remove_client(fd);
+		return NULL;
+	}
+
+	rapi_wire_hdr hdr;
+	while (!shutting_down && rapi_wire_recv(fd, &hdr, &in_buf) == RAPI_NO_ERROR) {
+		rapi_wire_cursor in = { in_buf.s, in_buf.s + in_buf.l };
+		int reply_type = RAPI_MSG_ERROR;
+		rapi_error_t error;
+
+		switch (hdr.type) {
+		case RAPI_MSG_REF_LOAD:
+			error = _handle_ref_load(&in, &out_buf, &reply_type);
+			break;
+		case RAPI_MSG_ALIGN:
+			error = _handle_align(&in, hdr.flags, state, &batch, &out_buf, &reply_type);
+			break;
+		default:
+			PERROR("Unexpected message type %d\n", hdr.type);
+			error = RAPI_OP_NOT_SUPPORTED_ERROR;
+		}
+
+		if (error != RAPI_NO_ERROR) {
+			out_buf.l = 0;
+			rapi_wire_put_u32(&out_buf, (uint32_t)error);
+			reply_type = RAPI_MSG_ERROR;
+		}
+		if (rapi_wire_send(fd, reply_type, 0, &out_buf) != RAPI_NO_ERROR)
+			break;
+	}
+
+	if (batch._private)
+		rapi_reads_free(&batch);
+	rapi_aligner_state_free(state);
+	free(in_buf.s);
+	free(out_buf.s);
+	_remove_client(fd); // last:  shutdown waits for it
+	return NULL;
+}
+
+static void _on_signal(int sig)
+{
+	shutting_down = 1;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* socket_path = NULL;
+	rapi_opts opts;
+	int c;
+
+	rapi_opts_init(&opts);
+	while ((c = getopt(argc, argv, "s:t:j:vp:")) != -1) {
+		switch (c) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 't':
+			opts.n_threads = atoi(optarg);
+			break;
+		case 'j':
+			jobs.n_free = atoi(optarg);
+			if (jobs.n_free < 1) usage(argv[0]);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'p': {
+			// aligner-specific parameter, e.g. -p batched_rescue=1
+			char* eq = strchr(optarg, '=');
+			if (NULL == eq) usage(argv[0]);
+			*eq = '\0';
+			rapi_param* p = kv_pushp(rapi_param, opts.parameters);
+			rapi_param_init(p);
+			rapi_param_set_name(p, optarg);
+			char* end;
+			long integer = strtol(eq + 1, &end, 10);
+			if (*end == '\0')
+				rapi_param_set_long(p, integer);
+			else {
+				double real = strtod(eq + 1, &end);
+				if (*end != '\0') usage(argv[0]); // only numeric parameters
+				rapi_param_set_dbl(p, real);
+			}
+			break;
+		}
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	struct sockaddr_un addr;
+	if (NULL == socket_path || strlen(socket_path) >= sizeof(addr.sun_path))
+		usage(argv[0]);
+
+	if (rapi_init(&opts) != RAPI_NO_ERROR) {
+		PERROR("Failed to initialize the aligner\n");
+		return 1;
+	}
+	// divide the threads among the jobs;  the parameters are shared, read-only
+	state_opts = opts;
+	state_opts.n_threads = opts.n_threads / jobs.n_free > 0 ? opts.n_threads / jobs.n_free : 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path); // left behind by a previous run
+
+	// the socket file gets mode 0600:  only our user may connect
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	const mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+	const int bound = listen_fd >= 0 && bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	umask(old_umask);
+	if (!bound || listen(listen_fd, 64) != 0) {
+		PERROR("Couldn't listen on %s: %s\n", socket_path, strerror(errno));
+		return 1;
+	}
+
+	// no SA_RESTART, so that accept returns when we're asked to stop
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "%s %s listening on %s\n", rapi_aligner_name(), rapi_aligner_version(), socket_path);
+	while (!shutting_down) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR)
+				PERROR("accept failed: %s\n", strerror(errno));
+			continue;
+		}
+		// the client threads block the signals, so that they interrupt accept here
+		sigset_t stop_signals, old_mask;
+		sigemptyset(&stop_signals);
+		sigaddset(&stop_signals, SIGINT);
+		sigaddset(&stop_signals, SIGTERM);
+		if (_add_client(fd) != 0) {
+			PERROR("Couldn't register a new client\n");
+			close(fd);
+			continue;
+		}
+		pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+		pthread_t thread;
+		const int failed = pthread_create(&thread, NULL, _serve_client, (void*)(intptr_t)fd);
+		pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+		if (failed) {
+			PERROR("Couldn't start a thread for a new client\n");
+			_remove_client(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	fprintf(stderr, "Shutting down\n");
+	close(listen_fd);
+	unlink(socket_path);
+	// state_opts shares its parameters with opts:  free them, and the
+	// references, only once no client thread can be using them
+	_disconnect_clients();
+	for (int i = 0; i < loaded_refs.n; ++i) {
+		if (loaded_refs.slots[i].status == REF_LOADED)
+			rapi_ref_free(&loaded_refs.slots[i].ref);
+		free(loaded_refs.slots[i].path);
+	}
+	rapi_opts_free(&opts);
+	rapi_shutdown();
+	return 0;
+}
@@ -38,6 +38,7 @@ typedef int rapi_error_t;
 #define RAPI_MEMORY_ERROR               -30
 #define RAPI_PARAM_ERROR                -40
 #define RAPI_TYPE_ERROR                 -50
+#define RAPI_CANCELLED                  -60
 
 static const char*const rapi_error_name(rapi_error_t e)
 {
@@ -48,6 +49,7 @@ static const char*const rapi_error_name(rapi_error_t e)
 		case RAPI_MEMORY_ERROR:           return "MEMORY_ERROR";
 		case RAPI_PARAM_ERROR:            return "PARAM_ERROR";
 		case RAPI_TYPE_ERROR:             return "TYPE_ERROR";
+		case RAPI_CANCELLED:              return "CANCELLED";
 		default: return "Unknown error type";
 	};
 }
@@ -143,6 +145,20 @@ static inline int rapi_param_get_text(const rapi_param* kv, const char** value)
 static inline int rapi_param_get_long(const rapi_param* kv, long * value      ) KV_GET_IMPL(RAPI_VTYPE_INT,  value.integer)
 static inline int rapi_param_get_dbl( const rapi_param* kv, double * value    ) KV_GET_IMPL(RAPI_VTYPE_REAL, value.real)
 
+/* List of named parameters */
+typedef kvec_t(rapi_param) rapi_param_list;
+
+/**
+ * Free all the parameters in `list` and the list's own storage.  The list is
+ * left empty and can be reused.
+ */
+static inline void rapi_param_list_free(rapi_param_list* list) {
+	for (size_t i = 0; i < kv_size(*list); ++i)
+		rapi_param_free(&kv_A(*list, i));
+	kv_destroy(*list);
+	kv_init(*list);
+}
+
 /* Key-value list */
 typedef struct rapi_tag {
 	char key[RAPI_MAX_TAG_LEN + 1]; // null-terminated
@@ -228,7 +244,7 @@ typedef struct rapi_opts {
 	 * of letting the user set aligner-specific options through the
 	 * _private structure below.
 	 */
-	kvec_t(rapi_param) parameters;
+	rapi_param_list parameters;
 
 	void * _private; /**< can be used for aligner-specific data */
 } rapi_opts;
@@ -276,7 +292,8 @@ typedef struct rapi_alignment {
 	        prop_paired:1,
 	        mapped:1,
 	        reverse_strand:1,
-	        secondary_aln:1;
+	        secondary_aln:1,
+	        duplicate:1;
 
 	uint8_t n_mismatches;
 	uint8_t n_gap_opens;
@@ -298,6 +315,8 @@ typedef struct rapi_read {
 	unsigned int length; // sequence length
 	rapi_alignment* alignments;
 	uint8_t n_alignments;
+	uint8_t off_target; // set by the region filter (rapi_aligner_state_set_regions)
+	uint8_t host;       // set by the host prefilter (rapi_aligner_state_set_host_filter)
 } rapi_read;
 
 /**
@@ -452,11 +471,247 @@ rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, cons
  *                 second pair of reads in the batch give the indices [1, 2). For the entire
  *                 batch give [0, batch.n_frags).
  * \param state Provide the state initialized with rapi_aligner_state_init.
+ * \return RAPI_CANCELLED if the call was cancelled with rapi_aligner_state_cancel.
+ *         In that case the fragments in [start_frag, end_frag) that were finished
+ *         keep their alignments (every read of a finished fragment has at least
+ *         one, if only to say it's unmapped), and the others have none.
  */
 rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
     rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state );
 
-/** Clear aligner state and free any associated system resources. */
+/**
+ * Competitive alignment
+ */
+
+#define RAPI_REF_UNMAPPED  -1
+#define RAPI_REF_AMBIGUOUS -2
+
+/** The primary alignment of a read to one of the references of rapi_align_reads_competitive. */
+typedef struct rapi_ref_hit {
+	int contig;        // index in the reference's contigs;  -1 if the read isn't mapped there
+	rapi_ssize_t pos;  // 1-based
+	int score;
+	uint8_t mapq;
+	uint8_t reverse_strand;
+} rapi_ref_hit;
+
+/**
+ * Align the fragments in [start_frag, end_frag) of `batch` to each of the
+ * `n_refs` references in `refs` in a single call, e.g., to a graft and a
+ * host genome.  The reads are converted once and every reference is
+ * aligned by the same pipeline and worker threads as rapi_align_reads.
+ *
+ * A fragment's score against a reference is the sum of the scores of its
+ * reads' primary alignments there.  For fragment f (counted from
+ * start_frag):
+ *   - hits[(f * n_reads_frag + r) * n_refs + i] gets the primary alignment
+ *     of its read r to refs[i];
+ *   - classes[f] gets the index of the reference with the highest score;
+ *     RAPI_REF_AMBIGUOUS if another one's is within `min_score_margin` of
+ *     it;  RAPI_REF_UNMAPPED if none of its reads maps anywhere;
+ *   - its reads keep the alignments to the highest scoring reference (the
+ *     first one, on ties), so they're formatted against that reference.
+ *
+ * Each reference is aligned with the insert size model `state` has when the
+ * call starts (estimated from the batch against that reference, if none is
+ * set), and the call leaves that model unchanged.
+ *
+ * Region filtering, metrics, fragment callbacks and the k-mer fast path
+ * work with a single reference:  if any is set on `state`, the call
+ * returns RAPI_OP_NOT_SUPPORTED_ERROR.  If the call fails or is cancelled,
+ * the reads are left without alignments.
+ */
+rapi_error_t rapi_align_reads_competitive( const rapi_ref* refs, int n_refs, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state,
+    int min_score_margin, rapi_ref_hit* hits, int* classes );
+
+/**
+ * Ask the rapi_align_reads call running with `state` to stop.
+ *
+ * Can be called from any thread.  The aligner checks for cancellation between
+ * reads, so the call returns RAPI_CANCELLED shortly after.  If no call is
+ * running, it does nothing:  the request never carries over to the next call.
+ */
+rapi_error_t rapi_aligner_state_cancel(rapi_aligner_state* state);
+
+/**
+ * Called for each fragment of a rapi_align_reads call as soon as its reads
+ * have their final alignments, so they can be formatted and written while
+ * the rest of the batch is being aligned.  `frag` is the fragment's index in
+ * `batch`.  The callback must not modify the batch.
+ */
+typedef void (*rapi_fragment_callback)(const rapi_batch* batch, rapi_ssize_t frag, void* user_data);
+
+/**
+ * Set the callback invoked by rapi_align_reads for each finished fragment,
+ * or NULL to remove it.
+ *
+ * The callback runs on the aligner's worker threads, or on the calling thread
+ * for fragments that need no alignment work.  If `in_order` is 0,
+ * fragments are reported as they finish, concurrently from several threads
+ * and in no particular order.  Otherwise calls are serialized and report the
+ * fragments in increasing index order; fragments that finish early are held
+ * back until all the preceding ones are done.
+ *
+ * Every fragment in [start_frag, end_frag) is reported once, before
+ * rapi_align_reads returns, unless the call fails or is cancelled.  The
+ * fragments reported by a cancelled call keep their alignments.
+ */
+rapi_error_t rapi_aligner_state_set_fragment_callback(rapi_aligner_state* state,
+    rapi_fragment_callback callback, void* user_data, int in_order);
+
+/** Alignment QC metrics collector; see rapi_metrics.h. */
+typedef struct rapi_metrics rapi_metrics;
+
+/**
+ * Add the fragments aligned by each rapi_align_reads call with `state` to
+ * `metrics`, or stop collecting with NULL.
+ *
+ * Each worker thread fills its own forked collector (rapi_metrics_fork),
+ * and they're merged into `metrics` at the end of the call, so `metrics`
+ * must not be read or freed while a call is running.  Cancelled calls add
+ * nothing.  Fragments are added before duplicates can be marked, so
+ * nothing is counted as a duplicate;  see rapi_metrics.h.
+ */
+rapi_error_t rapi_aligner_state_set_metrics(rapi_aligner_state* state, rapi_metrics* metrics);
+
+/** Target regions; see rapi_regions.h. */
+typedef struct rapi_regions rapi_regions;
+
+/**
+ * Filter the fragments aligned by each rapi_align_reads call with `state`
+ * by the indexed `regions`, or stop filtering with NULL.
+ *
+ * The filter runs in the conversion step, after mate rescue and before the
+ * hits are turned into rapi_alignments:  a fragment is on target if any
+ * hit of its reads overlaps a region, including hits that won't make it
+ * to the output, so no fragment whose alignments could touch a region is
+ * lost.  Fragments served from the result cache are judged by their
+ * primary and supplementary alignments instead, and fragments cut short
+ * by batch_deadline_ms are always on target.  The reads of off-target
+ * fragments get their `off_target` mark, so that they can be routed
+ * elsewhere.  With `drop`, they're also left with no alignments at all,
+ * skipping conversion, tag generation and the metrics.
+ *
+ * `regions` must not be modified or freed while a call is running.
+ */
+rapi_error_t rapi_aligner_state_set_regions(rapi_aligner_state* state, const rapi_regions* regions, int drop);
+
+/** Host k-mer filter; see rapi_host_filter.h. */
+typedef struct rapi_host_filter rapi_host_filter;
+
+/**
+ * Screen the fragments of each rapi_align_reads call with `state` against
+ * the host k-mers in `filter` before aligning them, or stop screening with
+ * NULL.
+ *
+ * The screen runs after duplicate collapsing and the result cache lookup,
+ * in front of seeding.  A fragment is host if at least `min_hit_fraction`
+ * of the k-mers of its reads are in the filter;  its reads get their
+ * `host` mark and no alignments, and it skips the aligner altogether,
+ * including the metrics and the result cache.
+ *
+ * `filter` must not be freed while a call is running.
+ */
+rapi_error_t rapi_aligner_state_set_host_filter(rapi_aligner_state* state,
+    const rapi_host_filter* filter, double min_hit_fraction);
+
+/** Handle to an alignment submitted with rapi_align_reads_async. */
+typedef struct rapi_align_job rapi_align_job;
+
+/**
+ * Completion callback for rapi_align_reads_async.  `result` is what
+ * rapi_align_reads returned for the job.
+ */
+typedef void (*rapi_align_callback)(rapi_error_t result, void* user_data);
+
+/**
+ * Like rapi_align_reads, but return immediately and align the reads on the
+ * library's threads.
+ *
+ * Jobs submitted to the same aligner state run one at a time, in submission
+ * order; use one state per batch to keep several in flight concurrently.
+ * Jobs of different states only run at the same time while their threads
+ * (rapi_opts.n_threads) fit in the number of online processors, so that
+ * several states don't oversubscribe the cores;  the others wait their
+ * turn.  A job is always let through when no other is running.
+ * The ref and the batch must not be modified or freed until the job
+ * completes.
+ *
+ * If `callback` is not NULL, it is called from a library thread when the job
+ * is done, before rapi_align_job_poll reports it as done.  The callback must
+ * not free the aligner state, and must not call rapi_align_job_wait or
+ * rapi_align_job_free on its own job:  the job is only marked done after
+ * the callback returns, so either call deadlocks.
+ *
+ * \param job Return argument for the job handle, to be released with
+ *            rapi_align_job_free.  If NULL, the library releases the job
+ *            itself after calling the callback.
+ */
+rapi_error_t rapi_align_reads_async( const rapi_ref* ref, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state,
+    rapi_align_callback callback, void* user_data, rapi_align_job** job );
+
+/**
+ * Check whether `job` is done without blocking.
+ *
+ * \param done Set to 1 if the job is done, 0 otherwise.
+ */
+rapi_error_t rapi_align_job_poll(rapi_align_job* job, int* done);
+
+/**
+ * Block until `job` is done.
+ *
+ * \return The result of the job's rapi_align_reads call.
+ */
+rapi_error_t rapi_align_job_wait(rapi_align_job* job);
+
+/** Wait for `job` to complete, then release it. */
+rapi_error_t rapi_align_job_free(rapi_align_job* job);
+
+/**
+ * Get the statistics collected by the aligner state since it was created.
+ *
+ * The counters are appended to `stats` as named parameters:  integers for
+ * counts, reals for rates and ratios.  Which counters are reported depends on
+ * the aligner plug-in.  The caller owns the
+ * appended parameters and should release them with rapi_param_list_free.
+ */
+rapi_error_t rapi_aligner_state_get_stats(const rapi_aligner_state* state, rapi_param_list* stats);
+
+/**
+ * Append to `output` a snapshot of what the aligner state carries from one
+ * rapi_align_reads call to the next:  the number of reads processed (which
+ * seeds the aligner's tie-breaking), the insert size model and the
+ * statistics.  The snapshot is opaque and only valid for the same plug-in
+ * version.  See rapi_checkpoint.h.
+ */
+rapi_error_t rapi_aligner_state_save(const rapi_aligner_state* state, kstring_t* output);
+
+/**
+ * Restore a snapshot taken with rapi_aligner_state_save, so that aligning
+ * the following batches gives the same results as in the run that took it.
+ * Cached alignments (result_cache_size) are not part of the snapshot.
+ */
+rapi_error_t rapi_aligner_state_restore(rapi_aligner_state* state, const char* data, size_t size);
+
+/**
+ * Align the following paired-end batches with the insert size model of the
+ * snapshot `data` (see rapi_aligner_state_save) instead of estimating one
+ * from each batch, as if it had been given with options.  The rest of the
+ * state is left alone.  With NULL `data`, go back to the model given with
+ * the options, if any, or to estimating it.
+ *
+ * \return RAPI_PARAM_ERROR if the snapshot is invalid or has no model.
+ */
+rapi_error_t rapi_aligner_state_set_insert_size(rapi_aligner_state* state, const char* data, size_t size);
+
+/**
+ * Clear aligner state and free any associated system resources.
+ *
+ * Asynchronous jobs submitted to the state that have not started yet
+ * complete with RAPI_CANCELLED; a running one is cancelled and waited for.
+ */
 rapi_error_t rapi_aligner_state_free(struct rapi_aligner_state* state);
 
 #endif
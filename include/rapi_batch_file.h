@@ -0,0 +1,171 @@
+/*
+ * rapi_batch_file.h - binary, mmap-able serialization of read batches
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_BATCH_FILE_H__
+#define __RAPI_BATCH_FILE_H__
+
+#include "rapi.h"
+#include <stdint.h>
+
+/**
+ * Binary image of a read batch with its alignments.
+ *
+ * The image is a header followed by five arrays:  reads, alignments, CIGAR
+ * operations, tags and a string area.  Records refer to each other by index
+ * and to strings by offset in the string area, so the image has no pointers
+ * and can be written to disk, sent to another process or placed in shared
+ * memory, and then used where it lies through rapi_batch_map.  Contigs are
+ * stored as indices into the rapi_ref used for the alignment, and the header
+ * carries a fingerprint of that reference's contig names and lengths so that
+ * rapi_batch_load can refuse a different one.
+ *
+ * Integers are in the byte order of the machine that wrote the image;
+ * rapi_batch_map refuses images with a different byte order or version.
+ */
+
+#define RAPI_BATCH_FILE_MAGIC   "RAPIBAT"
+#define RAPI_BATCH_FILE_VERSION 2
+#define RAPI_BIN_NONE           UINT64_MAX // no string (e.g., reads without qualities)
+
+typedef struct rapi_bin_header {
+	char magic[8];         // RAPI_BATCH_FILE_MAGIC, NUL-terminated
+	uint32_t version;
+	uint32_t byte_order;   // 0x01020304 as written by the producer
+	int64_t n_frags;
+	uint32_t n_reads_frag;
+	uint32_t n_contigs;    // of the reference the batch was aligned to
+	uint64_t ref_fingerprint; // rapi_batch_ref_fingerprint of that reference
+	uint64_t n_alignments;
+	uint64_t n_cigar_ops;
+	uint64_t n_tags;
+	uint64_t strings_size;
+	// byte offsets of the arrays from the start of the image
+	uint64_t reads_off, alignments_off, cigars_off, tags_off, strings_off;
+	uint64_t size;         // of the whole image
+} rapi_bin_header;
+
+typedef struct rapi_bin_read {
+	uint64_t id, seq, qual; // offsets of NUL-terminated strings; qual may be RAPI_BIN_NONE
+	uint32_t length;
+	uint32_t n_alignments;
+	uint64_t alignments;    // index of the read's first alignment
+} rapi_bin_read;
+
+#define RAPI_BIN_PAIRED         0x01
+#define RAPI_BIN_PROP_PAIRED    0x02
+#define RAPI_BIN_MAPPED         0x04
+#define RAPI_BIN_REVERSE_STRAND 0x08
+#define RAPI_BIN_SECONDARY_ALN  0x10
+#define RAPI_BIN_DUPLICATE      0x20
+
+typedef struct rapi_bin_alignment {
+	int64_t pos;            // 1-based
+	int32_t contig;         // index into rapi_ref.contigs;  -1 if none
+	int32_t score;
+	uint8_t mapq;
+	uint8_t flags;          // RAPI_BIN_* flags
+	uint8_t n_mismatches;
+	uint8_t n_gap_opens;
+	uint8_t n_gap_extensions;
+	uint8_t n_cigar_ops;
+	uint16_t n_tags;
+	uint64_t cigar_ops;     // index of the first CIGAR operation
+	uint64_t tags;          // index of the first tag
+} rapi_bin_alignment;
+
+typedef struct rapi_bin_tag {
+	char key[8];            // NUL-terminated
+	uint32_t type;          // RAPI_VTYPE_*
+	uint32_t text_len;      // TEXT:  length, not counting the terminating NUL
+	union {
+		int64_t integer;      // INT, and CHAR as an unsigned char
+		double real;
+		uint64_t text;        // TEXT:  offset in the string area
+	} value;
+} rapi_bin_tag;
+
+/**
+ * A batch image opened with rapi_batch_map or rapi_batch_map_file.  The
+ * arrays point into the image.
+ */
+typedef struct rapi_mapped_batch {
+	const rapi_bin_header* header;
+	rapi_ssize_t n_frags;
+	int n_reads_frag;
+	int n_contigs;
+	uint64_t ref_fingerprint;
+	const rapi_bin_read* reads;            // n_frags * n_reads_frag, fragment-major
+	const rapi_bin_alignment* alignments;
+	const uint32_t* cigar_ops;             // op | len << 4
+	const rapi_bin_tag* tags;
+	const char* strings;
+	void* _mapping;                        // set if rapi_batch_map_file mapped the file
+	size_t _mapping_size;
+} rapi_mapped_batch;
+
+/**
+ * 64-bit FNV-1a hash of the names and lengths of the contigs of `ref`, in
+ * order.  Images record it for the reference they were aligned to.
+ */
+uint64_t rapi_batch_ref_fingerprint(const rapi_ref* ref);
+
+/**
+ * Append the image of fragments [start_frag, end_frag) of `batch`, aligned
+ * to `ref`, to `output`.  Reads without alignments are fine.  The image
+ * starts at an 8-byte aligned offset of `output`, padding it if needed.
+ */
+rapi_error_t rapi_batch_serialize(const rapi_ref* ref, const rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, kstring_t* output);
+
+/**
+ * Open the image of `size` bytes at `data`, which must be 8-byte aligned
+ * and stay valid while `mb` is used.  Only the header and the array bounds
+ * are checked;  nothing is copied.
+ */
+rapi_error_t rapi_batch_map(rapi_mapped_batch* mb, const void* data, size_t size);
+
+/** mmap the file at `path`, which holds exactly one image, and open it. */
+rapi_error_t rapi_batch_map_file(rapi_mapped_batch* mb, const char* path);
+
+/** Release `mb`, unmapping the file if it came from rapi_batch_map_file. */
+rapi_error_t rapi_batch_unmap(rapi_mapped_batch* mb);
+
+/**
+ * Copy the image into `batch`, which must have been allocated with
+ * rapi_reads_alloc for the same number of reads per fragment.  The batch's
+ * previous content is cleared and the image's fragments go to
+ * [0, mb->n_frags).  Alignments refer to the contigs of `ref`,
+ * which must be the reference the image was aligned to:  a reference with
+ * other contig names or lengths is refused with RAPI_PARAM_ERROR.  Every
+ * index and offset in the image is checked.
+ */
+rapi_error_t rapi_batch_load(const rapi_mapped_batch* mb, const rapi_ref* ref, rapi_batch* batch);
+
+static inline const rapi_bin_read* rapi_mapped_get_read(const rapi_mapped_batch* mb,
+    rapi_ssize_t n_frag, int n_read) {
+	return &mb->reads[n_frag * mb->n_reads_frag + n_read];
+}
+
+/** The string at offset `off`, or NULL for RAPI_BIN_NONE. */
+static inline const char* rapi_mapped_str(const rapi_mapped_batch* mb, uint64_t off) {
+	return off == RAPI_BIN_NONE ? NULL : mb->strings + off;
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * rapi_checkpoint.h - checkpoint and resume long alignment runs
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_CHECKPOINT_H__
+#define __RAPI_CHECKPOINT_H__
+
+#include "rapi.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Checkpoints for runs that read batches from some inputs, align them and
+ * write the results to an output file.
+ *
+ * A checkpoint records where the run is in its inputs (offsets of the
+ * caller's choosing, e.g., byte offsets in the FASTQ files), how much of the
+ * output is durably written and a snapshot of the aligner state.  The usual
+ * loop is:
+ *
+ *     if (rapi_checkpoint_read(&cp, path) == RAPI_NO_ERROR) {
+ *         rapi_aligner_state_restore(state, cp.state.s, cp.state.l);
+ *         rapi_checkpoint_resume_output(&cp, out);
+ *         // seek the inputs to cp.input_offsets
+ *     }
+ *     while (read a batch) {
+ *         align and write it to out;
+ *         if (time for a checkpoint) {
+ *             // set cp.input_offsets to the end of the batch
+ *             rapi_checkpoint_commit(&cp, path, state, out);
+ *         }
+ *     }
+ *
+ * As long as the resumed run cuts its batches at the same places, its output
+ * is identical to that of an uninterrupted run (the insert size model is
+ * estimated per batch, so batch boundaries matter).  That only holds for
+ * what the snapshot carries:  with result_cache_size the results depend on
+ * the cached fragments of earlier batches, which aren't saved, and with
+ * batch_deadline_ms on timing, so neither gives a reproducible output.
+ * Anything else the caller keeps across batches (e.g., a rapi_dupmark, a
+ * rapi_sam_sorter) isn't covered either.  rapi_align refuses -C with these.
+ */
+
+#define RAPI_CHECKPOINT_MAX_INPUTS 8
+
+typedef struct rapi_checkpoint {
+	int64_t n_batches;      // batches aligned and written
+	int n_inputs;
+	int64_t input_offsets[RAPI_CHECKPOINT_MAX_INPUTS];
+	int64_t output_offset;  // bytes of output synced to disk
+	kstring_t state;        // rapi_aligner_state_save snapshot
+} rapi_checkpoint;
+
+rapi_error_t rapi_checkpoint_init(rapi_checkpoint* cp);
+
+rapi_error_t rapi_checkpoint_free(rapi_checkpoint* cp);
+
+/**
+ * Take a checkpoint.  Flush `output` and sync it to disk, record its size in
+ * cp->output_offset, snapshot `state` and write `cp` to `path`.  The file is
+ * replaced atomically, so a crash leaves either the old checkpoint or the
+ * new one.  cp->n_batches is incremented by the caller.
+ */
+rapi_error_t rapi_checkpoint_commit(rapi_checkpoint* cp, const char* path,
+    const rapi_aligner_state* state, FILE* output);
+
+/**
+ * Read the checkpoint at `path`.  Returns RAPI_PARAM_ERROR if there is no
+ * file there, which is how a fresh run starts, and RAPI_GENERIC_ERROR if
+ * the file can't be read or is corrupt.
+ */
+rapi_error_t rapi_checkpoint_read(rapi_checkpoint* cp, const char* path);
+
+/**
+ * Discard whatever was written to `output` after the checkpoint and move
+ * to its end.  `output` must be a regular file open for writing (not in
+ * append mode).
+ */
+rapi_error_t rapi_checkpoint_resume_output(const rapi_checkpoint* cp, FILE* output);
+
+#endif
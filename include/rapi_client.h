@@ -0,0 +1,71 @@
+/*
+ * rapi_client.h - align through a running rapi_daemon
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_CLIENT_H__
+#define __RAPI_CLIENT_H__
+
+#include "rapi.h"
+
+/**
+ * Client of the alignment daemon (see daemon/rapi_daemon.c).
+ *
+ * The daemon keeps the references loaded, so clients don't pay for
+ * rapi_ref_load nor keep their own copy of the index.  The functions mirror
+ * rapi_ref_load, rapi_ref_free and rapi_align_reads:  batches are built with
+ * the usual rapi_reads_* functions and get the usual rapi_alignment
+ * structures back, so code can switch between local and daemon alignment by
+ * swapping these calls.
+ *
+ * A client holds one connection and must not be used by several threads at
+ * the same time; open one client per thread instead.
+ */
+typedef struct rapi_client rapi_client;
+
+/** Connect to the daemon listening on the Unix socket `socket_path`. */
+rapi_error_t rapi_client_connect(rapi_client** ret_client, const char* socket_path);
+
+/** Close the connection and free the client. */
+rapi_error_t rapi_client_close(rapi_client* client);
+
+/**
+ * Have the daemon load `reference_path` (if it hasn't already) and fill
+ * `ref` with its contigs.  Release `ref` with rapi_client_ref_free, not
+ * rapi_ref_free.
+ */
+rapi_error_t rapi_client_ref_load(rapi_client* client, const char* reference_path, rapi_ref* ref);
+
+rapi_error_t rapi_client_ref_free(rapi_ref* ref);
+
+/**
+ * Like rapi_align_reads, with the alignment done by the daemon.  The
+ * daemon's options (those it was started with) apply.
+ */
+rapi_error_t rapi_client_align_reads(rapi_client* client, const rapi_ref* ref, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag);
+
+/**
+ * Have the daemon align fragments [start_frag, end_frag) of `batch` and
+ * append their SAM records to `output`.  The batch's reads are not
+ * modified.
+ */
+rapi_error_t rapi_client_align_reads_sam(rapi_client* client, const rapi_ref* ref, const rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, kstring_t* output);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * rapi_coalescer.h - pack many small alignment requests into large batches
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_COALESCER_H__
+#define __RAPI_COALESCER_H__
+
+#include "rapi.h"
+
+/**
+ * Request coalescer.
+ *
+ * Many client threads submit small batches with rapi_coalescer_align.  A
+ * background thread packs the pending requests into one large batch, aligns
+ * it with a single rapi_align_reads call and hands each client its own
+ * results.  A batch is flushed when it reaches `flush_frags` fragments or
+ * when its oldest request has waited `max_latency_ms`, whichever comes
+ * first.  While a batch is being aligned, new requests accumulate for the
+ * next one.
+ */
+typedef struct rapi_coalescer rapi_coalescer;
+
+/**
+ * Create a coalescer that aligns to `ref` with `state`.  Both must outlive
+ * the coalescer, and `state` must not be used by anyone else meanwhile.
+ * Don't set a fragment callback on `state` directly:  it would see the
+ * coalesced batch.  Use rapi_coalescer_set_fragment_callback.
+ *
+ * \param n_reads_frag Reads per fragment in the submitted batches.
+ * \param flush_frags Flush when this many fragments are pending.
+ * \param max_latency_ms Flush when the oldest pending request is this old.
+ */
+rapi_error_t rapi_coalescer_init(rapi_coalescer** ret_coalescer, const rapi_ref* ref,
+    rapi_aligner_state* state, int n_reads_frag, rapi_ssize_t flush_frags, double max_latency_ms);
+
+/**
+ * Align fragments [0, n_frags) of `batch`, blocking until they're done.
+ *
+ * Can be called concurrently from any number of threads.  The batch must
+ * have the coalescer's number of reads per fragment.  The reads are aligned
+ * in place, replacing any alignments they had, as with rapi_align_reads.
+ *
+ * \return The result of the rapi_align_reads call that aligned the
+ *         request.  If it failed, the request's reads have no alignments.
+ */
+rapi_error_t rapi_coalescer_align(rapi_coalescer* coalescer, rapi_batch* batch, rapi_ssize_t n_frags);
+
+/**
+ * Set the callback invoked for each finished fragment, or NULL to remove
+ * it.  The callback is given the request's own batch and the fragment's
+ * index in it, and the fragment's reads already have their alignments.
+ * With `in_order` set, the fragments of each request are reported in
+ * increasing index order.  Otherwise see
+ * rapi_aligner_state_set_fragment_callback, which this replaces for the
+ * coalescer's state.  Call it while no rapi_coalescer_align calls are
+ * running.
+ */
+rapi_error_t rapi_coalescer_set_fragment_callback(rapi_coalescer* coalescer,
+    rapi_fragment_callback callback, void* user_data, int in_order);
+
+/**
+ * Stop the background thread and free the coalescer.  No
+ * rapi_coalescer_align calls may be running.
+ */
+rapi_error_t rapi_coalescer_free(rapi_coalescer* coalescer);
+
+#endif
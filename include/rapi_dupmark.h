@@ -0,0 +1,91 @@
+/*
+ * rapi_dupmark.h - duplicate marking as fragments are aligned
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_DUPMARK_H__
+#define __RAPI_DUPMARK_H__
+
+#include "rapi.h"
+#include <stdint.h>
+
+/**
+ * Marks duplicate fragments (the `duplicate` bit of rapi_alignment,
+ * written as SAM flag 0x400) as aligned batches go by, with the same
+ * signatures as Picard's MarkDuplicates:
+ *
+ *   - a pair with both reads mapped is keyed by the contig, unclipped 5'
+ *     position and strand of its two primary alignments;
+ *   - a single read, or the mapped read of a pair whose mate is unmapped,
+ *     is keyed by its own end alone, and is a duplicate of any pair with
+ *     an end there;
+ *   - pairs with both reads unmapped are never duplicates.
+ *
+ * All the records of a duplicate fragment are marked, including secondary
+ * and supplementary alignments and the unmapped mate, as Picard does with
+ * query-grouped input.  Only one library is assumed.
+ *
+ * This is separate from the aligner's dedup_reads option, which saves work
+ * rather than marking anything:  it aligns each distinct sequence once and
+ * copies the alignments to the fragments that repeat it.  Those fragments
+ * are only a subset of the duplicates (PCR copies with a sequencing error
+ * differ), and flagging them needs the signatures of fragments from other
+ * batches, so the aligner leaves them unmarked;  they get the same
+ * signature here and are marked with the rest.
+ *
+ * Picard keeps the copy with the highest sum of base qualities >= 15.
+ * Since fragments are marked before they're written, here the first copy
+ * seen is kept; the number of duplicates is the same, but when a later
+ * copy scores higher, or a fragment is followed by a pair at the same
+ * position, the copy Picard would flag has already gone out.  Those cases
+ * are counted in `n_late`.
+ *
+ * Signatures are kept in a hash table of 24-byte entries that grows up to
+ * the memory budget (at least 1.5 MB).  Signatures that don't fit aren't remembered, so
+ * their later copies aren't marked;  they're counted in `n_untracked`.
+ */
+typedef struct rapi_dupmark rapi_dupmark;
+
+typedef struct {
+	uint64_t n_pairs;              // fragments with both reads mapped
+	uint64_t n_fragments;          // single reads and pairs with one read mapped
+	uint64_t n_unmapped;           // fragments with no mapped read
+	uint64_t n_pair_duplicates;
+	uint64_t n_fragment_duplicates;
+	uint64_t n_late;               // kept copies Picard would have marked instead
+	uint64_t n_untracked;          // signatures not stored for lack of memory
+} rapi_dupmark_stats;
+
+/**
+ * \param mem_budget Maximum bytes for the signature table.
+ * \param n_threads Threads computing signatures.
+ */
+rapi_error_t rapi_dupmark_init(rapi_dupmark** ret_dupmark, const rapi_ref* ref, size_t mem_budget, int n_threads);
+
+/**
+ * Mark the duplicates among fragments [start, end) of an aligned `batch`
+ * and all those seen before.  Fragments are considered in order, so the
+ * result doesn't depend on the number of threads.
+ */
+rapi_error_t rapi_dupmark_batch(rapi_dupmark* dupmark, rapi_batch* batch, rapi_ssize_t start, rapi_ssize_t end);
+
+rapi_error_t rapi_dupmark_get_stats(const rapi_dupmark* dupmark, rapi_dupmark_stats* stats);
+
+rapi_error_t rapi_dupmark_free(rapi_dupmark* dupmark);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * rapi_fastq.h - chunked FASTQ input for splitting reads across workers
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_FASTQ_H__
+#define __RAPI_FASTQ_H__
+
+#include "rapi.h"
+#include <stdint.h>
+
+/**
+ * Index of record-aligned split points in a FASTQ file, or in a pair of
+ * files with the two reads of each fragment at the same record number.
+ *
+ * The reads are cut into chunks of `records_per_chunk` records (fragments);
+ * chunk k starts at record k * records_per_chunk in every file, so paired
+ * files stay in sync.  Files may be plain or gzip-compressed (including
+ * BGZF).  For gzip files the index also keeps zran-style access points
+ * (see zlib's examples/zran.c) so that a reader can start decompressing
+ * close to any chunk;  gzip member boundaries, such as BGZF block starts,
+ * make access points that need no saved window.
+ *
+ * Records must be in the common four-line format.
+ */
+typedef struct rapi_fastq_index rapi_fastq_index;
+
+/**
+ * Build the index of `path1` and, for paired input, `path2` (or NULL).
+ *
+ * Plain files are scanned in parallel by `n_threads` threads;  the two files
+ * of a pair are indexed concurrently.  Decompressing a gzip file is
+ * sequential, so `span` (bytes of uncompressed data between access points,
+ * 0 for the default of 16 MB) trades index size for seek time:  each
+ * access point with a window takes 32 kB.
+ */
+rapi_error_t rapi_fastq_index_build(rapi_fastq_index** ret_idx, const char* path1, const char* path2,
+    int64_t records_per_chunk, uint64_t span, int n_threads);
+
+rapi_error_t rapi_fastq_index_save(const rapi_fastq_index* idx, const char* path);
+
+rapi_error_t rapi_fastq_index_load(rapi_fastq_index** ret_idx, const char* path);
+
+rapi_error_t rapi_fastq_index_free(rapi_fastq_index* idx);
+
+/** Number of files (reads per fragment) indexed. */
+int rapi_fastq_index_n_files(const rapi_fastq_index* idx);
+
+/** Number of records (fragments) in the input. */
+int64_t rapi_fastq_index_n_records(const rapi_fastq_index* idx);
+
+int64_t rapi_fastq_index_n_chunks(const rapi_fastq_index* idx);
+
+/**
+ * Records [*first_record, *first_record + *n_records) make chunk `chunk`,
+ * starting at uncompressed byte offsets `offsets[0]` (and `offsets[1]` for
+ * paired input).  `offsets` may be NULL.
+ */
+rapi_error_t rapi_fastq_index_chunk(const rapi_fastq_index* idx, int64_t chunk,
+    int64_t* first_record, int64_t* n_records, uint64_t* offsets);
+
+/** Reads the records of one chunk. */
+typedef struct rapi_fastq_reader rapi_fastq_reader;
+
+/**
+ * Open chunk `chunk` of the files indexed by `idx`, which are found at
+ * `path1` and `path2` (NULL for single files) on this node.  The files'
+ * sizes are checked against the index.
+ *
+ * With a NULL `idx`, `chunk` is ignored and the reader goes through the
+ * whole files, which need no index.
+ */
+rapi_error_t rapi_fastq_reader_open(rapi_fastq_reader** ret_reader, const rapi_fastq_index* idx,
+    const char* path1, const char* path2, int64_t chunk);
+
+/**
+ * Read up to `max_frags` fragments of the chunk into fragments
+ * [0, *n_frags) of `batch`, which must have as many reads per fragment as
+ * the index has files.  The batch's previous content is cleared.  *n_frags
+ * is 0 at the end of the chunk.  The reads of a pair must have the same
+ * name, apart from a /1 or /2 suffix;  otherwise RAPI_PARAM_ERROR is returned.
+ */
+rapi_error_t rapi_fastq_read_batch(rapi_fastq_reader* reader, rapi_batch* batch, int max_frags, int* n_frags);
+
+rapi_error_t rapi_fastq_reader_close(rapi_fastq_reader* reader);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * rapi_host_filter.h - k-mer Bloom filter for host read depletion
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_HOST_FILTER_H__
+#define __RAPI_HOST_FILTER_H__
+
+#include "rapi.h"
+#include <stddef.h>
+
+#define RAPI_HOST_FILTER_MAX_K 31
+#define RAPI_HOST_FILTER_DEFAULT_K 31
+
+/**
+ * The canonical k-mers of a host genome in a split block Bloom filter (as
+ * in Parquet's):  each k-mer sets one bit in each of the eight 32-bit words
+ * of one 32-byte block, so a lookup touches a single cache line and its
+ * eight probes are independent, SIMD-friendly multiplications.  With the
+ * default 10 bits per host base, about 1% of absent k-mers test positive.
+ *
+ * Attach a filter to an aligner state with
+ * rapi_aligner_state_set_host_filter to skip the alignment of host reads.
+ */
+
+/**
+ * Build the filter of the sequences in the FASTA file `fasta_path` (plain or
+ * gzipped), with `n_threads` threads.
+ *
+ * \param n_bytes Size of the filter;  0 to size it from the file, at about
+ *                10 bits per base.
+ */
+rapi_error_t rapi_host_filter_build(rapi_host_filter** ret_filter, const char* fasta_path,
+    int k, size_t n_bytes, int n_threads);
+
+/** Save the filter to `path`;  the file is replaced atomically. */
+rapi_error_t rapi_host_filter_save(const rapi_host_filter* filter, const char* path);
+
+rapi_error_t rapi_host_filter_load(rapi_host_filter** ret_filter, const char* path);
+
+/**
+ * Load the filter of `fasta_path` from `<fasta_path>.bloom`.  If that
+ * doesn't exist, has a different k or size, or was built from a FASTA file
+ * of a different size or modification time, build the filter as
+ * rapi_host_filter_build does and try to save it there for next time.
+ */
+rapi_error_t rapi_host_filter_open(rapi_host_filter** ret_filter, const char* fasta_path,
+    int k, size_t n_bytes, int n_threads);
+
+rapi_error_t rapi_host_filter_free(rapi_host_filter* filter);
+
+int rapi_host_filter_k(const rapi_host_filter* filter);
+
+size_t rapi_host_filter_size(const rapi_host_filter* filter);
+
+/**
+ * Count the k-mers of `seq` (`len` bases) that have no ambiguous bases in
+ * `*n_kmers`, and how many of them are in the filter in `*n_hits`.
+ */
+void rapi_host_filter_count(const rapi_host_filter* filter, const char* seq, int len, int* n_kmers, int* n_hits);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * rapi_metrics.h - alignment QC metrics collected as reads are aligned
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_METRICS_H__
+#define __RAPI_METRICS_H__
+
+#include "rapi.h"
+#include <stdint.h>
+
+/**
+ * Collects the usual post-alignment QC metrics from aligned fragments:
+ * samtools flagstat's counts, the MAPQ and insert size histograms and the
+ * coverage of each contig, in bins of a fixed size.
+ *
+ * Attach a collector to an aligner state with rapi_aligner_state_set_metrics
+ * to have each rapi_align_reads call add its fragments, or add them
+ * yourself with rapi_metrics_add_fragment.
+ *
+ * A collector attached to the state sees the fragments as they're aligned,
+ * before any duplicates are marked (rapi_dupmark.h), so its n_duplicates is
+ * always 0 and its coverage includes the duplicates.  For duplicate-aware
+ * metrics, mark each batch with rapi_dupmark_batch and then pass its
+ * fragments to rapi_metrics_add_fragment.
+ */
+
+/** Record counts, as reported by samtools flagstat. */
+typedef struct {
+	uint64_t n_records;              // SAM records, including secondary and supplementary
+	uint64_t n_secondary;
+	uint64_t n_supplementary;
+	uint64_t n_duplicates;
+	uint64_t n_mapped;
+	// the rest only count primary records
+	uint64_t n_paired;
+	uint64_t n_read1;
+	uint64_t n_read2;
+	uint64_t n_proper_pairs;
+	uint64_t n_both_mapped;          // mapped, with the mate mapped
+	uint64_t n_singletons;           // mapped, with the mate unmapped
+	uint64_t n_mate_other_contig;
+	uint64_t n_mate_other_contig_q5; // ... with MAPQ >= 5
+} rapi_flagstat;
+
+#define RAPI_METRICS_MAPQ_BINS 256
+
+/**
+ * \param coverage_bin_size Reference bases per coverage bin.
+ * \param max_insert_size The insert size histogram has a bin for each size
+ *                        up to max_insert_size, which also counts the
+ *                        larger ones.
+ */
+rapi_error_t rapi_metrics_init(rapi_metrics** ret_metrics, const rapi_ref* ref,
+    int coverage_bin_size, int max_insert_size);
+
+/**
+ * Make an empty collector with the same reference and bins as `parent`, to
+ * be filled by one thread and then merged into `parent`.  Instead of
+ * coverage arrays, it keeps a list of the aligned blocks of its reads, so
+ * it costs memory in proportion to what is added to it rather than to the
+ * size of the reference.  Its coverage can't be read until it's merged.
+ */
+rapi_error_t rapi_metrics_fork(rapi_metrics** ret_metrics, const rapi_metrics* parent);
+
+rapi_error_t rapi_metrics_free(rapi_metrics* metrics);
+
+/** Reset all the counts to zero. */
+rapi_error_t rapi_metrics_clear(rapi_metrics* metrics);
+
+/**
+ * Add the aligned reads of a fragment (1 or 2 reads).  Not thread-safe:
+ * use one forked collector per thread.
+ *
+ * Coverage counts the aligned bases (M operations) of the primary and
+ * supplementary alignments that aren't marked as duplicates.  The insert
+ * size is counted once per pair, when both reads are mapped to the same
+ * contig.
+ */
+rapi_error_t rapi_metrics_add_fragment(rapi_metrics* metrics, const rapi_read* reads, int n_reads);
+
+/** Add the counts of `src` to `dest` and clear `src`. */
+rapi_error_t rapi_metrics_merge(rapi_metrics* dest, rapi_metrics* src);
+
+const rapi_flagstat* rapi_metrics_flagstat(const rapi_metrics* metrics);
+
+/** Number of primary mapped reads by MAPQ:  RAPI_METRICS_MAPQ_BINS values. */
+const uint64_t* rapi_metrics_mapq_histogram(const rapi_metrics* metrics);
+
+/** Number of pairs by insert size, in [0, *n_bins). */
+const uint64_t* rapi_metrics_insert_size_histogram(const rapi_metrics* metrics, int* n_bins);
+
+int rapi_metrics_coverage_bin_size(const rapi_metrics* metrics);
+
+/**
+ * Aligned bases in each bin of contig `contig` (its index in the
+ * reference), in [0, *n_bins).  Divide by the bin size (smaller for the
+ * last bin) for the mean depth.  NULL for forked collectors.
+ */
+const uint64_t* rapi_metrics_coverage(const rapi_metrics* metrics, int contig, rapi_ssize_t* n_bins);
+
+#endif
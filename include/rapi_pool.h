@@ -0,0 +1,74 @@
+/*
+ * rapi_pool.h - multi-process aligner sharing a single copy of the index
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_POOL_H__
+#define __RAPI_POOL_H__
+
+#include "rapi.h"
+
+/**
+ * Pool of worker processes.
+ *
+ * The coordinator (the process calling rapi_pool_init) loads the reference
+ * and then forks the workers, which share the index pages with it instead
+ * of loading their own copy.  rapi_pool_align_reads splits a batch among the
+ * workers; reads and alignments travel through lock-free single-producer,
+ * single-consumer rings in shared memory, two per worker.  Each worker
+ * aligns with its own aligner state.
+ *
+ * Paired-end batches are aligned with one insert size model for all the
+ * workers, estimated by one of them from the first 2000 fragments of the
+ * batch before the others start (unless the options fix the model).  So the
+ * pairing doesn't depend on how the batch is split, but the model comes
+ * from a sample rather than from the whole batch as in rapi_align_reads.
+ *
+ * Since the workers are forked, create the pool before the coordinator
+ * starts any other threads.
+ */
+typedef struct rapi_pool rapi_pool;
+
+/**
+ * Load `reference_path` and start `n_workers` worker processes, which align
+ * with `opts`.  The opts' n_threads are split among the workers (at least
+ * one each).
+ *
+ * \param ring_size Bytes of each ring buffer.  Larger messages are streamed
+ *                  through the ring, so this only affects how much can be
+ *                  in flight.
+ */
+rapi_error_t rapi_pool_init(rapi_pool** ret_pool, const char* reference_path, const rapi_opts* opts,
+    int n_workers, size_t ring_size);
+
+/** The reference loaded by the pool, to be used for SAM output and the like. */
+const rapi_ref* rapi_pool_get_ref(const rapi_pool* pool);
+
+/**
+ * Like rapi_align_reads, but with the fragments split among the workers.
+ *
+ * Calls are serialized.  If a worker dies, this and any later calls return
+ * RAPI_GENERIC_ERROR.
+ */
+rapi_error_t rapi_pool_align_reads(rapi_pool* pool, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag);
+
+/** Stop the workers, unload the reference and free the pool. */
+rapi_error_t rapi_pool_free(rapi_pool* pool);
+
+#endif
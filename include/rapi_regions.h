@@ -0,0 +1,69 @@
+/*
+ * rapi_regions.h - target regions, indexed for overlap queries
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_REGIONS_H__
+#define __RAPI_REGIONS_H__
+
+#include "rapi.h"
+#include <stdint.h>
+
+/**
+ * A set of regions of a reference, such as the targets of an exome or panel,
+ * for rapi_aligner_state_set_regions.  Coordinates are 0-based and
+ * half-open, as in BED files.
+ *
+ * Add the regions, then call rapi_regions_index once before querying.  The
+ * index is an implicit interval tree per contig:  the intervals sorted by
+ * start in a flat array, with the subtree's maximum end stored in each
+ * node, so it takes no pointers and a query walks a few contiguous blocks.
+ * Once indexed, queries are thread-safe.
+ */
+
+rapi_error_t rapi_regions_init(rapi_regions** ret_regions, const rapi_ref* ref);
+
+rapi_error_t rapi_regions_free(rapi_regions* regions);
+
+/** Add [start, end) of contig `contig` (its index in the reference). */
+rapi_error_t rapi_regions_add(rapi_regions* regions, int contig, int64_t start, int64_t end);
+
+/**
+ * Add the regions in a BED file.  Contig names are resolved against the
+ * reference;  an unknown name is an error.  Header lines ("#", "track",
+ * "browser") and columns after the third are ignored.
+ */
+rapi_error_t rapi_regions_load_bed(rapi_regions* regions, const char* path);
+
+/** Build the index.  Adding regions afterwards requires indexing again. */
+rapi_error_t rapi_regions_index(rapi_regions* regions);
+
+rapi_ssize_t rapi_regions_size(const rapi_regions* regions);
+
+int rapi_regions_indexed(const rapi_regions* regions);
+
+/** Whether [start, end) of contig `contig` overlaps a region.  Needs the index. */
+int rapi_regions_overlaps(const rapi_regions* regions, int contig, int64_t start, int64_t end);
+
+/**
+ * Whether any mapped primary or supplementary alignment of the reads of a
+ * fragment overlaps a region.  Needs the index.
+ */
+int rapi_regions_fragment_overlaps(const rapi_regions* regions, const rapi_read* reads, int n_reads);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * rapi_sam_sort.h - coordinate-sorted SAM output
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_SAM_SORT_H__
+#define __RAPI_SAM_SORT_H__
+
+#include "rapi.h"
+#include <stdio.h>
+
+/**
+ * Collects the SAM records of aligned batches and writes them sorted by
+ * coordinate, so the aligner's output doesn't need a separate sorting pass.
+ *
+ * Records are keyed by contig index (in the order of the reference) and
+ * position, as SAM places them:  an unmapped read with a mapped mate gets
+ * its mate's coordinates, and reads with no coordinates go last.  Records
+ * with the same key keep the order in which they were added.
+ *
+ * Records are kept in memory until they exceed the memory budget.  Then
+ * they're sorted, n_threads slices at a time with a radix sort on the
+ * 64-bit key, and spilled as a sorted run to an (unlinked) temporary file.
+ * rapi_sam_sorter_finish merges the runs and what is still in memory into
+ * the output.
+ */
+typedef struct rapi_sam_sorter rapi_sam_sorter;
+
+/**
+ * \param ref The reference the batches are aligned to.
+ * \param mem_budget Bytes of records to hold in memory before spilling.
+ * \param tmp_dir Directory for the sorted runs (NULL for "/tmp").
+ */
+rapi_error_t rapi_sam_sorter_init(rapi_sam_sorter** ret_sorter, const rapi_ref* ref,
+    size_t mem_budget, const char* tmp_dir, int n_threads);
+
+/** Add the SAM records of fragments [start, end) of an aligned `batch`. */
+rapi_error_t rapi_sam_sorter_add_batch(rapi_sam_sorter* sorter, const rapi_batch* batch,
+    rapi_ssize_t start, rapi_ssize_t end);
+
+/**
+ * Write the SAM header, with SO:coordinate, and all the records in order to
+ * `output`.  No more batches can be added afterwards.
+ */
+rapi_error_t rapi_sam_sorter_finish(rapi_sam_sorter* sorter, FILE* output);
+
+rapi_error_t rapi_sam_sorter_free(rapi_sam_sorter* sorter);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * rapi_scatter.h - SAM output split by contig
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_SCATTER_H__
+#define __RAPI_SCATTER_H__
+
+#include "rapi.h"
+
+/**
+ * Writes the SAM records of aligned batches to one file per contig, or per
+ * group of contigs, plus one for reads that aren't placed anywhere, so that
+ * per-chromosome jobs can start on them right after alignment.
+ *
+ * A read's records (including its secondary and supplementary alignments)
+ * go to the stream of the contig of its primary alignment.  An unmapped
+ * read goes with its mate, if the mate is mapped, as in SAM; otherwise it
+ * goes to the "unmapped" stream.
+ *
+ * Stream `name` is written to PREFIXname.sam.tmp, which is renamed to
+ * PREFIXname.sam once complete, so a file that exists is whole.  Slashes
+ * in the name are replaced by underscores;  names that then make the same
+ * path (including "unmapped") are refused.
+ *
+ * A stream's records are written out when its buffer reaches buffer_size /
+ * number of streams bytes (at least 4 kB) or, largest first, when the
+ * buffers take more than buffer_size bytes in all.  At most 64 files are
+ * open at a time:  the file flushed least recently is closed, and reopened
+ * for appending when needed again.
+ */
+typedef struct rapi_scatter rapi_scatter;
+
+/** Called as each stream's file is completed, e.g., to start a job on it. */
+typedef void (*rapi_scatter_done_cb)(const char* name, const char* path, void* user_data);
+
+/**
+ * \param prefix Prepended to the stream names to make paths (e.g., "out/sample.").
+ * \param n_groups 0 for one stream per contig, named after it.  Otherwise
+ *                 the number of groups in `group_names`.
+ * \param contig_group For each contig, its group in [0, n_groups).  Ignored
+ *                     if n_groups is 0.
+ * \param buffer_size Total bytes buffered across the streams.
+ *
+ * \return RAPI_PARAM_ERROR if two streams would be written to the same file.
+ */
+rapi_error_t rapi_scatter_init(rapi_scatter** ret_scatter, const rapi_ref* ref, const char* prefix,
+    int n_groups, const int* contig_group, const char* const* group_names, size_t buffer_size);
+
+/** Route the SAM records of fragments [start, end) of an aligned `batch`. */
+rapi_error_t rapi_scatter_add_batch(rapi_scatter* scatter, const rapi_batch* batch,
+    rapi_ssize_t start, rapi_ssize_t end);
+
+/**
+ * Flush and complete every stream, calling `done` (if not NULL) for each.
+ * Streams that got no records still get a file with just the header.
+ */
+rapi_error_t rapi_scatter_close(rapi_scatter* scatter, rapi_scatter_done_cb done, void* user_data);
+
+/** Free the scatter.  If it wasn't closed, its incomplete files are removed. */
+rapi_error_t rapi_scatter_free(rapi_scatter* scatter);
+
+#endif
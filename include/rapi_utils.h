@@ -69,6 +69,31 @@ rapi_error_t rapi_format_sam(const rapi_read** reads, int n_reads, kstring_t* ou
  */
 rapi_error_t rapi_format_sam_b(const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* output);
 
+/**
+ * Called by rapi_format_sam_lines for each SAM line of a fragment.
+ *
+ * \param n_read Index of the read in the fragment.
+ * \param n_aln  Index of the alignment in the read, or -1 for the line of a
+ *               read without alignments.
+ * \param line   The line, `len` bytes without the newline.
+ *
+ * eturn Anything but RAPI_NO_ERROR stops rapi_format_sam_lines, which
+ *         returns it.
+ */
+typedef rapi_error_t (*rapi_sam_line_callback)(int n_read, int n_aln, const char* line, size_t len, void* user_data);
+
+/**
+ * Format SAM for the reads in the indicated fragment, as rapi_format_sam_b
+ * does, and pass each line to `callback` with the read and alignment it's
+ * the record of:  rapi_format_sam_b writes a line per alignment, in order,
+ * or one for a read without any.
+ *
+ * \param scratch An initialized kstring_t for the fragment's SAM text;  its
+ *                content is replaced.
+ */
+rapi_error_t rapi_format_sam_lines(const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* scratch,
+    rapi_sam_line_callback callback, void* user_data);
+
 /**
  * Format the SAM header for the given reference.  The header will also contain
  * a @PG tag identifying the RAPI-interfaced aligner being used.
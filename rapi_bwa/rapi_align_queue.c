@@ -0,0 +1,258 @@
+/*
+ * rapi_align_queue.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // sysconf
+
+#include "rapi_align_queue.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct rapi_align_job {
+	const rapi_ref* ref;
+	rapi_batch* batch;
+	rapi_ssize_t start_frag, end_frag;
+	rapi_aligner_state* state;
+	int n_threads;
+	rapi_align_callback callback;
+	void* user_data;
+	int detached; // no handle was returned to the caller;  free when done
+
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	int done;
+	rapi_error_t result;
+
+	struct rapi_align_job* next; // queue link
+};
+
+struct rapi_align_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	rapi_align_job *head, *tail;
+	int closing;
+	pthread_t thread;
+};
+
+/*
+ * Library-wide budget of worker threads for the running jobs.  Each state
+ * has its own dispatcher, and rapi_align_reads starts the state's own
+ * workers, so without it a front end keeping a state per batch in flight
+ * would run states * n_threads workers on the same cores.
+ */
+static pthread_mutex_t _budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _budget_cond = PTHREAD_COND_INITIALIZER;
+static int _threads_running;
+
+static int _thread_budget(void)
+{
+	const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return n_cpus > 0 ? (int)n_cpus : 1;
+}
+
+static void _budget_acquire(int n_threads)
+{
+	const int budget = _thread_budget();
+	pthread_mutex_lock(&_budget_lock);
+	// a job needing more than the whole budget still runs, alone
+	while (_threads_running > 0 && _threads_running + n_threads > budget)
+		pthread_cond_wait(&_budget_cond, &_budget_lock);
+	_threads_running += n_threads;
+	pthread_mutex_unlock(&_budget_lock);
+}
+
+static void _budget_release(int n_threads)
+{
+	pthread_mutex_lock(&_budget_lock);
+	_threads_running -= n_threads;
+	pthread_cond_broadcast(&_budget_cond);
+	pthread_mutex_unlock(&_budget_lock);
+}
+
+static void _job_destroy(rapi_align_job* job)
+{
+	pthread_cond_destroy(&job->done_cond);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+}
+
+static void _job_complete(rapi_align_job* job, rapi_error_t result)
+{
+	// run the callback first, so that a job is never seen as done before
+	// its callback has returned
+	if (job->callback)
+		job->callback(result, job->user_data);
+
+	pthread_mutex_lock(&job->lock);
+	const int detached = job->detached;
+	job->result = result;
+	job->done = 1;
+	pthread_cond_broadcast(&job->done_cond);
+	pthread_mutex_unlock(&job->lock);
+
+	if (detached)
+		_job_destroy(job);
+}
+
+static void* _dispatcher(void* arg)
+{
+	rapi_align_queue* queue = arg;
+
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		while (NULL == queue->head && !queue->closing)
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+		rapi_align_job* job = queue->head;
+		if (NULL == job) { // closing and nothing left
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+		queue->head = job->next;
+		if (NULL == queue->head)
+			queue->tail = NULL;
+		pthread_mutex_unlock(&queue->lock);
+
+		_budget_acquire(job->n_threads);
+		pthread_mutex_lock(&queue->lock); // the queue may have been closed while waiting
+		const int closing = queue->closing;
+		pthread_mutex_unlock(&queue->lock);
+		rapi_error_t result = closing ? RAPI_CANCELLED :
+			rapi_align_reads(job->ref, job->batch, job->start_frag, job->end_frag, job->state);
+		_budget_release(job->n_threads);
+		_job_complete(job, result);
+	}
+	return NULL;
+}
+
+rapi_align_queue* rapi_align_queue_new(void)
+{
+	rapi_align_queue* queue = calloc(1, sizeof(*queue));
+	if (NULL == queue)
+		return NULL;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	if (pthread_create(&queue->thread, NULL, _dispatcher, queue) != 0) {
+		pthread_cond_destroy(&queue->not_empty);
+		pthread_mutex_destroy(&queue->lock);
+		free(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+void rapi_align_queue_free(rapi_align_queue* queue)
+{
+	if (NULL == queue)
+		return;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->closing = 1;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	pthread_join(queue->thread, NULL);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+rapi_error_t rapi_align_queue_submit(rapi_align_queue* queue,
+		const rapi_ref* ref, rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state, int n_threads,
+		rapi_align_callback callback, void* user_data, rapi_align_job** ret_job)
+{
+	rapi_align_job* job = calloc(1, sizeof(*job));
+	if (NULL == job)
+		return RAPI_MEMORY_ERROR;
+
+	job->ref = ref;
+	job->batch = batch;
+	job->start_frag = start_frag;
+	job->end_frag = end_frag;
+	job->state = state;
+	job->n_threads = n_threads > 0 ? n_threads : 1;
+	job->callback = callback;
+	job->user_data = user_data;
+	job->detached = (NULL == ret_job);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->done_cond, NULL);
+
+	// set the return argument before queueing:  a detached job may be freed
+	// as soon as it's in the queue
+	if (ret_job)
+		*ret_job = job;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->closing) {
+		pthread_mutex_unlock(&queue->lock);
+		if (ret_job)
+			*ret_job = NULL;
+		_job_destroy(job);
+		return RAPI_CANCELLED;
+	}
+	if (queue->tail)
+		queue->tail->next = job;
+	else
+		queue->head = job;
+	queue->tail = job;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	return RAPI_NO_ERROR;
+}
+
+/******** job handles ********/
+
+rapi_error_t rapi_align_job_poll(rapi_align_job* job, int* done)
+{
+	if (NULL == job || NULL == done)
+		return RAPI_PARAM_ERROR;
+
+	pthread_mutex_lock(&job->lock);
+	*done = job->done;
+	pthread_mutex_unlock(&job->lock);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_align_job_wait(rapi_align_job* job)
+{
+	if (NULL == job)
+		return RAPI_PARAM_ERROR;
+
+	pthread_mutex_lock(&job->lock);
+	while (!job->done)
+		pthread_cond_wait(&job->done_cond, &job->lock);
+	rapi_error_t result = job->result;
+	pthread_mutex_unlock(&job->lock);
+	return result;
+}
+
+rapi_error_t rapi_align_job_free(rapi_align_job* job)
+{
+	if (NULL == job)
+		return RAPI_NO_ERROR;
+
+	rapi_align_job_wait(job);
+	_job_destroy(job);
+	return RAPI_NO_ERROR;
+}
@@ -0,0 +1,60 @@
+/*
+ * rapi_align_queue.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_ALIGN_QUEUE_H__
+#define __RAPI_ALIGN_QUEUE_H__
+
+#include <rapi.h>
+
+/**
+ * FIFO of asynchronous alignment jobs for one aligner state, served by its
+ * own dispatcher thread.  Each job is a rapi_align_reads call, so the
+ * alignment itself still runs on the aligner's worker threads.
+ *
+ * The dispatchers of all the queues share a budget of worker threads, the
+ * number of online processors:  a job starts when its threads fit in what
+ * the running jobs leave, or when no job is running.
+ */
+typedef struct rapi_align_queue rapi_align_queue;
+
+/**
+ * Create a queue and start its dispatcher thread.
+ *
+ * \return the new queue, or NULL if it cannot be created.
+ */
+rapi_align_queue* rapi_align_queue_new(void);
+
+/**
+ * Stop the dispatcher.  Jobs still queued complete with RAPI_CANCELLED
+ * without running; the job running, if any, is waited for.
+ */
+void rapi_align_queue_free(rapi_align_queue* queue);
+
+/**
+ * Queue a rapi_align_reads call, which will run with `n_threads` worker
+ * threads.  See rapi_align_reads_async for the meaning of the other
+ * arguments.
+ */
+rapi_error_t rapi_align_queue_submit(rapi_align_queue* queue,
+		const rapi_ref* ref, rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state, int n_threads,
+		rapi_align_callback callback, void* user_data, rapi_align_job** job);
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * rapi_aln_cache.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "rapi_aln_cache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_N_SHARDS 16
+
+typedef struct cache_entry {
+	struct cache_entry *prev, *next; // LRU list; most recently used first
+	struct cache_entry *chain;       // next entry in the same bucket
+	uint64_t hash;
+	char* seqs;        // the fragment's sequences, each NULL-terminated
+	size_t seqs_size;
+	int n_reads;
+	rapi_read* reads;  // only the alignments are set, with NULL contigs
+	int* contigs;      // contig index of each alignment, in read order; -1 for none
+	size_t n_alignments; // of all the reads
+} cache_entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	cache_entry** buckets;
+	size_t n_buckets; // power of 2
+	cache_entry *head, *tail;
+	size_t n_entries, capacity;
+} cache_shard;
+
+struct rapi_aln_cache {
+	cache_shard shards[CACHE_N_SHARDS];
+};
+
+/******** alignment copies ********/
+
+void rapi_read_free_alignments(rapi_read* read)
+{
+	for (int a = 0; a < read->n_alignments; ++a) {
+		for (int t = 0; t < read->alignments[a].tags.n; ++t)
+			rapi_tag_clear(&read->alignments[a].tags.a[t]);
+		kv_destroy(read->alignments[a].tags);
+		free(read->alignments[a].cigar_ops);
+	}
+	free(read->alignments);
+	read->alignments = NULL;
+	read->n_alignments = 0;
+}
+
+rapi_error_t rapi_read_copy_alignments(rapi_read* dst, const rapi_read* src)
+{
+	if (src->n_alignments == 0)
+		return RAPI_NO_ERROR;
+
+	dst->alignments = calloc(src->n_alignments, sizeof(rapi_alignment));
+	if (NULL == dst->alignments)
+		return RAPI_MEMORY_ERROR;
+	dst->n_alignments = src->n_alignments;
+
+	for (int a = 0; a < src->n_alignments; ++a) {
+		const rapi_alignment* src_aln = &src->alignments[a];
+		rapi_alignment* dst_aln = &dst->alignments[a];
+
+		*dst_aln = *src_aln;
+		dst_aln->cigar_ops = NULL;
+		kv_init(dst_aln->tags);
+
+		if (src_aln->n_cigar_ops > 0) {
+			dst_aln->cigar_ops = malloc(src_aln->n_cigar_ops * sizeof(dst_aln->cigar_ops[0]));
+			if (NULL == dst_aln->cigar_ops)
+				goto error;
+			memcpy(dst_aln->cigar_ops, src_aln->cigar_ops, src_aln->n_cigar_ops * sizeof(dst_aln->cigar_ops[0]));
+		}
+
+		for (int t = 0; t < src_aln->tags.n; ++t) {
+			const rapi_tag* src_tag = &src_aln->tags.a[t];
+			rapi_tag* tag = kv_pushp(rapi_tag, dst_aln->tags);
+			*tag = *src_tag;
+			if (src_tag->type == RAPI_VTYPE_TEXT) {
+				rapi_tag_set_text(tag, "");
+				kputsn(src_tag->value.text.s, src_tag->value.text.l, &tag->value.text);
+			}
+		}
+	}
+	return RAPI_NO_ERROR;
+
+error:
+	rapi_read_free_alignments(dst);
+	return RAPI_MEMORY_ERROR;
+}
+
+/******** cache ********/
+
+static uint64_t _fragment_hash(uint64_t fingerprint, const rapi_read* reads, int n_reads)
+{
+	uint64_t h = 14695981039346656037ULL ^ fingerprint; // FNV-1a
+	for (int r = 0; r < n_reads; ++r) {
+		for (const char* c = reads[r].seq; *c; ++c)
+			h = (h ^ (uint8_t)*c) * 1099511628211ULL;
+		h = (h ^ 0xff) * 1099511628211ULL; // read separator
+	}
+	return h;
+}
+
+static size_t _seqs_size(const rapi_read* reads, int n_reads)
+{
+	size_t size = 0;
+	for (int r = 0; r < n_reads; ++r)
+		size += reads[r].length + 1;
+	return size;
+}
+
+static int _entry_matches(const cache_entry* e, uint64_t hash, const rapi_read* reads, int n_reads)
+{
+	if (e->hash != hash || e->n_reads != n_reads)
+		return 0;
+	const char* s = e->seqs;
+	for (int r = 0; r < n_reads; ++r) {
+		if (strcmp(s, reads[r].seq) != 0)
+			return 0;
+		s += reads[r].length + 1;
+	}
+	return 1;
+}
+
+static inline cache_shard* _shard(rapi_aln_cache* cache, uint64_t hash)
+{
+	return &cache->shards[hash >> 60]; // high bits; the buckets use the low ones
+}
+
+static void _lru_unlink(cache_shard* shard, cache_entry* e)
+{
+	if (e->prev) e->prev->next = e->next; else shard->head = e->next;
+	if (e->next) e->next->prev = e->prev; else shard->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void _lru_push_front(cache_shard* shard, cache_entry* e)
+{
+	e->prev = NULL;
+	e->next = shard->head;
+	if (shard->head) shard->head->prev = e;
+	shard->head = e;
+	if (NULL == shard->tail) shard->tail = e;
+}
+
+static void _free_entry(cache_entry* e)
+{
+	if (e->reads) {
+		for (int r = 0; r < e->n_reads; ++r)
+			rapi_read_free_alignments(&e->reads[r]);
+		free(e->reads);
+	}
+	free(e->contigs);
+	free(e->seqs);
+	free(e);
+}
+
+static void _evict_lru(cache_shard* shard)
+{
+	cache_entry* victim = shard->tail;
+	cache_entry** link = &shard->buckets[victim->hash & (shard->n_buckets - 1)];
+	while (*link != victim)
+		link = &(*link)->chain;
+	*link = victim->chain;
+	_lru_unlink(shard, victim);
+	_free_entry(victim);
+	shard->n_entries -= 1;
+}
+
+rapi_aln_cache* rapi_aln_cache_new(size_t capacity)
+{
+	rapi_aln_cache* cache = calloc(1, sizeof(*cache));
+	if (NULL == cache)
+		return NULL;
+
+	size_t shard_capacity = (capacity + CACHE_N_SHARDS - 1) / CACHE_N_SHARDS;
+	size_t n_buckets = 16;
+	while (n_buckets < shard_capacity)
+		n_buckets <<= 1;
+
+	for (int i = 0; i < CACHE_N_SHARDS; ++i) {
+		cache_shard* shard = &cache->shards[i];
+		shard->capacity = shard_capacity;
+		shard->n_buckets = n_buckets;
+		shard->buckets = calloc(n_buckets, sizeof(shard->buckets[0]));
+		if (NULL == shard->buckets) {
+			for (int j = 0; j < i; ++j) {
+				free(cache->shards[j].buckets);
+				pthread_mutex_destroy(&cache->shards[j].lock);
+			}
+			free(cache);
+			return NULL;
+		}
+		pthread_mutex_init(&shard->lock, NULL);
+	}
+	return cache;
+}
+
+void rapi_aln_cache_free(rapi_aln_cache* cache)
+{
+	if (NULL == cache)
+		return;
+	for (int i = 0; i < CACHE_N_SHARDS; ++i) {
+		cache_shard* shard = &cache->shards[i];
+		cache_entry* e = shard->head;
+		while (e) {
+			cache_entry* next = e->next;
+			_free_entry(e);
+			e = next;
+		}
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
+
+/* Index of `contig` in `ref`'s contigs:  -1 for NULL, -2 if it isn't one of them. */
+static int _contig_index(const rapi_ref* ref, const rapi_contig* contig)
+{
+	if (NULL == contig)
+		return -1;
+	// compare addresses as integers:  `contig` may point into another array
+	const uintptr_t offset = (uintptr_t)contig - (uintptr_t)ref->contigs;
+	if (offset % sizeof(rapi_contig) != 0 || offset / sizeof(rapi_contig) >= (uintptr_t)ref->n_contigs)
+		return -2;
+	return offset / sizeof(rapi_contig);
+}
+
+/* Point the alignments copied from `e` into `reads` to the contigs of `ref`.  \return 0 if `ref` hasn't got them. */
+static int _bind_contigs(const cache_entry* e, const rapi_ref* ref, rapi_read* reads)
+{
+	int k = 0;
+	for (int r = 0; r < e->n_reads; ++r) {
+		for (int a = 0; a < reads[r].n_alignments; ++a, ++k) {
+			const int contig = e->contigs[k];
+			if (contig >= ref->n_contigs)
+				return 0;
+			reads[r].alignments[a].contig = contig >= 0 ? &ref->contigs[contig] : NULL;
+		}
+	}
+	return 1;
+}
+
+int rapi_aln_cache_get(rapi_aln_cache* cache, uint64_t fingerprint, const rapi_ref* ref, rapi_read* reads, int n_reads)
+{
+	const uint64_t hash = _fragment_hash(fingerprint, reads, n_reads);
+	cache_shard* shard = _shard(cache, hash);
+	int result = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	cache_entry* e = shard->buckets[hash & (shard->n_buckets - 1)];
+	while (e && !_entry_matches(e, hash, reads, n_reads))
+		e = e->chain;
+	if (e) {
+		_lru_unlink(shard, e);
+		_lru_push_front(shard, e);
+		result = 1;
+		for (int r = 0; r < n_reads && result > 0; ++r) {
+			rapi_error_t error = rapi_read_copy_alignments(&reads[r], &e->reads[r]);
+			if (error != RAPI_NO_ERROR)
+				result = -error;
+		}
+		if (result > 0 && !_bind_contigs(e, ref, reads))
+			result = 0;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (result <= 0) {
+		for (int r = 0; r < n_reads; ++r)
+			rapi_read_free_alignments(&reads[r]);
+	}
+	return result;
+}
+
+rapi_error_t rapi_aln_cache_put(rapi_aln_cache* cache, uint64_t fingerprint, const rapi_ref* ref, const rapi_read* reads, int n_reads)
+{
+	const uint64_t hash = _fragment_hash(fingerprint, reads, n_reads);
+	cache_shard* shard = _shard(cache, hash);
+	if (shard->capacity == 0)
+		return RAPI_NO_ERROR;
+
+	// Build the entry outside the lock
+	cache_entry* e = calloc(1, sizeof(*e));
+	if (NULL == e)
+		return RAPI_MEMORY_ERROR;
+	e->hash = hash;
+	e->n_reads = n_reads;
+	e->seqs_size = _seqs_size(reads, n_reads);
+	e->seqs = malloc(e->seqs_size);
+	e->reads = calloc(n_reads, sizeof(e->reads[0]));
+	for (int r = 0; r < n_reads; ++r)
+		e->n_alignments += reads[r].n_alignments;
+	e->contigs = malloc((e->n_alignments > 0 ? e->n_alignments : 1) * sizeof(e->contigs[0]));
+	if (NULL == e->seqs || NULL == e->reads || NULL == e->contigs) {
+		_free_entry(e);
+		return RAPI_MEMORY_ERROR;
+	}
+	char* s = e->seqs;
+	int k = 0;
+	for (int r = 0; r < n_reads; ++r) {
+		memcpy(s, reads[r].seq, reads[r].length + 1);
+		s += reads[r].length + 1;
+		rapi_error_t error = rapi_read_copy_alignments(&e->reads[r], &reads[r]);
+		if (error != RAPI_NO_ERROR) {
+			_free_entry(e);
+			return error;
+		}
+		for (int a = 0; a < e->reads[r].n_alignments; ++a, ++k) {
+			const int index = _contig_index(ref, e->reads[r].alignments[a].contig);
+			if (index < -1) {
+				_free_entry(e);
+				return RAPI_PARAM_ERROR;
+			}
+			e->contigs[k] = index;
+			e->reads[r].alignments[a].contig = NULL;
+		}
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	cache_entry** bucket = &shard->buckets[hash & (shard->n_buckets - 1)];
+	cache_entry* existing = *bucket;
+	while (existing && !_entry_matches(existing, hash, reads, n_reads))
+		existing = existing->chain;
+	if (existing) { // another thread cached it first
+		pthread_mutex_unlock(&shard->lock);
+		_free_entry(e);
+		return RAPI_NO_ERROR;
+	}
+	if (shard->n_entries >= shard->capacity)
+		_evict_lru(shard);
+	e->chain = *bucket;
+	*bucket = e;
+	_lru_push_front(shard, e);
+	shard->n_entries += 1;
+	pthread_mutex_unlock(&shard->lock);
+
+	return RAPI_NO_ERROR;
+}
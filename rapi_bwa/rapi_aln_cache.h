@@ -0,0 +1,79 @@
+/*
+ * rapi_aln_cache.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_ALN_CACHE_H__
+#define __RAPI_ALN_CACHE_H__
+
+#include <rapi.h>
+
+/**
+ * Bounded LRU cache of fragment alignments, keyed by the fragment's read
+ * sequences and an options fingerprint.
+ *
+ * The cache is split in shards, each with its own lock, so it can be used
+ * concurrently from the worker threads.
+ *
+ * Entries don't keep pointers into the reference:  the contig of each
+ * alignment is stored as an index, and bound to the contigs of the rapi_ref
+ * passed to rapi_aln_cache_get.  So the reference can be freed and loaded
+ * again while the cache lives, as long as the fingerprint identifies it.
+ */
+typedef struct rapi_aln_cache rapi_aln_cache;
+
+/**
+ * Create a cache holding up to `capacity` fragments.
+ *
+ * \return the new cache, or NULL if allocation fails.
+ */
+rapi_aln_cache* rapi_aln_cache_new(size_t capacity);
+
+void rapi_aln_cache_free(rapi_aln_cache* cache);
+
+/**
+ * Look up the fragment made of the `n_reads` reads in `reads`, with the
+ * options identified by `fingerprint`.  On a hit, copy the cached
+ * alignments into `reads`, which must have none, pointing them to the
+ * contigs of `ref`.  An entry with a contig index beyond `ref`'s contigs is
+ * a miss.
+ *
+ * \return 1 on a hit, 0 on a miss, or a negative rapi_error_t if copying fails.
+ */
+int rapi_aln_cache_get(rapi_aln_cache* cache, uint64_t fingerprint, const rapi_ref* ref, rapi_read* reads, int n_reads);
+
+/**
+ * Store a copy of the alignments of the fragment in `reads`, made against
+ * `ref`, evicting the least recently used fragment if the cache is full.
+ * Does nothing if the fragment is already cached.
+ *
+ * \return RAPI_PARAM_ERROR if an alignment's contig isn't one of `ref`'s.
+ */
+rapi_error_t rapi_aln_cache_put(rapi_aln_cache* cache, uint64_t fingerprint, const rapi_ref* ref, const rapi_read* reads, int n_reads);
+
+/**
+ * Deep copy the alignments of `src` into `dst`, which must have none.
+ */
+rapi_error_t rapi_read_copy_alignments(rapi_read* dst, const rapi_read* src);
+
+/**
+ * Free the alignments of `read`.
+ */
+void rapi_read_free_alignments(rapi_read* read);
+
+#endif
@@ -0,0 +1,438 @@
+/*
+ * rapi_batch_file.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_batch_file.h>
+#include <rapi_utils.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BYTE_ORDER_MARK 0x01020304u
+#define Align8(n) ( ((n) + 7) & ~(uint64_t)7 )
+
+/******** serialization ********/
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME        0x100000001b3ull
+
+static uint64_t _fnv1a(uint64_t h, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return h;
+}
+
+uint64_t rapi_batch_ref_fingerprint(const rapi_ref* ref)
+{
+	uint64_t h = FNV_OFFSET_BASIS;
+	for (int c = 0; c < ref->n_contigs; ++c) {
+		const rapi_contig* contig = &ref->contigs[c];
+		// the name with its NUL, so that "chr1" + 2 and "chr" + 12 differ
+		h = _fnv1a(h, contig->name, strlen(contig->name) + 1);
+		// the length byte by byte, least significant first, whatever the byte order
+		uint64_t len = (uint64_t)contig->len;
+		for (int b = 0; b < 8; ++b, len >>= 8) {
+			const unsigned char byte = len & 0xff;
+			h = _fnv1a(h, &byte, 1);
+		}
+	}
+	return h;
+}
+
+static uint64_t _put_str(char* strings, uint64_t* pos, const char* s, size_t len)
+{
+	const uint64_t off = *pos;
+	memcpy(strings + off, s, len);
+	strings[off + len] = '\0';
+	*pos += len + 1;
+	return off;
+}
+
+rapi_error_t rapi_batch_serialize(const rapi_ref* ref, const rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, kstring_t* output)
+{
+	if (NULL == ref || NULL == batch || NULL == output)
+		return RAPI_PARAM_ERROR;
+	if (start_frag < 0 || end_frag < start_frag || end_frag > batch->n_frags)
+		return RAPI_PARAM_ERROR;
+
+	const uint64_t n_reads = (uint64_t)(end_frag - start_frag) * batch->n_reads_frag;
+	uint64_t n_alignments = 0, n_cigar_ops = 0, n_tags = 0, strings_size = 0;
+
+	// first pass:  size the arrays
+	for (rapi_ssize_t f = start_frag; f < end_frag; ++f) {
+		for (int r = 0; r < batch->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(batch, f, r);
+			strings_size += strlen(read->id) + 1 + read->length + 1;
+			if (read->qual)
+				strings_size += read->length + 1;
+			n_alignments += read->n_alignments;
+			for (int a = 0; a < read->n_alignments; ++a) {
+				const rapi_alignment* aln = &read->alignments[a];
+				if (aln->contig && (aln->contig < ref->contigs || aln->contig >= ref->contigs + ref->n_contigs)) {
+					PERROR("Alignment of read %s isn't on a contig of reference %s\n", read->id, ref->path);
+					return RAPI_PARAM_ERROR;
+				}
+				if (kv_size(aln->tags) > UINT16_MAX)
+					return RAPI_PARAM_ERROR;
+				n_cigar_ops += aln->n_cigar_ops;
+				n_tags += kv_size(aln->tags);
+				for (size_t t = 0; t < kv_size(aln->tags); ++t) {
+					const rapi_tag* tag = &kv_A(aln->tags, t);
+					if (tag->type == RAPI_VTYPE_TEXT)
+						strings_size += tag->value.text.l + 1;
+				}
+			}
+		}
+	}
+
+	rapi_bin_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, RAPI_BATCH_FILE_MAGIC);
+	hdr.version = RAPI_BATCH_FILE_VERSION;
+	hdr.byte_order = BYTE_ORDER_MARK;
+	hdr.n_frags = end_frag - start_frag;
+	hdr.n_reads_frag = batch->n_reads_frag;
+	hdr.n_contigs = ref->n_contigs;
+	hdr.ref_fingerprint = rapi_batch_ref_fingerprint(ref);
+	hdr.n_alignments = n_alignments;
+	hdr.n_cigar_ops = n_cigar_ops;
+	hdr.n_tags = n_tags;
+	hdr.strings_size = strings_size;
+	hdr.reads_off = Align8(sizeof(hdr));
+	hdr.alignments_off = hdr.reads_off + n_reads * sizeof(rapi_bin_read);
+	hdr.cigars_off = hdr.alignments_off + n_alignments * sizeof(rapi_bin_alignment);
+	hdr.tags_off = Align8(hdr.cigars_off + n_cigar_ops * sizeof(uint32_t));
+	hdr.strings_off = hdr.tags_off + n_tags * sizeof(rapi_bin_tag);
+	hdr.size = Align8(hdr.strings_off + strings_size);
+
+	const size_t base = Align8(output->l);
+	if (ks_resize(output, base + hdr.size + 1) != 0)
+		return RAPI_MEMORY_ERROR;
+	// zero the padding too, so that equal batches give identical images
+	memset(output->s + output->l, 0, base + hdr.size - output->l);
+	char* img = output->s + base;
+	memcpy(img, &hdr, sizeof(hdr));
+
+	// second pass:  fill the arrays
+	rapi_bin_read* bin_reads = (rapi_bin_read*)(img + hdr.reads_off);
+	rapi_bin_alignment* bin_alns = (rapi_bin_alignment*)(img + hdr.alignments_off);
+	uint32_t* bin_cigars = (uint32_t*)(img + hdr.cigars_off);
+	rapi_bin_tag* bin_tags = (rapi_bin_tag*)(img + hdr.tags_off);
+	char* strings = img + hdr.strings_off;
+	uint64_t i_aln = 0, i_cigar = 0, i_tag = 0, str_pos = 0;
+
+	for (rapi_ssize_t f = start_frag; f < end_frag; ++f) {
+		for (int r = 0; r < batch->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(batch, f, r);
+			rapi_bin_read* br = bin_reads++;
+			br->id = _put_str(strings, &str_pos, read->id, strlen(read->id));
+			br->seq = _put_str(strings, &str_pos, read->seq, read->length);
+			br->qual = read->qual ? _put_str(strings, &str_pos, read->qual, read->length) : RAPI_BIN_NONE;
+			br->length = read->length;
+			br->n_alignments = read->n_alignments;
+			br->alignments = i_aln;
+
+			for (int a = 0; a < read->n_alignments; ++a) {
+				const rapi_alignment* aln = &read->alignments[a];
+				rapi_bin_alignment* ba = &bin_alns[i_aln++];
+				ba->pos = aln->pos;
+				ba->contig = aln->contig ? (int32_t)(aln->contig - ref->contigs) : -1;
+				ba->score = aln->score;
+				ba->mapq = aln->mapq;
+				ba->flags = (aln->paired ? RAPI_BIN_PAIRED : 0)
+				    | (aln->prop_paired ? RAPI_BIN_PROP_PAIRED : 0)
+				    | (aln->mapped ? RAPI_BIN_MAPPED : 0)
+				    | (aln->reverse_strand ? RAPI_BIN_REVERSE_STRAND : 0)
+				    | (aln->secondary_aln ? RAPI_BIN_SECONDARY_ALN : 0)
+				    | (aln->duplicate ? RAPI_BIN_DUPLICATE : 0);
+				ba->n_mismatches = aln->n_mismatches;
+				ba->n_gap_opens = aln->n_gap_opens;
+				ba->n_gap_extensions = aln->n_gap_extensions;
+				ba->n_cigar_ops = aln->n_cigar_ops;
+				ba->n_tags = kv_size(aln->tags);
+				ba->cigar_ops = i_cigar;
+				ba->tags = i_tag;
+
+				for (int c = 0; c < aln->n_cigar_ops; ++c)
+					bin_cigars[i_cigar++] = aln->cigar_ops[c].op | (uint32_t)aln->cigar_ops[c].len << 4;
+
+				for (size_t t = 0; t < kv_size(aln->tags); ++t) {
+					const rapi_tag* tag = &kv_A(aln->tags, t);
+					rapi_bin_tag* bt = &bin_tags[i_tag++];
+					strncpy(bt->key, tag->key, sizeof(bt->key) - 1);
+					bt->type = tag->type;
+					switch (tag->type) {
+					case RAPI_VTYPE_CHAR: bt->value.integer = (unsigned char)tag->value.character; break;
+					case RAPI_VTYPE_INT:  bt->value.integer = tag->value.integer; break;
+					case RAPI_VTYPE_REAL: bt->value.real = tag->value.real; break;
+					case RAPI_VTYPE_TEXT:
+						bt->text_len = tag->value.text.l;
+						bt->value.text = _put_str(strings, &str_pos, tag->value.text.s ? tag->value.text.s : "", tag->value.text.l);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	output->l = base + hdr.size;
+	output->s[output->l] = '\0';
+	return RAPI_NO_ERROR;
+}
+
+/******** mapping ********/
+
+static int _array_ok(uint64_t off, uint64_t count, size_t elem_size, size_t alignment, uint64_t size)
+{
+	return off % alignment == 0 && off <= size && count <= (size - off) / elem_size;
+}
+
+rapi_error_t rapi_batch_map(rapi_mapped_batch* mb, const void* data, size_t size)
+{
+	if (NULL == mb || NULL == data || (uintptr_t)data % 8 != 0)
+		return RAPI_PARAM_ERROR;
+
+	const rapi_bin_header* hdr = data;
+	if (size < sizeof(*hdr) || strncmp(hdr->magic, RAPI_BATCH_FILE_MAGIC, sizeof(hdr->magic)) != 0) {
+		PERROR("Not a RAPI batch image\n");
+		return RAPI_PARAM_ERROR;
+	}
+	if (hdr->version != RAPI_BATCH_FILE_VERSION || hdr->byte_order != BYTE_ORDER_MARK) {
+		PERROR("Unsupported RAPI batch image (version %u, byte order %#x)\n", hdr->version, hdr->byte_order);
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
+	}
+
+	const uint64_t img_size = hdr->size;
+	if (img_size > size || hdr->n_frags < 0 || hdr->n_reads_frag < 1 || hdr->n_reads_frag > 2
+	    || (uint64_t)hdr->n_frags > img_size / sizeof(rapi_bin_read)
+	    || !_array_ok(hdr->reads_off, (uint64_t)hdr->n_frags * hdr->n_reads_frag, sizeof(rapi_bin_read), 8, img_size)
+	    || !_array_ok(hdr->alignments_off, hdr->n_alignments, sizeof(rapi_bin_alignment), 8, img_size)
+	    || !_array_ok(hdr->cigars_off, hdr->n_cigar_ops, sizeof(uint32_t), 4, img_size)
+	    || !_array_ok(hdr->tags_off, hdr->n_tags, sizeof(rapi_bin_tag), 8, img_size)
+	    || !_array_ok(hdr->strings_off, hdr->strings_size, 1, 1, img_size)) {
+		PERROR("Corrupt RAPI batch image\n");
+		return RAPI_PARAM_ERROR;
+	}
+
+	const char* img = data;
+	memset(mb, 0, sizeof(*mb));
+	mb->header = hdr;
+	mb->n_frags = hdr->n_frags;
+	mb->n_reads_frag = hdr->n_reads_frag;
+	mb->n_contigs = hdr->n_contigs;
+	mb->ref_fingerprint = hdr->ref_fingerprint;
+	mb->reads = (const rapi_bin_read*)(img + hdr->reads_off);
+	mb->alignments = (const rapi_bin_alignment*)(img + hdr->alignments_off);
+	mb->cigar_ops = (const uint32_t*)(img + hdr->cigars_off);
+	mb->tags = (const rapi_bin_tag*)(img + hdr->tags_off);
+	mb->strings = img + hdr->strings_off;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_batch_map_file(rapi_mapped_batch* mb, const char* path)
+{
+	if (NULL == mb || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		PERROR("Couldn't open batch file %s\n", path);
+		if (fd >= 0) close(fd);
+		return RAPI_GENERIC_ERROR;
+	}
+	if ((size_t)st.st_size < sizeof(rapi_bin_header)) {
+		PERROR("%s is not a RAPI batch file\n", path);
+		close(fd);
+		return RAPI_PARAM_ERROR;
+	}
+
+	void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p) {
+		PERROR("Couldn't mmap batch file %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	rapi_error_t error = rapi_batch_map(mb, p, st.st_size);
+	if (error != RAPI_NO_ERROR) {
+		munmap(p, st.st_size);
+		return error;
+	}
+	mb->_mapping = p;
+	mb->_mapping_size = st.st_size;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_batch_unmap(rapi_mapped_batch* mb)
+{
+	if (NULL == mb)
+		return RAPI_PARAM_ERROR;
+	if (mb->_mapping)
+		munmap(mb->_mapping, mb->_mapping_size);
+	memset(mb, 0, sizeof(*mb));
+	return RAPI_NO_ERROR;
+}
+
+/******** loading into a rapi_batch ********/
+
+static rapi_error_t _load_alignment(const rapi_mapped_batch* mb, const rapi_ref* ref,
+    const rapi_bin_alignment* ba, uint64_t strings_size, rapi_alignment* aln)
+{
+	if (ba->contig >= mb->n_contigs || ba->contig < -1)
+		return RAPI_PARAM_ERROR;
+
+	aln->contig = ba->contig < 0 ? NULL : &ref->contigs[ba->contig];
+	aln->pos = ba->pos;
+	aln->score = ba->score;
+	aln->mapq = ba->mapq;
+	aln->paired = (ba->flags & RAPI_BIN_PAIRED) != 0;
+	aln->prop_paired = (ba->flags & RAPI_BIN_PROP_PAIRED) != 0;
+	aln->mapped = (ba->flags & RAPI_BIN_MAPPED) != 0;
+	aln->reverse_strand = (ba->flags & RAPI_BIN_REVERSE_STRAND) != 0;
+	aln->secondary_aln = (ba->flags & RAPI_BIN_SECONDARY_ALN) != 0;
+	aln->duplicate = (ba->flags & RAPI_BIN_DUPLICATE) != 0;
+	aln->n_mismatches = ba->n_mismatches;
+	aln->n_gap_opens = ba->n_gap_opens;
+	aln->n_gap_extensions = ba->n_gap_extensions;
+
+	if (ba->n_cigar_ops > 0) {
+		aln->cigar_ops = malloc(ba->n_cigar_ops * sizeof(aln->cigar_ops[0]));
+		if (NULL == aln->cigar_ops)
+			return RAPI_MEMORY_ERROR;
+		aln->n_cigar_ops = ba->n_cigar_ops;
+		for (int c = 0; c < ba->n_cigar_ops; ++c) {
+			const uint32_t v = mb->cigar_ops[ba->cigar_ops + c];
+			aln->cigar_ops[c].op = v & 0xf;
+			aln->cigar_ops[c].len = v >> 4;
+		}
+	}
+
+	for (int t = 0; t < ba->n_tags; ++t) {
+		const rapi_bin_tag* bt = &mb->tags[ba->tags + t];
+		rapi_tag* tag = kv_pushp(rapi_tag, aln->tags);
+		if (NULL == tag)
+			return RAPI_MEMORY_ERROR;
+		memset(tag, 0, sizeof(*tag));
+		if (memchr(bt->key, '\0', sizeof(bt->key)) == NULL) {
+			aln->tags.n -= 1;
+			return RAPI_PARAM_ERROR;
+		}
+		rapi_tag_set_key(tag, bt->key);
+		switch (bt->type) {
+		case RAPI_VTYPE_CHAR: rapi_tag_set_char(tag, (char)bt->value.integer); break;
+		case RAPI_VTYPE_INT:  rapi_tag_set_long(tag, bt->value.integer); break;
+		case RAPI_VTYPE_REAL: rapi_tag_set_dbl(tag, bt->value.real); break;
+		case RAPI_VTYPE_TEXT:
+			if (bt->value.text >= strings_size || bt->text_len > strings_size - bt->value.text - 1) {
+				aln->tags.n -= 1;
+				return RAPI_PARAM_ERROR;
+			}
+			tag->type = RAPI_VTYPE_TEXT;
+			rapi_kstr_init(&tag->value.text);
+			if (kputsn(mb->strings + bt->value.text, bt->text_len, &tag->value.text) < 0) {
+				aln->tags.n -= 1;
+				return RAPI_MEMORY_ERROR;
+			}
+			break;
+		default:
+			aln->tags.n -= 1;
+			return RAPI_PARAM_ERROR;
+		}
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_batch_load(const rapi_mapped_batch* mb, const rapi_ref* ref, rapi_batch* batch)
+{
+	if (NULL == mb || NULL == ref || NULL == batch || batch->n_reads_frag != mb->n_reads_frag)
+		return RAPI_PARAM_ERROR;
+	if (mb->n_contigs != ref->n_contigs) {
+		PERROR("Batch image was aligned to a reference with %d contigs, not %d\n", mb->n_contigs, ref->n_contigs);
+		return RAPI_PARAM_ERROR;
+	}
+	if (mb->ref_fingerprint != rapi_batch_ref_fingerprint(ref)) {
+		PERROR("Batch image was aligned to a reference with other contig names or lengths than %s\n", ref->path);
+		return RAPI_PARAM_ERROR;
+	}
+
+	const rapi_bin_header* hdr = mb->header;
+	const uint64_t strings_size = hdr->strings_size;
+	// with a terminated string area, any offset within it is a valid string
+	if (strings_size > 0 && mb->strings[strings_size - 1] != '\0')
+		return RAPI_PARAM_ERROR;
+
+	rapi_error_t error = rapi_reads_clear(batch);
+	if (error == RAPI_NO_ERROR)
+		error = rapi_reads_reserve(batch, mb->n_frags);
+
+	for (rapi_ssize_t f = 0; f < mb->n_frags && !error; ++f) {
+		for (int r = 0; r < mb->n_reads_frag && !error; ++r) {
+			const rapi_bin_read* br = rapi_mapped_get_read(mb, f, r);
+			if (br->id >= strings_size || br->seq >= strings_size
+			    || (br->qual != RAPI_BIN_NONE && br->qual >= strings_size)
+			    || br->alignments > hdr->n_alignments || br->n_alignments > hdr->n_alignments - br->alignments
+			    || br->n_alignments > UINT8_MAX) {
+				error = RAPI_PARAM_ERROR;
+				break;
+			}
+			const char* seq = mb->strings + br->seq;
+			const char* qual = rapi_mapped_str(mb, br->qual);
+			if (qual && strlen(qual) != strlen(seq)) {
+				error = RAPI_PARAM_ERROR;
+				break;
+			}
+			// qualities are stored as rapi_read keeps them, i.e., Sanger-encoded
+			error = rapi_set_read(batch, f, r, mb->strings + br->id, seq, qual, 33);
+			if (error || br->n_alignments == 0)
+				continue;
+
+			rapi_read* read = rapi_get_read(batch, f, r);
+			read->alignments = calloc(br->n_alignments, sizeof(rapi_alignment));
+			if (NULL == read->alignments) {
+				error = RAPI_MEMORY_ERROR;
+				break;
+			}
+			read->n_alignments = br->n_alignments;
+			for (uint32_t a = 0; a < br->n_alignments && !error; ++a) {
+				const rapi_bin_alignment* ba = &mb->alignments[br->alignments + a];
+				if (ba->cigar_ops > hdr->n_cigar_ops || ba->n_cigar_ops > hdr->n_cigar_ops - ba->cigar_ops
+				    || ba->tags > hdr->n_tags || ba->n_tags > hdr->n_tags - ba->tags)
+					error = RAPI_PARAM_ERROR;
+				else
+					error = _load_alignment(mb, ref, ba, strings_size, &read->alignments[a]);
+			}
+		}
+	}
+
+	if (error != RAPI_NO_ERROR) {
+		PERROR("Couldn't load the RAPI batch image (%s)\n", rapi_error_name(error));
+		rapi_reads_clear(batch);
+	}
+	return error;
+}
@@ -19,6 +19,9 @@
  ******************************************************************************/
 
 #include <rapi.h>
+#include <rapi_metrics.h>
+#include <rapi_regions.h>
+#include <rapi_host_filter.h>
 #include <rapi_utils.h>
 #include <bwamem.h>
 #include <kstring.h>
@@ -26,12 +29,18 @@
 #include <utils.h>
 
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "bwa_header.h"
+#include "rapi_sw_batch.h"
+#include "rapi_aln_cache.h"
+#include "rapi_kmer_index.h"
+#include "rapi_align_queue.h"
 
 #define RAPI_BWA_PLUGIN_VERSION  "0.1.0-dev"
 
@@ -43,10 +52,210 @@ typedef struct {
 	int n_threads;
 	int share_ref_mem;
 	mem_opt_t* bwa_opts;
+
+	/* plug-in specific options, set through rapi_opts.parameters */
+	long adaptive_rescue;
+	double adaptive_rescue_min_score;
+	long adaptive_rescue_max_sw;
+	long batched_rescue;
+	long batched_seeding;
+	long reorder_reads;
+	long dedup_reads;
+	long result_cache_size;
+	long kmer_fast_path;
+	long kmer_length;
+	long kmer_stride;
+	long rescue_cell_budget;
+	long read_seed_budget;
+	long batch_deadline_ms;
+	long max_occ;
+	long deterministic;
+	double isize_mean;
+	double isize_std;
 } library_opts;
 
 library_opts* _g_library_opts = NULL;
 
+/*
+ * Plug-in specific parameters that can be set through the rapi_opts.parameters
+ * list.  INT parameters are stored in `long` fields, REAL parameters in `double`
+ * fields and TEXT parameters in `char*` fields (owned by the library_opts).
+ *
+ *   adaptive_rescue            (INT)  If non-zero, don't run mate-SW to look
+ *                                     for read ends that are already
+ *                                     confidently placed, and cap the mate-SW
+ *                                     of the other pairs (_rescue_sw_limit).
+ *   adaptive_rescue_min_score  (REAL) Fraction of the perfect score an end's
+ *                                     best hit must reach to be considered
+ *                                     confidently placed.
+ *   adaptive_rescue_max_sw     (INT)  With adaptive_rescue, maximum number of
+ *                                     mate-SW runs for a pair that isn't
+ *                                     confidently placed;  no limit if not
+ *                                     positive.
+ *   batched_rescue             (INT)  If non-zero, score the mate-SW problems of
+ *                                     chunks of pairs together with the SIMD
+ *                                     kernel in rapi_sw_batch.c.
+ *   batched_seeding            (INT)  If non-zero, seed chunks of reads together,
+ *                                     prefetching their FM-index lookups.
+ *   reorder_reads              (INT)  If non-zero, align fragments in an order
+ *                                     that groups reads from the same locus.
+ *   dedup_reads                (INT)  If non-zero, align only one of each set of
+ *                                     fragments with identical sequences and copy
+ *                                     its alignments to the others.
+ *   result_cache_size          (INT)  If positive, keep the alignments of up to
+ *                                     this many fragments in an LRU cache in
+ *                                     the aligner state, and reuse them for
+ *                                     fragments with the same sequences.
+ *   kmer_fast_path             (INT)  If non-zero, try to place reads with the
+ *                                     auxiliary k-mer index (rapi_kmer_index.c)
+ *                                     before running BWA's seeding.  Their
+ *                                     MAPQ is conservative.  The index takes
+ *                                     about 4 GB for a human genome
+ *                                     (rapi_kmer_index.h).
+ *   kmer_length                (INT)  Length of the indexed k-mers (<= 31).
+ *   kmer_stride                (INT)  Sampling interval of the indexed k-mers;
+ *                                     the index size is inversely proportional.
+ *   rescue_cell_budget         (INT)  If positive, maximum number of SW cells
+ *                                     mate rescue may compute for a pair.
+ *   read_seed_budget           (INT)  If positive, maximum number of seed
+ *                                     occurrences a read may have:  the
+ *                                     occurrences of its SMEMs, each counting
+ *                                     at most max_occ as in BWA's chaining.
+ *                                     Reads over it aren't seeded, chained or
+ *                                     extended (_seed_budget_exceeded);  they
+ *                                     can still be placed by mate rescue.
+ *                                     Counting costs an extra SMEM pass per
+ *                                     read.
+ *   batch_deadline_ms          (INT)  If positive, time limit for each
+ *                                     rapi_align_reads call.  Fragments reached
+ *                                     after it get no further alignment work.
+ *                                     It's checked before each read (chunk of
+ *                                     reads with batched_seeding) and each
+ *                                     mate rescue:  the seeding and extension
+ *                                     of a read, inside BWA, can't be stopped,
+ *                                     so a call may overrun it by the time of
+ *                                     the slowest read in flight per thread.
+ *                                     Set read_seed_budget to bound that.
+ *   max_occ                    (INT)  If positive, BWA's max_occ:  seeds with
+ *                                     more occurrences are skipped.  It bounds
+ *                                     the seeding and chaining work per read
+ *                                     (BWA's default is 10000).
+ *   deterministic              (INT)  If non-zero, make the results independent
+ *                                     of how the reads are split into batches:
+ *                                     ties between equally good hits are broken
+ *                                     by a hash of the read name rather than by
+ *                                     the read's position in the run, and paired
+ *                                     reads need an insert size model given
+ *                                     with isize_mean or loaded from a snapshot
+ *                                     (rapi_aligner_state_restore or
+ *                                     rapi_aligner_state_set_insert_size);
+ *                                     without one they're refused with
+ *                                     RAPI_PARAM_ERROR.  Incompatible with
+ *                                     batch_deadline_ms, result_cache_size and
+ *                                     dedup_reads.
+ *   isize_mean                 (REAL) If positive, use a fixed insert size model
+ *                                     with this mean for FR pairs instead of
+ *                                     estimating it from the reads.
+ *   isize_std                  (REAL) Standard deviation of the fixed model;
+ *                                     10% of the mean if not positive.
+ *
+ * Fragments cut short by any of these limits have the tag RAPI_BWA_BUDGET_TAG
+ * on all their alignments, with the bitwise OR of the budget_hit values as its
+ * value.
+ */
+typedef struct {
+	const char* name;
+	uint8_t type;  // RAPI_VTYPE_*
+	size_t offset; // of the field within library_opts
+} plugin_param_def;
+
+static const plugin_param_def _plugin_params[] = {
+	{ "adaptive_rescue",           RAPI_VTYPE_INT,  offsetof(library_opts, adaptive_rescue) },
+	{ "adaptive_rescue_min_score", RAPI_VTYPE_REAL, offsetof(library_opts, adaptive_rescue_min_score) },
+	{ "adaptive_rescue_max_sw",    RAPI_VTYPE_INT,  offsetof(library_opts, adaptive_rescue_max_sw) },
+	{ "batched_rescue",            RAPI_VTYPE_INT,  offsetof(library_opts, batched_rescue) },
+	{ "batched_seeding",           RAPI_VTYPE_INT,  offsetof(library_opts, batched_seeding) },
+	{ "reorder_reads",             RAPI_VTYPE_INT,  offsetof(library_opts, reorder_reads) },
+	{ "dedup_reads",               RAPI_VTYPE_INT,  offsetof(library_opts, dedup_reads) },
+	{ "result_cache_size",         RAPI_VTYPE_INT,  offsetof(library_opts, result_cache_size) },
+	{ "kmer_fast_path",            RAPI_VTYPE_INT,  offsetof(library_opts, kmer_fast_path) },
+	{ "kmer_length",               RAPI_VTYPE_INT,  offsetof(library_opts, kmer_length) },
+	{ "kmer_stride",               RAPI_VTYPE_INT,  offsetof(library_opts, kmer_stride) },
+	{ "rescue_cell_budget",        RAPI_VTYPE_INT,  offsetof(library_opts, rescue_cell_budget) },
+	{ "read_seed_budget",          RAPI_VTYPE_INT,  offsetof(library_opts, read_seed_budget) },
+	{ "batch_deadline_ms",         RAPI_VTYPE_INT,  offsetof(library_opts, batch_deadline_ms) },
+	{ "max_occ",                   RAPI_VTYPE_INT,  offsetof(library_opts, max_occ) },
+	{ "deterministic",             RAPI_VTYPE_INT,  offsetof(library_opts, deterministic) },
+	{ "isize_mean",                RAPI_VTYPE_REAL, offsetof(library_opts, isize_mean) },
+	{ "isize_std",                 RAPI_VTYPE_REAL, offsetof(library_opts, isize_std) },
+};
+
+#define RAPI_BWA_BUDGET_TAG "ZB"
+
+typedef enum {
+	BUDGET_RESCUE   = 1, // mate rescue stopped at rescue_cell_budget
+	BUDGET_DEADLINE = 2, // alignment stopped at batch_deadline_ms
+	BUDGET_SEEDS    = 4  // a read not aligned for going over read_seed_budget
+} budget_hit;
+
+#define N_PLUGIN_PARAMS (sizeof(_plugin_params) / sizeof(_plugin_params[0]))
+#define ParamField(lib_opts_ptr, def, field_type) (*(field_type*)((char*)(lib_opts_ptr) + (def)->offset))
+
+/*
+ * Counters accumulated while aligning.  Worker threads update a private copy
+ * (indexed by thread id) which is summed into the aligner state at the end of
+ * each batch.  All members must be int64_t.
+ */
+typedef struct {
+	int64_t n_rescue_attempted;  // mate-SW runs
+	int64_t n_rescue_successful; // mate hits added by mate-SW
+	int64_t n_rescue_skipped;    // mate-SW runs avoided by adaptive rescue
+	int64_t n_rescue_capped;     // pairs whose mate-SW stopped at adaptive_rescue_max_sw
+	int64_t n_rescue_cells;      // SW cells computed by mate rescue, including the batched scoring
+	int64_t n_rescue_filtered;   // mate-SW runs resolved by the batched SIMD scoring alone
+	int64_t n_dedup_fragments;   // fragments examined by duplicate collapsing
+	int64_t n_dedup_collapsed;   // fragments whose alignments were copied from an identical one
+	int64_t n_cache_hits;        // fragments found in the result cache
+	int64_t n_cache_misses;      // fragments looked up in the result cache and not found
+	int64_t n_kmer_attempts;     // reads tried on the k-mer fast path
+	int64_t n_kmer_hits;         // reads placed by the k-mer fast path
+	int64_t n_budget_hits;       // fragments over rescue_cell_budget or read_seed_budget
+	int64_t n_deadline_hits;     // fragments cut short by batch_deadline_ms
+	int64_t n_off_target;        // fragments outside the target regions
+	int64_t n_host;              // fragments classified as host by the prefilter
+} bwa_counters;
+
+static const struct {
+	const char* name;
+	size_t offset;
+} _counter_defs[] = {
+	{ "rescue_attempted",  offsetof(bwa_counters, n_rescue_attempted) },
+	{ "rescue_successful", offsetof(bwa_counters, n_rescue_successful) },
+	{ "rescue_skipped",    offsetof(bwa_counters, n_rescue_skipped) },
+	{ "rescue_capped",     offsetof(bwa_counters, n_rescue_capped) },
+	{ "rescue_cells",      offsetof(bwa_counters, n_rescue_cells) },
+	{ "rescue_filtered",   offsetof(bwa_counters, n_rescue_filtered) },
+	{ "dedup_fragments",   offsetof(bwa_counters, n_dedup_fragments) },
+	{ "dedup_collapsed",   offsetof(bwa_counters, n_dedup_collapsed) },
+	{ "cache_hits",        offsetof(bwa_counters, n_cache_hits) },
+	{ "cache_misses",      offsetof(bwa_counters, n_cache_misses) },
+	{ "kmer_attempts",     offsetof(bwa_counters, n_kmer_attempts) },
+	{ "kmer_hits",         offsetof(bwa_counters, n_kmer_hits) },
+	{ "budget_hits",       offsetof(bwa_counters, n_budget_hits) },
+	{ "deadline_hits",     offsetof(bwa_counters, n_deadline_hits) },
+	{ "off_target",        offsetof(bwa_counters, n_off_target) },
+	{ "host",              offsetof(bwa_counters, n_host) },
+};
+
+#define N_COUNTER_DEFS (sizeof(_counter_defs) / sizeof(_counter_defs[0]))
+#define CounterField(counters_ptr, i) (*(int64_t*)((char*)(counters_ptr) + _counter_defs[(i)].offset))
+
+static void _merge_counters(bwa_counters* dest, const bwa_counters* src)
+{
+	for (int i = 0; i < N_COUNTER_DEFS; ++i)
+		CounterField(dest, i) += CounterField(src, i);
+}
+
 const char vtype_char[] = {
 	'0',
 	'A', // RAPI_VTYPE_CHAR       1
@@ -248,6 +457,7 @@ static rapi_error_t _rapi_format_sam_aln(const rapi_read* read, int i_aln, const
 		flag |= aln->prop_paired ? 0x2 : 0;
 		flag |= aln->secondary_aln ? 0x100 : 0; // secondary alignment
 	}
+	flag |= aln->duplicate ? 0x400 : 0; // PCR or optical duplicate
 
 	// supplementary alignment -- i.e., additional alignments that are not marked as secondary
 	flag |= (i_aln > 0 && !aln->secondary_aln) ? 0x800 : 0;
@@ -415,6 +625,38 @@ rapi_error_t rapi_format_sam(const rapi_read** reads, int n_reads, kstring_t* ou
 	return error;
 }
 
+rapi_error_t rapi_format_sam_lines(const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* scratch,
+    rapi_sam_line_callback callback, void* user_data)
+{
+	if (NULL == scratch || NULL == callback)
+		return RAPI_PARAM_ERROR;
+
+	scratch->l = 0;
+	rapi_error_t error = rapi_format_sam_b(batch, n_frag, scratch);
+	const char* line = scratch->s;
+	const char* const sam_end = scratch->s + scratch->l;
+
+	for (int r = 0; r < batch->n_reads_frag && error == RAPI_NO_ERROR; ++r) {
+		const rapi_read* read = rapi_get_read(batch, n_frag, r);
+		const int n_lines = read->n_alignments > 0 ? read->n_alignments : 1;
+		for (int i = 0; i < n_lines && error == RAPI_NO_ERROR; ++i) {
+			if (NULL == line || line > sam_end) {
+				error = RAPI_GENERIC_ERROR;
+				break;
+			}
+			const char* nl = memchr(line, '\n', sam_end - line);
+			const size_t len = nl ? (size_t)(nl - line) : (size_t)(sam_end - line);
+			error = callback(r, read->n_alignments > 0 ? i : -1, line, len, user_data);
+			line = nl ? nl + 1 : sam_end + 1;
+		}
+	}
+	if (error == RAPI_NO_ERROR && line <= sam_end) {
+		PERROR("SAM output doesn't match the alignments of fragment %lld\n", (long long)n_frag);
+		error = RAPI_GENERIC_ERROR;
+	}
+	return error;
+}
+
 /**
  * Format SAM for an entire fragment.
  *
@@ -525,6 +767,23 @@ struct rapi_aligner_state {
 	int64_t n_reads_processed;
 	// paired-end stats
 	mem_pestat_t pes[4];
+	int pes_fixed; // don't estimate pes from each batch
+	bwa_counters stats;
+	rapi_aln_cache* cache; // NULL unless result_cache_size > 0
+	rapi_kmer_index* kmer_index; // loaded on first use, for the reference of the last call
+	pthread_mutex_t cancel_lock; // guards call_running and the setting of cancel_requested
+	int call_running; // an alignment call is in progress
+	volatile int cancel_requested; // set by rapi_aligner_state_cancel while a call is running
+	pthread_mutex_t queue_lock;
+	rapi_align_queue* queue; // created by the first rapi_align_reads_async call
+	rapi_fragment_callback frag_callback; // if set, called for each fragment as soon as it's done
+	void* frag_user_data;
+	int frag_in_order;
+	rapi_metrics* metrics; // if set, collects QC metrics of the aligned fragments
+	const rapi_regions* regions; // if set, fragments that don't hit them are marked off target
+	int drop_off_target;
+	const rapi_host_filter* host_filter; // if set, screens the fragments before they're aligned
+	double host_min_fraction;
 };
 
 
@@ -543,26 +802,112 @@ char* strdup(const char* str)
 }
 #endif
 
+static void _set_plugin_param_defaults(library_opts* lib_opts) {
+	lib_opts->adaptive_rescue = 0;
+	lib_opts->adaptive_rescue_min_score = 0.9;
+	lib_opts->adaptive_rescue_max_sw = 16;
+	lib_opts->batched_rescue = 0;
+	lib_opts->batched_seeding = 0;
+	lib_opts->reorder_reads = 0;
+	lib_opts->dedup_reads = 0;
+	lib_opts->result_cache_size = 0;
+	lib_opts->kmer_fast_path = 0;
+	lib_opts->kmer_length = 25;
+	lib_opts->kmer_stride = 8;
+	lib_opts->rescue_cell_budget = 0;
+	lib_opts->read_seed_budget = 0;
+	lib_opts->batch_deadline_ms = 0;
+	lib_opts->max_occ = 0;
+	lib_opts->deterministic = 0;
+	lib_opts->isize_mean = 0.0;
+	lib_opts->isize_std = 0.0;
+}
+
 static rapi_error_t _library_opts_init(void) {
     _g_library_opts = calloc(1, sizeof(library_opts));
     if (!_g_library_opts) {
         PERROR("_library_opts_init Failed to allocate space for library options");
         return RAPI_MEMORY_ERROR;
     }
+    _set_plugin_param_defaults(_g_library_opts);
     return RAPI_NO_ERROR;
 }
 
+/* Free the memory owned by the library_opts members, but not the structure itself. */
+static void _library_opts_clear(library_opts* lib_opts) {
+	free(lib_opts->bwa_opts);
+	lib_opts->bwa_opts = NULL;
+	for (int i = 0; i < N_PLUGIN_PARAMS; ++i) {
+		const plugin_param_def* def = &_plugin_params[i];
+		if (def->type == RAPI_VTYPE_TEXT) {
+			free(ParamField(lib_opts, def, char*));
+			ParamField(lib_opts, def, char*) = NULL;
+		}
+	}
+}
+
 static rapi_error_t _library_opts_free(void) {
     if (_g_library_opts) {
-        if (_g_library_opts->bwa_opts)
-            free(_g_library_opts->bwa_opts);
+        _library_opts_clear(_g_library_opts);
         free(_g_library_opts);
         _g_library_opts = NULL;
     }
     return RAPI_NO_ERROR;
 }
 
+static rapi_error_t _set_plugin_param(library_opts* lib_opts, const rapi_param* param, int ignore_unsupported) {
+	const char* name = rapi_param_get_name(param);
+	const plugin_param_def* def = NULL;
+
+	for (int i = 0; name && i < N_PLUGIN_PARAMS && !def; ++i) {
+		if (strcmp(name, _plugin_params[i].name) == 0)
+			def = &_plugin_params[i];
+	}
+
+	if (!def) {
+		if (ignore_unsupported)
+			return RAPI_NO_ERROR;
+		PERROR("Unsupported parameter '%s'\n", name ? name : "(null)");
+		return RAPI_PARAM_ERROR;
+	}
+
+	switch (def->type) {
+		case RAPI_VTYPE_INT:
+			if (rapi_param_get_long(param, &ParamField(lib_opts, def, long)))
+				goto type_error;
+			break;
+		case RAPI_VTYPE_REAL: {
+			long integer;
+			if (rapi_param_get_long(param, &integer) == RAPI_NO_ERROR)
+				ParamField(lib_opts, def, double) = integer;
+			else if (rapi_param_get_dbl(param, &ParamField(lib_opts, def, double)))
+				goto type_error;
+			break;
+		}
+		case RAPI_VTYPE_TEXT: {
+			const char* text;
+			if (rapi_param_get_text(param, &text))
+				goto type_error;
+			char* copy = strdup(text);
+			if (text && !copy)
+				return RAPI_MEMORY_ERROR;
+			free(ParamField(lib_opts, def, char*));
+			ParamField(lib_opts, def, char*) = copy;
+			break;
+		}
+		default:
+			goto type_error;
+	}
+	return RAPI_NO_ERROR;
+
+type_error:
+	PERROR("Wrong value type for parameter '%s'\n", name);
+	return RAPI_TYPE_ERROR;
+}
+
 static rapi_error_t _set_library_opts(library_opts* lib_opts, const rapi_opts* opts) {
+	rapi_error_t error = RAPI_NO_ERROR;
+
 	lib_opts->mapq_min = opts->mapq_min;
 	lib_opts->isize_min = opts->isize_min;
 	lib_opts->isize_max = opts->isize_max;
@@ -579,7 +924,23 @@ static rapi_error_t _set_library_opts(library_opts* lib_opts, const rapi_opts* o
 		memcpy(lib_opts->bwa_opts, src, sizeof(mem_opt_t));
 	}
 
-	return RAPI_NO_ERROR;
+	_set_plugin_param_defaults(lib_opts);
+	for (int i = 0; i < kv_size(opts->parameters) && RAPI_NO_ERROR == error; ++i)
+		error = _set_plugin_param(lib_opts, &kv_A(opts->parameters, i), opts->ignore_unsupported);
+	if (lib_opts->max_occ > 0)
+		lib_opts->bwa_opts->max_occ = lib_opts->max_occ > INT_MAX ? INT_MAX : lib_opts->max_occ;
+
+	// these make the results depend on timing or on the other reads in the run
+	if (error == RAPI_NO_ERROR && lib_opts->deterministic
+	    && (lib_opts->batch_deadline_ms > 0 || lib_opts->result_cache_size > 0 || lib_opts->dedup_reads)) {
+		PERROR("deterministic can't be used with batch_deadline_ms, result_cache_size or dedup_reads\n");
+		error = RAPI_PARAM_ERROR;
+	}
+
+	if (error != RAPI_NO_ERROR)
+		_library_opts_clear(lib_opts);
+
+	return error;
 }
 
 static inline const library_opts* _library_opts_get(void) {
@@ -654,6 +1015,7 @@ rapi_error_t rapi_opts_init( rapi_opts * my_opts )
 rapi_error_t rapi_opts_free( rapi_opts * my_opts )
 {
 	free(my_opts->_private);
+	rapi_param_list_free(&my_opts->parameters);
 	return RAPI_NO_ERROR;
 }
 
@@ -868,6 +1230,23 @@ static int _convert_opts(const library_opts* opts, mem_opt_t* bwa_opts)
 	return RAPI_NO_ERROR;
 }
 
+/*
+ * Insert size model for FR pairs with the given mean and standard deviation,
+ * set up like BWA's -I option does.
+ */
+static void _fixed_pestat(double mean, double std, mem_pestat_t pes[4])
+{
+	for (int d = 0; d < 4; ++d)
+		pes[d].failed = 1;
+	pes[1].failed = 0;
+	pes[1].avg = mean;
+	pes[1].std = std > 0 ? std : mean * .1;
+	pes[1].high = (int)(pes[1].avg + 4. * pes[1].std + .499);
+	pes[1].low = (int)(pes[1].avg - 4. * pes[1].std + .499);
+	if (pes[1].low < 1)
+		pes[1].low = 1;
+}
+
 rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, const rapi_opts* opts)
 {
 	rapi_error_t error;
@@ -899,13 +1278,42 @@ rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, cons
 	}
 
 	state->opts = lib_opts;
+	pthread_mutex_init(&state->queue_lock, NULL);
+	pthread_mutex_init(&state->cancel_lock, NULL);
+
+	if (lib_opts->isize_mean > 0) {
+		_fixed_pestat(lib_opts->isize_mean, lib_opts->isize_std, state->pes);
+		state->pes_fixed = 1;
+	}
+	else { // no model yet
+		for (int d = 0; d < 4; ++d)
+			state->pes[d].failed = 1;
+	}
+
+	if (lib_opts->result_cache_size > 0) {
+		state->cache = rapi_aln_cache_new(lib_opts->result_cache_size);
+		if (NULL == state->cache) {
+			rapi_aligner_state_free(state);
+			*ret_state = NULL;
+			return RAPI_MEMORY_ERROR;
+		}
+	}
 
 	return RAPI_NO_ERROR;
 }
 
 rapi_error_t rapi_aligner_state_free(rapi_aligner_state* state)
 {
+	if (state->queue) {
+		rapi_aligner_state_cancel(state);
+		rapi_align_queue_free(state->queue);
+	}
+	pthread_mutex_destroy(&state->queue_lock);
+	pthread_mutex_destroy(&state->cancel_lock);
+	rapi_aln_cache_free(state->cache);
+	rapi_kmer_index_free(state->kmer_index);
 	if (state->opts != _library_opts_get()) {
+		_library_opts_clear((library_opts*)state->opts);
 		free((library_opts*)state->opts);
 		state->opts = NULL;
 	}
@@ -913,6 +1321,223 @@ rapi_error_t rapi_aligner_state_free(rapi_aligner_state* state)
 	return RAPI_NO_ERROR;
 }
 
+rapi_error_t rapi_aligner_state_cancel(rapi_aligner_state* state)
+{
+	if (NULL == state)
+		return RAPI_PARAM_ERROR;
+	pthread_mutex_lock(&state->cancel_lock);
+	if (state->call_running) // otherwise there's nothing to cancel
+		state->cancel_requested = 1;
+	pthread_mutex_unlock(&state->cancel_lock);
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Bracket an alignment call, so that rapi_aligner_state_cancel only affects
+ * the call in progress.  A call made of several passes over the batch
+ * (rapi_align_reads_competitive) is bracketed once.
+ */
+static void _call_begin(rapi_aligner_state* state)
+{
+	pthread_mutex_lock(&state->cancel_lock);
+	state->call_running = 1;
+	state->cancel_requested = 0;
+	pthread_mutex_unlock(&state->cancel_lock);
+}
+
+static void _call_end(rapi_aligner_state* state)
+{
+	pthread_mutex_lock(&state->cancel_lock);
+	state->call_running = 0;
+	state->cancel_requested = 0;
+	pthread_mutex_unlock(&state->cancel_lock);
+}
+
+rapi_error_t rapi_aligner_state_set_fragment_callback(rapi_aligner_state* state,
+		rapi_fragment_callback callback, void* user_data, int in_order)
+{
+	if (NULL == state)
+		return RAPI_PARAM_ERROR;
+	state->frag_callback = callback;
+	state->frag_user_data = user_data;
+	state->frag_in_order = in_order;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_aligner_state_set_metrics(rapi_aligner_state* state, rapi_metrics* metrics)
+{
+	if (NULL == state)
+		return RAPI_PARAM_ERROR;
+	state->metrics = metrics;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_aligner_state_set_regions(rapi_aligner_state* state, const rapi_regions* regions, int drop)
+{
+	if (NULL == state || (regions && !rapi_regions_indexed(regions)))
+		return RAPI_PARAM_ERROR;
+	state->regions = regions;
+	state->drop_off_target = drop != 0;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_aligner_state_set_host_filter(rapi_aligner_state* state,
+    const rapi_host_filter* filter, double min_hit_fraction)
+{
+	if (NULL == state || (filter && !(min_hit_fraction > 0 && min_hit_fraction <= 1)))
+		return RAPI_PARAM_ERROR;
+	state->host_filter = filter;
+	state->host_min_fraction = min_hit_fraction;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_align_reads_async( const rapi_ref* ref, rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state,
+		rapi_align_callback callback, void* user_data, rapi_align_job** job )
+{
+	if (NULL == ref || NULL == batch || NULL == state)
+		return RAPI_PARAM_ERROR;
+
+	pthread_mutex_lock(&state->queue_lock);
+	if (NULL == state->queue)
+		state->queue = rapi_align_queue_new();
+	rapi_align_queue* queue = state->queue;
+	pthread_mutex_unlock(&state->queue_lock);
+
+	if (NULL == queue) {
+		PERROR("Failed to start the asynchronous alignment thread\n");
+		return RAPI_GENERIC_ERROR;
+	}
+	return rapi_align_queue_submit(queue, ref, batch, start_frag, end_frag, state, state->opts->n_threads,
+			callback, user_data, job);
+}
+
+rapi_error_t rapi_aligner_state_get_stats(const rapi_aligner_state* state, rapi_param_list* stats)
+{
+	if (NULL == state || NULL == stats)
+		return RAPI_PARAM_ERROR;
+
+	rapi_param* p = kv_pushp(rapi_param, *stats);
+	rapi_param_init(p);
+	rapi_param_set_name(p, "reads_processed");
+	rapi_param_set_long(p, state->n_reads_processed);
+
+	for (int i = 0; i < N_COUNTER_DEFS; ++i) {
+		p = kv_pushp(rapi_param, *stats);
+		rapi_param_init(p);
+		rapi_param_set_name(p, _counter_defs[i].name);
+		rapi_param_set_long(p, CounterField(&state->stats, i));
+	}
+
+	// fraction of the fragments that duplicate collapsing didn't need to align
+	p = kv_pushp(rapi_param, *stats);
+	rapi_param_init(p);
+	rapi_param_set_name(p, "dedup_collapse_ratio");
+	rapi_param_set_dbl(p, state->stats.n_dedup_fragments > 0 ?
+	    (double)state->stats.n_dedup_collapsed / state->stats.n_dedup_fragments : 0.0);
+
+	// fraction of the reads tried that the k-mer fast path placed
+	p = kv_pushp(rapi_param, *stats);
+	rapi_param_init(p);
+	rapi_param_set_name(p, "kmer_hit_rate");
+	rapi_param_set_dbl(p, state->stats.n_kmer_attempts > 0 ?
+	    (double)state->stats.n_kmer_hits / state->stats.n_kmer_attempts : 0.0);
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Aligner state snapshot:  this header, then n_reads_processed, pes and
+ * stats as they are in memory.  The sizes catch snapshots from builds with
+ * different structures.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pes_size;
+	uint32_t stats_size;
+} state_snapshot_hdr;
+
+#define STATE_SNAPSHOT_MAGIC 0x54534152 // "RAST"
+#define STATE_SNAPSHOT_SIZE (sizeof(state_snapshot_hdr) + sizeof(int64_t) + 4 * sizeof(mem_pestat_t) + sizeof(bwa_counters))
+
+rapi_error_t rapi_aligner_state_save(const rapi_aligner_state* state, kstring_t* output)
+{
+	if (NULL == state || NULL == output)
+		return RAPI_PARAM_ERROR;
+
+	const state_snapshot_hdr hdr = { STATE_SNAPSHOT_MAGIC, 1, sizeof(state->pes), sizeof(state->stats) };
+	if (kputsn_(&hdr, sizeof(hdr), output) < 0
+	    || kputsn_(&state->n_reads_processed, sizeof(state->n_reads_processed), output) < 0
+	    || kputsn_(state->pes, sizeof(state->pes), output) < 0
+	    || kputsn_(&state->stats, sizeof(state->stats), output) < 0)
+		return RAPI_MEMORY_ERROR;
+	return RAPI_NO_ERROR;
+}
+
+/* Whether `data` is a snapshot of this build. */
+static int _valid_snapshot(const rapi_aligner_state* state, const char* data, size_t size)
+{
+	state_snapshot_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	if (size == STATE_SNAPSHOT_SIZE)
+		memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.magic != STATE_SNAPSHOT_MAGIC || hdr.version != 1 || hdr.pes_size != sizeof(state->pes) || hdr.stats_size != sizeof(state->stats)) {
+		PERROR("Aligner state snapshot is corrupt or from a different build\n");
+		return 0;
+	}
+	return 1;
+}
+
+rapi_error_t rapi_aligner_state_restore(rapi_aligner_state* state, const char* data, size_t size)
+{
+	if (NULL == state || NULL == data)
+		return RAPI_PARAM_ERROR;
+	if (!_valid_snapshot(state, data, size))
+		return RAPI_PARAM_ERROR;
+
+	data += sizeof(state_snapshot_hdr);
+	memcpy(&state->n_reads_processed, data, sizeof(state->n_reads_processed));
+	data += sizeof(state->n_reads_processed);
+	memcpy(state->pes, data, sizeof(state->pes));
+	data += sizeof(state->pes);
+	memcpy(&state->stats, data, sizeof(state->stats));
+
+	int has_model = 0;
+	for (int d = 0; d < 4; ++d)
+		has_model |= !state->pes[d].failed;
+	if (!has_model) // keep the options' model, if any
+		return rapi_aligner_state_set_insert_size(state, NULL, 0);
+	if (state->opts->deterministic) // keep the restored model
+		state->pes_fixed = 1;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_aligner_state_set_insert_size(rapi_aligner_state* state, const char* data, size_t size)
+{
+	if (NULL == state)
+		return RAPI_PARAM_ERROR;
+
+	if (NULL == data) { // back to the options' model, or to estimating one
+		if (state->opts->isize_mean > 0)
+			_fixed_pestat(state->opts->isize_mean, state->opts->isize_std, state->pes);
+		state->pes_fixed = state->opts->isize_mean > 0;
+		return RAPI_NO_ERROR;
+	}
+
+	if (!_valid_snapshot(state, data, size))
+		return RAPI_PARAM_ERROR;
+	mem_pestat_t pes[4];
+	memcpy(pes, data + sizeof(state_snapshot_hdr) + sizeof(state->n_reads_processed), sizeof(pes));
+	int valid = 0;
+	for (int d = 0; d < 4; ++d)
+		valid |= !pes[d].failed;
+	if (!valid)
+		return RAPI_PARAM_ERROR;
+	memcpy(state->pes, pes, sizeof(pes));
+	state->pes_fixed = 1;
+	return RAPI_NO_ERROR;
+}
+
 void rapi_put_cigar(int n_ops, const rapi_cigar* ops, int force_hard_clip, kstring_t* output)
 {
 	if (n_ops > 0) {
@@ -1161,33 +1786,205 @@ static int _bwa_reg2_rapi_aln(const mem_opt_t *opt, const rapi_ref* rapi_ref, ra
 #if 1
 
 #define raw_mapq(diff, a) ((int)(6.02 * (diff) / (a) + .499))
+
+/*
+ * Mark the orientations mem_matesw doesn't align for anchor `a` because they
+ * failed insert size estimation or they're already covered by a hit in `ma`.
+ * Same test as in mem_matesw.
+ *
+ * \return the number of skipped orientations
+ */
+static int _mate_sw_skipped(int64_t l_pac, const mem_pestat_t pes[4], const mem_alnreg_t* a, const mem_alnreg_v* ma, int skip[4])
+{
+	int r;
+	for (r = 0; r < 4; ++r)
+		skip[r] = pes[r].failed? 1 : 0;
+	for (int i = 0; i < ma->n; ++i) {
+		int64_t dist;
+		r = mem_infer_dir(l_pac, a->rb, ma->a[i].rb, &dist);
+		if (dist >= pes[r].low && dist <= pes[r].high)
+			skip[r] = 1;
+	}
+	return skip[0] + skip[1] + skip[2] + skip[3];
+}
+
+/*
+ * The reference window [rb, re) in which mem_matesw looks for the mate of
+ * anchor `a` in orientation `r`.
+ *
+ * \return whether the mate is reverse complemented in this orientation
+ */
+static int _mate_sw_window(int64_t l_pac, const mem_pestat_t pes[4], const mem_alnreg_t* a, int l_ms, int r, int64_t* rb, int64_t* re)
+{
+	int is_rev = (r>>1 != (r&1)); // whether to reverse complement the mate
+	int is_larger = !(r>>1); // whether the mate has larger coordinate
+	if (!is_rev) {
+		*rb = is_larger? a->rb + pes[r].low : a->rb - pes[r].high;
+		*re = (is_larger? a->rb + pes[r].high: a->rb - pes[r].low) + l_ms; // if on the same strand, end position should be larger to make room for the seq length
+	} else {
+		*rb = (is_larger? a->rb + pes[r].low : a->rb - pes[r].high) - l_ms; // similarly on opposite strands
+		*re = is_larger? a->rb + pes[r].high: a->rb - pes[r].low;
+	}
+	if (*rb < 0) *rb = 0;
+	if (*re > l_pac<<1) *re = l_pac<<1;
+	return is_rev;
+}
+
+/*
+ * Number of SW cells mem_matesw computes for anchor `a`, given the current
+ * hits `ma` of the mate.
+ */
+static int64_t _mate_sw_cells(int64_t l_pac, const mem_pestat_t pes[4], const mem_alnreg_t* a, const mem_alnreg_v* ma, int l_ms)
+{
+	int skip[4];
+	int64_t cells = 0;
+	if (_mate_sw_skipped(l_pac, pes, a, ma, skip) == 4)
+		return 0;
+	for (int r = 0; r < 4; ++r) {
+		int64_t rb, re;
+		if (skip[r]) continue;
+		_mate_sw_window(l_pac, pes, a, l_ms, r, &rb, &re);
+		if (re > rb)
+			cells += (re - rb) * l_ms;
+	}
+	return cells;
+}
+
+/*
+ * Number of mate-SW runs mem_matesw would make around the candidates
+ * [from, to) of `b`, given the current hits `ma` of the mate.
+ */
+static int _mate_sw_runs(int64_t l_pac, const mem_pestat_t pes[4], const mem_alnreg_v* b, int from, int to, const mem_alnreg_v* ma)
+{
+	int skip[4], n = 0;
+	for (int j = from; j < to; ++j)
+		n += 4 - _mate_sw_skipped(l_pac, pes, &b->a[j], ma, skip);
+	return n;
+}
+
+/*
+ * The mate rescue candidates for each read end:  the hits scoring within
+ * pen_unpaired of the end's best hit.  From mem_sam_pe in bwamem_pair.c.
+ */
+static void _mate_rescue_candidates(const mem_opt_t *opt, const mem_alnreg_v a[2], mem_alnreg_v b[2])
+{
+	kv_init(b[0]); kv_init(b[1]);
+	for (int i = 0; i < 2; ++i)
+		for (int j = 0; j < a[i].n; ++j)
+			if (a[i].a[j].score >= a[i].a[0].score  - opt->pen_unpaired)
+				kv_push(mem_alnreg_t, b[i], a[i].a[j]);
+}
+
+/*
+ * Adaptive mate rescue.
+ *
+ * mem_matesw already skips the orientations that failed insert size
+ * estimation or that have a mate hit at a proper distance, so a pair placed
+ * concordantly costs no mate-SW.  The cost is in looking for an end around
+ * each of its mate's candidates when the mate is in a repeat, and around
+ * both ends of a discordant pair.
+ *
+ * An end is confidently placed when it has a single candidate (no other hit
+ * within pen_unpaired of the best) that reaches adaptive_rescue_min_score
+ * of the perfect score for the read.  Looking for it around the mate's
+ * candidates could only add weaker hits, so we don't:  a pair with both ends
+ * confidently placed gets no mate-SW at all.  The other pairs get at most
+ * adaptive_rescue_max_sw mate-SW runs, spent on the best candidates first;
+ * when both ends are looked for, the first search gets half of them.
+ */
+static inline int _rescue_confident(const mem_opt_t* opt, double min_score, int l_seq, const mem_alnreg_v* candidates)
+{
+	return candidates->n == 1 && candidates->a[0].score >= min_score * opt->a * l_seq;
+}
+
+/* Whether adaptive rescue skips looking for end !i around the candidates `b[i]` of end i. */
+static inline int _skip_rescue_end(const mem_opt_t *opt, const library_opts* lib_opts, const bseq1_t s[2], const mem_alnreg_v b[2], int i)
+{
+	return lib_opts->adaptive_rescue && _rescue_confident(opt, lib_opts->adaptive_rescue_min_score, s[!i].l_seq, &b[!i]);
+}
+
+/*
+ * The mate-SW runs adaptive rescue allows in looking for end !i, when the
+ * pair has already used `n_runs`;  -1 for no limit.
+ */
+static int _rescue_sw_limit(const mem_opt_t *opt, const library_opts* lib_opts, const bseq1_t s[2], const mem_alnreg_v b[2], int i, int n_runs)
+{
+	const int max_sw = lib_opts->adaptive_rescue_max_sw;
+	if (!lib_opts->adaptive_rescue || max_sw <= 0)
+		return -1;
+	if (i == 0 && !_skip_rescue_end(opt, lib_opts, s, b, 1))
+		return (max_sw + 1) / 2; // end 0 is looked for next
+	return max_sw > n_runs ? max_sw - n_runs : 0;
+}
+
 /*
- * Mostly taken from mem_sam_pe in bwamem_pair.c
+ * Mate rescue for one pair:  run mate-SW around the rescue candidates of each
+ * end to look for hits of the other end.  From mem_sam_pe in bwamem_pair.c,
+ * with the limits of adaptive rescue.
  *
- * \return I think this function returns the number pairs aligned by SW
+ * If lib_opts->rescue_cell_budget is set, the rescue stops before the
+ * candidate that would exceed it, and `over_budget` is set.
+ *
+ * \return the number of mate-SW runs performed
+ */
+static int _bwa_mate_rescue(const mem_opt_t *opt, const library_opts* lib_opts, const bntseq_t* bns, const uint8_t* pac,
+		const mem_pestat_t pes[4], bseq1_t s[2], mem_alnreg_v a[2], bwa_counters* counters, int* over_budget)
+{
+	int n = 0, capped = 0;
+	int64_t cells = 0;
+	mem_alnreg_v b[2];
+
+	*over_budget = 0;
+	_mate_rescue_candidates(opt, a, b);
+	for (int i = 0; i < 2 && !*over_budget; ++i) {
+		const int n_cand = b[i].n < opt->max_matesw ? b[i].n : opt->max_matesw;
+		const int skip_end = _skip_rescue_end(opt, lib_opts, s, b, i);
+		const int limit = skip_end ? 0 : _rescue_sw_limit(opt, lib_opts, s, b, i, n);
+		const size_t n_mate_hits = a[!i].n;
+		int n_end = 0;
+		for (int j = 0; j < n_cand; ++j) {
+			const int runs = _mate_sw_runs(bns->l_pac, pes, &b[i], j, j + 1, &a[!i]);
+			if (runs == 0)
+				continue;
+			if (limit >= 0 && n_end + runs > limit) {
+				counters->n_rescue_skipped += _mate_sw_runs(bns->l_pac, pes, &b[i], j, n_cand, &a[!i]);
+				capped |= !skip_end;
+				break;
+			}
+			const int64_t c = _mate_sw_cells(bns->l_pac, pes, &b[i].a[j], &a[!i], s[!i].l_seq);
+			if (lib_opts->rescue_cell_budget > 0) {
+				cells += c;
+				if (cells > lib_opts->rescue_cell_budget) {
+					*over_budget = 1;
+					break;
+				}
+			}
+			counters->n_rescue_cells += c;
+			n_end += mem_matesw(opt, bns->l_pac, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
+		}
+		n += n_end;
+		counters->n_rescue_successful += a[!i].n - n_mate_hits;
+	}
+	counters->n_rescue_attempted += n;
+	counters->n_rescue_capped += capped;
+	free(b[0].a); free(b[1].a);
+	return n;
+}
+
+/*
+ * Pair the hits of the two ends (after mate rescue), compute the mapping
+ * qualities and convert the result into rapi alignments in `out`.
+ * Mostly taken from mem_sam_pe in bwamem_pair.c.
  */
-int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], rapi_read out[2])
+static void _bwa_mem_pe_pair(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat_t pes[4],
+		uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], rapi_read out[2])
 {
 	const bntseq_t *const bns = ((bwaidx_t*)rapi_ref->_private)->bns;
 	const uint8_t *const pac = ((bwaidx_t*)rapi_ref->_private)->pac;
 
-	int n = 0, i, j, z[2], o, subo, n_sub, extra_flag = 1;
-	kstring_t str;
+	int i, j, z[2], o, subo, n_sub, extra_flag = 1;
 	mem_aln_t h[2];
 
-	str.l = str.m = 0; str.s = 0;
-	if (!(opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
-		mem_alnreg_v b[2];
-		kv_init(b[0]); kv_init(b[1]);
-		for (i = 0; i < 2; ++i)
-			for (j = 0; j < a[i].n; ++j)
-				if (a[i].a[j].score >= a[i].a[0].score  - opt->pen_unpaired)
-					kv_push(mem_alnreg_t, b[i], a[i].a[j]);
-		for (i = 0; i < 2; ++i)
-			for (j = 0; j < b[i].n && j < opt->max_matesw; ++j)
-				n += mem_matesw(opt, bns->l_pac, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
-		free(b[0].a); free(b[1].a);
-	}
 	mem_mark_primary_se(opt, a[0].n, a[0].a, id<<1|0);
 	mem_mark_primary_se(opt, a[1].n, a[1].a, id<<1|1);
 	if (opt->flag&MEM_F_NOPAIRING) goto no_pairing;
@@ -1246,7 +2043,7 @@ int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat
 		free(h[0].cigar); free(h[1].cigar);
 
 	} else goto no_pairing;
-	return n;
+	return;
 
 no_pairing:
 	for (i = 0; i < 2; ++i) {
@@ -1272,64 +2069,966 @@ no_pairing:
 
 	if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
 	free(h[0].cigar); free(h[1].cigar);
-	return n;
 }
 
-typedef struct {
-	const mem_opt_t *opt;
-	const rapi_ref* rapi_ref;
-	const bwa_batch* read_batch;
-	rapi_read* rapi_reads; // need to pass these along because the code to convert BWA alignments into rapi is nested pretty deep
-	mem_pestat_t *pes;
-	mem_alnreg_v *regs;
-	int64_t n_processed;
-} bwa_worker_t;
-
 /*
- * This function is the same as worker1 from bwamem.c
+ * Mark all the alignments of `read` as cut short by a budget.  `reasons` is
+ * a bitwise OR of budget_hit values.
  */
-static void bwa_worker_1(void *data, int i, int tid)
+static void _tag_budget_hit(rapi_read* read, int reasons)
 {
-	bwa_worker_t *w = (bwa_worker_t*)data;
-
-	const bwaidx_t* const bwaidx = (bwaidx_t*)(w->rapi_ref->_private);
-	const bwt_t*    const bwt    = bwaidx->bwt;
-	const bntseq_t* const bns    = bwaidx->bns;
-	const uint8_t*  const pac    = bwaidx->pac;
-
-	//PDEBUG("bwa_worker_1: MEM_F_PE is %sset\n", ((w->opt->flag & MEM_F_PE) == 0 ? "not " : " "));
-	if (w->opt->flag & MEM_F_PE) {
-		int read = 2*i;
-		int mate = 2*i + 1;
-		w->regs[read] = mem_align1_core(w->opt, bwt, bns, pac, w->read_batch->seqs[read].l_seq, w->read_batch->seqs[read].seq);
-		w->regs[mate] = mem_align1_core(w->opt, bwt, bns, pac, w->read_batch->seqs[mate].l_seq, w->read_batch->seqs[mate].seq);
-	} else {
-		w->regs[i] = mem_align1_core(w->opt, bwt, bns, pac, w->read_batch->seqs[i].l_seq, w->read_batch->seqs[i].seq);
+	for (int a = 0; a < read->n_alignments; ++a) {
+		rapi_tag* pTag = kv_pushp(rapi_tag, read->alignments[a].tags);
+		rapi_tag_set_key(pTag, RAPI_BWA_BUDGET_TAG);
+		rapi_tag_set_long(pTag, reasons);
 	}
 }
 
-/* based on worker2 from bwamem.c */
-static void bwa_worker_2(void *data, int i, int tid)
-{
-	bwa_worker_t *w = (bwa_worker_t*)data;
-	//PDEBUG("bwa_worker_2 with i %d\n", i);
-	rapi_error_t error = RAPI_NO_ERROR;
+/*
+ * Batched mate rescue.
+ *
+ * Rather than running mate-SW pair by pair, we collect the mate-SW problems of
+ * a chunk of fragments and score them all together with the inter-read SIMD
+ * kernel in rapi_sw_batch.c.  The problems are collected speculatively, from
+ * the hits each end has before any rescue.  Then we replay the mate rescue of
+ * each pair in the same order as _bwa_mate_rescue, but call mem_matesw only
+ * for the candidates where at least one of the orientations it would still
+ * align scores opt->min_seed_len or more -- the minimum score mem_matesw
+ * accepts for a rescued hit.  The other candidates can't add any hits, so the
+ * results are the same as the scalar path's.
+ *
+ * Hits added by the rescue can only make mem_matesw skip more orientations,
+ * never fewer, so the speculative problems cover everything the replay needs.
+ */
 
-	if ((w->opt->flag & MEM_F_PE)) {
-		// paired end
-		// This function does not return an error code but aborts if things go wrong.
-		// Unfortunately this strategy is nested deep in the BWA code.
+#define MATESW_BATCH_FRAGS 64
+
+typedef struct {
+	int end;  // read end providing the anchor hit
+	int cand; // index of the anchor among the end's rescue candidates
+	int r;    // pair orientation
+	int sw;   // index of the SW problem; < 0 if the reference window couldn't be fetched
+} mate_sw_job;
+
+typedef struct {
+	mem_alnreg_v b[2];   // rescue candidates
+	int skip_end[2];     // ends skipped by adaptive rescue
+	uint8_t* rev[2];     // reverse complement of each end, if needed
+	size_t first_job, n_jobs;
+} mate_rescue_frag;
+
+static uint8_t* _rev_comp_codes(const uint8_t* seq, int len)
+{
+	uint8_t* rev = malloc(len);
+	if (NULL == rev)
+		err_fatal(__func__, "Failed to allocate space for reverse complemented sequence\n");
+	for (int i = 0; i < len; ++i)
+		rev[len - 1 - i] = seq[i] < 4? 3 - seq[i] : 4;
+	return rev;
+}
+
+/*
+ * Batched mate rescue for the `n_frags` pairs with indices `frag_idx` among
+ * `seqs` (with the corresponding hits in `regs`).  Equivalent to calling
+ * _bwa_mate_rescue on each pair.
+ */
+static void _bwa_batched_mate_rescue(const mem_opt_t *opt, const library_opts* lib_opts, const bntseq_t* bns, const uint8_t* pac,
+		const mem_pestat_t pes[4], bseq1_t* seqs, mem_alnreg_v* regs, const int* frag_idx, int n_frags, bwa_counters* counters,
+		int* over_budget)
+{
+	mate_rescue_frag frags[MATESW_BATCH_FRAGS];
+	kvec_t(mate_sw_job) jobs;
+	kvec_t(rapi_sw_job) problems;
+	kv_init(jobs);
+	kv_init(problems);
+
+	// collect the SW problems
+	for (int f = 0; f < n_frags; ++f) {
+		const bseq1_t* s = seqs + 2*frag_idx[f];
+		const mem_alnreg_v* a = regs + 2*frag_idx[f];
+		mate_rescue_frag* fr = &frags[f];
+
+		_mate_rescue_candidates(opt, a, fr->b);
+		fr->rev[0] = fr->rev[1] = NULL;
+		fr->first_job = jobs.n;
+		for (int i = 0; i < 2; ++i) {
+			fr->skip_end[i] = _skip_rescue_end(opt, lib_opts, s, fr->b, i);
+			if (fr->skip_end[i])
+				continue;
+
+			const int l_ms = s[!i].l_seq;
+			const uint8_t* ms = (uint8_t*)s[!i].seq;
+			for (int j = 0; j < fr->b[i].n && j < opt->max_matesw; ++j) {
+				const mem_alnreg_t* anchor = &fr->b[i].a[j];
+				int skip[4];
+				if (_mate_sw_skipped(bns->l_pac, pes, anchor, &a[!i], skip) == 4)
+					continue;
+				for (int r = 0; r < 4; ++r) {
+					if (skip[r]) continue;
+					int64_t rb, re, len;
+					int is_rev = _mate_sw_window(bns->l_pac, pes, anchor, l_ms, r, &rb, &re);
+					mate_sw_job* job = kv_pushp(mate_sw_job, jobs);
+					job->end = i; job->cand = j; job->r = r; job->sw = -1;
+
+					uint8_t* ref = bns_get_seq(bns->l_pac, pac, rb, re, &len);
+					if (len != re - rb) { // mem_matesw doesn't align these
+						free(ref);
+						continue;
+					}
+					if (is_rev && NULL == fr->rev[!i])
+						fr->rev[!i] = _rev_comp_codes(ms, l_ms);
+
+					job->sw = problems.n;
+					rapi_sw_job* p = kv_pushp(rapi_sw_job, problems);
+					p->qlen = l_ms;
+					p->query = is_rev ? fr->rev[!i] : ms;
+					p->tlen = len;
+					p->target = ref;
+				}
+			}
+		}
+		fr->n_jobs = jobs.n - fr->first_job;
+	}
+
+	// score them all
+	int* scores = malloc((problems.n > 0 ? problems.n : 1) * sizeof(int));
+	if (NULL == scores)
+		err_fatal(__func__, "Failed to allocate space for mate-SW scores\n");
+	if (rapi_sw_batch_score(problems.n, problems.a, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, scores) != 0) {
+		// no filtering; run mem_matesw for every candidate
+		for (int k = 0; k < problems.n; ++k)
+			scores[k] = opt->min_seed_len;
+	}
+	else {
+		for (int k = 0; k < problems.n; ++k)
+			counters->n_rescue_cells += (int64_t)problems.a[k].qlen * problems.a[k].tlen;
+	}
+
+	// replay the mate rescue of each pair
+	for (int f = 0; f < n_frags; ++f) {
+		bseq1_t* s = seqs + 2*frag_idx[f];
+		mem_alnreg_v* a = regs + 2*frag_idx[f];
+		mate_rescue_frag* fr = &frags[f];
+		const mate_sw_job* job = jobs.a + fr->first_job;
+		const mate_sw_job* const jobs_end = job + fr->n_jobs;
+		int n = 0, capped = 0;
+		int64_t cells = 0;
+
+		over_budget[f] = 0;
+		for (int i = 0; i < 2 && !over_budget[f]; ++i) {
+			const int n_cand = fr->b[i].n < opt->max_matesw ? fr->b[i].n : opt->max_matesw;
+			const int limit = fr->skip_end[i] ? 0 : _rescue_sw_limit(opt, lib_opts, s, fr->b, i, n);
+			const size_t n_mate_hits = a[!i].n;
+			int n_end = 0;
+			for (int j = 0; j < n_cand; ++j) { // same limits and accounting as _bwa_mate_rescue
+				const mem_alnreg_t* anchor = &fr->b[i].a[j];
+				int skip[4], n_sw = 0, promising = 0;
+				const int runs = 4 - _mate_sw_skipped(bns->l_pac, pes, anchor, &a[!i], skip);
+				if (runs == 0)
+					continue;
+				if (limit >= 0 && n_end + runs > limit) {
+					counters->n_rescue_skipped += _mate_sw_runs(bns->l_pac, pes, &fr->b[i], j, n_cand, &a[!i]);
+					capped |= !fr->skip_end[i];
+					break;
+				}
+				const int64_t c = _mate_sw_cells(bns->l_pac, pes, anchor, &a[!i], s[!i].l_seq);
+				if (lib_opts->rescue_cell_budget > 0) {
+					cells += c;
+					if (cells > lib_opts->rescue_cell_budget) {
+						over_budget[f] = 1;
+						break;
+					}
+				}
+				for (; job < jobs_end && (job->end < i || (job->end == i && job->cand < j)); ++job)
+					; // candidates skipped above
+				for (; job < jobs_end && job->end == i && job->cand == j; ++job) {
+					if (skip[job->r] || job->sw < 0) continue;
+					n_sw += 1;
+					if (scores[job->sw] >= opt->min_seed_len)
+						promising = 1;
+				}
+				if (promising) {
+					counters->n_rescue_cells += c;
+					n_end += mem_matesw(opt, bns->l_pac, pac, pes, anchor, s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
+				}
+				else {
+					n_end += n_sw; // the SW mem_matesw would have run, without finding anything
+					counters->n_rescue_filtered += n_sw;
+				}
+			}
+			n += n_end;
+			counters->n_rescue_successful += a[!i].n - n_mate_hits;
+		}
+		counters->n_rescue_attempted += n;
+		counters->n_rescue_capped += capped;
+	}
+
+	for (int f = 0; f < n_frags; ++f) {
+		free(frags[f].b[0].a); free(frags[f].b[1].a);
+		free(frags[f].rev[0]); free(frags[f].rev[1]);
+	}
+	for (int k = 0; k < problems.n; ++k)
+		free((uint8_t*)problems.a[k].target);
+	free(scores);
+	kv_destroy(problems);
+	kv_destroy(jobs);
+}
+
+typedef struct {
+	const mem_opt_t *opt;
+	const library_opts* lib_opts;
+	const rapi_ref* rapi_ref;
+	const bwa_batch* read_batch;
+	rapi_read* rapi_reads; // need to pass these along because the code to convert BWA alignments into rapi is nested pretty deep
+	mem_pestat_t *pes;
+	mem_alnreg_v *regs;
+	int64_t n_processed;
+	bwa_counters* counters; // one per thread, indexed by tid
+	const int* order; // if not NULL, the fragments to process, in order
+	int n_fragments;  // number of fragments to process
+	const rapi_kmer_index* kmer_index; // if not NULL, try the k-mer fast path first
+	double deadline;    // realtime() after which fragments get no further work; 0 for none
+	char* budget_flags; // per fragment, budget_hit bits
+	bwtintv_v* seed_bufs; // with read_seed_budget, 3 SMEM buffers per thread for _seed_budget_exceeded
+	char* finished;     // per fragment, set by _fragment_done
+	volatile const int* cancel; // if set, the workers skip the remaining work items
+	const int* dup_next; // if not NULL, chains each representative fragment to its duplicates; -1 ends a chain
+	struct fragment_sink* sink; // if not NULL, where to report finished fragments
+	rapi_metrics** metrics; // if not NULL, one collector per thread, indexed by tid
+	const rapi_regions* regions; // if not NULL, the target regions
+	int drop_off_target;    // don't convert the hits of off-target fragments
+	const rapi_host_filter* host_filter; // if not NULL, screens the fragments in host_filter_worker
+	double host_min_fraction;
+	volatile rapi_error_t error; // set by any worker that fails
+} bwa_worker_t;
+
+/*
+ * Id of fragment `i` (of read `i` for single-end reads), which seeds BWA's
+ * tie-breaking between equally good hits.  BWA uses the position in the run,
+ * which depends on how the reads are batched;  in deterministic mode we use a
+ * hash (FNV-1a) of the read name instead.  The id is shifted left by one for
+ * pairs, so keep it to 62 bits.
+ */
+static int64_t _tie_break_id(const bwa_worker_t* w, int i)
+{
+	const int paired = (w->opt->flag & MEM_F_PE) != 0;
+	if (!w->lib_opts->deterministic)
+		return paired ? w->n_processed / 2 + i : w->n_processed + i;
+
+	uint64_t h = 14695981039346656037ULL;
+	for (const unsigned char* c = (const unsigned char*)w->rapi_reads[paired ? 2 * i : i].id; *c; ++c)
+		h = (h ^ *c) * 1099511628211ULL;
+	return (int64_t)(h >> 2);
+}
+
+static inline int _past_deadline(const bwa_worker_t* w)
+{
+	return w->deadline > 0 && realtime() > w->deadline;
+}
+
+/*
+ * Record that fragment `i` was cut short by the deadline.
+ */
+static inline void _deadline_hit(bwa_worker_t* w, int i, int tid)
+{
+	if (!(w->budget_flags[i] & BUDGET_DEADLINE)) {
+		w->budget_flags[i] |= BUDGET_DEADLINE;
+		w->counters[tid].n_deadline_hits += 1;
+	}
+}
+
+/*
+ * Record that fragment `i` went over a per-fragment work budget:  `reason`
+ * is BUDGET_RESCUE or BUDGET_SEEDS.  budget_hits counts each fragment once.
+ */
+static inline void _budget_hit(bwa_worker_t* w, int i, int tid, budget_hit reason)
+{
+	if (!(w->budget_flags[i] & (BUDGET_RESCUE | BUDGET_SEEDS)))
+		w->counters[tid].n_budget_hits += 1;
+	w->budget_flags[i] |= reason;
+}
+
+/*
+ * Streaming of finished fragments to the state's fragment callback.
+ *
+ * In order mode, fragments that finish early are marked ready and the
+ * thread that completes the run starting at `next` delivers it.  Only one
+ * thread delivers at a time, but the others don't wait for it.
+ */
+typedef struct fragment_sink {
+	rapi_fragment_callback callback;
+	void* user_data;
+	const rapi_batch* batch;
+	rapi_ssize_t start_frag; // batch index of fragment 0
+	int in_order;
+	pthread_mutex_t lock;
+	char* ready;     // in order mode, per fragment
+	int n_fragments;
+	int next;        // next fragment to deliver
+	int delivering;  // a thread is running callbacks
+} fragment_sink;
+
+static void _sink_deliver(fragment_sink* sink, int frag)
+{
+	if (!sink->in_order) {
+		sink->callback(sink->batch, sink->start_frag + frag, sink->user_data);
+		return;
+	}
+
+	pthread_mutex_lock(&sink->lock);
+	sink->ready[frag] = 1;
+	if (!sink->delivering) {
+		sink->delivering = 1;
+		while (sink->next < sink->n_fragments && sink->ready[sink->next]) {
+			const int f = sink->next;
+			pthread_mutex_unlock(&sink->lock);
+			sink->callback(sink->batch, sink->start_frag + f, sink->user_data);
+			pthread_mutex_lock(&sink->lock);
+			sink->next = f + 1;
+		}
+		sink->delivering = 0;
+	}
+	pthread_mutex_unlock(&sink->lock);
+}
+
+/*
+ * Region filter.
+ *
+ * Fragments are judged on all the hits of their reads, including those
+ * that won't be output because they score below opt->T or are shadowed:
+ * the pairing can still pick them, and a fragment whose output could touch
+ * a region is never dropped.  The hits are in the coordinates of BWA's
+ * forward-reverse concatenated reference;  the reverse strand is mapped
+ * back as in mem_reg2aln.  Fragments cut short by the deadline may be
+ * missing their hits, so they're never judged off target.
+ */
+static int _hits_on_target(const bwa_worker_t* w, const mem_alnreg_v* regs, int n_reads)
+{
+	const bntseq_t* const bns = ((bwaidx_t*)w->rapi_ref->_private)->bns;
+	for (int r = 0; r < n_reads; ++r) {
+		for (size_t k = 0; k < regs[r].n; ++k) {
+			const mem_alnreg_t* p = &regs[r].a[k];
+			int64_t rb = p->rb, re = p->re;
+			if (rb >= bns->l_pac) {
+				rb = (bns->l_pac << 1) - p->re;
+				re = (bns->l_pac << 1) - p->rb;
+			}
+			const int rid = bns_pos2rid(bns, rb);
+			if (rid < 0)
+				continue;
+			const int64_t offset = bns->anns[rid].offset;
+			if (rapi_regions_overlaps(w->regions, rid, rb - offset, re - offset))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pair the hits of fragment `i` and convert them into its rapi alignments,
+ * unless the region filter drops it.
+ */
+static void _convert_pair(bwa_worker_t* w, int i)
+{
+	rapi_read* out = &w->rapi_reads[2 * i];
+	const uint8_t off_target = w->regions && !(w->budget_flags[i] & BUDGET_DEADLINE) && !_hits_on_target(w, &w->regs[2 * i], 2);
+	out[0].off_target = out[1].off_target = off_target;
+	if (off_target && w->drop_off_target) // nothing to convert;  the reads stay without alignments
+		return;
+	_bwa_mem_pe_pair(w->opt, w->rapi_ref, w->pes, _tie_break_id(w, i),
+	                 &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], out);
+}
+
+/* Like _convert_pair for a fragment that already has its alignments (from the result cache). */
+static void _filter_converted(bwa_worker_t* w, int frag)
+{
+	const int n_reads_frag = (w->opt->flag & MEM_F_PE) ? 2 : 1;
+	rapi_read* reads = &w->rapi_reads[frag * n_reads_frag];
+	const uint8_t off_target = w->regions && !rapi_regions_fragment_overlaps(w->regions, reads, n_reads_frag);
+	for (int r = 0; r < n_reads_frag; ++r) {
+		reads[r].off_target = off_target;
+		if (off_target && w->drop_off_target)
+			rapi_read_free_alignments(&reads[r]);
+	}
+}
+
+static inline int _dropped(const bwa_worker_t* w, int frag)
+{
+	const int n_reads_frag = (w->opt->flag & MEM_F_PE) ? 2 : 1;
+	const rapi_read* read = &w->rapi_reads[frag * n_reads_frag];
+	return read->host || (w->drop_off_target && read->off_target);
+}
+
+static void _collect_metrics(bwa_worker_t* w, int frag, int tid)
+{
+	const int n_reads_frag = (w->opt->flag & MEM_F_PE) ? 2 : 1;
+	rapi_error_t error = rapi_metrics_add_fragment(w->metrics[tid], &w->rapi_reads[frag * n_reads_frag], n_reads_frag);
+	if (error != RAPI_NO_ERROR)
+		w->error = error;
+}
+
+/*
+ * Fragment `frag` has its final alignments:  give them to its duplicates,
+ * if any, and report them all to the sink and the metrics (unless the
+ * region or host filter dropped them).  `tid` is the calling worker's.
+ * The duplicates get copies of the alignments, without the duplicate
+ * flag:  marking is rapi_dupmark's job (see rapi_dupmark.h).
+ */
+static void _fragment_done(bwa_worker_t* w, int frag, int tid)
+{
+	const int n_reads_frag = (w->opt->flag & MEM_F_PE) ? 2 : 1;
+	const int off_target = w->rapi_reads[frag * n_reads_frag].off_target;
+	const int host = w->rapi_reads[frag * n_reads_frag].host;
+
+	w->finished[frag] = 1;
+	w->counters[tid].n_off_target += off_target;
+	w->counters[tid].n_host += host;
+	if (w->metrics && !_dropped(w, frag))
+		_collect_metrics(w, frag, tid);
+	if (w->sink)
+		_sink_deliver(w->sink, frag);
+	if (NULL == w->dup_next)
+		return;
+
+	for (int d = w->dup_next[frag]; d >= 0; d = w->dup_next[d]) {
+		for (int r = 0; r < n_reads_frag; ++r) {
+			rapi_error_t error = rapi_read_copy_alignments(&w->rapi_reads[d * n_reads_frag + r], &w->rapi_reads[frag * n_reads_frag + r]);
+			if (error != RAPI_NO_ERROR)
+				w->error = error;
+			w->rapi_reads[d * n_reads_frag + r].off_target = off_target;
+			w->rapi_reads[d * n_reads_frag + r].host = host;
+		}
+		w->finished[d] = 1;
+		w->counters[tid].n_off_target += off_target;
+		w->counters[tid].n_host += host;
+		if (w->metrics && !_dropped(w, d))
+			_collect_metrics(w, d, tid);
+		if (w->sink)
+			_sink_deliver(w->sink, d);
+	}
+}
+
+/*
+ * Fragment reordering.
+ *
+ * Consecutive work items touch unrelated parts of the index and reference.
+ * To improve locality, we can process the fragments sorted by the minimizer
+ * of their first read:  reads from the same locus tend to share it, so
+ * they're processed close together and reuse the same BWT and reference
+ * blocks.  Results are still written to each fragment's own slots, and
+ * each fragment keeps its original index (which seeds BWA's random
+ * tie-breaking), so the output doesn't change.
+ */
+
+#define REORDER_K 15
+
+typedef struct {
+	uint64_t key;
+	int frag;
+} frag_key;
+
+// Thomas Wang's invertible integer hash, so that minimizers aren't biased towards poly-A
+static inline uint64_t _hash64(uint64_t key, uint64_t mask)
+{
+	key = (~key + (key << 21)) & mask;
+	key = key ^ key >> 24;
+	key = ((key + (key << 3)) + (key << 8)) & mask;
+	key = key ^ key >> 14;
+	key = ((key + (key << 2)) + (key << 4)) & mask;
+	key = key ^ key >> 28;
+	key = (key + (key << 31)) & mask;
+	return key;
+}
+
+/*
+ * Smallest hash of the canonical k-mers in `seq`, so that reads from either
+ * strand get the same key.  Reads too short to have a k-mer get UINT64_MAX.
+ */
+static uint64_t _read_minimizer(const char* seq, int len)
+{
+	const int shift = 2 * (REORDER_K - 1);
+	const uint64_t mask = (1ULL << 2 * REORDER_K) - 1;
+	uint64_t kmer[2] = { 0, 0 }; // forward, reverse complement
+	uint64_t min = UINT64_MAX;
+
+	for (int i = 0, l = 0; i < len; ++i) {
+		int c = seq[i] < 4 ? seq[i] : nst_nt4_table[(uint8_t)seq[i]]; // already base codes if aligned before
+		if (c > 3) { // k-mers can't span an N
+			l = 0;
+			continue;
+		}
+		kmer[0] = (kmer[0] << 2 | c) & mask;
+		kmer[1] = kmer[1] >> 2 | (uint64_t)(3 - c) << shift;
+		if (++l >= REORDER_K) {
+			uint64_t h = _hash64(kmer[0] < kmer[1] ? kmer[0] : kmer[1], mask);
+			if (h < min)
+				min = h;
+		}
+	}
+	return min;
+}
+
+static int _cmp_frag_keys(const void* a, const void* b)
+{
+	const frag_key* ka = a;
+	const frag_key* kb = b;
+	if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+	return ka->frag - kb->frag;
+}
+
+/*
+ * Compute the order in which to process the fragments of `read_batch`.
+ *
+ * \return an array of `n_fragments` fragment indices, or NULL if allocation fails.
+ */
+static int* _fragment_order(const bwa_batch* read_batch, int n_reads_frag, int n_fragments)
+{
+	int* order = malloc(n_fragments * sizeof(order[0]));
+	frag_key* keys = malloc(n_fragments * sizeof(keys[0]));
+	if (NULL == order || NULL == keys) {
+		free(order); free(keys);
+		return NULL;
+	}
+
+	for (int f = 0; f < n_fragments; ++f) {
+		const bseq1_t* read = &read_batch->seqs[f * n_reads_frag];
+		keys[f].key = _read_minimizer(read->seq, read->l_seq);
+		keys[f].frag = f;
+	}
+	qsort(keys, n_fragments, sizeof(keys[0]), _cmp_frag_keys);
+	for (int f = 0; f < n_fragments; ++f)
+		order[f] = keys[f].frag;
+
+	free(keys);
+	return order;
+}
+
+/*
+ * Duplicate collapsing.
+ *
+ * Fragments whose reads have byte-identical sequences get the same hits, so
+ * we align only the first one of each set (the representative) and copy its
+ * alignments to the others.  The copies keep their own names and base
+ * qualities:  BWA-MEM doesn't use qualities for alignment, so none of the
+ * alignment fields depend on them.  For insert size estimation each duplicate
+ * counts with its representative's hits (_pestat_regs), as if it had been
+ * aligned.  Since BWA's random tie-breaking is seeded by the fragment index, a copy may resolve ties
+ * between equally good hits differently than aligning it would have.
+ */
+
+static uint64_t _fragment_hash(const bseq1_t* reads, int n_reads_frag)
+{
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for (int r = 0; r < n_reads_frag; ++r) {
+		for (int i = 0; i < reads[r].l_seq; ++i)
+			h = (h ^ (uint8_t)reads[r].seq[i]) * 1099511628211ULL;
+		h = (h ^ 0xff) * 1099511628211ULL; // read separator; not a valid base
+	}
+	return h;
+}
+
+static int _same_sequences(const bseq1_t* a, const bseq1_t* b, int n_reads_frag)
+{
+	for (int r = 0; r < n_reads_frag; ++r) {
+		if (a[r].l_seq != b[r].l_seq || memcmp(a[r].seq, b[r].seq, a[r].l_seq) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * The hits to estimate the insert size from:  a copy of `regs` in which the
+ * slots of each duplicate share the hits of its representative (they aren't
+ * owned by the copy;  only free the array).
+ *
+ * \return NULL if allocation fails.
+ */
+static mem_alnreg_v* _pestat_regs(const mem_alnreg_v* regs, const int* dup_rep, int n_reads_frag, int n_fragments)
+{
+	mem_alnreg_v* copy = malloc((n_fragments > 0 ? n_fragments : 1) * n_reads_frag * sizeof(copy[0]));
+	if (NULL == copy)
+		return NULL;
+	for (int f = 0; f < n_fragments; ++f) {
+		for (int r = 0; r < n_reads_frag; ++r)
+			copy[f * n_reads_frag + r] = regs[dup_rep[f] * n_reads_frag + r];
+	}
+	return copy;
+}
+
+/*
+ * Find the representative of each fragment:  the fragment with the lowest
+ * index among those with the same sequences.
+ *
+ * \return an array of `n_fragments` representative indices, or NULL if allocation fails.
+ */
+static int* _find_duplicates(const bwa_batch* read_batch, int n_reads_frag, int n_fragments)
+{
+	int* rep = malloc(n_fragments * sizeof(rep[0]));
+	frag_key* keys = malloc(n_fragments * sizeof(keys[0]));
+	if (NULL == rep || NULL == keys) {
+		free(rep); free(keys);
+		return NULL;
+	}
+
+	for (int f = 0; f < n_fragments; ++f) {
+		keys[f].key = _fragment_hash(&read_batch->seqs[f * n_reads_frag], n_reads_frag);
+		keys[f].frag = f;
+	}
+	// sorts by hash, then by index, so each representative precedes its duplicates
+	qsort(keys, n_fragments, sizeof(keys[0]), _cmp_frag_keys);
+
+	for (int start = 0, end; start < n_fragments; start = end) {
+		for (end = start + 1; end < n_fragments && keys[end].key == keys[start].key; ++end)
+			;
+		// Within a run of equal hashes, compare the sequences to rule out
+		// collisions.  Runs almost always hold a single set of duplicates.
+		for (int k = start; k < end; ++k) {
+			const int f = keys[k].frag;
+			rep[f] = f;
+			for (int j = start; j < k; ++j) {
+				const int g = keys[j].frag;
+				if (rep[g] == g && _same_sequences(&read_batch->seqs[g * n_reads_frag], &read_batch->seqs[f * n_reads_frag], n_reads_frag)) {
+					rep[f] = g;
+					break;
+				}
+			}
+		}
+	}
+
+	free(keys);
+	return rep;
+}
+
+/*
+ * Whether the read `seq` (base codes) has more than lib_opts->read_seed_budget
+ * seed occurrences.  We walk its SMEMs as the first pass of BWA's
+ * mem_collect_intv does and add up the occurrences of those at least
+ * min_seed_len long, each capped at max_occ like mem_chain samples them.
+ * The seeds, and so the chains and extensions, of mem_align1_core grow with
+ * that sum;  the walk stops as soon as it's over the budget.  `bufs` are
+ * three SMEM buffers of the calling thread.
+ */
+static int _seed_budget_exceeded(const bwa_worker_t* w, int len, const uint8_t* seq, bwtintv_v bufs[3])
+{
+	const bwt_t* bwt = ((bwaidx_t*)w->rapi_ref->_private)->bwt;
+	bwtintv_v* tmpv[2] = { &bufs[1], &bufs[2] };
+	int64_t n_occ = 0;
+	for (int x = 0; x < len; ) {
+		if (seq[x] > 3) {
+			++x;
+			continue;
+		}
+		x = bwt_smem1(bwt, len, seq, x, 1, &bufs[0], tmpv);
+		for (size_t i = 0; i < bufs[0].n; ++i) {
+			const bwtintv_t* p = &bufs[0].a[i];
+			const int slen = (uint32_t)p->info - (p->info >> 32);
+			if (slen >= w->opt->min_seed_len)
+				n_occ += p->x[2] < w->opt->max_occ ? p->x[2] : w->opt->max_occ;
+		}
+		if (n_occ > w->lib_opts->read_seed_budget)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Find the hits of read `r` of fragment `frag`:  with the k-mer fast path,
+ * if enabled and it can place the read; else with mem_align1_core, unless
+ * the read is over read_seed_budget.
+ */
+static mem_alnreg_v _bwa_align1(bwa_worker_t* w, bseq1_t* read, int frag, int tid)
+{
+	const bwaidx_t* const bwaidx = (bwaidx_t*)(w->rapi_ref->_private);
+	bwa_counters* counters = &w->counters[tid];
+	mem_alnreg_v regs;
+
+	if (w->kmer_index || w->seed_bufs) {
+		// convert to base codes in place, like mem_align1_core does
+		for (int i = 0; i < read->l_seq; ++i)
+			read->seq[i] = read->seq[i] < 4 ? read->seq[i] : nst_nt4_table[(int)read->seq[i]];
+	}
+	if (w->kmer_index) {
+		mem_alnreg_t hit;
+		counters->n_kmer_attempts += 1;
+		if (rapi_kmer_index_place(w->kmer_index, w->opt, bwaidx->bns, bwaidx->pac, read->l_seq, (uint8_t*)read->seq, &hit)) {
+			counters->n_kmer_hits += 1;
+			kv_init(regs);
+			kv_push(mem_alnreg_t, regs, hit);
+			return regs;
+		}
+	}
+	if (w->seed_bufs && _seed_budget_exceeded(w, read->l_seq, (uint8_t*)read->seq, &w->seed_bufs[3 * tid])) {
+		_budget_hit(w, frag, tid, BUDGET_SEEDS);
+		kv_init(regs); // unmapped, unless mate rescue finds it
+		return regs;
+	}
+	return mem_align1_core(w->opt, bwaidx->bwt, bwaidx->bns, bwaidx->pac, read->l_seq, read->seq);
+}
+
+/*
+ * Host prefilter:  classify fragment w->order[i] by the fraction of the
+ * k-mers of its reads that are in the host filter.  Host fragments are done
+ * right away, without alignments;  the caller drops them from w->order.
+ */
+static void host_filter_worker(void *data, int i, int tid)
+{
+	bwa_worker_t *w = (bwa_worker_t*)data;
+
+	if (*w->cancel)
+		return;
+
+	const int n_reads_frag = (w->opt->flag & MEM_F_PE) ? 2 : 1;
+	const int frag = w->order[i];
+	rapi_read* reads = &w->rapi_reads[frag * n_reads_frag];
+	int n_kmers = 0, n_hits = 0;
+	for (int r = 0; r < n_reads_frag; ++r) {
+		int k, h;
+		rapi_host_filter_count(w->host_filter, reads[r].seq, reads[r].length, &k, &h);
+		n_kmers += k;
+		n_hits += h;
+	}
+	if (n_kmers > 0 && n_hits >= w->host_min_fraction * n_kmers) {
+		for (int r = 0; r < n_reads_frag; ++r)
+			reads[r].host = 1;
+		_fragment_done(w, frag, tid);
+	}
+}
+
+/*
+ * This function is the same as worker1 from bwamem.c
+ */
+static void bwa_worker_1(void *data, int i, int tid)
+{
+	bwa_worker_t *w = (bwa_worker_t*)data;
+
+	if (*w->cancel)
+		return;
+
+	if (w->order)
+		i = w->order[i];
+
+	if (_past_deadline(w)) { // leave the fragment's hits empty
+		_deadline_hit(w, i, tid);
+		return;
+	}
+
+	//PDEBUG("bwa_worker_1: MEM_F_PE is %sset\n", ((w->opt->flag & MEM_F_PE) == 0 ? "not " : " "));
+	if (w->opt->flag & MEM_F_PE) {
+		int read = 2*i;
+		int mate = 2*i + 1;
+		w->regs[read] = _bwa_align1(w, &w->read_batch->seqs[read], i, tid);
+		w->regs[mate] = _bwa_align1(w, &w->read_batch->seqs[mate], i, tid);
+	} else {
+		w->regs[i] = _bwa_align1(w, &w->read_batch->seqs[i], i, tid);
+	}
+}
+
+/*
+ * Batched seeding.
+ *
+ * Seeding is dominated by the FM-index occurrence lookups, each a likely
+ * cache miss, and each depending on the result of the previous one.  To hide
+ * their latency we walk the forward SMEM extensions of a chunk of reads in
+ * round-robin, prefetching the occurrence blocks each read needs for its
+ * next step before moving on to the next read.  Then mem_align1_core aligns
+ * the reads of the chunk, finding most of the index blocks it needs already
+ * in cache.  The alignment itself is unchanged, so the hits are the same as
+ * bwa_worker_1's.
+ *
+ * The walk only has to find the blocks, not the SMEMs:  it tracks the
+ * reverse-strand end of each read's interval (x[1], x[2]), which takes a
+ * single-base bwt_2occ per step where bwt_extend counts all four bases and
+ * updates the whole bi-interval.  So its cost is a fraction of the seeding
+ * work mem_align1_core repeats, and the latency it pays is overlapped
+ * across the reads of the chunk.
+ *
+ * The chunk is kept small enough for the blocks it touches to stay in cache.
+ */
+
+#define SEED_BATCH_READS 32
+
+typedef struct {
+	const char* seq;
+	int len;
+	int i;         // next query position to extend with
+	bwtint_t x;    // x[1] of the current bi-interval
+	bwtint_t size; // x[2] of the current bi-interval
+} seed_cursor;
+
+static inline int _seed_base(const char* seq, int i)
+{
+	return seq[i] < 4 ? seq[i] : nst_nt4_table[(int)seq[i]];
+}
+
+static inline void _seed_prefetch(const bwt_t* bwt, const seed_cursor* cur)
+{
+	// the blocks the next forward extension reads
+	__builtin_prefetch(bwt_occ_intv(bwt, cur->x - 1));
+	__builtin_prefetch(bwt_occ_intv(bwt, cur->x - 1 + cur->size));
+}
+
+/*
+ * Start a new forward extension at the first A/C/G/T base at or after
+ * position `x`, as bwt_smem1 does.
+ *
+ * \return 0 if there are no bases left to extend.
+ */
+static int _seed_restart(const bwt_t* bwt, seed_cursor* cur, int x)
+{
+	while (x < cur->len && _seed_base(cur->seq, x) > 3)
+		++x;
+	if (x >= cur->len)
+		return 0;
+	const int c = _seed_base(cur->seq, x);
+	// as bwt_set_intv
+	cur->x = bwt->L2[3 - c] + 1;
+	cur->size = bwt->L2[c + 1] - bwt->L2[c];
+	cur->i = x + 1;
+	_seed_prefetch(bwt, cur);
+	return 1;
+}
+
+/*
+ * Advance the cursor by one extension step.
+ *
+ * \return 0 when the read is done.
+ */
+static int _seed_step(const bwt_t* bwt, seed_cursor* cur)
+{
+	if (cur->i >= cur->len)
+		return 0;
+
+	int c = _seed_base(cur->seq, cur->i);
+	if (c < 4) {
+		// A forward extension by c is a backward extension of the reverse
+		// strand by 3 - c:  x[1] and x[2] only depend on that base's counts
+		// (see bwt_extend).
+		bwtint_t tk, tl;
+		bwt_2occ(bwt, cur->x - 1, cur->x - 1 + cur->size, 3 - c, &tk, &tl);
+		if (tl > tk) {
+			cur->x = bwt->L2[3 - c] + 1 + tk;
+			cur->size = tl - tk;
+			cur->i += 1;
+			_seed_prefetch(bwt, cur);
+			return 1;
+		}
+	}
+	// the SMEM ends here; the next one starts where it stopped
+	return _seed_restart(bwt, cur, cur->i);
+}
+
+static void _seed_prefetch_reads(const bwt_t* bwt, const bseq1_t* seqs, int n_reads)
+{
+	seed_cursor cursors[SEED_BATCH_READS];
+	int n_active = 0;
+
+	for (int r = 0; r < n_reads; ++r) {
+		seed_cursor* cur = &cursors[n_active];
+		cur->seq = seqs[r].seq;
+		cur->len = seqs[r].l_seq;
+		n_active += _seed_restart(bwt, cur, 0);
+	}
+
+	while (n_active > 0) {
+		for (int k = 0; k < n_active; ) {
+			if (_seed_step(bwt, &cursors[k]))
+				++k;
+			else // done; swap in the last active cursor
+				cursors[k] = cursors[--n_active];
+		}
+	}
+}
+
+/*
+ * Like bwa_worker_1, but works on the chunk of SEED_BATCH_READS reads (or
+ * SEED_BATCH_READS / 2 pairs) with index `chunk`.
+ */
+static void bwa_worker_1_batched(void *data, int chunk, int tid)
+{
+	bwa_worker_t *w = (bwa_worker_t*)data;
+
+	const bwaidx_t* const bwaidx = (bwaidx_t*)(w->rapi_ref->_private);
+	const bwt_t*    const bwt    = bwaidx->bwt;
+
+	const int n_reads_frag = (w->opt->flag & MEM_F_PE) ? 2 : 1;
+	int start = chunk * (SEED_BATCH_READS / n_reads_frag);
+	int n_frags = w->n_fragments - start;
+	if (n_frags > SEED_BATCH_READS / n_reads_frag)
+		n_frags = SEED_BATCH_READS / n_reads_frag;
+
+	if (*w->cancel)
+		return;
+
+	if (_past_deadline(w)) { // leave the fragments' hits empty
+		for (int f = start; f < start + n_frags; ++f)
+			_deadline_hit(w, w->order ? w->order[f] : f, tid);
+		return;
+	}
+
+	// gather the chunk's reads, following w->order if we have it
+	bseq1_t seqs[SEED_BATCH_READS];
+	int slots[SEED_BATCH_READS];
+	int n_reads = 0;
+	for (int f = start; f < start + n_frags; ++f) {
+		int frag = w->order ? w->order[f] : f;
+		for (int r = 0; r < n_reads_frag; ++r, ++n_reads) {
+			slots[n_reads] = frag * n_reads_frag + r;
+			seqs[n_reads] = w->read_batch->seqs[slots[n_reads]]; // shares the sequence buffer
+		}
+	}
+
+	_seed_prefetch_reads(bwt, seqs, n_reads);
+	for (int r = 0; r < n_reads; ++r)
+		w->regs[slots[r]] = _bwa_align1(w, &seqs[r], slots[r] / n_reads_frag, tid);
+}
+
+/* based on worker2 from bwamem.c */
+static void bwa_worker_2(void *data, int i, int tid)
+{
+	bwa_worker_t *w = (bwa_worker_t*)data;
+	//PDEBUG("bwa_worker_2 with i %d\n", i);
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	if (w->order)
+		i = w->order[i];
+
+	if (*w->cancel) { // just release the hits
+		for (int r = 0; r < ((w->opt->flag & MEM_F_PE) ? 2 : 1); ++r) {
+			mem_alnreg_v* regs = &w->regs[((w->opt->flag & MEM_F_PE) ? 2 * i : i) + r];
+			free(regs->a); kv_init(*regs);
+		}
+		return;
+	}
+
+	if ((w->opt->flag & MEM_F_PE)) {
+		// paired end
+		// This function does not return an error code but aborts if things go wrong.
+		// Unfortunately this strategy is nested deep in the BWA code.
 		//mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], &w->regs[i<<1]);
-		_bwa_mem_pe(w->opt, w->rapi_ref, w->pes, w->n_processed / 2 + i,
-		            &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], &(w->rapi_reads[2 * i]));
+		if (_past_deadline(w)) // no mate rescue; pair what we have
+			_deadline_hit(w, i, tid);
+		else if (!(w->opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
+			const bwaidx_t* const bwaidx = (bwaidx_t*)w->rapi_ref->_private;
+			int over_budget;
+			_bwa_mate_rescue(w->opt, w->lib_opts, bwaidx->bns, bwaidx->pac, w->pes,
+			                 &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], &w->counters[tid], &over_budget);
+			if (over_budget)
+				_budget_hit(w, i, tid, BUDGET_RESCUE);
+		}
+		_convert_pair(w, i);
+		for (int r = 0; r < 2; ++r) {
+			if (w->budget_flags[i])
+				_tag_budget_hit(&w->rapi_reads[2 * i + r], w->budget_flags[i]);
+		}
 		free(w->regs[2 * i].a); kv_init(w->regs[2 * i]);
 		free(w->regs[2 * i + 1].a); kv_init(w->regs[2 * i + 1]);
+		_fragment_done(w, i, tid);
 	}
 	else {
 		// single end
 		PERROR("Single end alignments aren't implemented in rapi_bwa yet!");
 		error = RAPI_OP_NOT_SUPPORTED_ERROR;
-		mem_mark_primary_se(w->opt, w->regs[i].n, w->regs[i].a, w->n_processed + i);
+		mem_mark_primary_se(w->opt, w->regs[i].n, w->regs[i].a, _tie_break_id(w, i));
 		//mem_reg2sam_se(w->opt, w->bns, w->pac, &w->seqs[i], &w->regs[i], 0, 0);
 		//error = _bwa_reg2_rapi_aln(w->opt, w->rapi_ref, &(w->read_batch->seqs[i]), /* unpaired */ 0, &w->regs[i], &(w->rapi_reads[i]), 0, 0);
 		free(w->regs[i].a); kv_init(w->regs[i]);
@@ -1341,6 +3040,59 @@ static void bwa_worker_2(void *data, int i, int tid)
 	}
 }
 
+/*
+ * Like bwa_worker_2 for paired reads, but works on the chunk of
+ * MATESW_BATCH_FRAGS fragments with index `chunk`, with batched mate rescue.
+ */
+static void bwa_worker_2_batched(void *data, int chunk, int tid)
+{
+	bwa_worker_t *w = (bwa_worker_t*)data;
+	const bwaidx_t* const bwaidx = (bwaidx_t*)(w->rapi_ref->_private);
+
+	int start = chunk * MATESW_BATCH_FRAGS;
+	int n_frags = w->n_fragments - start;
+	if (n_frags > MATESW_BATCH_FRAGS)
+		n_frags = MATESW_BATCH_FRAGS;
+
+	int frags[MATESW_BATCH_FRAGS];
+	for (int f = 0; f < n_frags; ++f)
+		frags[f] = w->order ? w->order[start + f] : start + f;
+
+	if (*w->cancel) { // just release the hits
+		for (int f = 0; f < n_frags; ++f) {
+			free(w->regs[2 * frags[f]].a); kv_init(w->regs[2 * frags[f]]);
+			free(w->regs[2 * frags[f] + 1].a); kv_init(w->regs[2 * frags[f] + 1]);
+		}
+		return;
+	}
+
+	int over_budget[MATESW_BATCH_FRAGS];
+	if (_past_deadline(w)) { // no mate rescue; pair what we have
+		for (int f = 0; f < n_frags; ++f)
+			_deadline_hit(w, frags[f], tid);
+	}
+	else if (!(w->opt->flag & MEM_F_NO_RESCUE)) {
+		_bwa_batched_mate_rescue(w->opt, w->lib_opts, bwaidx->bns, bwaidx->pac, w->pes,
+		                         w->read_batch->seqs, w->regs, frags, n_frags, &w->counters[tid], over_budget);
+		for (int f = 0; f < n_frags; ++f) {
+			if (over_budget[f])
+				_budget_hit(w, frags[f], tid, BUDGET_RESCUE);
+		}
+	}
+
+	for (int f = 0; f < n_frags; ++f) {
+		const int i = frags[f];
+		_convert_pair(w, i);
+		for (int r = 0; r < 2; ++r) {
+			if (w->budget_flags[i])
+				_tag_budget_hit(&w->rapi_reads[2 * i + r], w->budget_flags[i]);
+		}
+		free(w->regs[2 * i].a); kv_init(w->regs[2 * i]);
+		free(w->regs[2 * i + 1].a); kv_init(w->regs[2 * i + 1]);
+		_fragment_done(w, i, tid);
+	}
+}
+
 #endif
 /********** end modified BWA code *****************/
 
@@ -1403,14 +3155,7 @@ static void _rapi_free_read_structures(rapi_batch* batch)
 			rapi_read* read = rapi_get_read(batch, f, r);
 			// the reads use a single chunk of memory for id, seq and quality
 			free(read->id);
-			for (int a = 0; a < read->n_alignments; ++a) {
-				for (int t = 0; t < read->alignments[a].tags.n; ++t)
-					rapi_tag_clear(&read->alignments[a].tags.a[t]);
-				kv_destroy(read->alignments[a].tags);
-				free(read->alignments[a].cigar_ops);
-			}
-			free(read->alignments);
-			read->n_alignments = 0;
+			rapi_read_free_alignments(read);
 			// *Don't* free the contig name.  It belongs to the contig structure.
 		}
 	}
@@ -1504,17 +3249,87 @@ error:
 	return error_code;
 }
 
-/******* Read alignment ******/
-rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
-        rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, rapi_aligner_state* state )
+/*
+ * Result cache.
+ *
+ * Fragments are looked up before alignment, and the ones found skip seeding
+ * and extension altogether.  The others are added to the cache once aligned.
+ * Entries are keyed by the read sequences and a fingerprint of the BWA
+ * options, so changing options doesn't return stale results.  Note that paired
+ * alignments keep the pairing from when they were cached, which was based on
+ * the insert size distribution of that batch.
+ */
+
+typedef struct {
+	rapi_aln_cache* cache;
+	uint64_t fingerprint;
+	const rapi_ref* ref;
+	rapi_read* rapi_reads;
+	int n_reads_frag;
+	const int* frags;     // fragments to look up or store
+	char* hit;            // for lookups, set to 1 for each fragment found
+	const char* budget_flags; // fragments cut short aren't stored
+	int drop_off_target;      // nor are those left without alignments by the region filter
+	bwa_counters* counters; // one per thread, indexed by tid
+} cache_worker_t;
+
+/*
+ * The options and the reference the cached alignments were made with.  The
+ * reference is identified by its path and its size, so that a reference
+ * rebuilt at the same path doesn't get the old alignments.
+ */
+static uint64_t _cache_fingerprint(const mem_opt_t* opt, const rapi_ref* ref)
 {
-	rapi_error_t error = RAPI_NO_ERROR;
+	const uint8_t* bytes = (const uint8_t*)opt;
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for (size_t i = 0; i < sizeof(*opt); ++i)
+		h = (h ^ bytes[i]) * 1099511628211ULL;
+	for (const unsigned char* c = (const unsigned char*)ref->path; c && *c; ++c)
+		h = (h ^ *c) * 1099511628211ULL;
+	const int64_t sizes[2] = { ((bwaidx_t*)ref->_private)->bns->l_pac, ref->n_contigs };
+	bytes = (const uint8_t*)sizes;
+	for (size_t i = 0; i < sizeof(sizes); ++i)
+		h = (h ^ bytes[i]) * 1099511628211ULL;
+	return h;
+}
 
-	if (batch->n_reads_frag > 2)
-		return RAPI_OP_NOT_SUPPORTED_ERROR;
+static void cache_lookup_worker(void *data, int i, int tid)
+{
+	cache_worker_t* w = (cache_worker_t*)data;
+	const int f = w->frags[i];
+	int result = rapi_aln_cache_get(w->cache, w->fingerprint, w->ref, &w->rapi_reads[f * w->n_reads_frag], w->n_reads_frag);
+	if (result < 0)
+		err_fatal(__func__, "%s (%d) while copying cached alignments\n", rapi_error_name(-result), -result);
+	w->hit[i] = result;
+	if (result)
+		w->counters[tid].n_cache_hits += 1;
+	else
+		w->counters[tid].n_cache_misses += 1;
+}
 
-	if (batch->n_reads_frag <= 0)
-		return RAPI_PARAM_ERROR;
+static void cache_store_worker(void *data, int i, int tid)
+{
+	cache_worker_t* w = (cache_worker_t*)data;
+	const int f = w->frags[i];
+	if (w->budget_flags[f] || (w->drop_off_target && w->rapi_reads[f * w->n_reads_frag].off_target))
+		return;
+	rapi_error_t error = rapi_aln_cache_put(w->cache, w->fingerprint, w->ref, &w->rapi_reads[f * w->n_reads_frag], w->n_reads_frag);
+	if (error != RAPI_NO_ERROR)
+		err_fatal(__func__, "%s (%d) while caching alignments\n", rapi_error_name(error), error);
+}
+
+/******* Read alignment ******/
+
+/*
+ * Align the reads of `batch` from `start_fragment`, already converted into
+ * `bwa_seqs`, to `ref`.  BWA turns the sequences into base codes as it goes,
+ * so they can be aligned again, to another reference.  Doesn't advance
+ * state->n_reads_processed, so the caller decides when a batch is done.
+ */
+static rapi_error_t _align_bwa_seqs(const rapi_ref* ref, rapi_batch* batch,
+    rapi_ssize_t start_fragment, rapi_aligner_state* state, bwa_batch* bwa_seqs)
+{
+	rapi_error_t error = RAPI_NO_ERROR;
 
 	// "extract" BWA-specific structures
 	mem_opt_t*const bwa_opt = (mem_opt_t*) state->opts->bwa_opts;
@@ -1522,53 +3337,459 @@ rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
 	if (batch->n_reads_frag == 2) // paired-end
 		bwa_opt->flag |= MEM_F_PE;
 
-	if ((error = _convert_opts(state->opts, bwa_opt)))
-		return error;
+	// a model estimated here would depend on which reads come first
+	if (batch->n_reads_frag == 2 && state->opts->deterministic && !state->pes_fixed) {
+		PERROR("deterministic mode needs an insert size model for paired reads:  "
+		       "set isize_mean or load one with rapi_aligner_state_restore or rapi_aligner_state_set_insert_size\n");
+		return RAPI_PARAM_ERROR;
+	}
 
-	// traslate our read structure into BWA reads
-	bwa_batch bwa_seqs;
-	if ((error = _batch_to_bwa_seq(batch, start_fragment, end_fragment, &bwa_seqs)))
+	if ((error = _convert_opts(state->opts, bwa_opt)))
 		return error;
-	fprintf(stderr, "Converted reads to BWA structures.\n");
 
 	fprintf(stderr, "Going to process.\n");
-	mem_alnreg_v *regs = malloc(bwa_seqs.n_reads * sizeof(mem_alnreg_v));
-	if (NULL == regs) {
+	int* order = NULL;
+	int* dup_rep = NULL;
+	int* dup_next = NULL;
+	char* cache_hits = NULL;
+	rapi_metrics** thread_metrics = NULL; // merged into the state's collector if the call succeeds
+	const int n_thread_metrics = state->metrics ? (bwa_opt->n_threads > 0 ? bwa_opt->n_threads : 1) : 0;
+	fragment_sink sink;
+	memset(&sink, 0, sizeof(sink));
+	const double start_time = realtime();
+	mem_alnreg_v *regs = calloc(bwa_seqs->n_reads, sizeof(mem_alnreg_v));
+	char* budget_flags = calloc(bwa_seqs->n_reads > 0 ? bwa_seqs->n_reads : 1, 1); // per fragment; n_reads is enough
+	char* finished = calloc(bwa_seqs->n_reads > 0 ? bwa_seqs->n_reads : 1, 1); // likewise
+	// per-thread counters
+	bwa_counters* counters = calloc(bwa_opt->n_threads > 0 ? bwa_opt->n_threads : 1, sizeof(bwa_counters));
+	const int n_seed_bufs = state->opts->read_seed_budget > 0 ? 3 * (bwa_opt->n_threads > 0 ? bwa_opt->n_threads : 1) : 0;
+	bwtintv_v* seed_bufs = n_seed_bufs > 0 ? calloc(n_seed_bufs, sizeof(bwtintv_v)) : NULL;
+	if (NULL == regs || NULL == budget_flags || NULL == finished || NULL == counters || (n_seed_bufs > 0 && NULL == seed_bufs)) {
 		error = RAPI_MEMORY_ERROR;
 		goto clean_up;
 	}
+	if (n_thread_metrics > 0) {
+		thread_metrics = calloc(n_thread_metrics, sizeof(thread_metrics[0]));
+		if (NULL == thread_metrics) {
+			error = RAPI_MEMORY_ERROR;
+			goto clean_up;
+		}
+		for (int t = 0; t < n_thread_metrics && error == RAPI_NO_ERROR; ++t)
+			error = rapi_metrics_fork(&thread_metrics[t], state->metrics);
+		if (error != RAPI_NO_ERROR)
+			goto clean_up;
+	}
 
 	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
 	bwa_worker_t w;
 	w.opt = bwa_opt;
-	w.read_batch = &bwa_seqs;
+	w.lib_opts = state->opts;
+	w.read_batch = bwa_seqs;
 	w.regs = regs;
 	w.pes = state->pes;
 	w.n_processed = state->n_reads_processed;
 	w.rapi_ref = ref;
-	w.rapi_reads = BatchGetReads(batch);
+	w.rapi_reads = BatchGetReads(batch) + start_fragment * batch->n_reads_frag; // same indexing as bwa_seqs
+	w.counters = counters;
+	w.order = NULL;
+	w.kmer_index = NULL;
+	w.deadline = state->opts->batch_deadline_ms > 0 ? start_time + state->opts->batch_deadline_ms / 1000.0 : 0;
+	w.budget_flags = budget_flags;
+	w.seed_bufs = seed_bufs;
+	w.finished = finished;
+	w.cancel = &state->cancel_requested;
+	w.dup_next = NULL;
+	w.sink = NULL;
+	w.metrics = thread_metrics;
+	w.regions = state->regions;
+	w.drop_off_target = state->drop_off_target;
+	w.host_filter = state->host_filter;
+	w.host_min_fraction = state->host_min_fraction;
+	w.error = RAPI_NO_ERROR;
+
+	for (int r = 0; r < bwa_seqs->n_reads; ++r) // the filters only ever set the marks
+		w.rapi_reads[r].off_target = w.rapi_reads[r].host = 0;
+
+	if (state->opts->kmer_fast_path) {
+		if (NULL == state->kmer_index // first use, or a different reference
+		    || !rapi_kmer_index_is_for(state->kmer_index, ref->path, (bwaidx_t*)ref->_private,
+		                               state->opts->kmer_length, state->opts->kmer_stride)) {
+			rapi_kmer_index_free(state->kmer_index);
+			state->kmer_index = rapi_kmer_index_load(ref->path, (bwaidx_t*)ref->_private,
+			    state->opts->kmer_length, state->opts->kmer_stride, bwa_opt->n_threads);
+			if (NULL == state->kmer_index) {
+				PERROR("Couldn't load or build the k-mer index (kmer_length: %ld, kmer_stride: %ld)\n",
+				    state->opts->kmer_length, state->opts->kmer_stride);
+				error = RAPI_GENERIC_ERROR;
+				goto clean_up;
+			}
+		}
+		w.kmer_index = state->kmer_index;
+	}
 
 	fprintf(stderr, "Calling bwa_worker_1. ");
 	rapi_print_bwa_flag_string(stderr, bwa_opt->flag);
 
-	int n_fragments = (bwa_opt->flag & MEM_F_PE) ? bwa_seqs.n_reads / 2 : bwa_seqs.n_reads;
+	const int n_reads_frag = (bwa_opt->flag & MEM_F_PE) ? 2 : 1;
+	const int n_fragments = bwa_seqs->n_reads / n_reads_frag;
+	if (state->opts->reorder_reads) {
+		order = _fragment_order(bwa_seqs, n_reads_frag, n_fragments);
+		if (NULL == order) {
+			error = RAPI_MEMORY_ERROR;
+			goto clean_up;
+		}
+	}
+	w.n_fragments = n_fragments;
+	if (state->frag_callback) {
+		sink.callback = state->frag_callback;
+		sink.user_data = state->frag_user_data;
+		sink.batch = batch;
+		sink.start_frag = start_fragment;
+		sink.in_order = state->frag_in_order;
+		sink.n_fragments = n_fragments;
+		if (sink.in_order) {
+			sink.ready = calloc(n_fragments > 0 ? n_fragments : 1, 1);
+			if (NULL == sink.ready) {
+				error = RAPI_MEMORY_ERROR;
+				goto clean_up;
+			}
+			pthread_mutex_init(&sink.lock, NULL);
+		}
+		w.sink = &sink;
+	}
+	if ((state->opts->dedup_reads || state->cache || state->host_filter) && NULL == order) {
+		order = malloc(n_fragments * sizeof(order[0]));
+		if (NULL == order) {
+			error = RAPI_MEMORY_ERROR;
+			goto clean_up;
+		}
+		for (int f = 0; f < n_fragments; ++f)
+			order[f] = f;
+	}
+	if (state->opts->dedup_reads) {
+		dup_rep = _find_duplicates(bwa_seqs, n_reads_frag, n_fragments);
+		dup_next = malloc((n_fragments > 0 ? n_fragments : 1) * sizeof(dup_next[0]));
+		if (NULL == dup_rep || NULL == dup_next) {
+			error = RAPI_MEMORY_ERROR;
+			goto clean_up;
+		}
+		// chain each representative to its duplicates, in ascending order
+		for (int f = 0; f < n_fragments; ++f)
+			dup_next[f] = -1;
+		for (int f = n_fragments - 1; f >= 0; --f) {
+			if (dup_rep[f] != f) {
+				dup_next[f] = dup_next[dup_rep[f]];
+				dup_next[dup_rep[f]] = f;
+			}
+		}
+		w.dup_next = dup_next;
+		// keep only the representatives, in their processing order
+		int n_unique = 0;
+		for (int k = 0; k < n_fragments; ++k) {
+			if (dup_rep[order[k]] == order[k])
+				order[n_unique++] = order[k];
+		}
+		state->stats.n_dedup_fragments += n_fragments;
+		state->stats.n_dedup_collapsed += n_fragments - n_unique;
+		w.n_fragments = n_unique;
+	}
+
+	cache_worker_t cw;
+	cw.cache = state->cache;
+	cw.fingerprint = _cache_fingerprint(bwa_opt, ref);
+	cw.ref = ref;
+	cw.rapi_reads = w.rapi_reads;
+	cw.n_reads_frag = n_reads_frag;
+	cw.frags = order;
+	cw.counters = counters;
+	cw.budget_flags = budget_flags;
+	cw.drop_off_target = state->drop_off_target;
+	if (state->cache) {
+		cache_hits = calloc(w.n_fragments > 0 ? w.n_fragments : 1, sizeof(cache_hits[0]));
+		if (NULL == cache_hits) {
+			error = RAPI_MEMORY_ERROR;
+			goto clean_up;
+		}
+		cw.hit = cache_hits;
+		kt_for(bwa_opt->n_threads, cache_lookup_worker, &cw, w.n_fragments);
+		// keep only the misses;  the hits are already done
+		int n_misses = 0;
+		for (int k = 0; k < w.n_fragments; ++k) {
+			if (!cache_hits[k])
+				order[n_misses++] = order[k];
+			else { // no workers are running
+				_filter_converted(&w, order[k]);
+				_fragment_done(&w, order[k], 0);
+			}
+		}
+		w.n_fragments = n_misses;
+	}
+	w.order = order;
+	if (state->host_filter) {
+		kt_for(bwa_opt->n_threads, host_filter_worker, &w, w.n_fragments);
+		// keep only the fragments to align;  the host ones are already done
+		int n_kept = 0;
+		for (int k = 0; k < w.n_fragments; ++k) {
+			if (!w.rapi_reads[order[k] * n_reads_frag].host)
+				order[n_kept++] = order[k];
+		}
+		w.n_fragments = n_kept;
+	}
 	fprintf(stderr, "Mapping in %d threads.\n", bwa_opt->n_threads);
-	kt_for(bwa_opt->n_threads, bwa_worker_1, &w, n_fragments); // find mapping positions
+	if (state->opts->batched_seeding) {
+		const int frags_per_chunk = SEED_BATCH_READS / n_reads_frag;
+		int n_chunks = (w.n_fragments + frags_per_chunk - 1) / frags_per_chunk;
+		kt_for(bwa_opt->n_threads, bwa_worker_1_batched, &w, n_chunks); // find mapping positions
+	}
+	else
+		kt_for(bwa_opt->n_threads, bwa_worker_1, &w, w.n_fragments); // find mapping positions
 
-	if (bwa_opt->flag & MEM_F_PE) { // infer insert sizes if not provided
-		// TODO: support manually setting insert size dist parameters
-		// if (pes0) memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
-		mem_pestat(bwa_opt, ((bwaidx_t*)ref->_private)->bns->l_pac, bwa_seqs.n_reads, regs, w.pes); // infer the insert size distribution from data
+	if ((bwa_opt->flag & MEM_F_PE) && !state->cancel_requested && !state->pes_fixed) { // infer insert sizes if not provided
+		// duplicates count with their representative's hits;  if we can't
+		// afford the copy, estimate from the representatives alone
+		mem_alnreg_v* pestat_regs = dup_rep ? _pestat_regs(regs, dup_rep, n_reads_frag, n_fragments) : NULL;
+		mem_pestat(bwa_opt, ((bwaidx_t*)ref->_private)->bns->l_pac, bwa_seqs->n_reads,
+				pestat_regs ? pestat_regs : regs, w.pes); // infer the insert size distribution from data
+		free(pestat_regs);
+	}
+	if ((bwa_opt->flag & MEM_F_PE) && state->opts->batched_rescue) {
+		int n_chunks = (w.n_fragments + MATESW_BATCH_FRAGS - 1) / MATESW_BATCH_FRAGS;
+		kt_for(bwa_opt->n_threads, bwa_worker_2_batched, &w, n_chunks); // generate alignment
 	}
-	kt_for(bwa_opt->n_threads, bwa_worker_2, &w, n_fragments); // generate alignment
+	else
+		kt_for(bwa_opt->n_threads, bwa_worker_2, &w, w.n_fragments); // generate alignment
+
+	for (int t = 0; t < bwa_opt->n_threads; ++t)
+		_merge_counters(&state->stats, &counters[t]);
+
+	if (state->cancel_requested) {
+		// The finished fragments keep their alignments:  they may already
+		// have been reported.  Leave the others as they were before the call.
+		for (int f = 0; f < n_fragments; ++f) {
+			if (finished[f])
+				continue;
+			for (int r = f * n_reads_frag; r < (f + 1) * n_reads_frag; ++r) {
+				rapi_read_free_alignments(&w.rapi_reads[r]);
+				w.rapi_reads[r].off_target = w.rapi_reads[r].host = 0;
+			}
+		}
+		error = RAPI_CANCELLED;
+		goto clean_up;
+	}
+
+	if (w.error != RAPI_NO_ERROR) { // the duplicates' alignments or the metrics couldn't be copied
+		error = w.error;
+		goto clean_up;
+	}
+
+	for (int t = 0; t < n_thread_metrics && error == RAPI_NO_ERROR; ++t)
+		error = rapi_metrics_merge(state->metrics, thread_metrics[t]);
+	if (error != RAPI_NO_ERROR)
+		goto clean_up;
 
-	// run the alignment
-	state->n_reads_processed += bwa_seqs.n_reads;
-	fprintf(stderr, "processed %" PRId64 " reads\n", state->n_reads_processed);
+	if (state->cache)
+		kt_for(bwa_opt->n_threads, cache_store_worker, &cw, w.n_fragments);
 
 clean_up:
+	if (sink.ready) {
+		pthread_mutex_destroy(&sink.lock);
+		free(sink.ready);
+	}
+	free(budget_flags);
+	for (int b = 0; seed_bufs && b < n_seed_bufs; ++b)
+		free(seed_bufs[b].a);
+	free(seed_bufs);
+	free(finished);
+	free(cache_hits);
+	free(dup_next);
+	free(dup_rep);
+	free(order);
+	free(counters);
+	for (int t = 0; thread_metrics && t < n_thread_metrics; ++t) {
+		if (thread_metrics[t])
+			rapi_metrics_free(thread_metrics[t]);
+	}
+	free(thread_metrics);
 	free(regs);
+
+	return error;
+}
+
+rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
+        rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, rapi_aligner_state* state )
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	if (batch->n_reads_frag > 2)
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
+
+	if (batch->n_reads_frag <= 0)
+		return RAPI_PARAM_ERROR;
+
+	// traslate our read structure into BWA reads
+	bwa_batch bwa_seqs;
+	if ((error = _batch_to_bwa_seq(batch, start_fragment, end_fragment, &bwa_seqs)))
+		return error;
+	fprintf(stderr, "Converted reads to BWA structures.\n");
+
+	_call_begin(state);
+	error = _align_bwa_seqs(ref, batch, start_fragment, state, &bwa_seqs);
+	_call_end(state);
+	if (error == RAPI_NO_ERROR) {
+		state->n_reads_processed += bwa_seqs.n_reads;
+		fprintf(stderr, "processed %" PRId64 " reads\n", state->n_reads_processed);
+	}
 	_free_bwa_batch_contents(&bwa_seqs);
+	return error;
+}
+
+/******* Competitive alignment ******/
+
+/*
+ * Convert the sequences into base codes up front, as BWA does in place
+ * while aligning them.  Otherwise the first pass would leave the fragments
+ * it didn't align (duplicates, cache hits) as text, and the following
+ * passes would see two spellings of the same sequence.
+ */
+static void _bwa_seqs_to_codes(bwa_batch* bwa_seqs)
+{
+	for (int r = 0; r < bwa_seqs->n_reads; ++r) {
+		char* seq = bwa_seqs->seqs[r].seq;
+		for (int i = 0; i < bwa_seqs->seqs[r].l_seq; ++i)
+			seq[i] = seq[i] < 4 ? seq[i] : nst_nt4_table[(int)seq[i]];
+	}
+}
+
+static void _get_ref_hit(const rapi_ref* ref, const rapi_read* read, rapi_ref_hit* hit)
+{
+	memset(hit, 0, sizeof(*hit));
+	const rapi_alignment* aln = read->n_alignments > 0 ? &read->alignments[0] : NULL;
+	if (NULL == aln || !aln->mapped || NULL == aln->contig) {
+		hit->contig = -1;
+		return;
+	}
+	hit->contig = aln->contig - ref->contigs;
+	hit->pos = aln->pos;
+	hit->score = aln->score;
+	hit->mapq = aln->mapq;
+	hit->reverse_strand = aln->reverse_strand;
+}
+
+static inline void _move_alignments(rapi_read* dst, rapi_read* src)
+{
+	rapi_read_free_alignments(dst);
+	dst->alignments = src->alignments;
+	dst->n_alignments = src->n_alignments;
+	src->alignments = NULL;
+	src->n_alignments = 0;
+}
+
+rapi_error_t rapi_align_reads_competitive( const rapi_ref* refs, int n_refs, rapi_batch* batch,
+    rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, rapi_aligner_state* state,
+    int min_score_margin, rapi_ref_hit* hits, int* classes )
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	if (NULL == refs || n_refs < 1 || NULL == batch || NULL == state
+	    || NULL == hits || NULL == classes || min_score_margin < 0)
+		return RAPI_PARAM_ERROR;
+
+	if (batch->n_reads_frag > 2)
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
 
+	if (batch->n_reads_frag <= 0)
+		return RAPI_PARAM_ERROR;
+
+	// these are tied to a single reference
+	if (state->regions || state->metrics || state->frag_callback || state->opts->kmer_fast_path)
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
+
+	bwa_batch bwa_seqs;
+	if ((error = _batch_to_bwa_seq(batch, start_fragment, end_fragment, &bwa_seqs)))
+		return error;
+	_bwa_seqs_to_codes(&bwa_seqs);
+	fprintf(stderr, "Converted reads to BWA structures.\n");
+
+	const int n_reads_frag = batch->n_reads_frag;
+	const int n_fragments = bwa_seqs.n_reads / n_reads_frag;
+	rapi_read* reads = BatchGetReads(batch) + start_fragment * n_reads_frag; // same indexing as bwa_seqs
+	// alignments to the best reference so far, moved out of the batch between passes
+	rapi_read* best = calloc(bwa_seqs.n_reads > 0 ? bwa_seqs.n_reads : 1, sizeof(best[0]));
+	int* best_score = malloc((n_fragments > 0 ? n_fragments : 1) * sizeof(best_score[0]));
+	int* runner_up = malloc((n_fragments > 0 ? n_fragments : 1) * sizeof(runner_up[0])); // INT_MIN if none
+	if (NULL == best || NULL == best_score || NULL == runner_up)
+		error = RAPI_MEMORY_ERROR;
+
+	for (int f = 0; error == RAPI_NO_ERROR && f < n_fragments; ++f) {
+		classes[f] = RAPI_REF_UNMAPPED;
+		runner_up[f] = INT_MIN;
+	}
+
+	// every pass starts from the caller's insert size model, and the call
+	// leaves it as it was:  one estimated against a reference says nothing
+	// about the others
+	mem_pestat_t pes[4];
+	memcpy(pes, state->pes, sizeof(pes));
+	const int pes_fixed = state->pes_fixed;
+
+	_call_begin(state);
+	for (int i = 0; i < n_refs && error == RAPI_NO_ERROR; ++i) {
+		memcpy(state->pes, pes, sizeof(pes));
+		state->pes_fixed = pes_fixed;
+		error = _align_bwa_seqs(&refs[i], batch, start_fragment, state, &bwa_seqs);
+		for (int f = 0; error == RAPI_NO_ERROR && f < n_fragments; ++f) {
+			rapi_read* frag = &reads[f * n_reads_frag];
+			int score = 0, mapped = 0;
+			for (int r = 0; r < n_reads_frag; ++r) {
+				rapi_ref_hit* hit = &hits[(f * n_reads_frag + r) * n_refs + i];
+				_get_ref_hit(&refs[i], &frag[r], hit);
+				if (hit->contig >= 0) {
+					score += hit->score;
+					mapped = 1;
+				}
+			}
+			if (mapped && (classes[f] == RAPI_REF_UNMAPPED || score > best_score[f])) {
+				if (classes[f] != RAPI_REF_UNMAPPED)
+					runner_up[f] = best_score[f];
+				best_score[f] = score;
+				classes[f] = i;
+				for (int r = 0; r < n_reads_frag; ++r)
+					_move_alignments(&best[f * n_reads_frag + r], &frag[r]);
+			}
+			else {
+				if (mapped && score > runner_up[f])
+					runner_up[f] = score;
+				for (int r = 0; r < n_reads_frag; ++r)
+					rapi_read_free_alignments(&frag[r]);
+			}
+		}
+	}
+	memcpy(state->pes, pes, sizeof(pes));
+	state->pes_fixed = pes_fixed;
+	_call_end(state);
+
+	for (int f = 0; f < n_fragments; ++f) {
+		for (int r = 0; r < n_reads_frag; ++r) {
+			if (error == RAPI_NO_ERROR)
+				_move_alignments(&reads[f * n_reads_frag + r], &best[f * n_reads_frag + r]);
+			else { // leave the batch without alignments;  partial passes aren't reported
+				rapi_read_free_alignments(&reads[f * n_reads_frag + r]);
+				if (best)
+					rapi_read_free_alignments(&best[f * n_reads_frag + r]);
+			}
+		}
+		if (error == RAPI_NO_ERROR && classes[f] >= 0 && runner_up[f] != INT_MIN
+		    && best_score[f] - runner_up[f] <= min_score_margin)
+			classes[f] = RAPI_REF_AMBIGUOUS;
+	}
+
+	if (error == RAPI_NO_ERROR) {
+		state->n_reads_processed += bwa_seqs.n_reads;
+		fprintf(stderr, "processed %" PRId64 " reads\n", state->n_reads_processed);
+	}
+	free(runner_up);
+	free(best_score);
+	free(best);
+	_free_bwa_batch_contents(&bwa_seqs);
 	return error;
 }
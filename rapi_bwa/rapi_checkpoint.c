@@ -0,0 +1,244 @@
+/*
+ * rapi_checkpoint.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_checkpoint.h>
+#include <rapi_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * File layout:  magic, u32 version, u32 n_inputs, i64 n_batches,
+ * i64 output_offset, i64 input_offsets[n_inputs], u32 state length, the
+ * state snapshot and a CRC32 of everything before it.
+ */
+#define CHECKPOINT_MAGIC "RAPICKPT"
+#define CHECKPOINT_VERSION 1
+
+rapi_error_t rapi_checkpoint_init(rapi_checkpoint* cp)
+{
+	if (NULL == cp)
+		return RAPI_PARAM_ERROR;
+	memset(cp, 0, sizeof(*cp));
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_checkpoint_free(rapi_checkpoint* cp)
+{
+	if (NULL == cp)
+		return RAPI_PARAM_ERROR;
+	free(cp->state.s);
+	memset(cp, 0, sizeof(*cp));
+	return RAPI_NO_ERROR;
+}
+
+static int _put(kstring_t* out, const void* p, size_t n)
+{
+	return kputsn_(p, n, out) < 0 ? -1 : 0;
+}
+
+static int _write_all(int fd, const char* p, size_t n)
+{
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* Write `data` to `path` so that a crash leaves either the old or the new file. */
+static rapi_error_t _replace_file(const char* path, const kstring_t* data)
+{
+	kstring_t tmp = { 0, 0, NULL };
+	ksprintf(&tmp, "%s.tmp", path);
+	char* dir_buf = strdup(path);
+	if (NULL == tmp.s || NULL == dir_buf) {
+		free(tmp.s);
+		free(dir_buf);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	int fd = open(tmp.s, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || _write_all(fd, data->s, data->l) != 0 || fsync(fd) != 0) {
+		PERROR("Couldn't write checkpoint %s: %s\n", tmp.s, strerror(errno));
+		error = RAPI_GENERIC_ERROR;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (error == RAPI_NO_ERROR && rename(tmp.s, path) != 0) {
+		PERROR("Couldn't rename %s to %s: %s\n", tmp.s, path, strerror(errno));
+		error = RAPI_GENERIC_ERROR;
+	}
+	if (error == RAPI_NO_ERROR) {
+		// make the rename itself durable
+		int dir_fd = open(dirname(dir_buf), O_RDONLY);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+	else
+		unlink(tmp.s);
+
+	free(tmp.s);
+	free(dir_buf);
+	return error;
+}
+
+rapi_error_t rapi_checkpoint_commit(rapi_checkpoint* cp, const char* path,
+    const rapi_aligner_state* state, FILE* output)
+{
+	if (NULL == cp || NULL == path || NULL == state || NULL == output)
+		return RAPI_PARAM_ERROR;
+	if (cp->n_inputs < 0 || cp->n_inputs > RAPI_CHECKPOINT_MAX_INPUTS)
+		return RAPI_PARAM_ERROR;
+
+	// the output must be on disk before the checkpoint that points past it
+	if (fflush(output) != 0 || fsync(fileno(output)) != 0) {
+		PERROR("Couldn't sync the output: %s\n", strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	cp->output_offset = ftello(output);
+	if (cp->output_offset < 0)
+		return RAPI_GENERIC_ERROR;
+
+	cp->state.l = 0;
+	rapi_error_t error = rapi_aligner_state_save(state, &cp->state);
+	if (error != RAPI_NO_ERROR)
+		return error;
+
+	kstring_t buf = { 0, 0, NULL };
+	const uint32_t version = CHECKPOINT_VERSION, n_inputs = cp->n_inputs, state_len = cp->state.l;
+	if (_put(&buf, CHECKPOINT_MAGIC, 8)
+	    || _put(&buf, &version, sizeof(version))
+	    || _put(&buf, &n_inputs, sizeof(n_inputs))
+	    || _put(&buf, &cp->n_batches, sizeof(cp->n_batches))
+	    || _put(&buf, &cp->output_offset, sizeof(cp->output_offset))
+	    || _put(&buf, cp->input_offsets, n_inputs * sizeof(cp->input_offsets[0]))
+	    || _put(&buf, &state_len, sizeof(state_len))
+	    || _put(&buf, cp->state.s, state_len))
+		error = RAPI_MEMORY_ERROR;
+	else {
+		const uint32_t crc = crc32(0L, (const Bytef*)buf.s, buf.l);
+		error = _put(&buf, &crc, sizeof(crc)) ? RAPI_MEMORY_ERROR : _replace_file(path, &buf);
+	}
+	free(buf.s);
+	return error;
+}
+
+static int _get(const char** p, const char* end, void* v, size_t n)
+{
+	if ((size_t)(end - *p) < n)
+		return -1;
+	memcpy(v, *p, n);
+	*p += n;
+	return 0;
+}
+
+rapi_error_t rapi_checkpoint_read(rapi_checkpoint* cp, const char* path)
+{
+	if (NULL == cp || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	FILE* f = fopen(path, "rb");
+	if (NULL == f) {
+		if (errno == ENOENT)
+			return RAPI_PARAM_ERROR; // no checkpoint yet
+		PERROR("Couldn't open checkpoint %s: %s\n", path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+
+	kstring_t buf = { 0, 0, NULL };
+	char chunk[4096];
+	size_t n;
+	int put_error = 0;
+	while (!put_error && (n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		put_error = _put(&buf, chunk, n);
+	const int read_error = ferror(f);
+	fclose(f);
+	if (read_error || put_error) {
+		free(buf.s);
+		return read_error ? RAPI_GENERIC_ERROR : RAPI_MEMORY_ERROR;
+	}
+
+	rapi_error_t error = RAPI_GENERIC_ERROR;
+	char magic[8];
+	uint32_t version, n_inputs, state_len, crc = 0;
+	rapi_checkpoint tmp;
+	rapi_checkpoint_init(&tmp);
+
+	// the CRC is in the last 4 bytes
+	const char* p = buf.s;
+	const char* end = buf.s + (buf.l >= sizeof(crc) ? buf.l - sizeof(crc) : 0);
+	if (buf.l >= sizeof(crc))
+		memcpy(&crc, end, sizeof(crc));
+
+	if (buf.l < sizeof(crc) || crc != crc32(0L, (const Bytef*)buf.s, end - buf.s)
+	    || _get(&p, end, magic, sizeof(magic)) || memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0
+	    || _get(&p, end, &version, sizeof(version)) || version != CHECKPOINT_VERSION
+	    || _get(&p, end, &n_inputs, sizeof(n_inputs)) || n_inputs > RAPI_CHECKPOINT_MAX_INPUTS
+	    || _get(&p, end, &tmp.n_batches, sizeof(tmp.n_batches))
+	    || _get(&p, end, &tmp.output_offset, sizeof(tmp.output_offset))
+	    || _get(&p, end, tmp.input_offsets, n_inputs * sizeof(tmp.input_offsets[0]))
+	    || _get(&p, end, &state_len, sizeof(state_len)) || (size_t)(end - p) != state_len) {
+		PERROR("Checkpoint %s is corrupt\n", path);
+	}
+	else if (kputsn_(p, state_len, &tmp.state) < 0)
+		error = RAPI_MEMORY_ERROR;
+	else {
+		tmp.n_inputs = n_inputs;
+		rapi_checkpoint_free(cp);
+		*cp = tmp;
+		error = RAPI_NO_ERROR;
+	}
+
+	if (error != RAPI_NO_ERROR)
+		rapi_checkpoint_free(&tmp);
+	free(buf.s);
+	return error;
+}
+
+rapi_error_t rapi_checkpoint_resume_output(const rapi_checkpoint* cp, FILE* output)
+{
+	if (NULL == cp || NULL == output)
+		return RAPI_PARAM_ERROR;
+
+	if (fflush(output) != 0 || ftruncate(fileno(output), cp->output_offset) != 0
+	    || fseeko(output, cp->output_offset, SEEK_SET) != 0) {
+		PERROR("Couldn't rewind the output to the checkpoint: %s\n", strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
@@ -0,0 +1,205 @@
+/*
+ * rapi_client.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_client.h>
+#include <rapi_utils.h>
+#include "rapi_wire.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct rapi_client {
+	int fd;
+	kstring_t buf; // request and reply payloads
+};
+
+// the daemon's id for the reference, kept in rapi_ref._private
+#define ClientRefId(ref_ptr) ( *(const uint32_t*)((ref_ptr)->_private) )
+
+rapi_error_t rapi_client_connect(rapi_client** ret_client, const char* socket_path)
+{
+	struct sockaddr_un addr;
+	if (NULL == ret_client || NULL == socket_path || strlen(socket_path) >= sizeof(addr.sun_path))
+		return RAPI_PARAM_ERROR;
+
+	rapi_client* client = calloc(1, sizeof(*client));
+	if (NULL == client)
+		return RAPI_MEMORY_ERROR;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (client->fd < 0 || connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		PERROR("Couldn't connect to the RAPI daemon at %s\n", socket_path);
+		if (client->fd >= 0)
+			close(client->fd);
+		free(client);
+		return RAPI_GENERIC_ERROR;
+	}
+	*ret_client = client;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_client_close(rapi_client* client)
+{
+	if (NULL == client)
+		return RAPI_NO_ERROR;
+	close(client->fd);
+	free(client->buf.s);
+	free(client);
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Send the request in client->buf and receive the reply into it.  ERROR
+ * replies are turned into their error code.
+ */
+static rapi_error_t _transact(rapi_client* client, int type, int flags, rapi_wire_hdr* reply)
+{
+	rapi_error_t error = rapi_wire_send(client->fd, type, flags, &client->buf);
+	if (error == RAPI_NO_ERROR)
+		error = rapi_wire_recv(client->fd, reply, &client->buf);
+	if (error != RAPI_NO_ERROR) {
+		PERROR("Lost the connection to the RAPI daemon\n");
+		return error;
+	}
+
+	if (reply->type == RAPI_MSG_ERROR) {
+		rapi_wire_cursor in = { client->buf.s, client->buf.s + client->buf.l };
+		uint32_t code;
+		if (rapi_wire_get_u32(&in, &code) != RAPI_NO_ERROR)
+			return RAPI_GENERIC_ERROR;
+		return (int32_t)code;
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_client_ref_load(rapi_client* client, const char* reference_path, rapi_ref* ref)
+{
+	if (NULL == client || NULL == reference_path || NULL == ref)
+		return RAPI_PARAM_ERROR;
+
+	memset(ref, 0, sizeof(*ref));
+	client->buf.l = 0;
+	rapi_wire_put_str(&client->buf, reference_path);
+
+	rapi_wire_hdr reply;
+	rapi_error_t error = _transact(client, RAPI_MSG_REF_LOAD, 0, &reply);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	if (reply.type != RAPI_MSG_REF_INFO)
+		return RAPI_GENERIC_ERROR;
+
+	rapi_wire_cursor in = { client->buf.s, client->buf.s + client->buf.l };
+	uint32_t* id = malloc(sizeof(*id));
+	ref->path = malloc(strlen(reference_path) + 1);
+	if (NULL == id || NULL == ref->path) {
+		free(id);
+		error = RAPI_MEMORY_ERROR;
+	}
+	else {
+		ref->_private = id;
+		strcpy(ref->path, reference_path);
+		if ((error = rapi_wire_get_u32(&in, id)) == RAPI_NO_ERROR)
+			error = rapi_wire_get_contigs(&in, ref);
+	}
+
+	if (error != RAPI_NO_ERROR)
+		rapi_client_ref_free(ref);
+	return error;
+}
+
+rapi_error_t rapi_client_ref_free(rapi_ref* ref)
+{
+	if (NULL == ref)
+		return RAPI_PARAM_ERROR;
+	if (ref->contigs) {
+		for (int c = 0; c < ref->n_contigs; ++c)
+			free(ref->contigs[c].name);
+		free(ref->contigs);
+	}
+	free(ref->path);
+	free(ref->_private);
+	memset(ref, 0, sizeof(*ref));
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t _send_align(rapi_client* client, const rapi_ref* ref, const rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, int flags, rapi_wire_hdr* reply)
+{
+	if (NULL == client || NULL == ref || NULL == ref->_private || NULL == batch)
+		return RAPI_PARAM_ERROR;
+	if (start_frag < 0 || end_frag < start_frag || end_frag > batch->n_frags)
+		return RAPI_PARAM_ERROR;
+
+	client->buf.l = 0;
+	rapi_wire_put_u32(&client->buf, ClientRefId(ref));
+	rapi_wire_put_u32(&client->buf, batch->n_reads_frag);
+	rapi_wire_put_i64(&client->buf, end_frag - start_frag);
+	rapi_wire_put_reads(&client->buf, batch, start_frag, end_frag);
+	if (NULL == client->buf.s)
+		return RAPI_MEMORY_ERROR;
+	if (client->buf.l > RAPI_WIRE_MAX_PAYLOAD) {
+		PERROR("Batch too large for a single request; split it\n");
+		return RAPI_PARAM_ERROR;
+	}
+
+	return _transact(client, RAPI_MSG_ALIGN, flags, reply);
+}
+
+rapi_error_t rapi_client_align_reads(rapi_client* client, const rapi_ref* ref, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag)
+{
+	rapi_wire_hdr reply;
+	rapi_error_t error = _send_align(client, ref, batch, start_frag, end_frag, 0, &reply);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	if (reply.type != RAPI_MSG_ALIGNMENTS)
+		return RAPI_GENERIC_ERROR;
+
+	rapi_wire_cursor in = { client->buf.s, client->buf.s + client->buf.l };
+	return rapi_wire_get_alignments(&in, ref, batch, start_frag, end_frag);
+}
+
+rapi_error_t rapi_client_align_reads_sam(rapi_client* client, const rapi_ref* ref, const rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, kstring_t* output)
+{
+	if (NULL == output)
+		return RAPI_PARAM_ERROR;
+
+	rapi_wire_hdr reply;
+	rapi_error_t error = _send_align(client, ref, batch, start_frag, end_frag, RAPI_WIRE_F_SAM, &reply);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	if (reply.type != RAPI_MSG_SAM)
+		return RAPI_GENERIC_ERROR;
+
+	if (kputsn(client->buf.s, client->buf.l, output) < 0)
+		return RAPI_MEMORY_ERROR;
+	return RAPI_NO_ERROR;
+}
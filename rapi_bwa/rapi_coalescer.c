@@ -0,0 +1,323 @@
+/*
+ * rapi_coalescer.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include <rapi_coalescer.h>
+#include <rapi_utils.h>
+#include "rapi_aln_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The coalesced batch borrows the requests' reads:  their rapi_read
+ * structures are copied shallowly, so ids, sequences and qualities aren't
+ * duplicated.  After the alignment the structures, with their alignments
+ * and filter marks, are copied back to the requests' reads and the
+ * borrowed slots are zeroed.
+ */
+
+typedef struct coalescer_request {
+	rapi_batch* batch;
+	rapi_ssize_t n_frags;
+	rapi_ssize_t start; // first fragment in the coalesced batch
+	struct timespec submitted;
+	int done;
+	rapi_error_t result;
+	struct coalescer_request* next;
+} coalescer_request;
+
+struct rapi_coalescer {
+	const rapi_ref* ref;
+	rapi_aligner_state* state;
+	int n_reads_frag;
+	rapi_ssize_t flush_frags;
+	double max_latency_ms;
+
+	pthread_mutex_t lock;
+	pthread_cond_t pending_cond; // a request was queued, or we're closing
+	pthread_cond_t done_cond;    // some requests are done
+	coalescer_request *head, *tail;
+	rapi_ssize_t n_pending_frags;
+	int closing;
+	pthread_t thread;
+
+	rapi_fragment_callback frag_callback;
+	void* frag_user_data;
+
+	// only used by the background thread and, during an alignment, the callback
+	rapi_batch batch;
+	coalescer_request** aligning; // the requests in the batch, by start
+	int n_aligning, m_aligning;
+};
+
+static struct timespec _add_ms(struct timespec t, double ms)
+{
+	long long ns = t.tv_nsec + (long long)(ms * 1e6);
+	t.tv_sec += ns / 1000000000LL;
+	t.tv_nsec = ns % 1000000000LL;
+	return t;
+}
+
+/*
+ * Fragment callback installed on the aligner state:  report fragment `frag`
+ * of the coalesced batch to the client's callback as a fragment of its own
+ * request.
+ */
+static void _forward_fragment(const rapi_batch* batch, rapi_ssize_t frag, void* user_data)
+{
+	rapi_coalescer* c = user_data;
+	// the request with the fragment is the last one starting at or before it
+	int lo = 0, hi = c->n_aligning - 1;
+	while (lo < hi) {
+		const int mid = (lo + hi + 1) / 2;
+		if (c->aligning[mid]->start <= frag)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	coalescer_request* req = c->aligning[lo];
+	const rapi_ssize_t local = frag - req->start;
+	// give the request's reads their alignments now, so the callback sees
+	// them;  _align_requests copies the same structures back at the end
+	for (int r = 0; r < c->n_reads_frag; ++r)
+		*rapi_get_read(req->batch, local, r) = *rapi_get_read(batch, frag, r);
+	c->frag_callback(req->batch, local, c->frag_user_data);
+}
+
+/*
+ * Align the `n_frags` fragments of the requests in the list `reqs` in one
+ * batch and set each request's result.
+ */
+static void _align_requests(rapi_coalescer* c, coalescer_request* reqs, rapi_ssize_t n_frags)
+{
+	rapi_error_t error = rapi_reads_reserve(&c->batch, n_frags);
+
+	c->n_aligning = 0;
+	for (coalescer_request* req = reqs; req && error == RAPI_NO_ERROR; req = req->next) {
+		if (c->n_aligning == c->m_aligning) {
+			const int m = c->m_aligning > 0 ? 2 * c->m_aligning : 16;
+			coalescer_request** a = realloc(c->aligning, m * sizeof(a[0]));
+			if (NULL == a) {
+				error = RAPI_MEMORY_ERROR;
+				break;
+			}
+			c->aligning = a;
+			c->m_aligning = m;
+		}
+		c->aligning[c->n_aligning++] = req;
+	}
+
+	if (error == RAPI_NO_ERROR) {
+		rapi_read* dst = rapi_get_read(&c->batch, 0, 0);
+		rapi_ssize_t offset = 0;
+		for (coalescer_request* req = reqs; req; req = req->next) {
+			const rapi_ssize_t n_reads = req->n_frags * c->n_reads_frag;
+			rapi_read* src = rapi_get_read(req->batch, 0, 0);
+			for (rapi_ssize_t r = 0; r < n_reads; ++r)
+				rapi_read_free_alignments(&src[r]);
+			memcpy(dst + offset, src, n_reads * sizeof(*src));
+			req->start = offset / c->n_reads_frag;
+			offset += n_reads;
+		}
+
+		error = rapi_align_reads(c->ref, &c->batch, 0, n_frags, c->state);
+
+		if (error != RAPI_NO_ERROR) { // leave all the requests without alignments
+			for (rapi_ssize_t r = 0; r < offset; ++r) {
+				rapi_read_free_alignments(&dst[r]);
+				dst[r].off_target = dst[r].host = 0;
+			}
+		}
+		offset = 0;
+		for (coalescer_request* req = reqs; req; req = req->next) {
+			const rapi_ssize_t n_reads = req->n_frags * c->n_reads_frag;
+			memcpy(rapi_get_read(req->batch, 0, 0), dst + offset, n_reads * sizeof(*dst));
+			offset += n_reads;
+		}
+		memset(dst, 0, offset * sizeof(*dst));
+	}
+	else
+		PERROR("Couldn't allocate a coalesced batch of %lld fragments\n", (long long)n_frags);
+
+	for (coalescer_request* req = reqs; req; req = req->next)
+		req->result = error;
+}
+
+static void* _flusher(void* arg)
+{
+	rapi_coalescer* c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		while (NULL == c->head && !c->closing)
+			pthread_cond_wait(&c->pending_cond, &c->lock);
+		if (NULL == c->head) // closing and nothing left
+			break;
+
+		// wait for a full batch, or for the oldest request to be due
+		const struct timespec due = _add_ms(c->head->submitted, c->max_latency_ms);
+		while (!c->closing && c->n_pending_frags < c->flush_frags) {
+			if (pthread_cond_timedwait(&c->pending_cond, &c->lock, &due) == ETIMEDOUT)
+				break;
+		}
+
+		// take up to flush_frags fragments' worth of requests (at least one)
+		coalescer_request* reqs = c->head;
+		coalescer_request* last = reqs;
+		rapi_ssize_t n_frags = last->n_frags;
+		while (last->next && n_frags + last->next->n_frags <= c->flush_frags) {
+			last = last->next;
+			n_frags += last->n_frags;
+		}
+		c->head = last->next;
+		if (NULL == c->head)
+			c->tail = NULL;
+		last->next = NULL;
+		c->n_pending_frags -= n_frags;
+		pthread_mutex_unlock(&c->lock);
+
+		_align_requests(c, reqs, n_frags);
+
+		pthread_mutex_lock(&c->lock);
+		// a request may be released by its client as soon as it's done
+		for (coalescer_request* req = reqs, *next; req; req = next) {
+			next = req->next;
+			req->done = 1;
+		}
+		pthread_cond_broadcast(&c->done_cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+rapi_error_t rapi_coalescer_init(rapi_coalescer** ret_coalescer, const rapi_ref* ref,
+    rapi_aligner_state* state, int n_reads_frag, rapi_ssize_t flush_frags, double max_latency_ms)
+{
+	if (NULL == ret_coalescer || NULL == ref || NULL == state
+	    || n_reads_frag <= 0 || flush_frags <= 0 || max_latency_ms < 0)
+		return RAPI_PARAM_ERROR;
+
+	rapi_coalescer* c = *ret_coalescer = calloc(1, sizeof(*c));
+	if (NULL == c)
+		return RAPI_MEMORY_ERROR;
+
+	c->ref = ref;
+	c->state = state;
+	c->n_reads_frag = n_reads_frag;
+	c->flush_frags = flush_frags;
+	c->max_latency_ms = max_latency_ms;
+
+	rapi_error_t error = rapi_reads_alloc(&c->batch, n_reads_frag, flush_frags);
+	if (error != RAPI_NO_ERROR) {
+		free(c);
+		*ret_coalescer = NULL;
+		return error;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->pending_cond, NULL);
+	pthread_cond_init(&c->done_cond, NULL);
+	if (pthread_create(&c->thread, NULL, _flusher, c) != 0) {
+		PERROR("Failed to start the coalescer thread\n");
+		pthread_cond_destroy(&c->done_cond);
+		pthread_cond_destroy(&c->pending_cond);
+		pthread_mutex_destroy(&c->lock);
+		rapi_reads_free(&c->batch);
+		free(c);
+		*ret_coalescer = NULL;
+		return RAPI_GENERIC_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_coalescer_align(rapi_coalescer* c, rapi_batch* batch, rapi_ssize_t n_frags)
+{
+	if (NULL == c || NULL == batch || n_frags < 0 || n_frags > batch->n_frags)
+		return RAPI_PARAM_ERROR;
+	if (batch->n_reads_frag != c->n_reads_frag) {
+		PERROR("Batch has %d reads per fragment; the coalescer was created for %d\n",
+		    batch->n_reads_frag, c->n_reads_frag);
+		return RAPI_PARAM_ERROR;
+	}
+	if (n_frags == 0)
+		return RAPI_NO_ERROR;
+
+	coalescer_request req;
+	memset(&req, 0, sizeof(req));
+	req.batch = batch;
+	req.n_frags = n_frags;
+	clock_gettime(CLOCK_REALTIME, &req.submitted);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->tail)
+		c->tail->next = &req;
+	else
+		c->head = &req;
+	c->tail = &req;
+	c->n_pending_frags += n_frags;
+	// the flusher only needs waking up for the first request or a full batch
+	if (c->head == &req || c->n_pending_frags >= c->flush_frags)
+		pthread_cond_signal(&c->pending_cond);
+
+	while (!req.done)
+		pthread_cond_wait(&c->done_cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	return req.result;
+}
+
+rapi_error_t rapi_coalescer_free(rapi_coalescer* c)
+{
+	if (NULL == c)
+		return RAPI_NO_ERROR;
+
+	pthread_mutex_lock(&c->lock);
+	c->closing = 1;
+	pthread_cond_signal(&c->pending_cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+
+	pthread_cond_destroy(&c->done_cond);
+	pthread_cond_destroy(&c->pending_cond);
+	pthread_mutex_destroy(&c->lock);
+	rapi_reads_free(&c->batch);
+	free(c->aligning);
+	free(c);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_coalescer_set_fragment_callback(rapi_coalescer* c,
+    rapi_fragment_callback callback, void* user_data, int in_order)
+{
+	if (NULL == c)
+		return RAPI_PARAM_ERROR;
+
+	c->frag_callback = callback;
+	c->frag_user_data = user_data;
+	if (callback)
+		return rapi_aligner_state_set_fragment_callback(c->state, _forward_fragment, c, in_order);
+	return rapi_aligner_state_set_fragment_callback(c->state, NULL, NULL, 0);
+}
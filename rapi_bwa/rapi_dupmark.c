@@ -0,0 +1,371 @@
+/*
+ * rapi_dupmark.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include <rapi_dupmark.h>
+#include <rapi_utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DUP_MAX_CONTIGS    (1 << 30)
+#define DUP_NO_END         UINT64_MAX // second key of single-end signatures
+#define DUP_MIN_QUAL       15         // as Picard's SUM_OF_BASE_QUALITIES
+#define DUP_BLOCK          1024       // fragments per signature work item
+#define DUP_INITIAL_SLOTS  (1 << 16)
+
+enum {
+	ENTRY_USED     = 1,
+	ENTRY_PAIR_END = 2,  // single-end entry with a pair's end on it
+	ENTRY_FRAGMENT = 4   // single-end entry with a fragment kept on it
+};
+
+/*
+ * A pair is keyed by its two ends, the lower first;  a single end (a
+ * fragment or either end of a pair) by its end and DUP_NO_END.
+ */
+typedef struct {
+	uint64_t k1, k2;
+	int32_t score;
+	uint32_t flags;
+} dup_entry;
+
+enum { SIG_UNMAPPED, SIG_FRAGMENT, SIG_PAIR };
+
+typedef struct {
+	uint64_t ends[2];
+	int32_t score;
+	int kind;
+} frag_sig;
+
+struct rapi_dupmark {
+	const rapi_ref* ref;
+	int n_threads;
+	size_t max_slots;
+	size_t n_slots; // power of 2
+	size_t n_used;
+	dup_entry* slots;
+	frag_sig* sigs;
+	size_t sigs_size;
+	rapi_dupmark_stats stats;
+};
+
+rapi_error_t rapi_dupmark_init(rapi_dupmark** ret_dupmark, const rapi_ref* ref, size_t mem_budget, int n_threads)
+{
+	if (NULL == ret_dupmark || NULL == ref || ref->n_contigs > DUP_MAX_CONTIGS)
+		return RAPI_PARAM_ERROR;
+
+	size_t max_slots = DUP_INITIAL_SLOTS;
+	while (max_slots * 2 * sizeof(dup_entry) <= mem_budget)
+		max_slots *= 2;
+
+	rapi_dupmark* dupmark = calloc(1, sizeof(*dupmark));
+	if (NULL == dupmark)
+		return RAPI_MEMORY_ERROR;
+	dupmark->ref = ref;
+	dupmark->n_threads = n_threads > 0 ? n_threads : 1;
+	dupmark->max_slots = max_slots;
+	dupmark->n_slots = DUP_INITIAL_SLOTS;
+	dupmark->slots = calloc(dupmark->n_slots, sizeof(dup_entry));
+	if (NULL == dupmark->slots) {
+		free(dupmark);
+		return RAPI_MEMORY_ERROR;
+	}
+	*ret_dupmark = dupmark;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_dupmark_free(rapi_dupmark* dupmark)
+{
+	if (NULL == dupmark)
+		return RAPI_PARAM_ERROR;
+	free(dupmark->slots);
+	free(dupmark->sigs);
+	free(dupmark);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_dupmark_get_stats(const rapi_dupmark* dupmark, rapi_dupmark_stats* stats)
+{
+	if (NULL == dupmark || NULL == stats)
+		return RAPI_PARAM_ERROR;
+	*stats = dupmark->stats;
+	return RAPI_NO_ERROR;
+}
+
+/********* signature table *********/
+
+static inline uint64_t _hash(uint64_t k1, uint64_t k2)
+{
+	// splitmix64 finalizer over both keys
+	uint64_t h = k1 ^ (k2 * 0x9e3779b97f4a7c15ULL);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static void _insert_slot(dup_entry* slots, size_t n_slots, const dup_entry* e)
+{
+	size_t i = _hash(e->k1, e->k2) & (n_slots - 1);
+	while (slots[i].flags != 0)
+		i = (i + 1) & (n_slots - 1);
+	slots[i] = *e;
+}
+
+static int _grow(rapi_dupmark* dupmark)
+{
+	const size_t n_slots = dupmark->n_slots * 2;
+	dup_entry* slots = calloc(n_slots, sizeof(dup_entry));
+	if (NULL == slots)
+		return -1;
+	for (size_t i = 0; i < dupmark->n_slots; ++i) {
+		if (dupmark->slots[i].flags != 0)
+			_insert_slot(slots, n_slots, &dupmark->slots[i]);
+	}
+	free(dupmark->slots);
+	dupmark->slots = slots;
+	dupmark->n_slots = n_slots;
+	return 0;
+}
+
+/*
+ * Find the entry for (k1, k2), adding an empty one if there isn't one
+ * (*added is set).  Returns NULL if the table is full.
+ */
+static dup_entry* _get(rapi_dupmark* dupmark, uint64_t k1, uint64_t k2, int* added)
+{
+	*added = 0;
+	size_t i = _hash(k1, k2) & (dupmark->n_slots - 1);
+	while (dupmark->slots[i].flags != 0) {
+		if (dupmark->slots[i].k1 == k1 && dupmark->slots[i].k2 == k2)
+			return &dupmark->slots[i];
+		i = (i + 1) & (dupmark->n_slots - 1);
+	}
+
+	// not found:  keep the load under 3/4, or 7/8 once the table can't grow
+	if ((dupmark->n_used + 1) * 4 > dupmark->n_slots * 3) {
+		if (dupmark->n_slots < dupmark->max_slots && _grow(dupmark) == 0)
+			return _get(dupmark, k1, k2, added);
+		if ((dupmark->n_used + 1) * 8 > dupmark->n_slots * 7)
+			return NULL;
+	}
+	dup_entry* e = &dupmark->slots[i];
+	e->k1 = k1;
+	e->k2 = k2;
+	e->score = 0;
+	e->flags = ENTRY_USED;
+	dupmark->n_used += 1;
+	*added = 1;
+	return e;
+}
+
+/********* signatures *********/
+
+/*
+ * Contig, unclipped 5' position and strand of a mapped alignment, in a
+ * key that orders ends by coordinate.
+ */
+static uint64_t _end_key(const rapi_ref* ref, const rapi_alignment* aln)
+{
+	int64_t pos = aln->pos;
+	if (!aln->reverse_strand) {
+		for (int i = 0; i < aln->n_cigar_ops
+		        && (aln->cigar_ops[i].op == RAPI_CIG_S || aln->cigar_ops[i].op == RAPI_CIG_H); ++i)
+			pos -= aln->cigar_ops[i].len;
+	}
+	else {
+		pos += rapi_get_rlen(aln->n_cigar_ops, aln->cigar_ops) - 1;
+		for (int i = aln->n_cigar_ops - 1; i >= 0
+		        && (aln->cigar_ops[i].op == RAPI_CIG_S || aln->cigar_ops[i].op == RAPI_CIG_H); --i)
+			pos += aln->cigar_ops[i].len;
+	}
+	if (pos < INT32_MIN) pos = INT32_MIN;
+	if (pos > INT32_MAX) pos = INT32_MAX;
+	const uint64_t contig = aln->contig - ref->contigs;
+	return contig << 33 | (uint64_t)(pos - (int64_t)INT32_MIN) << 1 | aln->reverse_strand;
+}
+
+static int32_t _qual_score(const rapi_read* read)
+{
+	int32_t score = 0;
+	for (unsigned int i = 0; read->qual && i < read->length; ++i) {
+		const int q = read->qual[i] - 33;
+		if (q >= DUP_MIN_QUAL)
+			score += q;
+	}
+	return score;
+}
+
+static inline int _is_mapped(const rapi_read* read)
+{
+	return read->n_alignments > 0 && read->alignments[0].mapped && read->alignments[0].contig;
+}
+
+typedef struct {
+	const rapi_ref* ref;
+	const rapi_batch* batch;
+	rapi_ssize_t start, end;
+	frag_sig* sigs;
+} dup_sig_t;
+
+static void dup_sig_worker(void* data, int block, int tid)
+{
+	(void)tid;
+	const dup_sig_t* w = data;
+	const rapi_ssize_t start = w->start + (rapi_ssize_t)block * DUP_BLOCK;
+	const rapi_ssize_t end = start + DUP_BLOCK < w->end ? start + DUP_BLOCK : w->end;
+	const int n_reads = w->batch->n_reads_frag;
+
+	for (rapi_ssize_t f = start; f < end; ++f) {
+		frag_sig* sig = &w->sigs[f - w->start];
+		sig->kind = SIG_UNMAPPED;
+		sig->score = 0;
+		int n_mapped = 0;
+		for (int r = 0; r < n_reads; ++r) {
+			const rapi_read* read = rapi_get_read(w->batch, f, r);
+			if (_is_mapped(read)) {
+				sig->ends[n_mapped++] = _end_key(w->ref, &read->alignments[0]);
+				sig->score += _qual_score(read);
+			}
+		}
+		if (n_mapped == 1)
+			sig->kind = SIG_FRAGMENT;
+		else if (n_mapped == 2) {
+			sig->kind = SIG_PAIR;
+			if (sig->ends[0] > sig->ends[1]) {
+				const uint64_t tmp = sig->ends[0];
+				sig->ends[0] = sig->ends[1];
+				sig->ends[1] = tmp;
+			}
+		}
+	}
+}
+
+/********* marking *********/
+
+static void _set_duplicate(rapi_batch* batch, rapi_ssize_t f, int duplicate)
+{
+	for (int r = 0; r < batch->n_reads_frag; ++r) {
+		rapi_read* read = rapi_get_read(batch, f, r);
+		for (int a = 0; a < read->n_alignments; ++a)
+			read->alignments[a].duplicate = duplicate != 0;
+	}
+}
+
+/* Record a pair's end on the single-end signature at `end`. */
+static void _add_pair_end(rapi_dupmark* dupmark, uint64_t end)
+{
+	int added;
+	dup_entry* e = _get(dupmark, end, DUP_NO_END, &added);
+	if (NULL == e)
+		dupmark->stats.n_untracked += 1;
+	else if (!(e->flags & ENTRY_PAIR_END)) {
+		// the fragment kept here is a duplicate of this pair
+		if (e->flags & ENTRY_FRAGMENT)
+			dupmark->stats.n_late += 1;
+		e->flags |= ENTRY_PAIR_END;
+	}
+}
+
+static int _mark_pair(rapi_dupmark* dupmark, const frag_sig* sig)
+{
+	dupmark->stats.n_pairs += 1;
+	_add_pair_end(dupmark, sig->ends[0]);
+	_add_pair_end(dupmark, sig->ends[1]);
+
+	int added;
+	dup_entry* e = _get(dupmark, sig->ends[0], sig->ends[1], &added);
+	if (NULL == e) {
+		dupmark->stats.n_untracked += 1;
+		return 0;
+	}
+	if (added) {
+		e->score = sig->score;
+		return 0;
+	}
+	if (sig->score > e->score) {
+		dupmark->stats.n_late += 1;
+		e->score = sig->score;
+	}
+	dupmark->stats.n_pair_duplicates += 1;
+	return 1;
+}
+
+static int _mark_fragment(rapi_dupmark* dupmark, const frag_sig* sig)
+{
+	dupmark->stats.n_fragments += 1;
+
+	int added;
+	dup_entry* e = _get(dupmark, sig->ends[0], DUP_NO_END, &added);
+	if (NULL == e) {
+		dupmark->stats.n_untracked += 1;
+		return 0;
+	}
+	if (!(e->flags & (ENTRY_PAIR_END | ENTRY_FRAGMENT))) {
+		e->flags |= ENTRY_FRAGMENT;
+		e->score = sig->score;
+		return 0;
+	}
+	if (!(e->flags & ENTRY_PAIR_END) && sig->score > e->score) {
+		dupmark->stats.n_late += 1;
+		e->score = sig->score;
+	}
+	dupmark->stats.n_fragment_duplicates += 1;
+	return 1;
+}
+
+rapi_error_t rapi_dupmark_batch(rapi_dupmark* dupmark, rapi_batch* batch, rapi_ssize_t start, rapi_ssize_t end)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+
+	if (NULL == dupmark || NULL == batch || start < 0 || end > batch->n_frags || start > end)
+		return RAPI_PARAM_ERROR;
+	if (batch->n_reads_frag > 2) {
+		PERROR("Only single and paired reads are supported (got %d)\n", batch->n_reads_frag);
+		return RAPI_PARAM_ERROR;
+	}
+	if (start == end)
+		return RAPI_NO_ERROR;
+
+	const size_t n_frags = end - start;
+	if (n_frags > dupmark->sigs_size) {
+		frag_sig* sigs = realloc(dupmark->sigs, n_frags * sizeof(sigs[0]));
+		if (NULL == sigs)
+			return RAPI_MEMORY_ERROR;
+		dupmark->sigs = sigs;
+		dupmark->sigs_size = n_frags;
+	}
+
+	// signatures in parallel, then the table in fragment order
+	dup_sig_t w = { dupmark->ref, batch, start, end, dupmark->sigs };
+	kt_for(dupmark->n_threads, dup_sig_worker, &w, (int)((n_frags + DUP_BLOCK - 1) / DUP_BLOCK));
+
+	for (size_t i = 0; i < n_frags; ++i) {
+		const frag_sig* sig = &dupmark->sigs[i];
+		int duplicate = 0;
+		if (sig->kind == SIG_PAIR)
+			duplicate = _mark_pair(dupmark, sig);
+		else if (sig->kind == SIG_FRAGMENT)
+			duplicate = _mark_fragment(dupmark, sig);
+		else
+			dupmark->stats.n_unmapped += 1;
+		_set_duplicate(batch, start + i, duplicate);
+	}
+	return RAPI_NO_ERROR;
+}
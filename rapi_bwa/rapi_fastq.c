@@ -0,0 +1,1016 @@
+/*
+ * rapi_fastq.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_fastq.h>
+#include <rapi_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define FQI_FILE_MAGIC   "RAPIFQI1"
+#define FQ_WINSIZE       32768U            // deflate window
+#define FQ_BUF_SIZE      (1U << 17)        // I/O buffers
+#define FQ_RANGE_SIZE    (32ULL << 20)     // bytes of plain file per scan work item
+#define FQ_DEFAULT_SPAN  (16ULL << 20)
+
+typedef struct {
+	uint64_t uoff;        // uncompressed offset
+	uint64_t coff;        // compressed offset of the first full byte
+	int32_t bits;         // bits of the byte before coff that belong to the point (0-7)
+	int32_t member_start; // coff is the start of a gzip member:  no window needed
+	unsigned char* window;
+} fq_point;
+
+typedef struct {
+	int gzip;
+	uint64_t size;        // file size on disk
+	uint64_t* chunk_off;  // uncompressed offset of each chunk
+	int64_t n_chunk_off, m_chunk_off;
+	int64_t n_points, m_points;
+	fq_point* points;
+	int64_t n_records;
+} fq_file;
+
+struct rapi_fastq_index {
+	int n_files;
+	int64_t records_per_chunk;
+	int64_t n_records;
+	int64_t n_chunks;
+	fq_file files[2];
+};
+
+typedef struct {
+	char magic[8];
+	int32_t n_files;
+	int32_t reserved;
+	int64_t records_per_chunk;
+	int64_t n_records;
+	int64_t n_chunks;
+} fqi_file_header;
+
+typedef struct {
+	int32_t gzip;
+	int32_t reserved;
+	uint64_t size;
+	int64_t n_points;
+} fqi_file_entry;
+
+typedef struct {
+	uint64_t uoff, coff;
+	int32_t bits, member_start;
+} fqi_point_entry;
+
+static void _file_free(fq_file* file)
+{
+	for (int64_t i = 0; i < file->n_points; ++i)
+		free(file->points[i].window);
+	free(file->points);
+	free(file->chunk_off);
+	memset(file, 0, sizeof(*file));
+}
+
+rapi_error_t rapi_fastq_index_free(rapi_fastq_index* idx)
+{
+	if (NULL == idx)
+		return RAPI_PARAM_ERROR;
+	for (int i = 0; i < idx->n_files; ++i)
+		_file_free(&idx->files[i]);
+	free(idx);
+	return RAPI_NO_ERROR;
+}
+
+static int _push_chunk_off(fq_file* file, uint64_t off)
+{
+	if (file->n_chunk_off == file->m_chunk_off) {
+		const int64_t m = file->m_chunk_off ? file->m_chunk_off * 2 : 1024;
+		uint64_t* p = realloc(file->chunk_off, m * sizeof(*p));
+		if (NULL == p)
+			return -1;
+		file->chunk_off = p;
+		file->m_chunk_off = m;
+	}
+	file->chunk_off[file->n_chunk_off++] = off;
+	return 0;
+}
+
+static fq_point* _push_point(fq_file* file)
+{
+	if (file->n_points == file->m_points) {
+		const int64_t m = file->m_points ? file->m_points * 2 : 64;
+		fq_point* p = realloc(file->points, m * sizeof(*p));
+		if (NULL == p)
+			return NULL;
+		file->points = p;
+		file->m_points = m;
+	}
+	fq_point* point = &file->points[file->n_points++];
+	memset(point, 0, sizeof(*point));
+	return point;
+}
+
+/*
+ * Lines must come in fours.  A final line without its newline still counts.
+ */
+static rapi_error_t _set_n_records(fq_file* file, const char* path, uint64_t n_lines, int64_t records_per_chunk)
+{
+	if (n_lines % 4 != 0) {
+		PERROR("%s has %llu lines, which is not a multiple of 4.  Only four-line FASTQ records are supported\n",
+		    path, (unsigned long long)n_lines);
+		return RAPI_PARAM_ERROR;
+	}
+	file->n_records = n_lines / 4;
+	// a chunk that would start at the end of the file is empty
+	const int64_t n_chunks = (file->n_records + records_per_chunk - 1) / records_per_chunk;
+	if (file->n_chunk_off > n_chunks)
+		file->n_chunk_off = n_chunks;
+	return RAPI_NO_ERROR;
+}
+
+/******** plain files ********/
+
+typedef struct {
+	const char* path;
+	int fd;
+	uint64_t size;
+	uint64_t lines_per_chunk;
+	uint64_t* n_newlines;   // per range;  after the first pass, newlines before each range and in total
+	uint64_t* chunk_off;
+	int64_t n_chunks;
+	int pass;
+	volatile int error;
+} plain_scan_t;
+
+static ssize_t _pread_full(int fd, char* buf, size_t n, uint64_t off)
+{
+	size_t done = 0;
+	while (done < n) {
+		ssize_t r = pread(fd, buf + done, n - done, off + done);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static void plain_scan_worker(void* data, int range, int tid)
+{
+	plain_scan_t* w = (plain_scan_t*)data;
+	if (w->error)
+		return;
+
+	const uint64_t begin = range * FQ_RANGE_SIZE;
+	const uint64_t end = begin + FQ_RANGE_SIZE < w->size ? begin + FQ_RANGE_SIZE : w->size;
+	uint64_t n_lines = w->pass == 0 ? 0 : w->n_newlines[range];
+	if (w->pass == 1) {
+		// only the ranges where a chunk boundary falls need the second pass
+		if (w->n_newlines[range + 1] / w->lines_per_chunk == n_lines / w->lines_per_chunk)
+			return;
+	}
+
+	char* buf = malloc(FQ_BUF_SIZE);
+	if (NULL == buf) {
+		w->error = RAPI_MEMORY_ERROR;
+		return;
+	}
+	for (uint64_t off = begin; off < end && !w->error; ) {
+		const size_t want = end - off < FQ_BUF_SIZE ? end - off : FQ_BUF_SIZE;
+		ssize_t n = _pread_full(w->fd, buf, want, off);
+		if (n != (ssize_t)want) {
+			PERROR("Error reading %s: %s\n", w->path, n < 0 ? strerror(errno) : "file truncated");
+			w->error = RAPI_GENERIC_ERROR;
+			break;
+		}
+		const char* p = buf;
+		const char* const buf_end = buf + n;
+		while ((p = memchr(p, '\n', buf_end - p)) != NULL) {
+			++p;
+			++n_lines;
+			if (w->pass == 1 && n_lines % w->lines_per_chunk == 0) {
+				const uint64_t k = n_lines / w->lines_per_chunk;
+				if ((int64_t)k < w->n_chunks)
+					w->chunk_off[k] = off + (p - buf);
+			}
+		}
+		off += n;
+	}
+	if (w->pass == 0)
+		w->n_newlines[range] = n_lines;
+	free(buf);
+}
+
+static rapi_error_t _index_plain(fq_file* file, const char* path, int fd, int64_t records_per_chunk, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+
+	plain_scan_t w;
+	memset(&w, 0, sizeof(w));
+	w.path = path;
+	w.fd = fd;
+	w.size = file->size;
+	w.lines_per_chunk = 4 * (uint64_t)records_per_chunk;
+	const uint64_t n_ranges = (file->size + FQ_RANGE_SIZE - 1) / FQ_RANGE_SIZE;
+	if (n_ranges > INT32_MAX)
+		return RAPI_PARAM_ERROR;
+	w.n_newlines = calloc(n_ranges + 1, sizeof(*w.n_newlines));
+	if (NULL == w.n_newlines)
+		return RAPI_MEMORY_ERROR;
+
+	// pass 1:  count the newlines in each range
+	kt_for(n_threads, plain_scan_worker, &w, (int)n_ranges);
+
+	uint64_t n_lines = 0;
+	for (uint64_t r = 0; r < n_ranges; ++r) {
+		const uint64_t n = w.n_newlines[r];
+		w.n_newlines[r] = n_lines;
+		n_lines += n;
+	}
+	w.n_newlines[n_ranges] = n_lines;
+	char last = '\n';
+	if (!w.error && file->size > 0 && _pread_full(fd, &last, 1, file->size - 1) != 1)
+		w.error = RAPI_GENERIC_ERROR;
+	if (last != '\n')
+		++n_lines;
+
+	// pass 2:  find the offsets where the chunks start
+	if (!w.error) {
+		w.n_chunks = (n_lines / 4 + records_per_chunk - 1) / records_per_chunk;
+		w.chunk_off = malloc((w.n_chunks > 0 ? w.n_chunks : 1) * sizeof(*w.chunk_off));
+		if (NULL == w.chunk_off)
+			w.error = RAPI_MEMORY_ERROR;
+		else {
+			w.chunk_off[0] = 0;
+			w.pass = 1;
+			kt_for(n_threads, plain_scan_worker, &w, (int)n_ranges);
+		}
+	}
+
+	rapi_error_t error = w.error;
+	free(w.n_newlines);
+	if (error != RAPI_NO_ERROR) {
+		free(w.chunk_off);
+		return error;
+	}
+	file->chunk_off = w.chunk_off;
+	file->n_chunk_off = file->m_chunk_off = w.n_chunks;
+	return _set_n_records(file, path, n_lines, records_per_chunk);
+}
+
+/******** gzip files ********/
+
+/*
+ * Add an access point (see zlib's examples/zran.c).  `window` is the
+ * circular output buffer, whose next byte to write is at
+ * FQ_WINSIZE - `left`.
+ */
+static int _add_point(fq_file* file, int bits, uint64_t coff, uint64_t uoff, int member_start,
+    unsigned left, const unsigned char* window)
+{
+	fq_point* point = _push_point(file);
+	if (NULL == point)
+		return -1;
+	point->uoff = uoff;
+	point->coff = coff;
+	point->bits = bits;
+	point->member_start = member_start;
+	if (!member_start) {
+		point->window = malloc(FQ_WINSIZE);
+		if (NULL == point->window) {
+			--file->n_points;
+			return -1;
+		}
+		if (left)
+			memcpy(point->window, window + FQ_WINSIZE - left, left);
+		if (left < FQ_WINSIZE)
+			memcpy(point->window + left, window, FQ_WINSIZE - left);
+	}
+	return 0;
+}
+
+/*
+ * Decompress the whole file once, counting lines and adding access points
+ * about every `span` bytes of output.  Points at the start of a gzip member
+ * don't need a window, so they're preferred:  they're taken after span/2
+ * bytes, the others only after span bytes.  For BGZF that means every
+ * point is a member start.
+ */
+static rapi_error_t _index_gzip(fq_file* file, const char* path, FILE* in, int64_t records_per_chunk, uint64_t span)
+{
+	const uint64_t lines_per_chunk = 4 * (uint64_t)records_per_chunk;
+	unsigned char* input = malloc(FQ_BUF_SIZE);
+	unsigned char* window = malloc(FQ_WINSIZE);
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (NULL == input || NULL == window || inflateInit2(&strm, 47) != Z_OK) {
+		free(input);
+		free(window);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	uint64_t totin = 0, totout = 0, last = 0, n_lines = 0;
+	unsigned char last_char = '\n';
+	int in_member = 1;
+	strm.avail_out = 0;
+
+	if (_add_point(file, 0, 0, 0, 1, 0, NULL) || _push_chunk_off(file, 0))
+		error = RAPI_MEMORY_ERROR;
+
+	while (error == RAPI_NO_ERROR) {
+		if (strm.avail_in == 0) {
+			strm.avail_in = fread(input, 1, FQ_BUF_SIZE, in);
+			if (ferror(in)) {
+				PERROR("Error reading %s: %s\n", path, strerror(errno));
+				error = RAPI_GENERIC_ERROR;
+				break;
+			}
+			if (strm.avail_in == 0) {
+				if (in_member) {
+					PERROR("%s is truncated\n", path);
+					error = RAPI_PARAM_ERROR;
+				}
+				break;
+			}
+			strm.next_in = input;
+		}
+
+		if (!in_member) {
+			// another gzip member follows
+			if (totout - last > span / 2) {
+				if (_add_point(file, 0, totin, totout, 1, 0, NULL)) {
+					error = RAPI_MEMORY_ERROR;
+					break;
+				}
+				last = totout;
+			}
+			inflateReset(&strm);
+			in_member = 1;
+		}
+
+		if (strm.avail_out == 0) {
+			strm.avail_out = FQ_WINSIZE;
+			strm.next_out = window;
+		}
+		unsigned char* const out = strm.next_out;
+		totin += strm.avail_in;
+		totout += strm.avail_out;
+		const int ret = inflate(&strm, Z_BLOCK);
+		totin -= strm.avail_in;
+		totout -= strm.avail_out;
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			PERROR("Error decompressing %s: %s\n", path, strm.msg ? strm.msg : "corrupt data");
+			error = ret == Z_MEM_ERROR ? RAPI_MEMORY_ERROR : RAPI_PARAM_ERROR;
+			break;
+		}
+
+		// count lines in the new output
+		const unsigned char* p = out;
+		const unsigned char* const out_end = strm.next_out;
+		const uint64_t out_base = totout - (out_end - out);
+		if (out_end > out)
+			last_char = out_end[-1];
+		while ((p = memchr(p, '\n', out_end - p)) != NULL) {
+			++p;
+			if (++n_lines % lines_per_chunk == 0 && _push_chunk_off(file, out_base + (p - out))) {
+				error = RAPI_MEMORY_ERROR;
+				break;
+			}
+		}
+
+		if (ret == Z_STREAM_END)
+			in_member = 0;
+		else if ((strm.data_type & 128) && !(strm.data_type & 64) && totout - last > span) {
+			// at a deflate block boundary, not after the last block
+			if (_add_point(file, strm.data_type & 7, totin, totout, 0, strm.avail_out, window)) {
+				error = RAPI_MEMORY_ERROR;
+				break;
+			}
+			last = totout;
+		}
+	}
+
+	inflateEnd(&strm);
+	free(input);
+	free(window);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	if (last_char != '\n')
+		++n_lines;
+	return _set_n_records(file, path, n_lines, records_per_chunk);
+}
+
+/******** build ********/
+
+typedef struct {
+	rapi_fastq_index* idx;
+	const char* paths[2];
+	uint64_t span;
+	int n_threads;
+	rapi_error_t errors[2];
+} index_build_t;
+
+static void index_file_worker(void* data, int i, int tid)
+{
+	index_build_t* w = (index_build_t*)data;
+	fq_file* file = &w->idx->files[i];
+	const char* path = w->paths[i];
+
+	FILE* in = fopen(path, "rb");
+	struct stat st;
+	if (NULL == in || fstat(fileno(in), &st) != 0) {
+		PERROR("Couldn't open %s: %s\n", path, strerror(errno));
+		if (in)
+			fclose(in);
+		w->errors[i] = RAPI_GENERIC_ERROR;
+		return;
+	}
+	file->size = st.st_size;
+
+	unsigned char magic[2] = { 0, 0 };
+	file->gzip = fread(magic, 1, 2, in) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+	if (file->gzip) {
+		rewind(in);
+		w->errors[i] = _index_gzip(file, path, in, w->idx->records_per_chunk, w->span);
+	}
+	else
+		w->errors[i] = _index_plain(file, path, fileno(in), w->idx->records_per_chunk, w->n_threads);
+	fclose(in);
+}
+
+rapi_error_t rapi_fastq_index_build(rapi_fastq_index** ret_idx, const char* path1, const char* path2,
+    int64_t records_per_chunk, uint64_t span, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+
+	if (NULL == ret_idx || NULL == path1 || records_per_chunk < 1 || records_per_chunk > INT64_MAX / 4)
+		return RAPI_PARAM_ERROR;
+
+	rapi_fastq_index* idx = calloc(1, sizeof(*idx));
+	if (NULL == idx)
+		return RAPI_MEMORY_ERROR;
+	idx->n_files = path2 ? 2 : 1;
+	idx->records_per_chunk = records_per_chunk;
+
+	index_build_t w;
+	memset(&w, 0, sizeof(w));
+	w.idx = idx;
+	w.paths[0] = path1;
+	w.paths[1] = path2;
+	w.span = span > 0 ? span : FQ_DEFAULT_SPAN;
+	if (n_threads < 1)
+		n_threads = 1;
+	// the files are indexed concurrently, and plain ones split their share of threads
+	w.n_threads = n_threads / idx->n_files > 0 ? n_threads / idx->n_files : 1;
+	kt_for(idx->n_files, index_file_worker, &w, idx->n_files);
+
+	rapi_error_t error = w.errors[0] ? w.errors[0] : w.errors[1];
+	if (error == RAPI_NO_ERROR && idx->n_files == 2 && idx->files[0].n_records != idx->files[1].n_records) {
+		PERROR("Paired files %s and %s have different numbers of records (%lld and %lld)\n",
+		    path1, path2, (long long)idx->files[0].n_records, (long long)idx->files[1].n_records);
+		error = RAPI_PARAM_ERROR;
+	}
+	if (error != RAPI_NO_ERROR) {
+		rapi_fastq_index_free(idx);
+		return error;
+	}
+	idx->n_records = idx->files[0].n_records;
+	idx->n_chunks = idx->files[0].n_chunk_off;
+	*ret_idx = idx;
+	return RAPI_NO_ERROR;
+}
+
+/******** load / save ********/
+
+rapi_error_t rapi_fastq_index_save(const rapi_fastq_index* idx, const char* path)
+{
+	if (NULL == idx || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	FILE* f = fopen(path, "wb");
+	if (NULL == f) {
+		PERROR("Couldn't open %s for writing: %s\n", path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+
+	fqi_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FQI_FILE_MAGIC, sizeof(header.magic));
+	header.n_files = idx->n_files;
+	header.records_per_chunk = idx->records_per_chunk;
+	header.n_records = idx->n_records;
+	header.n_chunks = idx->n_chunks;
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+	for (int i = 0; i < idx->n_files && ok; ++i) {
+		const fq_file* file = &idx->files[i];
+		fqi_file_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.gzip = file->gzip;
+		entry.size = file->size;
+		entry.n_points = file->n_points;
+		ok = fwrite(&entry, sizeof(entry), 1, f) == 1
+		  && fwrite(file->chunk_off, sizeof(file->chunk_off[0]), idx->n_chunks, f) == (size_t)idx->n_chunks;
+		for (int64_t j = 0; j < file->n_points && ok; ++j) {
+			const fq_point* point = &file->points[j];
+			fqi_point_entry pe;
+			memset(&pe, 0, sizeof(pe));
+			pe.uoff = point->uoff;
+			pe.coff = point->coff;
+			pe.bits = point->bits;
+			pe.member_start = point->member_start;
+			ok = fwrite(&pe, sizeof(pe), 1, f) == 1
+			  && (point->member_start || fwrite(point->window, 1, FQ_WINSIZE, f) == FQ_WINSIZE);
+		}
+	}
+	ok = (fclose(f) == 0) && ok;
+	if (!ok) {
+		PERROR("Couldn't write FASTQ index %s\n", path);
+		remove(path);
+		return RAPI_GENERIC_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t _read_file_entry(FILE* f, fq_file* file, int64_t n_chunks)
+{
+	fqi_file_entry entry;
+	if (fread(&entry, sizeof(entry), 1, f) != 1 || entry.n_points < 0 || (entry.gzip && entry.n_points < 1))
+		return RAPI_PARAM_ERROR;
+	file->gzip = entry.gzip != 0;
+	file->size = entry.size;
+
+	file->chunk_off = malloc((n_chunks > 0 ? n_chunks : 1) * sizeof(file->chunk_off[0]));
+	if (NULL == file->chunk_off)
+		return RAPI_MEMORY_ERROR;
+	file->n_chunk_off = file->m_chunk_off = n_chunks;
+	if (fread(file->chunk_off, sizeof(file->chunk_off[0]), n_chunks, f) != (size_t)n_chunks)
+		return RAPI_PARAM_ERROR;
+	for (int64_t k = 1; k < n_chunks; ++k) {
+		if (file->chunk_off[k] <= file->chunk_off[k - 1])
+			return RAPI_PARAM_ERROR;
+	}
+
+	for (int64_t j = 0; j < entry.n_points; ++j) {
+		fqi_point_entry pe;
+		if (fread(&pe, sizeof(pe), 1, f) != 1 || pe.bits < 0 || pe.bits > 7
+		    || (j == 0 && (pe.uoff != 0 || !pe.member_start))
+		    || (j > 0 && pe.uoff < file->points[j - 1].uoff))
+			return RAPI_PARAM_ERROR;
+		fq_point* point = _push_point(file);
+		if (NULL == point)
+			return RAPI_MEMORY_ERROR;
+		point->uoff = pe.uoff;
+		point->coff = pe.coff;
+		point->bits = pe.bits;
+		point->member_start = pe.member_start != 0;
+		if (!point->member_start) {
+			point->window = malloc(FQ_WINSIZE);
+			if (NULL == point->window)
+				return RAPI_MEMORY_ERROR;
+			if (fread(point->window, 1, FQ_WINSIZE, f) != FQ_WINSIZE)
+				return RAPI_PARAM_ERROR;
+		}
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_fastq_index_load(rapi_fastq_index** ret_idx, const char* path)
+{
+	if (NULL == ret_idx || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	FILE* f = fopen(path, "rb");
+	if (NULL == f) {
+		PERROR("Couldn't open %s: %s\n", path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+
+	rapi_error_t error = RAPI_PARAM_ERROR;
+	rapi_fastq_index* idx = NULL;
+	fqi_file_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1
+	    || memcmp(header.magic, FQI_FILE_MAGIC, sizeof(header.magic)) != 0
+	    || header.n_files < 1 || header.n_files > 2
+	    || header.records_per_chunk < 1 || header.records_per_chunk > INT64_MAX / 4 || header.n_records < 0
+	    || header.n_chunks != (header.n_records + header.records_per_chunk - 1) / header.records_per_chunk)
+		goto done;
+
+	idx = calloc(1, sizeof(*idx));
+	if (NULL == idx) {
+		error = RAPI_MEMORY_ERROR;
+		goto done;
+	}
+	idx->n_files = header.n_files;
+	idx->records_per_chunk = header.records_per_chunk;
+	idx->n_records = header.n_records;
+	idx->n_chunks = header.n_chunks;
+	error = RAPI_NO_ERROR;
+	for (int i = 0; i < idx->n_files && error == RAPI_NO_ERROR; ++i) {
+		idx->files[i].n_records = idx->n_records;
+		error = _read_file_entry(f, &idx->files[i], idx->n_chunks);
+	}
+
+done:
+	fclose(f);
+	if (error != RAPI_NO_ERROR) {
+		PERROR("%s is not a valid FASTQ index\n", path);
+		if (idx)
+			rapi_fastq_index_free(idx);
+		return error;
+	}
+	*ret_idx = idx;
+	return RAPI_NO_ERROR;
+}
+
+int rapi_fastq_index_n_files(const rapi_fastq_index* idx)
+{
+	return idx->n_files;
+}
+
+int64_t rapi_fastq_index_n_records(const rapi_fastq_index* idx)
+{
+	return idx->n_records;
+}
+
+int64_t rapi_fastq_index_n_chunks(const rapi_fastq_index* idx)
+{
+	return idx->n_chunks;
+}
+
+rapi_error_t rapi_fastq_index_chunk(const rapi_fastq_index* idx, int64_t chunk,
+    int64_t* first_record, int64_t* n_records, uint64_t* offsets)
+{
+	if (NULL == idx || chunk < 0 || chunk >= idx->n_chunks)
+		return RAPI_PARAM_ERROR;
+	const int64_t first = chunk * idx->records_per_chunk;
+	if (first_record)
+		*first_record = first;
+	if (n_records)
+		*n_records = idx->n_records - first < idx->records_per_chunk ? idx->n_records - first : idx->records_per_chunk;
+	for (int i = 0; offsets && i < idx->n_files; ++i)
+		offsets[i] = idx->files[i].chunk_off[chunk];
+	return RAPI_NO_ERROR;
+}
+
+/******** reader ********/
+
+typedef struct {
+	const char* path;
+	FILE* f;
+	int gzip;
+	z_stream strm;
+	int strm_init;
+	int in_member;         // inside a gzip member (otherwise a header comes next)
+	int raw;               // started mid-member with raw inflate, so we handle the trailer
+	unsigned skip_input;   // trailer bytes left to skip
+	unsigned char* input;
+	unsigned char* buf;
+	size_t buf_pos, buf_len;
+	kstring_t lines[4];
+} fq_stream;
+
+struct rapi_fastq_reader {
+	int n_files;
+	int64_t remaining;     // records left in the chunk
+	int whole_files;       // not reading an indexed chunk, but up to the end of the files
+	fq_stream streams[2];
+};
+
+/* Returns 1 if there's new data in the buffer, 0 at the end of the file, -1 on error. */
+static int _fill(fq_stream* s)
+{
+	s->buf_pos = s->buf_len = 0;
+	if (!s->gzip) {
+		s->buf_len = fread(s->buf, 1, FQ_BUF_SIZE, s->f);
+		return s->buf_len > 0 ? 1 : (ferror(s->f) ? -1 : 0);
+	}
+
+	while (s->buf_len == 0) {
+		if (s->strm.avail_in == 0) {
+			s->strm.avail_in = fread(s->input, 1, FQ_BUF_SIZE, s->f);
+			s->strm.next_in = s->input;
+			if (s->strm.avail_in == 0)
+				return ferror(s->f) || s->in_member || s->skip_input > 0 ? -1 : 0;
+		}
+		if (s->skip_input > 0) {
+			const unsigned n = s->skip_input < s->strm.avail_in ? s->skip_input : s->strm.avail_in;
+			s->strm.next_in += n;
+			s->strm.avail_in -= n;
+			s->skip_input -= n;
+			continue;
+		}
+		if (!s->in_member) {
+			if (inflateReset2(&s->strm, 31) != Z_OK)
+				return -1;
+			s->in_member = 1;
+		}
+
+		s->strm.next_out = s->buf;
+		s->strm.avail_out = FQ_BUF_SIZE;
+		const int ret = inflate(&s->strm, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			return -1;
+		s->buf_len = FQ_BUF_SIZE - s->strm.avail_out;
+		if (ret == Z_STREAM_END) {
+			s->in_member = 0;
+			if (s->raw) {
+				// raw inflate leaves the gzip trailer (CRC32 and ISIZE) in the input
+				s->skip_input = 8;
+				s->raw = 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Read a line without its newline.  Returns 0, -1 at the end of the file or -2 on error. */
+static int _getline(fq_stream* s, kstring_t* line)
+{
+	line->l = 0;
+	int got = 0;
+	for (;;) {
+		if (s->buf_pos == s->buf_len) {
+			const int r = _fill(s);
+			if (r < 0)
+				return -2;
+			if (r == 0)
+				break;
+		}
+		const unsigned char* start = s->buf + s->buf_pos;
+		const unsigned char* nl = memchr(start, '\n', s->buf_len - s->buf_pos);
+		const size_t n = nl ? (size_t)(nl - start) : s->buf_len - s->buf_pos;
+		if (kputsn((const char*)start, n, line) < 0)
+			return -2;
+		got = 1;
+		s->buf_pos += n + (nl ? 1 : 0);
+		if (nl)
+			break;
+	}
+	if (!got)
+		return -1;
+	if (line->l > 0 && line->s[line->l - 1] == '\r')
+		line->s[--line->l] = '\0';
+	return 0;
+}
+
+static rapi_error_t _skip(fq_stream* s, uint64_t n)
+{
+	while (n > 0) {
+		if (s->buf_pos == s->buf_len && _fill(s) <= 0)
+			return RAPI_PARAM_ERROR;
+		const size_t avail = s->buf_len - s->buf_pos;
+		const size_t take = n < avail ? n : avail;
+		s->buf_pos += take;
+		n -= take;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/* Position the stream at uncompressed offset `offset`. */
+static rapi_error_t _seek(fq_stream* s, const fq_file* file, uint64_t offset)
+{
+	if (!file->gzip)
+		return fseeko(s->f, offset, SEEK_SET) == 0 ? RAPI_NO_ERROR : RAPI_GENERIC_ERROR;
+
+	// last access point at or before the offset
+	int64_t lo = 0, hi = file->n_points - 1;
+	while (lo < hi) {
+		const int64_t mid = lo + (hi - lo + 1) / 2;
+		if (file->points[mid].uoff <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	const fq_point* point = &file->points[lo];
+
+	if (fseeko(s->f, point->coff - (point->bits ? 1 : 0), SEEK_SET) != 0)
+		return RAPI_GENERIC_ERROR;
+	s->strm.avail_in = 0;
+	if (point->member_start) {
+		s->in_member = 0;
+		s->raw = 0;
+	}
+	else {
+		if (inflateReset2(&s->strm, -15) != Z_OK)
+			return RAPI_GENERIC_ERROR;
+		if (point->bits) {
+			const int c = getc(s->f);
+			if (c == EOF || inflatePrime(&s->strm, point->bits, c >> (8 - point->bits)) != Z_OK)
+				return RAPI_GENERIC_ERROR;
+		}
+		if (inflateSetDictionary(&s->strm, point->window, FQ_WINSIZE) != Z_OK)
+			return RAPI_GENERIC_ERROR;
+		s->in_member = 1;
+		s->raw = 1;
+	}
+	return _skip(s, offset - point->uoff);
+}
+
+/* Open a stream at `offset` of an indexed file or, if `file` is NULL, at the start of any file. */
+static rapi_error_t _stream_open(fq_stream* s, const fq_file* file, const char* path, uint64_t offset)
+{
+	s->path = path;
+	s->f = fopen(path, "rb");
+	struct stat st;
+	if (NULL == s->f || fstat(fileno(s->f), &st) != 0) {
+		PERROR("Couldn't open %s: %s\n", path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	if (file && (uint64_t)st.st_size != file->size) {
+		PERROR("%s has changed since it was indexed\n", path);
+		return RAPI_PARAM_ERROR;
+	}
+	if (file)
+		s->gzip = file->gzip;
+	else {
+		const int c1 = getc(s->f), c2 = getc(s->f);
+		s->gzip = c1 == 0x1f && c2 == 0x8b;
+		rewind(s->f);
+	}
+
+	s->buf = malloc(FQ_BUF_SIZE);
+	if (NULL == s->buf)
+		return RAPI_MEMORY_ERROR;
+	if (s->gzip) {
+		s->input = malloc(FQ_BUF_SIZE);
+		if (NULL == s->input || inflateInit2(&s->strm, 31) != Z_OK)
+			return RAPI_MEMORY_ERROR;
+		s->strm_init = 1;
+	}
+	if (NULL == file)
+		return RAPI_NO_ERROR; // _fill starts with the first gzip member
+
+	rapi_error_t error = _seek(s, file, offset);
+	if (error != RAPI_NO_ERROR)
+		PERROR("Couldn't seek to offset %llu of %s\n", (unsigned long long)offset, path);
+	return error;
+}
+
+static void _stream_close(fq_stream* s)
+{
+	if (s->strm_init)
+		inflateEnd(&s->strm);
+	if (s->f)
+		fclose(s->f);
+	free(s->input);
+	free(s->buf);
+	for (int i = 0; i < 4; ++i)
+		free(s->lines[i].s);
+	memset(s, 0, sizeof(*s));
+}
+
+rapi_error_t rapi_fastq_reader_close(rapi_fastq_reader* reader)
+{
+	if (NULL == reader)
+		return RAPI_PARAM_ERROR;
+	for (int i = 0; i < reader->n_files; ++i)
+		_stream_close(&reader->streams[i]);
+	free(reader);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_fastq_reader_open(rapi_fastq_reader** ret_reader, const rapi_fastq_index* idx,
+    const char* path1, const char* path2, int64_t chunk)
+{
+	int64_t n_records = INT64_MAX;
+	uint64_t offsets[2] = { 0, 0 };
+	if (NULL == ret_reader || NULL == path1)
+		return RAPI_PARAM_ERROR;
+	if (idx && ((idx->n_files == 2) != (path2 != NULL)
+	        || rapi_fastq_index_chunk(idx, chunk, NULL, &n_records, offsets) != RAPI_NO_ERROR))
+		return RAPI_PARAM_ERROR;
+
+	rapi_fastq_reader* reader = calloc(1, sizeof(*reader));
+	if (NULL == reader)
+		return RAPI_MEMORY_ERROR;
+	reader->n_files = path2 ? 2 : 1;
+	reader->remaining = n_records;
+	reader->whole_files = NULL == idx;
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	const char* paths[2] = { path1, path2 };
+	for (int i = 0; i < reader->n_files && error == RAPI_NO_ERROR; ++i)
+		error = _stream_open(&reader->streams[i], idx ? &idx->files[i] : NULL, paths[i], offsets[i]);
+	if (error != RAPI_NO_ERROR) {
+		rapi_fastq_reader_close(reader);
+		return error;
+	}
+	*ret_reader = reader;
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Read the four lines of the next record and cut the name at the first
+ * blank.  If `eof` isn't NULL, the end of the file before the record sets it
+ * instead of being an error.
+ */
+static rapi_error_t _read_record(fq_stream* s, int* eof)
+{
+	for (int i = 0; i < 4; ++i) {
+		const int r = _getline(s, &s->lines[i]);
+		if (r == -2) {
+			PERROR("Error reading %s\n", s->path);
+			return RAPI_GENERIC_ERROR;
+		}
+		if (r == -1 && i == 0 && eof) {
+			*eof = 1;
+			return RAPI_NO_ERROR;
+		}
+		if (r == -1) {
+			PERROR("%s ended in the middle of a %s\n", s->path, eof ? "record" : "chunk");
+			return RAPI_PARAM_ERROR;
+		}
+	}
+	kstring_t* name = &s->lines[0];
+	if (name->l < 2 || name->s[0] != '@' || s->lines[2].l < 1 || s->lines[2].s[0] != '+'
+	    || s->lines[1].l != s->lines[3].l) {
+		PERROR("Malformed FASTQ record in %s (%.40s)\n", s->path, name->l > 0 ? name->s : "");
+		return RAPI_PARAM_ERROR;
+	}
+	name->l = strcspn(name->s, " \t");
+	name->s[name->l] = '\0';
+	return RAPI_NO_ERROR;
+}
+
+/* Whether two read names are the same apart from a /1 or /2 suffix */
+static int _same_fragment(const kstring_t* a, const kstring_t* b)
+{
+	size_t la = a->l, lb = b->l;
+	if (la > 2 && a->s[la - 2] == '/' && (a->s[la - 1] == '1' || a->s[la - 1] == '2'))
+		la -= 2;
+	if (lb > 2 && b->s[lb - 2] == '/' && (b->s[lb - 1] == '1' || b->s[lb - 1] == '2'))
+		lb -= 2;
+	return la == lb && memcmp(a->s, b->s, la) == 0;
+}
+
+rapi_error_t rapi_fastq_read_batch(rapi_fastq_reader* reader, rapi_batch* batch, int max_frags, int* n_frags)
+{
+	if (NULL == reader || NULL == batch || NULL == n_frags || max_frags < 1
+	    || batch->n_reads_frag != reader->n_files)
+		return RAPI_PARAM_ERROR;
+
+	*n_frags = 0;
+	rapi_error_t error = rapi_reads_clear(batch);
+	const int64_t n = reader->remaining < max_frags ? reader->remaining : max_frags;
+	if (error == RAPI_NO_ERROR && n > 0)
+		error = rapi_reads_reserve(batch, n);
+
+	int at_end = 0;
+	for (int64_t f = 0; f < n && error == RAPI_NO_ERROR; ++f) {
+		int eof[2] = { 0, 0 };
+		for (int r = 0; r < reader->n_files && error == RAPI_NO_ERROR; ++r)
+			error = _read_record(&reader->streams[r], reader->whole_files ? &eof[r] : NULL);
+		if (error == RAPI_NO_ERROR && (eof[0] || eof[1])) {
+			if (reader->n_files == 2 && eof[0] != eof[1]) {
+				PERROR("Paired files %s and %s have different numbers of records\n",
+				    reader->streams[0].path, reader->streams[1].path);
+				error = RAPI_PARAM_ERROR;
+			}
+			at_end = 1;
+			break;
+		}
+		if (error == RAPI_NO_ERROR && reader->n_files == 2
+		    && !_same_fragment(&reader->streams[0].lines[0], &reader->streams[1].lines[0])) {
+			PERROR("Paired files are out of sync:  read %s in %s, %s in %s\n",
+			    reader->streams[0].lines[0].s + 1, reader->streams[0].path,
+			    reader->streams[1].lines[0].s + 1, reader->streams[1].path);
+			error = RAPI_PARAM_ERROR;
+		}
+		for (int r = 0; r < reader->n_files && error == RAPI_NO_ERROR; ++r) {
+			const fq_stream* s = &reader->streams[r];
+			error = rapi_set_read(batch, f, r, s->lines[0].s + 1, s->lines[1].s, s->lines[3].s, 33);
+		}
+		if (error == RAPI_NO_ERROR)
+			++*n_frags;
+	}
+	reader->remaining = at_end ? 0 : reader->remaining - *n_frags;
+	return error;
+}
@@ -0,0 +1,447 @@
+/*
+ * rapi_host_filter.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // getpid, st_mtim
+
+#include <rapi_host_filter.h>
+#include <rapi_utils.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define FILTER_FILE_MAGIC     "RAPIBLM2"
+#define FILTER_BITS_PER_BASE  10
+#define FILTER_GZIP_RATIO     4         // bases per byte of gzipped FASTA, to size the filter
+#define FILTER_MAX_BLOCKS     UINT32_MAX
+#define FILTER_BUILD_CHUNK    (1 << 20) // bases per build work item
+#define FILTER_SCAN_BATCH     64        // k-mers hashed together
+#define FILTER_LINE_BUF       (1 << 16)
+
+typedef struct {
+	uint32_t w[8];
+} filter_block;
+
+struct rapi_host_filter {
+	int k;
+	uint64_t n_blocks;
+	filter_block* blocks; // 64-byte aligned, so a block never straddles two cache lines
+	uint64_t fasta_size;  // of the FASTA file it was built from, to tell when it's stale
+	int64_t fasta_mtime;  // in ns
+};
+
+typedef struct {
+	char magic[8];
+	int32_t k;
+	int32_t reserved;
+	uint64_t n_blocks;
+	uint64_t fasta_size;
+	int64_t fasta_mtime;
+} filter_file_header;
+
+// odd constants that spread a 32-bit hash over the eight words' bit indices
+static const uint32_t _salt[8] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static inline int _base_code(char c)
+{
+	switch (c) {
+		case 'A': case 'a': return 0;
+		case 'C': case 'c': return 1;
+		case 'G': case 'g': return 2;
+		case 'T': case 't': return 3;
+		default: return 4;
+	}
+}
+
+// splitmix64's finalizer:  only shifts, xors and multiplications, so batches vectorize
+static inline uint64_t _mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static inline filter_block* _block_of(const rapi_host_filter* filter, uint64_t h)
+{
+	return &filter->blocks[((h >> 32) * filter->n_blocks) >> 32]; // n_blocks < 2^32
+}
+
+static inline void _insert(const rapi_host_filter* filter, uint64_t h)
+{
+	uint32_t* w = _block_of(filter, h)->w;
+	const uint32_t x = (uint32_t)h;
+	for (int i = 0; i < 8; ++i)
+		__atomic_fetch_or(&w[i], (uint32_t)1 << ((x * _salt[i]) >> 27), __ATOMIC_RELAXED);
+}
+
+static inline int _contains(const rapi_host_filter* filter, uint64_t h)
+{
+	const uint32_t* w = _block_of(filter, h)->w;
+	const uint32_t x = (uint32_t)h;
+	uint32_t missing = 0;
+	for (int i = 0; i < 8; ++i)
+		missing |= ~w[i] & ((uint32_t)1 << ((x * _salt[i]) >> 27));
+	return missing == 0;
+}
+
+static int64_t _flush(const rapi_host_filter* filter, const uint64_t* kmers, int n, int insert)
+{
+	uint64_t hashes[FILTER_SCAN_BATCH];
+	for (int i = 0; i < n; ++i)
+		hashes[i] = _mix64(kmers[i]);
+
+	int64_t n_hits = 0;
+	for (int i = 0; i < n; ++i) {
+		if (insert)
+			_insert(filter, hashes[i]);
+		else
+			n_hits += _contains(filter, hashes[i]);
+	}
+	return n_hits;
+}
+
+/*
+ * Insert or look up the canonical k-mers of seq[0, len) that have no
+ * ambiguous bases.  Returns their number;  when looking up, `*n_hits` gets
+ * the number found.
+ */
+static int64_t _scan(const rapi_host_filter* filter, const char* seq, int64_t len, int insert, int64_t* n_hits)
+{
+	const int k = filter->k;
+	const int shift = 2 * (k - 1);
+	const uint64_t mask = ((uint64_t)1 << 2 * k) - 1; // k <= 31
+	uint64_t kmers[FILTER_SCAN_BATCH];
+	uint64_t fwd = 0, rev = 0;
+	int64_t n_kmers = 0, hits = 0;
+	int n = 0, l = 0;
+
+	for (int64_t i = 0; i < len; ++i) {
+		const int c = _base_code(seq[i]);
+		if (c > 3) {
+			l = 0;
+			continue;
+		}
+		fwd = (fwd << 2 | c) & mask;
+		rev = rev >> 2 | (uint64_t)(3 - c) << shift;
+		if (++l < k)
+			continue;
+		kmers[n++] = fwd < rev ? fwd : rev;
+		if (n == FILTER_SCAN_BATCH) {
+			hits += _flush(filter, kmers, n, insert);
+			n_kmers += n;
+			n = 0;
+		}
+	}
+	hits += _flush(filter, kmers, n, insert);
+	n_kmers += n;
+	if (n_hits)
+		*n_hits = hits;
+	return n_kmers;
+}
+
+static rapi_error_t _alloc(rapi_host_filter** ret_filter, int k, uint64_t n_blocks)
+{
+	if (k < 1 || k > RAPI_HOST_FILTER_MAX_K || n_blocks < 1 || n_blocks > FILTER_MAX_BLOCKS)
+		return RAPI_PARAM_ERROR;
+
+	rapi_host_filter* filter = calloc(1, sizeof(*filter));
+	if (NULL == filter)
+		return RAPI_MEMORY_ERROR;
+	filter->k = k;
+	filter->n_blocks = n_blocks;
+	void* blocks = NULL;
+	if (posix_memalign(&blocks, 64, n_blocks * sizeof(filter_block)) != 0) {
+		free(filter);
+		return RAPI_MEMORY_ERROR;
+	}
+	filter->blocks = blocks;
+	memset(filter->blocks, 0, n_blocks * sizeof(filter_block));
+	*ret_filter = filter;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_host_filter_free(rapi_host_filter* filter)
+{
+	if (NULL == filter)
+		return RAPI_PARAM_ERROR;
+	free(filter->blocks);
+	free(filter);
+	return RAPI_NO_ERROR;
+}
+
+int rapi_host_filter_k(const rapi_host_filter* filter)
+{
+	return filter->k;
+}
+
+size_t rapi_host_filter_size(const rapi_host_filter* filter)
+{
+	return filter->n_blocks * sizeof(filter_block);
+}
+
+void rapi_host_filter_count(const rapi_host_filter* filter, const char* seq, int len, int* n_kmers, int* n_hits)
+{
+	int64_t hits = 0;
+	*n_kmers = (int)_scan(filter, seq, len, 0, &hits);
+	*n_hits = (int)hits;
+}
+
+/******** build ********/
+
+/* Size and modification time of `path`;  -1 if it can't be read. */
+static int _stat_fasta(const char* path, uint64_t* size, int64_t* mtime)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return -1;
+	*size = st.st_size;
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	return 0;
+}
+
+typedef struct {
+	const rapi_host_filter* filter;
+	const char* seq;
+	int64_t len;
+} filter_build_worker_t;
+
+static void filter_build_worker(void* data, int chunk, int tid)
+{
+	filter_build_worker_t* w = (filter_build_worker_t*)data;
+	const int64_t start = (int64_t)chunk * FILTER_BUILD_CHUNK;
+	int64_t end = start + FILTER_BUILD_CHUNK + w->filter->k - 1; // the k-mers that start in the chunk
+	if (end > w->len)
+		end = w->len;
+	_scan(w->filter, w->seq + start, end - start, 1, NULL);
+}
+
+static void _add_sequence(rapi_host_filter* filter, const kstring_t* seq, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+	if (seq->l < (size_t)filter->k)
+		return;
+	filter_build_worker_t w;
+	w.filter = filter;
+	w.seq = seq->s;
+	w.len = seq->l;
+	kt_for(n_threads, filter_build_worker, &w, (int)((seq->l + FILTER_BUILD_CHUNK - 1) / FILTER_BUILD_CHUNK));
+}
+
+static uint64_t _estimate_blocks(const char* fasta_path, uint64_t size)
+{
+	uint64_t n_bases = size;
+	FILE* f = fopen(fasta_path, "rb");
+	unsigned char magic[2];
+	if (f && fread(magic, 1, 2, f) == 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		n_bases *= FILTER_GZIP_RATIO;
+	if (f)
+		fclose(f);
+	uint64_t n_blocks = n_bases * FILTER_BITS_PER_BASE / (8 * sizeof(filter_block));
+	return n_blocks < 1 ? 1 : n_blocks > FILTER_MAX_BLOCKS ? FILTER_MAX_BLOCKS : n_blocks;
+}
+
+rapi_error_t rapi_host_filter_build(rapi_host_filter** ret_filter, const char* fasta_path,
+    int k, size_t n_bytes, int n_threads)
+{
+	if (NULL == ret_filter || NULL == fasta_path)
+		return RAPI_PARAM_ERROR;
+
+	// before reading it, so that a change while building makes the filter stale
+	uint64_t fasta_size;
+	int64_t fasta_mtime;
+	if (_stat_fasta(fasta_path, &fasta_size, &fasta_mtime) != 0) {
+		PERROR("Couldn't open %s: %s\n", fasta_path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	const uint64_t n_blocks = n_bytes > 0 ? n_bytes / sizeof(filter_block) : _estimate_blocks(fasta_path, fasta_size);
+	rapi_host_filter* filter = NULL;
+	rapi_error_t error = _alloc(&filter, k, n_blocks);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	filter->fasta_size = fasta_size;
+	filter->fasta_mtime = fasta_mtime;
+
+	gzFile in = gzopen(fasta_path, "r");
+	char* line = malloc(FILTER_LINE_BUF);
+	if (NULL == in || NULL == line) {
+		PERROR("Couldn't open %s: %s\n", fasta_path, NULL == in ? strerror(errno) : "out of memory");
+		if (in)
+			gzclose(in);
+		free(line);
+		rapi_host_filter_free(filter);
+		return NULL == in ? RAPI_GENERIC_ERROR : RAPI_MEMORY_ERROR;
+	}
+
+	// one sequence at a time, so the build takes the size of the longest contig on top of the filter
+	kstring_t seq = { 0, 0, NULL };
+	int line_start = 1, in_header = 0;
+	while (error == RAPI_NO_ERROR && gzgets(in, line, FILTER_LINE_BUF) != NULL) {
+		size_t len = strlen(line);
+		if (line_start && line[0] == '>') {
+			_add_sequence(filter, &seq, n_threads);
+			seq.l = 0;
+			in_header = 1;
+		}
+		line_start = len > 0 && line[len - 1] == '\n';
+		if (!in_header) {
+			while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+				--len;
+			if (kputsn(line, len, &seq) < 0)
+				error = RAPI_MEMORY_ERROR;
+		}
+		if (line_start)
+			in_header = 0;
+	}
+	if (error == RAPI_NO_ERROR && !gzeof(in)) {
+		int errnum;
+		PERROR("Couldn't read %s: %s\n", fasta_path, gzerror(in, &errnum));
+		error = RAPI_GENERIC_ERROR;
+	}
+	if (error == RAPI_NO_ERROR)
+		_add_sequence(filter, &seq, n_threads);
+	gzclose(in);
+	free(line);
+	free(seq.s);
+
+	if (error != RAPI_NO_ERROR) {
+		rapi_host_filter_free(filter);
+		return error;
+	}
+	*ret_filter = filter;
+	return RAPI_NO_ERROR;
+}
+
+/******** load / save ********/
+
+// through a temporary file, so that concurrent loaders see either no file or a complete one
+rapi_error_t rapi_host_filter_save(const rapi_host_filter* filter, const char* path)
+{
+	if (NULL == filter || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	kstring_t tmp_path = { 0, 0, NULL };
+	if (ksprintf(&tmp_path, "%s.%ld.tmp", path, (long)getpid()) < 0)
+		return RAPI_MEMORY_ERROR;
+	FILE* f = fopen(tmp_path.s, "wb");
+	if (NULL == f) {
+		PERROR("Couldn't open %s: %s\n", tmp_path.s, strerror(errno));
+		free(tmp_path.s);
+		return RAPI_GENERIC_ERROR;
+	}
+	filter_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FILTER_FILE_MAGIC, sizeof(header.magic));
+	header.k = filter->k;
+	header.n_blocks = filter->n_blocks;
+	header.fasta_size = filter->fasta_size;
+	header.fasta_mtime = filter->fasta_mtime;
+
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1
+	      && fwrite(filter->blocks, sizeof(filter->blocks[0]), filter->n_blocks, f) == filter->n_blocks;
+	ok = (fclose(f) == 0) && ok;
+	ok = ok && rename(tmp_path.s, path) == 0;
+	if (!ok) {
+		PERROR("Couldn't write %s\n", path);
+		remove(tmp_path.s);
+	}
+	free(tmp_path.s);
+	return ok ? RAPI_NO_ERROR : RAPI_GENERIC_ERROR;
+}
+
+rapi_error_t rapi_host_filter_load(rapi_host_filter** ret_filter, const char* path)
+{
+	if (NULL == ret_filter || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	FILE* f = fopen(path, "rb");
+	if (NULL == f)
+		return RAPI_GENERIC_ERROR;
+
+	filter_file_header header;
+	rapi_host_filter* filter = NULL;
+	rapi_error_t error = RAPI_NO_ERROR;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, FILTER_FILE_MAGIC, sizeof(header.magic)) != 0)
+		error = RAPI_GENERIC_ERROR;
+	if (error == RAPI_NO_ERROR)
+		error = _alloc(&filter, header.k, header.n_blocks);
+	if (error == RAPI_NO_ERROR) {
+		filter->fasta_size = header.fasta_size;
+		filter->fasta_mtime = header.fasta_mtime;
+	}
+	if (error == RAPI_NO_ERROR
+	    && fread(filter->blocks, sizeof(filter->blocks[0]), filter->n_blocks, f) != filter->n_blocks) {
+		rapi_host_filter_free(filter);
+		error = RAPI_GENERIC_ERROR;
+	}
+	fclose(f);
+	if (error != RAPI_NO_ERROR) {
+		PERROR("%s isn't a valid host filter\n", path);
+		return error;
+	}
+	*ret_filter = filter;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_host_filter_open(rapi_host_filter** ret_filter, const char* fasta_path,
+    int k, size_t n_bytes, int n_threads)
+{
+	if (NULL == ret_filter || NULL == fasta_path)
+		return RAPI_PARAM_ERROR;
+
+	kstring_t filename = { 0, 0, NULL };
+	if (ksprintf(&filename, "%s.bloom", fasta_path) < 0)
+		return RAPI_MEMORY_ERROR;
+
+	// a saved filter is used only if it was built from this very FASTA, with the same parameters
+	rapi_host_filter* filter = NULL;
+	uint64_t fasta_size;
+	int64_t fasta_mtime;
+	struct stat st;
+	if (_stat_fasta(fasta_path, &fasta_size, &fasta_mtime) == 0 && stat(filename.s, &st) == 0
+	    && rapi_host_filter_load(&filter, filename.s) == RAPI_NO_ERROR) {
+		const uint64_t n_blocks = n_bytes > 0 ? n_bytes / sizeof(filter_block) : _estimate_blocks(fasta_path, fasta_size);
+		if (filter->k != k || filter->n_blocks != n_blocks
+		    || filter->fasta_size != fasta_size || filter->fasta_mtime != fasta_mtime) {
+			rapi_host_filter_free(filter);
+			filter = NULL;
+		}
+	}
+	rapi_error_t error = RAPI_NO_ERROR;
+	if (NULL == filter) {
+		error = rapi_host_filter_build(&filter, fasta_path, k, n_bytes, n_threads);
+		if (error == RAPI_NO_ERROR && rapi_host_filter_save(filter, filename.s) != RAPI_NO_ERROR)
+			fprintf(stderr, "Couldn't save host filter to %s\n", filename.s);
+	}
+	free(filename.s);
+	if (error == RAPI_NO_ERROR)
+		*ret_filter = filter;
+	return error;
+}
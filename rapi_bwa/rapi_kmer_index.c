@@ -0,0 +1,468 @@
+/*
+ * rapi_kmer_index.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // getpid
+
+#include "rapi_kmer_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KMER_FILE_MAGIC  "RAPIKMR2"
+#define KMER_EMPTY       UINT32_MAX // no sample has this number
+#define KMER_BUILD_BLOCK 4096       // sampled positions per build work item
+
+/*
+ * The table doesn't store the k-mers:  a slot holds the number of the
+ * sample (its position / stride) and the high bits of the k-mer's hash,
+ * and lookups check candidates against the reference itself.
+ */
+typedef struct {
+	uint32_t check;  // high 32 bits of the k-mer's hash
+	uint32_t sample; // KMER_EMPTY for an empty slot
+} kmer_slot;
+
+struct rapi_kmer_index {
+	int k, stride;
+	int64_t l_pac;
+	int32_t n_seqs;
+	char* ref_path;   // of the reference the index was loaded for
+	uint64_t n_slots; // power of 2
+	kmer_slot* slots;
+};
+
+typedef struct {
+	char magic[8];
+	int32_t k, stride;
+	int64_t l_pac;
+	int32_t n_seqs, unused;
+	uint64_t n_slots;
+} kmer_file_header;
+
+static inline int _pac_base(const uint8_t* pac, int64_t p)
+{
+	return pac[p>>2] >> ((~p&3)<<1) & 3;
+}
+
+// Thomas Wang's invertible integer hash
+static inline uint64_t _hash64(uint64_t key)
+{
+	key = ~key + (key << 21);
+	key = key ^ key >> 24;
+	key = (key + (key << 3)) + (key << 8);
+	key = key ^ key >> 14;
+	key = (key + (key << 2)) + (key << 4);
+	key = key ^ key >> 28;
+	key = key + (key << 31);
+	return key;
+}
+
+static inline uint64_t _encode(const uint8_t* seq, int k)
+{
+	uint64_t kmer = 0;
+	for (int i = 0; i < k; ++i)
+		kmer = kmer << 2 | seq[i];
+	return kmer;
+}
+
+static inline uint64_t _pac_kmer(const uint8_t* pac, int64_t pos, int k)
+{
+	uint64_t kmer = 0;
+	for (int i = 0; i < k; ++i)
+		kmer = kmer << 2 | _pac_base(pac, pos + i);
+	return kmer;
+}
+
+static int64_t _lookup(const rapi_kmer_index* index, const uint8_t* pac, uint64_t kmer)
+{
+	const uint64_t mask = index->n_slots - 1;
+	const uint64_t hash = _hash64(kmer);
+	const uint32_t check = hash >> 32;
+	for (uint64_t i = hash & mask; index->slots[i].sample != KMER_EMPTY; i = (i + 1) & mask) {
+		if (index->slots[i].check == check) {
+			const int64_t pos = (int64_t)index->slots[i].sample * index->stride;
+			if (_pac_kmer(pac, pos, index->k) == kmer)
+				return pos;
+		}
+	}
+	return -1;
+}
+
+static void _insert(rapi_kmer_index* index, uint64_t kmer, uint32_t sample)
+{
+	const uint64_t mask = index->n_slots - 1;
+	const uint64_t hash = _hash64(kmer);
+	uint64_t i = hash & mask;
+	while (index->slots[i].sample != KMER_EMPTY)
+		i = (i + 1) & mask;
+	index->slots[i].check = hash >> 32;
+	index->slots[i].sample = sample;
+}
+
+void rapi_kmer_index_free(rapi_kmer_index* index)
+{
+	if (index) {
+		free(index->slots);
+		free(index->ref_path);
+		free(index);
+	}
+}
+
+int rapi_kmer_index_is_for(const rapi_kmer_index* index, const char* ref_path, const bwaidx_t* idx, int k, int stride)
+{
+	return index->k == k && index->stride == stride
+	    && index->l_pac == idx->bns->l_pac && index->n_seqs == idx->bns->n_seqs
+	    && strcmp(index->ref_path, ref_path) == 0;
+}
+
+/******** build ********/
+
+typedef struct {
+	const bwt_t* bwt;
+	const uint8_t* pac;
+	int k, stride;
+	int64_t n_samples;
+	uint8_t* unique; // per sampled position
+} kmer_build_worker_t;
+
+/*
+ * Count the occurrences of the sampled k-mers by backward search on the
+ * FM-index, which covers both strands.
+ */
+static void kmer_build_worker(void* data, int block, int tid)
+{
+	kmer_build_worker_t* w = (kmer_build_worker_t*)data;
+	int64_t end = ((int64_t)block + 1) * KMER_BUILD_BLOCK;
+	if (end > w->n_samples)
+		end = w->n_samples;
+
+	uint8_t codes[RAPI_KMER_INDEX_MAX_K];
+	for (int64_t s = (int64_t)block * KMER_BUILD_BLOCK; s < end; ++s) {
+		const int64_t p = s * w->stride;
+		for (int i = 0; i < w->k; ++i)
+			codes[i] = _pac_base(w->pac, p + i);
+
+		bwtintv_t ik, ok[4];
+		bwt_set_intv(w->bwt, codes[w->k - 1], ik);
+		for (int i = w->k - 2; i >= 0 && ik.x[2] > 1; --i) {
+			bwt_extend(w->bwt, &ik, ok, 1);
+			ik = ok[codes[i]];
+		}
+		w->unique[s] = ik.x[2] == 1;
+	}
+}
+
+static rapi_kmer_index* _build(const bwaidx_t* idx, int k, int stride, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+	const bntseq_t* bns = idx->bns;
+
+	rapi_kmer_index* index = calloc(1, sizeof(*index));
+	if (NULL == index)
+		return NULL;
+	index->k = k;
+	index->stride = stride;
+	index->l_pac = bns->l_pac;
+	index->n_seqs = bns->n_seqs;
+
+	kmer_build_worker_t w;
+	w.bwt = idx->bwt;
+	w.pac = idx->pac;
+	w.k = k;
+	w.stride = stride;
+	w.n_samples = bns->l_pac >= k ? (bns->l_pac - k) / stride + 1 : 0;
+	if (w.n_samples >= KMER_EMPTY) { // the slots can't number them
+		free(index);
+		return NULL;
+	}
+	w.unique = calloc(w.n_samples > 0 ? w.n_samples : 1, 1);
+	if (NULL == w.unique) {
+		free(index);
+		return NULL;
+	}
+	kt_for(n_threads, kmer_build_worker, &w, (int)((w.n_samples + KMER_BUILD_BLOCK - 1) / KMER_BUILD_BLOCK));
+
+	// Drop the k-mers that overlap a contig boundary or a stretch of Ns (which
+	// BWA replaces with random bases in the pac)
+	for (int i = 0; i < bns->n_seqs; ++i) {
+		int64_t boundary = bns->anns[i].offset + bns->anns[i].len;
+		for (int64_t s = (boundary - k + 1 > 0 ? (boundary - k + 1 + stride - 1) / stride : 0); s * stride < boundary && s < w.n_samples; ++s)
+			w.unique[s] = 0;
+	}
+	for (int i = 0; i < bns->n_holes; ++i) {
+		const bntamb1_t* hole = &bns->ambs[i];
+		int64_t first = hole->offset - k + 1 > 0 ? (hole->offset - k + 1 + stride - 1) / stride : 0;
+		for (int64_t s = first; s * stride < hole->offset + hole->len && s < w.n_samples; ++s)
+			w.unique[s] = 0;
+	}
+
+	uint64_t n_unique = 0;
+	for (int64_t s = 0; s < w.n_samples; ++s)
+		n_unique += w.unique[s];
+
+	// load factor <= 3/4
+	index->n_slots = 1024;
+	while (index->n_slots / 4 * 3 < n_unique)
+		index->n_slots <<= 1;
+	index->slots = malloc(index->n_slots * sizeof(index->slots[0]));
+	if (NULL == index->slots) {
+		free(w.unique);
+		free(index);
+		return NULL;
+	}
+	memset(index->slots, 0xff, index->n_slots * sizeof(index->slots[0]));
+
+	uint8_t codes[RAPI_KMER_INDEX_MAX_K];
+	for (int64_t s = 0; s < w.n_samples; ++s) {
+		if (!w.unique[s]) continue;
+		for (int i = 0; i < k; ++i)
+			codes[i] = _pac_base(idx->pac, s * stride + i);
+		_insert(index, _encode(codes, k), (uint32_t)s);
+	}
+
+	free(w.unique);
+	return index;
+}
+
+/******** load / save ********/
+
+static rapi_kmer_index* _read_file(const char* filename, int k, int stride, const bntseq_t* bns)
+{
+	FILE* f = fopen(filename, "rb");
+	if (NULL == f)
+		return NULL;
+
+	rapi_kmer_index* index = NULL;
+	kmer_file_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1
+	    || memcmp(header.magic, KMER_FILE_MAGIC, sizeof(header.magic)) != 0
+	    || header.k != k || header.stride != stride || header.l_pac != bns->l_pac || header.n_seqs != bns->n_seqs)
+		goto done;
+
+	index = calloc(1, sizeof(*index));
+	if (NULL == index)
+		goto done;
+	index->k = k;
+	index->stride = stride;
+	index->l_pac = bns->l_pac;
+	index->n_seqs = bns->n_seqs;
+	index->n_slots = header.n_slots;
+	index->slots = malloc(header.n_slots * sizeof(index->slots[0]));
+	if (NULL == index->slots || fread(index->slots, sizeof(index->slots[0]), header.n_slots, f) != header.n_slots) {
+		rapi_kmer_index_free(index);
+		index = NULL;
+	}
+
+done:
+	fclose(f);
+	return index;
+}
+
+/*
+ * Write the index to a temporary file and rename it to `filename`, so that
+ * concurrent loaders see either no file or a complete one.
+ */
+static int _write_file(const char* filename, const rapi_kmer_index* index)
+{
+	char* tmp_name = malloc(strlen(filename) + 32);
+	if (NULL == tmp_name)
+		return -1;
+	sprintf(tmp_name, "%s.%ld.tmp", filename, (long)getpid());
+	FILE* f = fopen(tmp_name, "wb");
+	if (NULL == f) {
+		free(tmp_name);
+		return -1;
+	}
+
+	kmer_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KMER_FILE_MAGIC, sizeof(header.magic));
+	header.k = index->k;
+	header.stride = index->stride;
+	header.l_pac = index->l_pac;
+	header.n_seqs = index->n_seqs;
+	header.n_slots = index->n_slots;
+
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1
+	      && fwrite(index->slots, sizeof(index->slots[0]), index->n_slots, f) == index->n_slots;
+	ok = (fclose(f) == 0) && ok;
+	ok = ok && rename(tmp_name, filename) == 0;
+	if (!ok)
+		remove(tmp_name);
+	free(tmp_name);
+	return ok ? 0 : -1;
+}
+
+rapi_kmer_index* rapi_kmer_index_load(const char* ref_path, const bwaidx_t* idx, int k, int stride, int n_threads)
+{
+	if (k < 1 || k > RAPI_KMER_INDEX_MAX_K || stride < 1)
+		return NULL;
+
+	char* filename = malloc(strlen(ref_path) + 6);
+	if (NULL == filename)
+		return NULL;
+	sprintf(filename, "%s.kmer", ref_path);
+
+	rapi_kmer_index* index = _read_file(filename, k, stride, idx->bns);
+	if (NULL == index) {
+		index = _build(idx, k, stride, n_threads);
+		if (index && _write_file(filename, index) != 0)
+			fprintf(stderr, "Couldn't save k-mer index to %s\n", filename);
+	}
+	if (index) {
+		index->ref_path = strdup(ref_path);
+		if (NULL == index->ref_path) {
+			rapi_kmer_index_free(index);
+			index = NULL;
+		}
+	}
+
+	free(filename);
+	return index;
+}
+
+/******** lookup ********/
+
+/*
+ * Whether the k-mer of `q` at `offset` is indexed at reference position
+ * `start + offset`.
+ */
+static inline int _kmer_at(const rapi_kmer_index* index, const uint8_t* pac, const uint8_t* q, int offset, int64_t start)
+{
+	return _lookup(index, pac, _encode(q + offset, index->k)) == start + offset;
+}
+
+static inline int _min_int(int a, int b) { return a < b ? a : b; }
+
+/*
+ * An upper bound on the score of any other placement of the read `q`, given
+ * the sampled k-mers of `q` (not overlapping each other or the mismatch at
+ * `mm_pos`) that are indexed at `start`.  Each of them is unique in the
+ * reference, so another placement can't align any of them exactly:  it has
+ * an edit within each, or clips the read short of it.
+ *
+ * \return the bound, with the number of k-mers in `n_unique`.
+ */
+static int _sub_score_bound(const rapi_kmer_index* index, const mem_opt_t* opt, const uint8_t* pac,
+		int l_seq, const uint8_t* q, int o, int mm_pos, int64_t start, int* n_unique)
+{
+	const int k = index->k;
+	const int edit = _min_int(opt->a + opt->b, _min_int(opt->o_del + opt->e_del, opt->a + opt->o_ins + opt->e_ins));
+	int bound = opt->a * l_seq;
+	*n_unique = 0;
+	for (int o2 = o % index->stride, end = 0; o2 + k <= l_seq; o2 += index->stride) {
+		if (o2 < end || (o2 <= mm_pos && mm_pos < o2 + k))
+			continue;
+		if (o2 == o || _kmer_at(index, pac, q, o2, start)) {
+			const int to_end = _min_int(o2, l_seq - o2 - k); // bases between the k-mer and the closest end
+			bound -= _min_int(edit, opt->a * (to_end + 1));
+			*n_unique += 1;
+			end = o2 + k;
+		}
+	}
+	return bound;
+}
+
+/* Longest read whose reverse complement rapi_kmer_index_place keeps on the stack. */
+#define KMER_PLACE_STACK_LEN 512
+
+int rapi_kmer_index_place(const rapi_kmer_index* index, const mem_opt_t* opt, const bntseq_t* bns, const uint8_t* pac,
+		int l_seq, const uint8_t* seq, mem_alnreg_t* hit)
+{
+	const int k = index->k, stride = index->stride;
+	if (l_seq <= 0 || l_seq < k + stride - 1)
+		return 0;
+	for (int i = 0; i < l_seq; ++i) {
+		if (seq[i] > 3)
+			return 0;
+	}
+
+	// the reverse complement, on the stack for reads of typical length
+	uint8_t rev_buf[KMER_PLACE_STACK_LEN];
+	const size_t len = (size_t)l_seq;
+	uint8_t* rev = len <= sizeof(rev_buf) ? rev_buf : malloc(len);
+	if (NULL == rev)
+		return 0;
+	for (size_t i = 0; i < len; ++i)
+		rev[len - 1 - i] = 3 - seq[i];
+
+	int placed = 0;
+	for (int strand = 0; strand < 2 && !placed; ++strand) {
+		const uint8_t* q = strand ? rev : seq; // matches the forward strand
+		for (int o = 0; o < stride && !placed; ++o) {
+			int64_t start = _lookup(index, pac, _encode(q + o, k));
+			if (start < 0) continue;
+			start -= o;
+			if (start < 0 || start + l_seq > index->l_pac || bns_pos2rid(bns, start) != bns_pos2rid(bns, start + l_seq - 1))
+				continue;
+
+			int n_mm = 0, mm_pos = -1;
+			for (int i = 0; i < l_seq && n_mm <= 1; ++i) {
+				if (_pac_base(pac, start + i) != q[i]) {
+					n_mm += 1;
+					mm_pos = i;
+				}
+			}
+			if (n_mm > 1) continue;
+
+			int score = opt->a * l_seq;
+			if (n_mm == 1) {
+				// BWA would clip the read rather than keep the mismatch if it's too
+				// close to an end; leave those reads to it
+				const int m = strand ? l_seq - 1 - mm_pos : mm_pos; // mismatch position on the read
+				if (opt->b - opt->a * m >= opt->pen_clip5 || opt->b - opt->a * (l_seq - 1 - m) >= opt->pen_clip3)
+					continue;
+				score = opt->a * (l_seq - 1) - opt->b;
+			}
+
+			// With a mismatch, we need a second k-mer placed at the same position
+			// to rule out an equally good hit elsewhere.  In any case the bound
+			// on the other hits stands in for BWA's sub-optimal score, so that
+			// the MAPQ doesn't claim more certainty than we have.
+			int n_unique;
+			const int sub = _sub_score_bound(index, opt, pac, l_seq, q, o, mm_pos, start, &n_unique);
+			if ((n_mm == 1 && n_unique < 2) || sub >= score)
+				continue;
+
+			memset(hit, 0, sizeof(*hit));
+			if (strand == 0) {
+				hit->rb = start;
+			}
+			else { // BWA's coordinates for the reverse strand
+				hit->rb = (index->l_pac << 1) - (start + l_seq);
+			}
+			hit->re = hit->rb + l_seq;
+			hit->qb = 0;
+			hit->qe = l_seq;
+			hit->score = hit->truesc = score;
+			hit->sub = hit->csub = sub; // mem_mark_primary_se resets sub; csub takes the bound to the MAPQ
+			hit->w = opt->w;
+			hit->seedcov = l_seq;
+			hit->secondary = -1;
+			placed = 1;
+		}
+	}
+
+	if (rev != rev_buf)
+		free(rev);
+	return placed;
+}
@@ -0,0 +1,84 @@
+/*
+ * rapi_kmer_index.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_KMER_INDEX_H__
+#define __RAPI_KMER_INDEX_H__
+
+#include <bwamem.h>
+
+#define RAPI_KMER_INDEX_MAX_K 31
+
+/**
+ * Auxiliary index of reference k-mers for placing (near) exact read matches
+ * without going through the FM-index seeding.
+ *
+ * The index samples the forward strand every `stride` bases and keeps the
+ * k-mers that occur exactly once in the whole reference, on either strand,
+ * mapped to their position.  Any read of length >= k + stride - 1 that matches
+ * the reference contains at least one sampled k-mer.
+ *
+ * Memory:  the table takes 8 bytes per slot, at a load factor between 3/8
+ * and 3/4, so 11 to 21 bytes per unique sampled k-mer.  A human genome
+ * sampled with the default stride of 8 has about 330 million, in a 4 GB
+ * table.  Doubling the stride halves that, but reads shorter than
+ * k + stride - 1 can't be placed.  The reference length / stride must be
+ * below 2^32.
+ */
+typedef struct rapi_kmer_index rapi_kmer_index;
+
+/**
+ * Load the k-mer index for the reference `idx` from `<ref_path>.kmer`.  If the
+ * file doesn't exist or was built with different parameters, build the index
+ * with `n_threads` threads and try to save it there for next time.
+ *
+ * \return the index, or NULL if it can't be built (e.g., out of memory).
+ */
+rapi_kmer_index* rapi_kmer_index_load(const char* ref_path, const bwaidx_t* idx, int k, int stride, int n_threads);
+
+void rapi_kmer_index_free(rapi_kmer_index* index);
+
+/**
+ * Whether `index` was loaded by rapi_kmer_index_load with these arguments,
+ * for a reference of the same size and number of contigs as `idx`.
+ */
+int rapi_kmer_index_is_for(const rapi_kmer_index* index, const char* ref_path, const bwaidx_t* idx, int k, int stride);
+
+/**
+ * Try to place the read `seq` (base codes in [0,4]) with the k-mer index and
+ * verify the placement against the reference.
+ *
+ * A placement is accepted if it's gapless and has no mismatches, or a single
+ * mismatch when two non-overlapping k-mers of the read agree on it (which
+ * rules out an equally good hit elsewhere).  Reads with ambiguous bases
+ * aren't placed.
+ *
+ * Since no other hit is searched for, the hit's sub-optimal scores are set
+ * to an upper bound on the score of any other placement:  each unique k-mer
+ * of the read must have an edit there.  So the MAPQ of the reads placed
+ * here is conservative, lower than BWA would give a read with no
+ * alternative hits.  Reads for which the bound isn't below their score
+ * aren't placed.
+ *
+ * \return 1 and fill in `hit` if the read was placed; 0 otherwise.
+ */
+int rapi_kmer_index_place(const rapi_kmer_index* index, const mem_opt_t* opt, const bntseq_t* bns, const uint8_t* pac,
+		int l_seq, const uint8_t* seq, mem_alnreg_t* hit);
+
+#endif
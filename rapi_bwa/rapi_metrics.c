@@ -0,0 +1,315 @@
+/*
+ * rapi_metrics.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include <rapi_metrics.h>
+#include <rapi_utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FLAGSTAT_FIELDS (sizeof(rapi_flagstat) / sizeof(uint64_t))
+
+/* An aligned block, kept by forked collectors in place of the coverage arrays. */
+typedef struct {
+	int contig;
+	uint32_t len;
+	rapi_ssize_t start; // 0-based
+} cov_span;
+
+typedef struct {
+	cov_span* a;
+	size_t n, m;
+} cov_span_v;
+
+struct rapi_metrics {
+	const rapi_ref* ref;
+	int bin_size;
+	int n_isize_bins;
+	rapi_flagstat flagstat;
+	uint64_t mapq[RAPI_METRICS_MAPQ_BINS];
+	uint64_t* isize;
+	uint64_t** coverage; // per contig;  NULL in forked collectors
+	cov_span_v spans;    // forked collectors only
+};
+
+static rapi_error_t _alloc(rapi_metrics** ret_metrics, const rapi_ref* ref,
+    int coverage_bin_size, int max_insert_size, int forked)
+{
+	if (NULL == ret_metrics || NULL == ref || coverage_bin_size <= 0 || max_insert_size < 0)
+		return RAPI_PARAM_ERROR;
+
+	rapi_metrics* metrics = calloc(1, sizeof(*metrics));
+	if (NULL == metrics)
+		return RAPI_MEMORY_ERROR;
+	metrics->ref = ref;
+	metrics->bin_size = coverage_bin_size;
+	metrics->n_isize_bins = max_insert_size + 1;
+	metrics->isize = calloc(metrics->n_isize_bins, sizeof(metrics->isize[0]));
+	rapi_error_t error = metrics->isize ? RAPI_NO_ERROR : RAPI_MEMORY_ERROR;
+
+	if (error == RAPI_NO_ERROR && !forked) {
+		metrics->coverage = calloc(ref->n_contigs > 0 ? ref->n_contigs : 1, sizeof(metrics->coverage[0]));
+		if (NULL == metrics->coverage)
+			error = RAPI_MEMORY_ERROR;
+		for (int c = 0; c < ref->n_contigs && error == RAPI_NO_ERROR; ++c) {
+			const rapi_ssize_t n_bins = (ref->contigs[c].len + coverage_bin_size - 1) / coverage_bin_size;
+			metrics->coverage[c] = calloc(n_bins > 0 ? n_bins : 1, sizeof(uint64_t));
+			if (NULL == metrics->coverage[c])
+				error = RAPI_MEMORY_ERROR;
+		}
+	}
+	if (error != RAPI_NO_ERROR) {
+		rapi_metrics_free(metrics);
+		return error;
+	}
+	*ret_metrics = metrics;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_metrics_init(rapi_metrics** ret_metrics, const rapi_ref* ref,
+    int coverage_bin_size, int max_insert_size)
+{
+	return _alloc(ret_metrics, ref, coverage_bin_size, max_insert_size, 0);
+}
+
+rapi_error_t rapi_metrics_fork(rapi_metrics** ret_metrics, const rapi_metrics* parent)
+{
+	if (NULL == parent)
+		return RAPI_PARAM_ERROR;
+	return _alloc(ret_metrics, parent->ref, parent->bin_size, parent->n_isize_bins - 1, 1);
+}
+
+rapi_error_t rapi_metrics_free(rapi_metrics* metrics)
+{
+	if (NULL == metrics)
+		return RAPI_PARAM_ERROR;
+	for (int c = 0; metrics->coverage && c < metrics->ref->n_contigs; ++c)
+		free(metrics->coverage[c]);
+	free(metrics->coverage);
+	free(metrics->isize);
+	free(metrics->spans.a);
+	free(metrics);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_metrics_clear(rapi_metrics* metrics)
+{
+	if (NULL == metrics)
+		return RAPI_PARAM_ERROR;
+	memset(&metrics->flagstat, 0, sizeof(metrics->flagstat));
+	memset(metrics->mapq, 0, sizeof(metrics->mapq));
+	memset(metrics->isize, 0, metrics->n_isize_bins * sizeof(metrics->isize[0]));
+	for (int c = 0; metrics->coverage && c < metrics->ref->n_contigs; ++c) {
+		const rapi_ssize_t n_bins = (metrics->ref->contigs[c].len + metrics->bin_size - 1) / metrics->bin_size;
+		memset(metrics->coverage[c], 0, n_bins * sizeof(uint64_t));
+	}
+	metrics->spans.n = 0;
+	return RAPI_NO_ERROR;
+}
+
+/* Add `len` aligned bases at 0-based `start` to the coverage bins of `contig`. */
+static void _add_coverage(rapi_metrics* metrics, int contig, rapi_ssize_t start, rapi_ssize_t len)
+{
+	const rapi_ssize_t contig_len = metrics->ref->contigs[contig].len;
+	if (start < 0) {
+		len += start;
+		start = 0;
+	}
+	if (start + len > contig_len)
+		len = contig_len - start;
+	uint64_t* bins = metrics->coverage[contig];
+	while (len > 0) {
+		const rapi_ssize_t bin = start / metrics->bin_size;
+		const rapi_ssize_t bin_end = (bin + 1) * metrics->bin_size;
+		const rapi_ssize_t n = bin_end - start < len ? bin_end - start : len;
+		bins[bin] += n;
+		start += n;
+		len -= n;
+	}
+}
+
+static int _add_span(rapi_metrics* metrics, int contig, rapi_ssize_t start, uint32_t len)
+{
+	if (metrics->coverage) {
+		_add_coverage(metrics, contig, start, len);
+		return 0;
+	}
+	cov_span_v* v = &metrics->spans;
+	if (v->n == v->m) {
+		const size_t m = v->m ? v->m * 2 : 1024;
+		cov_span* a = realloc(v->a, m * sizeof(a[0]));
+		if (NULL == a)
+			return -1;
+		v->a = a;
+		v->m = m;
+	}
+	cov_span* s = &v->a[v->n++];
+	s->contig = contig;
+	s->start = start;
+	s->len = len;
+	return 0;
+}
+
+static int _add_aligned_blocks(rapi_metrics* metrics, const rapi_alignment* aln)
+{
+	const int contig = aln->contig - metrics->ref->contigs;
+	if (contig < 0 || contig >= metrics->ref->n_contigs)
+		return 0;
+	rapi_ssize_t pos = aln->pos - 1;
+	for (int i = 0; i < aln->n_cigar_ops; ++i) {
+		const rapi_cigar* op = &aln->cigar_ops[i];
+		if (op->op == RAPI_CIG_M) {
+			if (_add_span(metrics, contig, pos, op->len) != 0)
+				return -1;
+			pos += op->len;
+		}
+		else if (op->op == RAPI_CIG_D || op->op == RAPI_CIG_N)
+			pos += op->len;
+	}
+	return 0;
+}
+
+static rapi_error_t _add_read(rapi_metrics* metrics, const rapi_read* read, const rapi_read* mate, int read_num)
+{
+	static const rapi_alignment unmapped;
+	const rapi_alignment* mate_aln = mate && mate->n_alignments > 0 ? &mate->alignments[0] : &unmapped;
+	rapi_flagstat* fs = &metrics->flagstat;
+	const int n_records = read->n_alignments > 0 ? read->n_alignments : 1;
+
+	for (int i = 0; i < n_records; ++i) {
+		const rapi_alignment* aln = read->n_alignments > 0 ? &read->alignments[i] : &unmapped;
+		const int mapped = aln->mapped && aln->contig != NULL;
+		fs->n_records += 1;
+		fs->n_duplicates += aln->duplicate;
+		fs->n_mapped += mapped;
+		if (aln->secondary_aln) {
+			fs->n_secondary += 1;
+			continue;
+		}
+		if (mapped && !aln->duplicate && _add_aligned_blocks(metrics, aln) != 0)
+			return RAPI_MEMORY_ERROR;
+		if (i > 0) {
+			fs->n_supplementary += 1;
+			continue;
+		}
+
+		// primary record
+		if (mapped)
+			metrics->mapq[aln->mapq] += 1;
+		if (NULL == mate)
+			continue;
+		const int mate_mapped = mate_aln->mapped && mate_aln->contig != NULL;
+		fs->n_paired += 1;
+		fs->n_read1 += read_num == 1;
+		fs->n_read2 += read_num == 2;
+		if (mapped && aln->prop_paired)
+			fs->n_proper_pairs += 1;
+		if (mapped && mate_mapped) {
+			fs->n_both_mapped += 1;
+			if (aln->contig != mate_aln->contig) {
+				fs->n_mate_other_contig += 1;
+				fs->n_mate_other_contig_q5 += aln->mapq >= 5;
+			}
+			else if (read_num == 1) {
+				long isize = rapi_get_insert_size(aln, mate_aln);
+				if (isize < 0)
+					isize = -isize;
+				metrics->isize[isize < metrics->n_isize_bins ? isize : metrics->n_isize_bins - 1] += 1;
+			}
+		}
+		else if (mapped)
+			fs->n_singletons += 1;
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_metrics_add_fragment(rapi_metrics* metrics, const rapi_read* reads, int n_reads)
+{
+	if (NULL == metrics || NULL == reads || n_reads < 1 || n_reads > 2)
+		return RAPI_PARAM_ERROR;
+	rapi_error_t error = _add_read(metrics, &reads[0], n_reads == 2 ? &reads[1] : NULL, n_reads == 2 ? 1 : 0);
+	if (error == RAPI_NO_ERROR && n_reads == 2)
+		error = _add_read(metrics, &reads[1], &reads[0], 2);
+	return error;
+}
+
+rapi_error_t rapi_metrics_merge(rapi_metrics* dest, rapi_metrics* src)
+{
+	if (NULL == dest || NULL == src || dest->ref != src->ref
+	    || dest->bin_size != src->bin_size || dest->n_isize_bins != src->n_isize_bins)
+		return RAPI_PARAM_ERROR;
+	if (src->coverage && NULL == dest->coverage) {
+		PERROR("Can't merge a collector with coverage arrays into a forked one\n");
+		return RAPI_PARAM_ERROR;
+	}
+
+	for (size_t i = 0; i < src->spans.n; ++i) {
+		const cov_span* s = &src->spans.a[i];
+		if (_add_span(dest, s->contig, s->start, s->len) != 0)
+			return RAPI_MEMORY_ERROR;
+	}
+	for (int c = 0; src->coverage && c < src->ref->n_contigs; ++c) {
+		const rapi_ssize_t n_bins = (src->ref->contigs[c].len + src->bin_size - 1) / src->bin_size;
+		for (rapi_ssize_t b = 0; b < n_bins; ++b)
+			dest->coverage[c][b] += src->coverage[c][b];
+	}
+
+	uint64_t* d = (uint64_t*)&dest->flagstat;
+	const uint64_t* s = (const uint64_t*)&src->flagstat;
+	for (size_t i = 0; i < N_FLAGSTAT_FIELDS; ++i)
+		d[i] += s[i];
+	for (int i = 0; i < RAPI_METRICS_MAPQ_BINS; ++i)
+		dest->mapq[i] += src->mapq[i];
+	for (int i = 0; i < dest->n_isize_bins; ++i)
+		dest->isize[i] += src->isize[i];
+	return rapi_metrics_clear(src);
+}
+
+const rapi_flagstat* rapi_metrics_flagstat(const rapi_metrics* metrics)
+{
+	return metrics ? &metrics->flagstat : NULL;
+}
+
+const uint64_t* rapi_metrics_mapq_histogram(const rapi_metrics* metrics)
+{
+	return metrics ? metrics->mapq : NULL;
+}
+
+const uint64_t* rapi_metrics_insert_size_histogram(const rapi_metrics* metrics, int* n_bins)
+{
+	if (NULL == metrics || NULL == n_bins)
+		return NULL;
+	*n_bins = metrics->n_isize_bins;
+	return metrics->isize;
+}
+
+int rapi_metrics_coverage_bin_size(const rapi_metrics* metrics)
+{
+	return metrics ? metrics->bin_size : 0;
+}
+
+const uint64_t* rapi_metrics_coverage(const rapi_metrics* metrics, int contig, rapi_ssize_t* n_bins)
+{
+	if (NULL == metrics || NULL == metrics->coverage || NULL == n_bins
+	    || contig < 0 || contig >= metrics->ref->n_contigs)
+		return NULL;
+	*n_bins = (metrics->ref->contigs[contig].len + metrics->bin_size - 1) / metrics->bin_size;
+	return metrics->coverage[contig];
+}
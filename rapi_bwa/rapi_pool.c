@@ -0,0 +1,470 @@
+/*
+ * rapi_pool.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <rapi_pool.h>
+#include <rapi_utils.h>
+#include "rapi_wire.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Byte stream from one process to another.  `head` and `tail` count the
+ * bytes written and read since the start; each is only advanced by its own
+ * side, so the data path needs no locks.  The semaphores only let an idle
+ * side sleep:  they're posted after every advance and a woken side re-checks
+ * the counters, so extra posts are harmless.
+ */
+typedef struct {
+	volatile uint64_t head; // written by the producer
+	char pad1[64 - sizeof(uint64_t)];
+	volatile uint64_t tail; // written by the consumer
+	char pad2[64 - sizeof(uint64_t)];
+	sem_t data;  // posted by the producer
+	sem_t space; // posted by the consumer
+	size_t capacity;
+} shm_ring;
+
+#define RingBuf(ring_ptr) ( (char*)(ring_ptr) + sizeof(shm_ring) )
+
+enum { POOL_MSG_ALIGN = 1, POOL_MSG_STOP, POOL_MSG_ESTIMATE };
+
+// fragments of each paired-end batch used to estimate the shared insert size model
+#define POOL_PES_SAMPLE 2000
+
+typedef struct {
+	pid_t pid;
+	shm_ring* requests; // coordinator -> worker
+	shm_ring* replies;  // worker -> coordinator
+} pool_worker;
+
+struct rapi_pool {
+	rapi_ref ref;
+	int n_workers;
+	pool_worker* workers;
+	void* shm;
+	size_t shm_size;
+	pthread_mutex_t lock;
+	int broken; // a worker died
+	kstring_t buf;
+	kstring_t model; // insert size model for the workers (a state snapshot);  empty for none
+};
+
+/*
+ * Wait for `sem`, checking every second that the peer is still alive:
+ * `peer` is a worker's pid on the coordinator side, or the coordinator's
+ * pid on the worker side.
+ */
+static rapi_error_t _wait(sem_t* sem, pid_t peer, int peer_is_child)
+{
+	while (1) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_sec += 1;
+		if (sem_timedwait(sem, &t) == 0)
+			return RAPI_NO_ERROR;
+		if (errno == EINTR)
+			continue;
+		if (errno != ETIMEDOUT)
+			return RAPI_GENERIC_ERROR;
+
+		if (peer_is_child ? waitpid(peer, NULL, WNOHANG) == peer : getppid() != peer)
+			return RAPI_GENERIC_ERROR;
+	}
+}
+
+static rapi_error_t _ring_write(shm_ring* r, const void* src, size_t n, pid_t peer, int peer_is_child)
+{
+	const char* p = src;
+	while (n > 0) {
+		const uint64_t head = r->head;
+		const uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		const size_t space = r->capacity - (size_t)(head - tail);
+		if (space == 0) {
+			if (_wait(&r->space, peer, peer_is_child) != RAPI_NO_ERROR)
+				return RAPI_GENERIC_ERROR;
+			continue;
+		}
+		const size_t chunk = n < space ? n : space;
+		const size_t offset = head % r->capacity;
+		const size_t first = chunk < r->capacity - offset ? chunk : r->capacity - offset;
+		memcpy(RingBuf(r) + offset, p, first);
+		memcpy(RingBuf(r), p + first, chunk - first);
+		__atomic_store_n(&r->head, head + chunk, __ATOMIC_RELEASE);
+		sem_post(&r->data);
+		p += chunk;
+		n -= chunk;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t _ring_read(shm_ring* r, void* dst, size_t n, pid_t peer, int peer_is_child)
+{
+	char* p = dst;
+	while (n > 0) {
+		const uint64_t tail = r->tail;
+		const uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		const size_t avail = (size_t)(head - tail);
+		if (avail == 0) {
+			if (_wait(&r->data, peer, peer_is_child) != RAPI_NO_ERROR)
+				return RAPI_GENERIC_ERROR;
+			continue;
+		}
+		const size_t chunk = n < avail ? n : avail;
+		const size_t offset = tail % r->capacity;
+		const size_t first = chunk < r->capacity - offset ? chunk : r->capacity - offset;
+		memcpy(p, RingBuf(r) + offset, first);
+		memcpy(p + first, RingBuf(r), chunk - first);
+		__atomic_store_n(&r->tail, tail + chunk, __ATOMIC_RELEASE);
+		sem_post(&r->space);
+		p += chunk;
+		n -= chunk;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Messages are a uint32 type (requests) or rapi_error_t (replies), a
+ * uint32 payload length and the payload, in the rapi_wire encoding.
+ */
+static rapi_error_t _send_msg(shm_ring* r, uint32_t type, const kstring_t* payload, pid_t peer, int peer_is_child)
+{
+	uint32_t hdr[2] = { type, payload ? (uint32_t)payload->l : 0 };
+	rapi_error_t error = _ring_write(r, hdr, sizeof(hdr), peer, peer_is_child);
+	if (error == RAPI_NO_ERROR && hdr[1] > 0)
+		error = _ring_write(r, payload->s, payload->l, peer, peer_is_child);
+	return error;
+}
+
+static rapi_error_t _recv_msg(shm_ring* r, uint32_t* type, kstring_t* payload, pid_t peer, int peer_is_child)
+{
+	uint32_t hdr[2];
+	rapi_error_t error = _ring_read(r, hdr, sizeof(hdr), peer, peer_is_child);
+	if (error) return error;
+	*type = hdr[0];
+	payload->l = 0;
+	if (ks_resize(payload, hdr[1] + 1) != 0)
+		return RAPI_MEMORY_ERROR;
+	if ((error = _ring_read(r, payload->s, hdr[1], peer, peer_is_child)))
+		return error;
+	payload->l = hdr[1];
+	return RAPI_NO_ERROR;
+}
+
+/* Read a uint32 n_reads_frag, an int64 n_frags and the reads into the worker's `batch`. */
+static rapi_error_t _worker_get_reads(rapi_wire_cursor* in, rapi_batch* batch, int64_t* n_frags)
+{
+	uint32_t n_reads_frag;
+	rapi_error_t error;
+
+	if ((error = rapi_wire_get_u32(in, &n_reads_frag)) || (error = rapi_wire_get_i64(in, n_frags)))
+		return error;
+
+	if (batch->n_reads_frag != (int)n_reads_frag) {
+		rapi_reads_free(batch);
+		error = rapi_reads_alloc(batch, n_reads_frag, *n_frags > 0 ? *n_frags : 1);
+	}
+	else {
+		rapi_reads_clear(batch);
+		error = rapi_reads_reserve(batch, *n_frags);
+	}
+	if (error == RAPI_NO_ERROR)
+		error = rapi_wire_get_reads(in, batch, *n_frags);
+	return error;
+}
+
+/*
+ * Align the sample of reads in `payload` with the state `*estimator`
+ * (created on first use) and reply with its snapshot, which carries the
+ * insert size model estimated from them.
+ */
+static rapi_error_t _worker_estimate(const rapi_ref* ref, const rapi_opts* opts, rapi_aligner_state** estimator,
+		rapi_batch* batch, kstring_t* payload)
+{
+	rapi_wire_cursor in = { payload->s, payload->s + payload->l };
+	int64_t n_frags;
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	if (NULL == *estimator)
+		error = rapi_aligner_state_init(estimator, opts);
+	if (error == RAPI_NO_ERROR)
+		error = _worker_get_reads(&in, batch, &n_frags);
+	if (error == RAPI_NO_ERROR)
+		error = rapi_align_reads(ref, batch, 0, n_frags, *estimator);
+
+	payload->l = 0;
+	if (error == RAPI_NO_ERROR)
+		error = rapi_aligner_state_save(*estimator, payload);
+	return error;
+}
+
+static rapi_error_t _worker_align(const rapi_ref* ref, rapi_aligner_state* state,
+		rapi_batch* batch, kstring_t* payload)
+{
+	rapi_wire_cursor in = { payload->s, payload->s + payload->l };
+	const char* model;
+	uint32_t model_size;
+	int64_t n_frags;
+	rapi_error_t error;
+
+	if ((error = rapi_wire_get_str(&in, &model, &model_size)))
+		return error;
+	// without a usable shared model, estimate one from our own reads
+	if (0 == model_size || rapi_aligner_state_set_insert_size(state, model, model_size) != RAPI_NO_ERROR)
+		rapi_aligner_state_set_insert_size(state, NULL, 0);
+
+	error = _worker_get_reads(&in, batch, &n_frags);
+	if (error == RAPI_NO_ERROR)
+		error = rapi_align_reads(ref, batch, 0, n_frags, state);
+
+	payload->l = 0; // the request is consumed;  reuse the buffer for the reply
+	if (error == RAPI_NO_ERROR)
+		rapi_wire_put_alignments(payload, ref, batch, 0, n_frags);
+	return error;
+}
+
+static void _worker_main(rapi_pool* pool, pool_worker* self, const rapi_opts* opts, pid_t coordinator)
+{
+	rapi_aligner_state* state = NULL;
+	rapi_aligner_state* estimator = NULL;
+	rapi_batch batch;
+	kstring_t payload = { 0, 0, NULL };
+	memset(&batch, 0, sizeof(batch));
+
+	if (rapi_aligner_state_init(&state, opts) != RAPI_NO_ERROR)
+		_exit(1);
+
+	uint32_t type;
+	while (_recv_msg(self->requests, &type, &payload, coordinator, 0) == RAPI_NO_ERROR
+	       && (type == POOL_MSG_ALIGN || type == POOL_MSG_ESTIMATE)) {
+		rapi_error_t error = type == POOL_MSG_ALIGN ?
+			_worker_align(&pool->ref, state, &batch, &payload) :
+			_worker_estimate(&pool->ref, opts, &estimator, &batch, &payload);
+		if (_send_msg(self->replies, (uint32_t)error, error == RAPI_NO_ERROR ? &payload : NULL, coordinator, 0) != RAPI_NO_ERROR)
+			break;
+	}
+
+	if (batch._private)
+		rapi_reads_free(&batch);
+	if (estimator)
+		rapi_aligner_state_free(estimator);
+	rapi_aligner_state_free(state);
+	free(payload.s);
+	_exit(0);
+}
+
+rapi_error_t rapi_pool_init(rapi_pool** ret_pool, const char* reference_path, const rapi_opts* opts,
+		int n_workers, size_t ring_size)
+{
+	if (NULL == ret_pool || NULL == reference_path || NULL == opts || n_workers <= 0 || ring_size == 0)
+		return RAPI_PARAM_ERROR;
+
+	// the workers split the threads;  the parameters are shared, read-only
+	rapi_opts worker_opts = *opts;
+	worker_opts.n_threads = opts->n_threads / n_workers > 0 ? opts->n_threads / n_workers : 1;
+
+	rapi_pool* pool = *ret_pool = calloc(1, sizeof(*pool));
+	if (NULL == pool)
+		return RAPI_MEMORY_ERROR;
+	pool->n_workers = n_workers;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	rapi_error_t error = rapi_ref_load(reference_path, &pool->ref);
+	if (error != RAPI_NO_ERROR) {
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		*ret_pool = NULL;
+		return error;
+	}
+
+	// keep the rings' counters on their own cache lines
+	const size_t ring_bytes = (sizeof(shm_ring) + ring_size + 63) & ~(size_t)63;
+	pool->shm_size = 2 * n_workers * ring_bytes;
+	pool->shm = mmap(NULL, pool->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pool->workers = calloc(n_workers, sizeof(pool_worker));
+	if (MAP_FAILED == pool->shm || NULL == pool->workers) {
+		if (MAP_FAILED == pool->shm)
+			pool->shm = NULL;
+		rapi_pool_free(pool);
+		*ret_pool = NULL;
+		return RAPI_MEMORY_ERROR;
+	}
+
+	for (int w = 0; w < n_workers; ++w) {
+		shm_ring* rings[2];
+		for (int k = 0; k < 2; ++k) {
+			rings[k] = (shm_ring*)((char*)pool->shm + (2 * w + k) * ring_bytes);
+			rings[k]->capacity = ring_size;
+			sem_init(&rings[k]->data, 1, 0);
+			sem_init(&rings[k]->space, 1, 0);
+		}
+		pool->workers[w].requests = rings[0];
+		pool->workers[w].replies = rings[1];
+	}
+
+	const pid_t coordinator = getpid();
+	for (int w = 0; w < n_workers; ++w) {
+		pid_t pid = fork();
+		if (pid == 0)
+			_worker_main(pool, &pool->workers[w], &worker_opts, coordinator); // doesn't return
+		if (pid < 0) {
+			PERROR("Couldn't fork worker %d: %s\n", w, strerror(errno));
+			rapi_pool_free(pool);
+			*ret_pool = NULL;
+			return RAPI_GENERIC_ERROR;
+		}
+		pool->workers[w].pid = pid;
+	}
+	return RAPI_NO_ERROR;
+}
+
+const rapi_ref* rapi_pool_get_ref(const rapi_pool* pool)
+{
+	return &pool->ref;
+}
+
+rapi_error_t rapi_pool_align_reads(rapi_pool* pool, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag)
+{
+	if (NULL == pool || NULL == batch || start_frag < 0 || end_frag < start_frag || end_frag > batch->n_frags)
+		return RAPI_PARAM_ERROR;
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	const rapi_ssize_t n_frags = end_frag - start_frag;
+	const int W = pool->n_workers;
+	int w;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->broken) {
+		pthread_mutex_unlock(&pool->lock);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	// Paired-end reads are aligned with one insert size model, estimated by
+	// worker 0 from the first fragments of the batch:  each worker estimating
+	// its own from its slice would pair the reads of one batch differently,
+	// depending on the number of workers.  The snapshot carries a model fixed
+	// by the options too.  If that fails, the workers estimate their own.
+	pool->model.l = 0;
+	if (batch->n_reads_frag == 2 && n_frags > 0) {
+		const rapi_ssize_t n_sample = n_frags < POOL_PES_SAMPLE ? n_frags : POOL_PES_SAMPLE;
+		pool->buf.l = 0;
+		rapi_wire_put_u32(&pool->buf, batch->n_reads_frag);
+		rapi_wire_put_i64(&pool->buf, n_sample);
+		rapi_wire_put_reads(&pool->buf, batch, start_frag, start_frag + n_sample);
+		uint32_t result;
+		if (NULL == pool->buf.s)
+			error = RAPI_MEMORY_ERROR;
+		else if (_send_msg(pool->workers[0].requests, POOL_MSG_ESTIMATE, &pool->buf, pool->workers[0].pid, 1) != RAPI_NO_ERROR
+		         || _recv_msg(pool->workers[0].replies, &result, &pool->model, pool->workers[0].pid, 1) != RAPI_NO_ERROR)
+			pool->broken = 1;
+		else if ((rapi_error_t)result != RAPI_NO_ERROR)
+			pool->model.l = 0;
+	}
+
+	// send each worker a contiguous slice, then collect the replies in the
+	// same order.  A worker reads its whole request before replying, so
+	// filling a reply ring can't block us while we're still sending.
+	for (w = 0; w < W && error == RAPI_NO_ERROR && !pool->broken; ++w) {
+		const rapi_ssize_t s = start_frag + n_frags * w / W, e = start_frag + n_frags * (w + 1) / W;
+		pool->buf.l = 0;
+		rapi_wire_put_u32(&pool->buf, pool->model.l);
+		kputsn_(pool->model.s, pool->model.l, &pool->buf);
+		rapi_wire_put_u32(&pool->buf, batch->n_reads_frag);
+		rapi_wire_put_i64(&pool->buf, e - s);
+		rapi_wire_put_reads(&pool->buf, batch, s, e);
+		if (NULL == pool->buf.s) {
+			error = RAPI_MEMORY_ERROR;
+			break;
+		}
+		if (_send_msg(pool->workers[w].requests, POOL_MSG_ALIGN, &pool->buf, pool->workers[w].pid, 1) != RAPI_NO_ERROR) {
+			pool->broken = 1;
+			break;
+		}
+	}
+
+	const int n_sent = w;
+	for (w = 0; w < n_sent && !pool->broken; ++w) {
+		const rapi_ssize_t s = start_frag + n_frags * w / W, e = start_frag + n_frags * (w + 1) / W;
+		uint32_t result;
+		if (_recv_msg(pool->workers[w].replies, &result, &pool->buf, pool->workers[w].pid, 1) != RAPI_NO_ERROR) {
+			pool->broken = 1;
+			break;
+		}
+		if ((rapi_error_t)result != RAPI_NO_ERROR) {
+			if (error == RAPI_NO_ERROR)
+				error = (rapi_error_t)result;
+			continue; // keep draining the other workers' replies
+		}
+		rapi_wire_cursor in = { pool->buf.s, pool->buf.s + pool->buf.l };
+		rapi_error_t e_dec = rapi_wire_get_alignments(&in, &pool->ref, batch, s, e);
+		if (error == RAPI_NO_ERROR)
+			error = e_dec;
+	}
+
+	if (pool->broken) {
+		PERROR("A pool worker died\n");
+		error = RAPI_GENERIC_ERROR;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return error;
+}
+
+rapi_error_t rapi_pool_free(rapi_pool* pool)
+{
+	if (NULL == pool)
+		return RAPI_NO_ERROR;
+
+	for (int w = 0; pool->workers && w < pool->n_workers; ++w) {
+		if (pool->workers[w].pid <= 0)
+			continue;
+		if (pool->broken || _send_msg(pool->workers[w].requests, POOL_MSG_STOP, NULL, pool->workers[w].pid, 1) != RAPI_NO_ERROR)
+			kill(pool->workers[w].pid, SIGTERM);
+		waitpid(pool->workers[w].pid, NULL, 0);
+	}
+
+	if (pool->shm) {
+		for (int w = 0; w < pool->n_workers; ++w) {
+			sem_destroy(&pool->workers[w].requests->data);
+			sem_destroy(&pool->workers[w].requests->space);
+			sem_destroy(&pool->workers[w].replies->data);
+			sem_destroy(&pool->workers[w].replies->space);
+		}
+		munmap(pool->shm, pool->shm_size);
+	}
+	free(pool->workers);
+	rapi_ref_free(&pool->ref);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->buf.s);
+	free(pool->model.s);
+	free(pool);
+	return RAPI_NO_ERROR;
+}
@@ -0,0 +1,330 @@
+/*
+ * rapi_regions.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_regions.h>
+#include <rapi_utils.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Implicit interval tree, as in Heng Li's cgranges.
+ *
+ * The intervals of a contig are sorted by start.  Seen as a binary tree, the
+ * leaves are the even indices, and the node at index i is at level k if the
+ * k lowest bits of i are 1 and bit k is 0;  its children are i -/+ 2^(k-1).
+ * With n intervals the tree is that of the next power of 2, so the nodes
+ * past n don't exist but subtrees containing them can still be partially
+ * filled.  Each node stores the maximum end of its subtree.
+ */
+
+typedef struct {
+	int64_t start, end;
+	int64_t max;  // maximum end in the subtree
+	int contig;
+} region_intv;
+
+struct rapi_regions {
+	const rapi_ref* ref;
+	region_intv* a;
+	size_t n, m;
+	size_t* contig_off;  // n_contigs + 1 offsets into `a`, once indexed
+	int* root_level;     // per contig, once indexed;  -1 if it has no regions
+	int indexed;
+};
+
+#define SMALL_SUBTREE_LEVEL 3 // scan subtrees of up to 16 nodes linearly
+#define STACK_SIZE 64
+
+rapi_error_t rapi_regions_init(rapi_regions** ret_regions, const rapi_ref* ref)
+{
+	if (NULL == ret_regions || NULL == ref)
+		return RAPI_PARAM_ERROR;
+	rapi_regions* regions = calloc(1, sizeof(*regions));
+	if (NULL == regions)
+		return RAPI_MEMORY_ERROR;
+	regions->ref = ref;
+	*ret_regions = regions;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_regions_free(rapi_regions* regions)
+{
+	if (NULL == regions)
+		return RAPI_PARAM_ERROR;
+	free(regions->a);
+	free(regions->contig_off);
+	free(regions->root_level);
+	free(regions);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_regions_add(rapi_regions* regions, int contig, int64_t start, int64_t end)
+{
+	if (NULL == regions || contig < 0 || contig >= regions->ref->n_contigs || start < 0 || end < start)
+		return RAPI_PARAM_ERROR;
+
+	if (regions->n == regions->m) {
+		const size_t m = regions->m ? regions->m * 2 : 256;
+		region_intv* a = realloc(regions->a, m * sizeof(a[0]));
+		if (NULL == a)
+			return RAPI_MEMORY_ERROR;
+		regions->a = a;
+		regions->m = m;
+	}
+	region_intv* r = &regions->a[regions->n++];
+	r->start = start;
+	r->end = end;
+	r->max = end;
+	r->contig = contig;
+	regions->indexed = 0;
+	return RAPI_NO_ERROR;
+}
+
+/******** BED files ********/
+
+typedef struct {
+	const char* name;
+	int contig;
+} contig_name;
+
+static int _cmp_contig_names(const void* a, const void* b)
+{
+	return strcmp(((const contig_name*)a)->name, ((const contig_name*)b)->name);
+}
+
+rapi_error_t rapi_regions_load_bed(rapi_regions* regions, const char* path)
+{
+	if (NULL == regions || NULL == path)
+		return RAPI_PARAM_ERROR;
+
+	FILE* f = fopen(path, "r");
+	if (NULL == f) {
+		PERROR("Couldn't open %s: %s\n", path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+
+	// names sorted for binary search;  BED files of alt-heavy assemblies name thousands of contigs
+	const int n_contigs = regions->ref->n_contigs;
+	contig_name* names = malloc((n_contigs > 0 ? n_contigs : 1) * sizeof(names[0]));
+	if (NULL == names) {
+		fclose(f);
+		return RAPI_MEMORY_ERROR;
+	}
+	for (int c = 0; c < n_contigs; ++c) {
+		names[c].name = regions->ref->contigs[c].name;
+		names[c].contig = c;
+	}
+	qsort(names, n_contigs, sizeof(names[0]), _cmp_contig_names);
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	char* line = NULL;
+	size_t line_size = 0;
+	long line_no = 0;
+	while (error == RAPI_NO_ERROR && getline(&line, &line_size, f) > 0) {
+		line_no += 1;
+		char* save = NULL;
+		const char* chrom = strtok_r(line, " \t\r\n", &save);
+		if (NULL == chrom || chrom[0] == '#' || strcmp(chrom, "track") == 0 || strcmp(chrom, "browser") == 0)
+			continue;
+		const char* start_s = strtok_r(NULL, " \t\r\n", &save);
+		const char* end_s = strtok_r(NULL, " \t\r\n", &save);
+		char* start_end = NULL;
+		char* end_end = NULL;
+		const long long start = start_s ? strtoll(start_s, &start_end, 10) : -1;
+		const long long end = end_s ? strtoll(end_s, &end_end, 10) : -1;
+		if (NULL == end_s || *start_end != '\0' || *end_end != '\0' || start < 0 || end < start) {
+			PERROR("%s:%ld: expected CONTIG START END, with 0 <= START <= END\n", path, line_no);
+			error = RAPI_PARAM_ERROR;
+			break;
+		}
+
+		const contig_name key = { chrom, -1 };
+		const contig_name* found = bsearch(&key, names, n_contigs, sizeof(names[0]), _cmp_contig_names);
+		if (NULL == found) {
+			PERROR("%s:%ld: contig %s isn't in the reference\n", path, line_no, chrom);
+			error = RAPI_PARAM_ERROR;
+			break;
+		}
+		error = rapi_regions_add(regions, found->contig, start, end);
+	}
+	if (error == RAPI_NO_ERROR && ferror(f)) {
+		PERROR("Couldn't read %s: %s\n", path, strerror(errno));
+		error = RAPI_GENERIC_ERROR;
+	}
+	free(line);
+	free(names);
+	fclose(f);
+	return error;
+}
+
+/******** index ********/
+
+static int _cmp_intv(const void* a, const void* b)
+{
+	const region_intv* x = (const region_intv*)a;
+	const region_intv* y = (const region_intv*)b;
+	if (x->contig != y->contig)
+		return x->contig < y->contig ? -1 : 1;
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return (x->end > y->end) - (x->end < y->end);
+}
+
+/* Fill in the `max` of the tree over a[0, n) and return its root level, or -1 if n == 0. */
+static int _index_tree(region_intv* a, int64_t n)
+{
+	if (n <= 0)
+		return -1;
+
+	int64_t last_i = 0; // the last node of the current level that exists, or would be its ancestor
+	int64_t last = 0;   // its max
+	for (int64_t i = 0; i < n; i += 2) {
+		last_i = i;
+		last = a[i].max = a[i].end;
+	}
+	int k;
+	for (k = 1; (int64_t)1 << k <= n; ++k) {
+		const int64_t x = (int64_t)1 << (k - 1), i0 = (x << 1) - 1, step = x << 2;
+		for (int64_t i = i0; i < n; i += step) {
+			const int64_t el = a[i - x].max;
+			const int64_t er = i + x < n ? a[i + x].max : last; // right subtree may be past the end
+			int64_t e = a[i].end;
+			e = e > el ? e : el;
+			e = e > er ? e : er;
+			a[i].max = e;
+		}
+		last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+		if (last_i < n && a[last_i].max > last)
+			last = a[last_i].max;
+	}
+	return k - 1;
+}
+
+rapi_error_t rapi_regions_index(rapi_regions* regions)
+{
+	if (NULL == regions)
+		return RAPI_PARAM_ERROR;
+
+	const int n_contigs = regions->ref->n_contigs;
+	regions->indexed = 0;
+	free(regions->contig_off);
+	free(regions->root_level);
+	regions->contig_off = malloc((n_contigs + 1) * sizeof(regions->contig_off[0]));
+	regions->root_level = malloc((n_contigs > 0 ? n_contigs : 1) * sizeof(regions->root_level[0]));
+	if (NULL == regions->contig_off || NULL == regions->root_level)
+		return RAPI_MEMORY_ERROR;
+
+	if (regions->n > 0)
+		qsort(regions->a, regions->n, sizeof(regions->a[0]), _cmp_intv);
+	size_t i = 0;
+	for (int c = 0; c < n_contigs; ++c) {
+		regions->contig_off[c] = i;
+		while (i < regions->n && regions->a[i].contig == c)
+			++i;
+		regions->root_level[c] = _index_tree(regions->a + regions->contig_off[c], i - regions->contig_off[c]);
+	}
+	regions->contig_off[n_contigs] = i;
+	regions->indexed = 1;
+	return RAPI_NO_ERROR;
+}
+
+rapi_ssize_t rapi_regions_size(const rapi_regions* regions)
+{
+	return regions ? (rapi_ssize_t)regions->n : 0;
+}
+
+int rapi_regions_indexed(const rapi_regions* regions)
+{
+	return regions && regions->indexed;
+}
+
+/******** queries ********/
+
+typedef struct {
+	int64_t x; // node
+	int k;     // its level
+	int w;     // 1 once the left subtree has been visited
+} tree_cursor;
+
+int rapi_regions_overlaps(const rapi_regions* regions, int contig, int64_t start, int64_t end)
+{
+	if (NULL == regions || !regions->indexed || contig < 0 || contig >= regions->ref->n_contigs)
+		return 0;
+
+	const region_intv* a = regions->a + regions->contig_off[contig];
+	const int64_t n = regions->contig_off[contig + 1] - regions->contig_off[contig];
+	const int root = regions->root_level[contig];
+	if (root < 0)
+		return 0;
+
+	tree_cursor stack[STACK_SIZE];
+	int t = 0;
+	stack[t].x = ((int64_t)1 << root) - 1; stack[t].k = root; stack[t++].w = 0;
+	while (t > 0) {
+		const tree_cursor z = stack[--t];
+		if (z.k <= SMALL_SUBTREE_LEVEL) { // small subtree:  scan it
+			const int64_t i0 = z.x >> z.k << z.k;
+			int64_t i1 = i0 + ((int64_t)1 << (z.k + 1)) - 1;
+			if (i1 > n)
+				i1 = n;
+			for (int64_t i = i0; i < i1 && a[i].start < end; ++i) {
+				if (start < a[i].end)
+					return 1;
+			}
+		}
+		else if (z.w == 0) { // go down the left subtree first, if it can overlap
+			const int64_t y = z.x - ((int64_t)1 << (z.k - 1));
+			stack[t].x = z.x; stack[t].k = z.k; stack[t++].w = 1;
+			if (y >= n || a[y].max > start) {
+				stack[t].x = y; stack[t].k = z.k - 1; stack[t++].w = 0;
+			}
+		}
+		else if (z.x < n && a[z.x].start < end) { // then the node and the right subtree
+			if (start < a[z.x].end)
+				return 1;
+			stack[t].x = z.x + ((int64_t)1 << (z.k - 1)); stack[t].k = z.k - 1; stack[t++].w = 0;
+		}
+	}
+	return 0;
+}
+
+int rapi_regions_fragment_overlaps(const rapi_regions* regions, const rapi_read* reads, int n_reads)
+{
+	if (NULL == regions || NULL == reads)
+		return 0;
+
+	for (int r = 0; r < n_reads; ++r) {
+		for (int i = 0; i < reads[r].n_alignments; ++i) {
+			const rapi_alignment* aln = &reads[r].alignments[i];
+			if (!aln->mapped || aln->secondary_aln || NULL == aln->contig)
+				continue;
+			const int64_t start = aln->pos - 1;
+			const int64_t end = start + rapi_get_rlen(aln->n_cigar_ops, aln->cigar_ops);
+			if (rapi_regions_overlaps(regions, aln->contig - regions->ref->contigs, start, end > start ? end : start + 1))
+				return 1;
+		}
+	}
+	return 0;
+}
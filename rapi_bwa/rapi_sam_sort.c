@@ -0,0 +1,573 @@
+/*
+ * rapi_sam_sort.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_sam_sort.h>
+#include <rapi_utils.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SORT_POS_BITS      36         // key:  contig index << SORT_POS_BITS | position
+#define SORT_MAX_CONTIGS   ((1 << (64 - SORT_POS_BITS)) - 1)
+#define SORT_UNPLACED      UINT64_MAX
+#define SORT_MAX_RUNS      64         // open runs before they're merged into one
+#define SORT_ADD_BLOCK     256        // fragments per formatting work item
+#define SORT_MIN_SLICE     4096       // records per parallel sort slice
+
+/*
+ * A record.  `off` points into the arena, where the SAM line is stored
+ * preceded by its length as a uint32_t.
+ */
+typedef struct {
+	uint64_t key;
+	uint64_t off;
+} sort_rec;
+
+typedef struct {
+	sort_rec* a;
+	size_t n, m;
+} sort_rec_v;
+
+struct rapi_sam_sorter {
+	const rapi_ref* ref;
+	size_t mem_budget;
+	char* tmp_dir;
+	int n_threads;
+	kstring_t arena;
+	sort_rec_v recs;
+	int n_runs;
+	FILE* runs[SORT_MAX_RUNS];
+	int finished;
+};
+
+static int _push_rec(sort_rec_v* v, uint64_t key, uint64_t off)
+{
+	if (v->n == v->m) {
+		const size_t m = v->m ? v->m * 2 : 1024;
+		sort_rec* a = realloc(v->a, m * sizeof(*a));
+		if (NULL == a)
+			return -1;
+		v->a = a;
+		v->m = m;
+	}
+	v->a[v->n].key = key;
+	v->a[v->n].off = off;
+	++v->n;
+	return 0;
+}
+
+rapi_error_t rapi_sam_sorter_init(rapi_sam_sorter** ret_sorter, const rapi_ref* ref,
+    size_t mem_budget, const char* tmp_dir, int n_threads)
+{
+	if (NULL == ret_sorter || NULL == ref || ref->n_contigs > SORT_MAX_CONTIGS)
+		return RAPI_PARAM_ERROR;
+
+	rapi_sam_sorter* sorter = calloc(1, sizeof(*sorter));
+	if (NULL == sorter)
+		return RAPI_MEMORY_ERROR;
+	sorter->tmp_dir = strdup(tmp_dir ? tmp_dir : "/tmp");
+	if (NULL == sorter->tmp_dir) {
+		free(sorter);
+		return RAPI_MEMORY_ERROR;
+	}
+	sorter->ref = ref;
+	sorter->mem_budget = mem_budget;
+	sorter->n_threads = n_threads > 0 ? n_threads : 1;
+	*ret_sorter = sorter;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_sam_sorter_free(rapi_sam_sorter* sorter)
+{
+	if (NULL == sorter)
+		return RAPI_PARAM_ERROR;
+	for (int i = 0; i < sorter->n_runs; ++i)
+		fclose(sorter->runs[i]);
+	free(sorter->arena.s);
+	free(sorter->recs.a);
+	free(sorter->tmp_dir);
+	free(sorter);
+	return RAPI_NO_ERROR;
+}
+
+/******** keys ********/
+
+/*
+ * The key of the SAM record of alignment `i_aln` of `read` (-1 if it has
+ * none).  The coordinates are chosen as rapi_format_sam does.
+ */
+static rapi_error_t _sort_key(const rapi_ref* ref, const rapi_read* read, int i_aln, const rapi_read* mate, uint64_t* key)
+{
+	const rapi_alignment* aln = i_aln >= 0 ? &read->alignments[i_aln] : NULL;
+	const rapi_contig* contig = aln ? aln->contig : NULL;
+	int64_t pos = aln ? aln->pos : 0;
+
+	if ((NULL == aln || !aln->mapped) && mate && mate->n_alignments > 0 && mate->alignments[0].mapped) {
+		contig = mate->alignments[0].contig;
+		pos = mate->alignments[0].pos;
+	}
+
+	if (NULL == contig) {
+		*key = SORT_UNPLACED;
+		return RAPI_NO_ERROR;
+	}
+	const ptrdiff_t idx = contig - ref->contigs;
+	if (idx < 0 || idx >= ref->n_contigs) {
+		PERROR("Alignment to contig %s, which isn't in the sorter's reference\n", contig->name);
+		return RAPI_PARAM_ERROR;
+	}
+	if (pos < 0)
+		pos = 0;
+	if (pos >= (int64_t)1 << SORT_POS_BITS)
+		pos = ((int64_t)1 << SORT_POS_BITS) - 1;
+	*key = (uint64_t)idx << SORT_POS_BITS | (uint64_t)pos;
+	return RAPI_NO_ERROR;
+}
+
+/******** adding batches ********/
+
+typedef struct {
+	const rapi_ref* ref;
+	const rapi_batch* batch;
+	rapi_ssize_t start, end;
+	kstring_t* texts;       // per block:  length-prefixed lines
+	sort_rec_v* recs;       // per block, offsets into the block's text
+	rapi_error_t* errors;
+} sort_add_t;
+
+typedef struct {
+	const rapi_ref* ref;
+	const rapi_batch* batch;
+	rapi_ssize_t frag;
+	kstring_t* text;
+	sort_rec_v* recs;
+} sort_lines_t;
+
+/* rapi_format_sam_lines callback:  append a line to the block's text with its key. */
+static rapi_error_t _sort_line(int n_read, int n_aln, const char* line, size_t len, void* user_data)
+{
+	sort_lines_t* w = user_data;
+	const rapi_read* read = rapi_get_read(w->batch, w->frag, n_read);
+	const rapi_read* mate = w->batch->n_reads_frag == 2 ? rapi_get_read(w->batch, w->frag, 1 - n_read) : NULL;
+	uint64_t key;
+	rapi_error_t error = _sort_key(w->ref, read, n_aln, mate, &key);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	const uint32_t len32 = len;
+	if (_push_rec(w->recs, key, w->text->l) != 0
+	    || kputsn_(&len32, sizeof(len32), w->text) < 0 || kputsn_(line, len, w->text) < 0)
+		return RAPI_MEMORY_ERROR;
+	return RAPI_NO_ERROR;
+}
+
+/* Format a block of fragments and pair each SAM line with its key. */
+static void sort_add_worker(void* data, int block, int tid)
+{
+	sort_add_t* w = (sort_add_t*)data;
+	const rapi_ssize_t first = w->start + (rapi_ssize_t)block * SORT_ADD_BLOCK;
+	const rapi_ssize_t last = first + SORT_ADD_BLOCK < w->end ? first + SORT_ADD_BLOCK : w->end;
+	sort_lines_t lines = { w->ref, w->batch, 0, &w->texts[block], &w->recs[block] };
+	kstring_t sam = { 0, 0, NULL };
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	for (rapi_ssize_t f = first; f < last && error == RAPI_NO_ERROR; ++f) {
+		lines.frag = f;
+		error = rapi_format_sam_lines(w->batch, f, &sam, _sort_line, &lines);
+	}
+	free(sam.s);
+	w->errors[block] = error;
+}
+
+static rapi_error_t _spill(rapi_sam_sorter* sorter);
+
+rapi_error_t rapi_sam_sorter_add_batch(rapi_sam_sorter* sorter, const rapi_batch* batch,
+    rapi_ssize_t start, rapi_ssize_t end)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+
+	if (NULL == sorter || NULL == batch || sorter->finished || start < 0 || end > batch->n_frags || start > end)
+		return RAPI_PARAM_ERROR;
+	if (start == end)
+		return RAPI_NO_ERROR;
+
+	const int n_blocks = (int)((end - start + SORT_ADD_BLOCK - 1) / SORT_ADD_BLOCK);
+	sort_add_t w;
+	w.ref = sorter->ref;
+	w.batch = batch;
+	w.start = start;
+	w.end = end;
+	w.texts = calloc(n_blocks, sizeof(w.texts[0]));
+	w.recs = calloc(n_blocks, sizeof(w.recs[0]));
+	w.errors = calloc(n_blocks, sizeof(w.errors[0]));
+	rapi_error_t error = RAPI_NO_ERROR;
+	if (NULL == w.texts || NULL == w.recs || NULL == w.errors)
+		error = RAPI_MEMORY_ERROR;
+	else {
+		kt_for(sorter->n_threads, sort_add_worker, &w, n_blocks);
+		for (int b = 0; b < n_blocks && error == RAPI_NO_ERROR; ++b)
+			error = w.errors[b];
+	}
+
+	// append the blocks in order, so that equal keys keep their order
+	for (int b = 0; b < n_blocks && error == RAPI_NO_ERROR; ++b) {
+		const uint64_t base = sorter->arena.l;
+		if (kputsn_(w.texts[b].s, w.texts[b].l, &sorter->arena) < 0)
+			error = RAPI_MEMORY_ERROR;
+		for (size_t i = 0; i < w.recs[b].n && error == RAPI_NO_ERROR; ++i) {
+			if (_push_rec(&sorter->recs, w.recs[b].a[i].key, base + w.recs[b].a[i].off) != 0)
+				error = RAPI_MEMORY_ERROR;
+		}
+	}
+
+	for (int b = 0; w.texts && w.recs && b < n_blocks; ++b) {
+		free(w.texts[b].s);
+		free(w.recs[b].a);
+	}
+	free(w.texts);
+	free(w.recs);
+	free(w.errors);
+
+	// sorting needs a second record array
+	if (error == RAPI_NO_ERROR && sorter->arena.l + 2 * sorter->recs.n * sizeof(sort_rec) > sorter->mem_budget)
+		error = _spill(sorter);
+	return error;
+}
+
+/******** sorting ********/
+
+/* LSD radix sort, one byte at a time.  Stable, so equal keys keep their order. */
+static void _radix_sort(sort_rec* recs, sort_rec* tmp, size_t n)
+{
+	sort_rec* src = recs;
+	sort_rec* dst = tmp;
+	for (int shift = 0; shift < 64; shift += 8) {
+		size_t counts[256];
+		memset(counts, 0, sizeof(counts));
+		for (size_t i = 0; i < n; ++i)
+			++counts[(src[i].key >> shift) & 0xff];
+		// skip the bytes that are the same in all keys, like the high bytes of positions
+		if (n == 0 || counts[(src[0].key >> shift) & 0xff] == n)
+			continue;
+		size_t sum = 0;
+		for (int b = 0; b < 256; ++b) {
+			const size_t c = counts[b];
+			counts[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < n; ++i)
+			dst[counts[(src[i].key >> shift) & 0xff]++] = src[i];
+		sort_rec* t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != recs)
+		memcpy(recs, src, n * sizeof(*recs));
+}
+
+typedef struct {
+	sort_rec* recs;
+	sort_rec* tmp;
+	size_t n;
+	int n_slices;
+} sort_slices_t;
+
+static inline size_t _slice_start(const sort_slices_t* w, int i)
+{
+	const size_t q = w->n / w->n_slices, r = w->n % w->n_slices;
+	return q * i + ((size_t)i < r ? (size_t)i : r);
+}
+
+static void sort_slice_worker(void* data, int i, int tid)
+{
+	sort_slices_t* w = (sort_slices_t*)data;
+	const size_t a = _slice_start(w, i), b = _slice_start(w, i + 1);
+	_radix_sort(w->recs + a, w->tmp + a, b - a);
+}
+
+/******** merging ********/
+
+/* A sorted sequence of records:  a slice of the in-memory records or a run file. */
+typedef struct {
+	uint64_t key;
+	const char* line;
+	uint32_t len;
+	// in memory
+	const sort_rec* recs;
+	size_t i, n;
+	const char* arena;
+	// run file
+	FILE* f;
+	kstring_t buf;
+} merge_src;
+
+/* Move to the next record.  Returns 1, 0 at the end or -1 on error. */
+static int _src_next(merge_src* src)
+{
+	if (NULL == src->f) {
+		if (src->i == src->n)
+			return 0;
+		const sort_rec* r = &src->recs[src->i++];
+		src->key = r->key;
+		memcpy(&src->len, src->arena + r->off, sizeof(src->len));
+		src->line = src->arena + r->off + sizeof(src->len);
+		return 1;
+	}
+
+	if (fread(&src->key, sizeof(src->key), 1, src->f) != 1)
+		return ferror(src->f) ? -1 : 0;
+	if (fread(&src->len, sizeof(src->len), 1, src->f) != 1 || ks_resize(&src->buf, src->len + 1) != 0
+	    || fread(src->buf.s, 1, src->len, src->f) != src->len)
+		return -1;
+	src->line = src->buf.s;
+	return 1;
+}
+
+/* Heap order:  by key, then by source so that the earlier records come first. */
+static inline int _src_less(const merge_src* srcs, int a, int b)
+{
+	return srcs[a].key < srcs[b].key || (srcs[a].key == srcs[b].key && a < b);
+}
+
+static void _sift_down(const merge_src* srcs, int* heap, int n, int i)
+{
+	for (;;) {
+		int smallest = i;
+		const int l = 2 * i + 1, r = l + 1;
+		if (l < n && _src_less(srcs, heap[l], heap[smallest])) smallest = l;
+		if (r < n && _src_less(srcs, heap[r], heap[smallest])) smallest = r;
+		if (smallest == i)
+			return;
+		const int t = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = t;
+		i = smallest;
+	}
+}
+
+/*
+ * Merge `srcs` into `out`, as SAM lines or, if `to_run`, as run records
+ * (key, length, line).
+ */
+static rapi_error_t _merge(merge_src* srcs, int n_srcs, FILE* out, int to_run)
+{
+	int* heap = malloc((n_srcs > 0 ? n_srcs : 1) * sizeof(*heap));
+	if (NULL == heap)
+		return RAPI_MEMORY_ERROR;
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	int n = 0;
+	for (int i = 0; i < n_srcs && error == RAPI_NO_ERROR; ++i) {
+		const int r = _src_next(&srcs[i]);
+		if (r < 0)
+			error = RAPI_GENERIC_ERROR;
+		else if (r > 0)
+			heap[n++] = i;
+	}
+	for (int i = n / 2 - 1; i >= 0; --i)
+		_sift_down(srcs, heap, n, i);
+
+	while (n > 0 && error == RAPI_NO_ERROR) {
+		merge_src* top = &srcs[heap[0]];
+		if (to_run) {
+			fwrite(&top->key, sizeof(top->key), 1, out);
+			fwrite(&top->len, sizeof(top->len), 1, out);
+		}
+		fwrite(top->line, 1, top->len, out);
+		if (!to_run)
+			putc('\n', out);
+
+		const int r = _src_next(top);
+		if (r < 0)
+			error = RAPI_GENERIC_ERROR;
+		else if (r == 0)
+			heap[0] = heap[--n];
+		_sift_down(srcs, heap, n, 0);
+	}
+	if (error == RAPI_NO_ERROR && (fflush(out) != 0 || ferror(out)))
+		error = RAPI_GENERIC_ERROR;
+	if (error != RAPI_NO_ERROR)
+		PERROR("Error merging sorted records: %s\n", strerror(errno));
+	free(heap);
+	return error;
+}
+
+/*
+ * Sort the in-memory records in slices, in parallel, and add the slices to
+ * `srcs`.  The caller frees *tmp, the radix sort's buffer.
+ */
+static rapi_error_t _sort_in_memory(rapi_sam_sorter* sorter, merge_src* srcs, int* n_srcs, sort_rec** tmp)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+
+	sort_slices_t w;
+	w.recs = sorter->recs.a;
+	w.n = sorter->recs.n;
+	w.n_slices = w.n / SORT_MIN_SLICE < (size_t)sorter->n_threads ? (int)(w.n / SORT_MIN_SLICE) : sorter->n_threads;
+	if (w.n_slices < 1)
+		w.n_slices = 1;
+	w.tmp = *tmp = malloc((w.n > 0 ? w.n : 1) * sizeof(sort_rec));
+	if (NULL == w.tmp)
+		return RAPI_MEMORY_ERROR;
+	kt_for(w.n_slices, sort_slice_worker, &w, w.n_slices);
+
+	for (int i = 0; i < w.n_slices; ++i) {
+		merge_src* src = &srcs[(*n_srcs)++];
+		memset(src, 0, sizeof(*src));
+		src->recs = w.recs + _slice_start(&w, i);
+		src->n = _slice_start(&w, i + 1) - _slice_start(&w, i);
+		src->arena = sorter->arena.s;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static FILE* _new_run(const rapi_sam_sorter* sorter)
+{
+	kstring_t path = { 0, 0, NULL };
+	ksprintf(&path, "%s/rapi_sort.XXXXXX", sorter->tmp_dir);
+	if (NULL == path.s)
+		return NULL;
+	FILE* f = NULL;
+	const int fd = mkstemp(path.s);
+	if (fd >= 0) {
+		unlink(path.s); // removed as soon as it's closed
+		f = fdopen(fd, "w+b");
+		if (NULL == f)
+			close(fd);
+	}
+	if (NULL == f)
+		PERROR("Couldn't create a temporary file in %s: %s\n", sorter->tmp_dir, strerror(errno));
+	free(path.s);
+	return f;
+}
+
+/* Merge `srcs` into a new run. */
+static rapi_error_t _write_run(const rapi_sam_sorter* sorter, merge_src* srcs, int n_srcs, FILE** ret_run)
+{
+	FILE* run = _new_run(sorter);
+	if (NULL == run)
+		return RAPI_GENERIC_ERROR;
+	rapi_error_t error = _merge(srcs, n_srcs, run, 1);
+	if (error != RAPI_NO_ERROR) {
+		fclose(run);
+		return error;
+	}
+	*ret_run = run;
+	return RAPI_NO_ERROR;
+}
+
+static void _free_srcs(merge_src* srcs, int n_srcs)
+{
+	for (int i = 0; i < n_srcs; ++i)
+		free(srcs[i].buf.s);
+	free(srcs);
+}
+
+/* Merge all the runs into one, to keep the number of open files bounded. */
+static rapi_error_t _compact_runs(rapi_sam_sorter* sorter)
+{
+	merge_src* srcs = calloc(sorter->n_runs, sizeof(*srcs));
+	if (NULL == srcs)
+		return RAPI_MEMORY_ERROR;
+	for (int i = 0; i < sorter->n_runs; ++i) {
+		srcs[i].f = sorter->runs[i];
+		rewind(sorter->runs[i]);
+	}
+	FILE* run = NULL;
+	rapi_error_t error = _write_run(sorter, srcs, sorter->n_runs, &run);
+	_free_srcs(srcs, sorter->n_runs);
+	if (error != RAPI_NO_ERROR)
+		return error;
+
+	for (int i = 0; i < sorter->n_runs; ++i)
+		fclose(sorter->runs[i]);
+	sorter->runs[0] = run;
+	sorter->n_runs = 1;
+	return RAPI_NO_ERROR;
+}
+
+/* Sort the in-memory records and write them to a new run. */
+static rapi_error_t _spill(rapi_sam_sorter* sorter)
+{
+	if (sorter->recs.n == 0)
+		return RAPI_NO_ERROR;
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	if (sorter->n_runs == SORT_MAX_RUNS)
+		error = _compact_runs(sorter);
+	if (error != RAPI_NO_ERROR)
+		return error;
+
+	merge_src* srcs = calloc(sorter->n_threads, sizeof(*srcs));
+	sort_rec* tmp = NULL;
+	int n_srcs = 0;
+	if (NULL == srcs)
+		return RAPI_MEMORY_ERROR;
+	error = _sort_in_memory(sorter, srcs, &n_srcs, &tmp);
+	free(tmp);
+	FILE* run = NULL;
+	if (error == RAPI_NO_ERROR)
+		error = _write_run(sorter, srcs, n_srcs, &run);
+	_free_srcs(srcs, n_srcs);
+
+	if (error == RAPI_NO_ERROR) {
+		sorter->runs[sorter->n_runs++] = run;
+		sorter->arena.l = 0;
+		sorter->recs.n = 0;
+	}
+	return error;
+}
+
+rapi_error_t rapi_sam_sorter_finish(rapi_sam_sorter* sorter, FILE* output)
+{
+	if (NULL == sorter || NULL == output || sorter->finished)
+		return RAPI_PARAM_ERROR;
+	sorter->finished = 1;
+
+	kstring_t header = { 0, 0, NULL };
+	kputs("@HD\tVN:1.4\tSO:coordinate\n", &header);
+	rapi_error_t error = rapi_format_sam_hdr(sorter->ref, &header);
+	if (error == RAPI_NO_ERROR && (NULL == header.s || fprintf(output, "%s\n", header.s) < 0))
+		error = RAPI_GENERIC_ERROR;
+	free(header.s);
+	if (error != RAPI_NO_ERROR)
+		return error;
+
+	merge_src* srcs = calloc(sorter->n_runs + sorter->n_threads, sizeof(*srcs));
+	sort_rec* tmp = NULL;
+	int n_srcs = 0;
+	if (NULL == srcs)
+		return RAPI_MEMORY_ERROR;
+	for (int i = 0; i < sorter->n_runs; ++i) {
+		srcs[n_srcs++].f = sorter->runs[i];
+		rewind(sorter->runs[i]);
+	}
+	error = _sort_in_memory(sorter, srcs, &n_srcs, &tmp);
+	if (error == RAPI_NO_ERROR)
+		error = _merge(srcs, n_srcs, output, 0);
+
+	_free_srcs(srcs, n_srcs);
+	free(tmp);
+	return error;
+}
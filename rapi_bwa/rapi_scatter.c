@@ -0,0 +1,353 @@
+/*
+ * rapi_scatter.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi_scatter.h>
+#include <rapi_utils.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCATTER_MIN_BUFFER 4096
+#define SCATTER_MAX_OPEN   64         // files open at a time
+#define SCATTER_UNMAPPED   "unmapped"
+
+typedef struct {
+	char* name;
+	char* path;
+	char* tmp_path;     // where the stream is written until it's complete
+	FILE* f;            // open while among the SCATTER_MAX_OPEN most recently flushed
+	int created;        // tmp_path has been created, with the header
+	uint64_t last_flush;
+	kstring_t buf;
+	int done;
+} scatter_stream;
+
+struct rapi_scatter {
+	const rapi_ref* ref;
+	int n_streams;      // the last one is for unplaced reads
+	scatter_stream* streams;
+	int* contig_stream;
+	size_t buffer_size;
+	size_t stream_buffer;
+	size_t buffered;    // bytes allocated to the streams' buffers
+	int n_open;
+	uint64_t n_flushes;
+	kstring_t header;
+	kstring_t sam;
+	int closed;
+};
+
+static rapi_error_t _stream_init(scatter_stream* s, const char* prefix, const char* name)
+{
+	s->name = strdup(name);
+	kstring_t path = { 0, 0, NULL };
+	kputs(prefix, &path);
+	const size_t name_start = path.l;
+	kputs(name, &path);
+	// contig names may have slashes, but the name can't add directories
+	for (size_t i = name_start; path.s && i < path.l; ++i) {
+		if (path.s[i] == '/')
+			path.s[i] = '_';
+	}
+	kputs(".sam", &path);
+	s->path = path.s;
+
+	kstring_t tmp_path = { 0, 0, NULL };
+	if (s->path)
+		ksprintf(&tmp_path, "%s.tmp", s->path);
+	s->tmp_path = tmp_path.s;
+	return s->name && s->path && s->tmp_path ? RAPI_NO_ERROR : RAPI_MEMORY_ERROR;
+}
+
+rapi_error_t rapi_scatter_free(rapi_scatter* scatter)
+{
+	if (NULL == scatter)
+		return RAPI_PARAM_ERROR;
+	for (int i = 0; scatter->streams && i < scatter->n_streams; ++i) {
+		scatter_stream* s = &scatter->streams[i];
+		if (s->f)
+			fclose(s->f);
+		if (!s->done && s->created)
+			unlink(s->tmp_path);
+		free(s->name);
+		free(s->path);
+		free(s->tmp_path);
+		free(s->buf.s);
+	}
+	free(scatter->streams);
+	free(scatter->contig_stream);
+	free(scatter->header.s);
+	free(scatter->sam.s);
+	free(scatter);
+	return RAPI_NO_ERROR;
+}
+
+static int _cmp_stream_paths(const void* a, const void* b)
+{
+	return strcmp((*(const scatter_stream* const*)a)->path, (*(const scatter_stream* const*)b)->path);
+}
+
+/* Whether two streams would write the same file, e.g., contigs "a/b" and "a_b". */
+static rapi_error_t _check_paths(const rapi_scatter* scatter)
+{
+	const scatter_stream** sorted = malloc(scatter->n_streams * sizeof(sorted[0]));
+	if (NULL == sorted)
+		return RAPI_MEMORY_ERROR;
+	for (int i = 0; i < scatter->n_streams; ++i)
+		sorted[i] = &scatter->streams[i];
+	qsort(sorted, scatter->n_streams, sizeof(sorted[0]), _cmp_stream_paths);
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (int i = 1; i < scatter->n_streams && error == RAPI_NO_ERROR; ++i) {
+		if (strcmp(sorted[i - 1]->path, sorted[i]->path) == 0) {
+			PERROR("Streams %s and %s would both be written to %s\n", sorted[i - 1]->name, sorted[i]->name, sorted[i]->path);
+			error = RAPI_PARAM_ERROR;
+		}
+	}
+	free(sorted);
+	return error;
+}
+
+rapi_error_t rapi_scatter_init(rapi_scatter** ret_scatter, const rapi_ref* ref, const char* prefix,
+    int n_groups, const int* contig_group, const char* const* group_names, size_t buffer_size)
+{
+	if (NULL == ret_scatter || NULL == ref || NULL == prefix || n_groups < 0
+	    || (n_groups > 0 && (NULL == contig_group || NULL == group_names)))
+		return RAPI_PARAM_ERROR;
+	for (int c = 0; n_groups > 0 && c < ref->n_contigs; ++c) {
+		if (contig_group[c] < 0 || contig_group[c] >= n_groups)
+			return RAPI_PARAM_ERROR;
+	}
+
+	rapi_scatter* scatter = calloc(1, sizeof(*scatter));
+	if (NULL == scatter)
+		return RAPI_MEMORY_ERROR;
+	scatter->ref = ref;
+	scatter->n_streams = (n_groups > 0 ? n_groups : ref->n_contigs) + 1;
+	scatter->streams = calloc(scatter->n_streams, sizeof(scatter->streams[0]));
+	scatter->contig_stream = malloc((ref->n_contigs > 0 ? ref->n_contigs : 1) * sizeof(scatter->contig_stream[0]));
+	scatter->buffer_size = buffer_size;
+	scatter->stream_buffer = buffer_size / scatter->n_streams;
+	if (scatter->stream_buffer < SCATTER_MIN_BUFFER)
+		scatter->stream_buffer = SCATTER_MIN_BUFFER;
+
+	rapi_error_t error = scatter->streams && scatter->contig_stream ? RAPI_NO_ERROR : RAPI_MEMORY_ERROR;
+	for (int i = 0; i < scatter->n_streams - 1 && error == RAPI_NO_ERROR; ++i)
+		error = _stream_init(&scatter->streams[i], prefix, n_groups > 0 ? group_names[i] : ref->contigs[i].name);
+	if (error == RAPI_NO_ERROR)
+		error = _stream_init(&scatter->streams[scatter->n_streams - 1], prefix, SCATTER_UNMAPPED);
+	if (error == RAPI_NO_ERROR)
+		error = _check_paths(scatter);
+	for (int c = 0; error == RAPI_NO_ERROR && c < ref->n_contigs; ++c)
+		scatter->contig_stream[c] = n_groups > 0 ? contig_group[c] : c;
+
+	if (error == RAPI_NO_ERROR) {
+		error = rapi_format_sam_hdr(ref, &scatter->header);
+		if (error == RAPI_NO_ERROR && kputc('\n', &scatter->header) < 0)
+			error = RAPI_MEMORY_ERROR;
+	}
+	if (error != RAPI_NO_ERROR) {
+		rapi_scatter_free(scatter);
+		return error;
+	}
+	*ret_scatter = scatter;
+	return RAPI_NO_ERROR;
+}
+
+/* Close the file of the stream flushed least recently. */
+static rapi_error_t _close_lru(rapi_scatter* scatter)
+{
+	scatter_stream* lru = NULL;
+	for (int i = 0; i < scatter->n_streams; ++i) {
+		scatter_stream* s = &scatter->streams[i];
+		if (s->f && (NULL == lru || s->last_flush < lru->last_flush))
+			lru = s;
+	}
+	if (NULL == lru)
+		return RAPI_NO_ERROR;
+	const int close_error = fclose(lru->f);
+	lru->f = NULL;
+	scatter->n_open -= 1;
+	if (close_error != 0) {
+		PERROR("Couldn't write %s: %s\n", lru->tmp_path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Append the stream's buffer to its file, which is created with the header
+ * on the first flush and reopened if it was closed to make room.
+ */
+static rapi_error_t _flush(rapi_scatter* scatter, scatter_stream* s)
+{
+	if (NULL == s->f) {
+		rapi_error_t error = scatter->n_open < SCATTER_MAX_OPEN ? RAPI_NO_ERROR : _close_lru(scatter);
+		if (error != RAPI_NO_ERROR)
+			return error;
+		s->f = fopen(s->tmp_path, s->created ? "ab" : "wb");
+		if (s->f)
+			scatter->n_open += 1;
+		if (NULL == s->f
+		    || (!s->created && fwrite(scatter->header.s, 1, scatter->header.l, s->f) != scatter->header.l)) {
+			PERROR("Couldn't write %s: %s\n", s->tmp_path, strerror(errno));
+			return RAPI_GENERIC_ERROR;
+		}
+		s->created = 1;
+	}
+	if (s->buf.l > 0 && fwrite(s->buf.s, 1, s->buf.l, s->f) != s->buf.l) {
+		PERROR("Couldn't write %s: %s\n", s->tmp_path, strerror(errno));
+		return RAPI_GENERIC_ERROR;
+	}
+	s->buf.l = 0;
+	s->last_flush = ++scatter->n_flushes;
+	return RAPI_NO_ERROR;
+}
+
+/* Flush and release the largest buffers until they fit in the scatter's buffer_size. */
+static rapi_error_t _shrink_buffers(rapi_scatter* scatter)
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+	while (scatter->buffered > scatter->buffer_size && error == RAPI_NO_ERROR) {
+		scatter_stream* largest = &scatter->streams[0];
+		for (int i = 1; i < scatter->n_streams; ++i) {
+			if (scatter->streams[i].buf.m > largest->buf.m)
+				largest = &scatter->streams[i];
+		}
+		if (largest->buf.m == 0)
+			break;
+		error = _flush(scatter, largest);
+		scatter->buffered -= largest->buf.m;
+		free(largest->buf.s);
+		largest->buf.s = NULL;
+		largest->buf.l = largest->buf.m = 0;
+	}
+	return error;
+}
+
+/* The stream for `read`'s records:  that of its primary alignment's contig or, if unmapped, its mate's. */
+static rapi_error_t _read_stream(const rapi_scatter* scatter, const rapi_read* read, const rapi_read* mate, int* stream)
+{
+	const rapi_contig* contig = NULL;
+	if (read->n_alignments > 0 && read->alignments[0].mapped)
+		contig = read->alignments[0].contig;
+	else if (mate && mate->n_alignments > 0 && mate->alignments[0].mapped)
+		contig = mate->alignments[0].contig;
+
+	if (NULL == contig) {
+		*stream = scatter->n_streams - 1;
+		return RAPI_NO_ERROR;
+	}
+	const ptrdiff_t idx = contig - scatter->ref->contigs;
+	if (idx < 0 || idx >= scatter->ref->n_contigs) {
+		PERROR("Alignment to contig %s, which isn't in the scatter's reference\n", contig->name);
+		return RAPI_PARAM_ERROR;
+	}
+	*stream = scatter->contig_stream[idx];
+	return RAPI_NO_ERROR;
+}
+
+typedef struct {
+	rapi_scatter* scatter;
+	const rapi_batch* batch;
+	rapi_ssize_t frag;
+	scatter_stream* stream; // of the read whose lines are being added
+} scatter_lines_t;
+
+/* rapi_format_sam_lines callback:  buffer a line in its read's stream. */
+static rapi_error_t _scatter_line(int n_read, int n_aln, const char* line, size_t len, void* user_data)
+{
+	scatter_lines_t* w = user_data;
+	rapi_scatter* scatter = w->scatter;
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	if (n_aln <= 0) { // a read's first line
+		const rapi_read* read = rapi_get_read(w->batch, w->frag, n_read);
+		const rapi_read* mate = w->batch->n_reads_frag == 2 ? rapi_get_read(w->batch, w->frag, 1 - n_read) : NULL;
+		int i_stream = scatter->n_streams - 1;
+		error = _read_stream(scatter, read, mate, &i_stream);
+		if (error != RAPI_NO_ERROR)
+			return error;
+		w->stream = &scatter->streams[i_stream];
+	}
+
+	scatter_stream* s = w->stream;
+	const size_t old_m = s->buf.m;
+	if (kputsn(line, len, &s->buf) < 0 || kputc('\n', &s->buf) < 0)
+		return RAPI_MEMORY_ERROR;
+	scatter->buffered += s->buf.m - old_m;
+	if (s->buf.l >= scatter->stream_buffer)
+		error = _flush(scatter, s);
+	if (error == RAPI_NO_ERROR)
+		error = _shrink_buffers(scatter);
+	return error;
+}
+
+rapi_error_t rapi_scatter_add_batch(rapi_scatter* scatter, const rapi_batch* batch,
+    rapi_ssize_t start, rapi_ssize_t end)
+{
+	if (NULL == scatter || NULL == batch || scatter->closed || start < 0 || end > batch->n_frags || start > end)
+		return RAPI_PARAM_ERROR;
+
+	scatter_lines_t w = { scatter, batch, 0, NULL };
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (rapi_ssize_t f = start; f < end && error == RAPI_NO_ERROR; ++f) {
+		w.frag = f;
+		error = rapi_format_sam_lines(batch, f, &scatter->sam, _scatter_line, &w);
+	}
+	return error;
+}
+
+rapi_error_t rapi_scatter_close(rapi_scatter* scatter, rapi_scatter_done_cb done, void* user_data)
+{
+	if (NULL == scatter || scatter->closed)
+		return RAPI_PARAM_ERROR;
+	scatter->closed = 1;
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (int i = 0; i < scatter->n_streams && error == RAPI_NO_ERROR; ++i) {
+		scatter_stream* s = &scatter->streams[i];
+		error = _flush(scatter, s);
+		if (error == RAPI_NO_ERROR) {
+			const int close_error = fclose(s->f);
+			s->f = NULL;
+			scatter->n_open -= 1;
+			if (close_error != 0 || rename(s->tmp_path, s->path) != 0) {
+				PERROR("Couldn't complete %s: %s\n", s->path, strerror(errno));
+				error = RAPI_GENERIC_ERROR;
+			}
+		}
+		if (error == RAPI_NO_ERROR) {
+			s->done = 1;
+			scatter->buffered -= s->buf.m;
+			free(s->buf.s);
+			s->buf.s = NULL;
+			s->buf.l = s->buf.m = 0;
+			if (done)
+				done(s->name, s->path, user_data);
+		}
+	}
+	return error;
+}
@@ -0,0 +1,138 @@
+/*
+ * rapi_sw_batch.c
+ *
+ * Inter-sequence vectorized Smith-Waterman:  each SIMD lane computes the
+ * dynamic programming matrix of a different problem, so all lanes always
+ * work on the same cell (i, j).  This suits sets of small, similarly sized
+ * problems, such as the mate rescue alignments of a chunk of read pairs.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "rapi_sw_batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline int max_int(int a, int b) { return a > b ? a : b; }
+
+int rapi_sw_score1(const rapi_sw_job* job, const int8_t mat[25], int o_del, int e_del, int o_ins, int e_ins)
+{
+	const int oe_del = o_del + e_del, oe_ins = o_ins + e_ins;
+	int* H = calloc(job->qlen + 1, sizeof(int));
+	int* E = calloc(job->qlen + 1, sizeof(int));
+	if (!H || !E) {
+		free(H); free(E);
+		return -1;
+	}
+
+	int gmax = 0;
+	for (int i = 0; i < job->tlen; ++i) {
+		const int8_t* row = mat + job->target[i] * 5;
+		int h_diag = 0, f = 0;
+		for (int j = 0; j < job->qlen; ++j) {
+			int h = h_diag + row[job->query[j]];
+			h = max_int(h, E[j]);
+			h = max_int(h, f);
+			h = max_int(h, 0);
+			gmax = max_int(gmax, h);
+			h_diag = H[j];
+			H[j] = h;
+			E[j] = max_int(h - oe_del, E[j] - e_del); // E(i+1,j)
+			f = max_int(h - oe_ins, f - e_ins);       // F(i,j+1)
+		}
+	}
+	free(H); free(E);
+	return gmax;
+}
+
+static int _sw_scalar(int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores)
+{
+	for (int i = 0; i < n_jobs; ++i) {
+		scores[i] = rapi_sw_score1(&jobs[i], mat, o_del, e_del, o_ins, e_ins);
+		if (scores[i] < 0)
+			return -1;
+	}
+	return 0;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SW_LANES 8
+typedef __m128i sw_vec;
+#define sw_set1(x)     _mm_set1_epi16(x)
+#define sw_adds(a, b)  _mm_adds_epi16(a, b)
+#define sw_subs(a, b)  _mm_subs_epi16(a, b)
+#define sw_max(a, b)   _mm_max_epi16(a, b)
+#define sw_and(a, b)   _mm_and_si128(a, b)
+#define sw_or(a, b)    _mm_or_si128(a, b)
+#define sw_cmpeq(a, b) _mm_cmpeq_epi16(a, b)
+#define sw_loadu(p)    _mm_loadu_si128((const sw_vec*)(p))
+#define sw_storeu(p, v) _mm_storeu_si128((sw_vec*)(p), v)
+#define SW_KERNEL _sw_sse2
+#include "rapi_sw_lanes.h"
+#endif
+
+static int _cpu_has_avx2(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+
+rapi_sw_isa rapi_sw_batch_best_isa(void)
+{
+	if (rapi_sw_avx2_kernel && _cpu_has_avx2())
+		return RAPI_SW_AVX2;
+#if defined(__SSE2__)
+	return RAPI_SW_SSE2;
+#else
+	return RAPI_SW_SCALAR;
+#endif
+}
+
+int rapi_sw_batch_score_isa(rapi_sw_isa isa, int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores)
+{
+	rapi_sw_lanes_fn kernel = NULL;
+	switch (isa) {
+		case RAPI_SW_SCALAR:
+			kernel = _sw_scalar;
+			break;
+		case RAPI_SW_SSE2:
+#if defined(__SSE2__)
+			kernel = _sw_sse2;
+#endif
+			break;
+		case RAPI_SW_AVX2:
+			if (_cpu_has_avx2())
+				kernel = rapi_sw_avx2_kernel;
+			break;
+	}
+	if (NULL == kernel)
+		return -2;
+	return kernel(n_jobs, jobs, mat, o_del, e_del, o_ins, e_ins, scores);
+}
+
+int rapi_sw_batch_score(int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores)
+{
+	return rapi_sw_batch_score_isa(rapi_sw_batch_best_isa(), n_jobs, jobs, mat, o_del, e_del, o_ins, e_ins, scores);
+}
@@ -0,0 +1,92 @@
+/*
+ * rapi_sw_batch.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_SW_BATCH_H__
+#define __RAPI_SW_BATCH_H__
+
+#include <stdint.h>
+
+/**
+ * A local alignment problem.  Sequences are encoded as base codes in [0,4]
+ * (A, C, G, T, N), like BWA does internally.
+ */
+typedef struct {
+	int qlen;
+	const uint8_t* query;
+	int tlen;
+	const uint8_t* target;
+} rapi_sw_job;
+
+/**
+ * Best local alignment score for a single problem.
+ *
+ * \param mat 5x5 scoring matrix, indexed by target_base * 5 + query_base.
+ * \param o_del, e_del Deletion (gap in the query) open and extension penalties.
+ * \param o_ins, e_ins Insertion (gap in the target) open and extension penalties.
+ *
+ * A gap of length k costs o + k * e, as in ksw.
+ */
+int rapi_sw_score1(const rapi_sw_job* job, const int8_t mat[25], int o_del, int e_del, int o_ins, int e_ins);
+
+/** Instruction sets of the batched kernel. */
+typedef enum {
+	RAPI_SW_SCALAR = 0, // rapi_sw_score1 on each problem
+	RAPI_SW_SSE2   = 1, // 8 problems at a time
+	RAPI_SW_AVX2   = 2  // 16 problems at a time
+} rapi_sw_isa;
+
+/**
+ * The widest instruction set that both this build and the CPU we're running
+ * on support.  The AVX2 kernel is in its own object file
+ * (rapi_sw_batch_avx2.c), the only one compiled with the Makefile's
+ * SIMD_FLAGS, so the rest of the library runs on any x86-64 CPU.
+ */
+rapi_sw_isa rapi_sw_batch_best_isa(void);
+
+/**
+ * Compute the best local alignment score for each of the `n_jobs` problems
+ * and write it to `scores[i]`, with the kernel for `isa`.
+ *
+ * The SIMD kernels process several problems at a time, one per 16-bit
+ * lane.  Problems whose scores could overflow 16 bits use rapi_sw_score1.
+ * Results are the same with all the kernels.
+ *
+ * \return 0 on success; -1 if memory allocation fails; -2 if `isa` isn't
+ *         supported by the build or the CPU.
+ */
+int rapi_sw_batch_score_isa(rapi_sw_isa isa, int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores);
+
+/**
+ * rapi_sw_batch_score_isa with rapi_sw_batch_best_isa().
+ *
+ * \return 0 on success; -1 if memory allocation fails.
+ */
+int rapi_sw_batch_score(int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores);
+
+/* Signature of the SIMD kernels, which return 0 on success and -1 if memory allocation fails. */
+typedef int (*rapi_sw_lanes_fn)(int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores);
+
+/* Defined in rapi_sw_batch_avx2.c;  NULL if it wasn't compiled for AVX2. */
+extern const rapi_sw_lanes_fn rapi_sw_avx2_kernel;
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * rapi_sw_batch_avx2.c
+ *
+ * AVX2 build of the batched Smith-Waterman kernel in rapi_sw_lanes.h.  This
+ * is the only file compiled with the Makefile's SIMD_FLAGS (-mavx2 by
+ * default), and rapi_sw_batch.c only calls into it after checking that the
+ * CPU supports AVX2.  Without AVX2 support in the build the kernel is left
+ * out.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "rapi_sw_batch.h"
+
+#include <stddef.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SW_LANES 16
+typedef __m256i sw_vec;
+#define sw_set1(x)     _mm256_set1_epi16(x)
+#define sw_adds(a, b)  _mm256_adds_epi16(a, b)
+#define sw_subs(a, b)  _mm256_subs_epi16(a, b)
+#define sw_max(a, b)   _mm256_max_epi16(a, b)
+#define sw_and(a, b)   _mm256_and_si256(a, b)
+#define sw_or(a, b)    _mm256_or_si256(a, b)
+#define sw_cmpeq(a, b) _mm256_cmpeq_epi16(a, b)
+#define sw_loadu(p)    _mm256_loadu_si256((const sw_vec*)(p))
+#define sw_storeu(p, v) _mm256_storeu_si256((sw_vec*)(p), v)
+#define SW_KERNEL _sw_avx2
+#include "rapi_sw_lanes.h"
+
+const rapi_sw_lanes_fn rapi_sw_avx2_kernel = _sw_avx2;
+#else
+const rapi_sw_lanes_fn rapi_sw_avx2_kernel = NULL;
+#endif
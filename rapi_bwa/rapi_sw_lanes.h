@@ -0,0 +1,213 @@
+/*
+ * rapi_sw_lanes.h
+ *
+ * Body of the inter-sequence SIMD Smith-Waterman kernel, included once per
+ * instruction set by rapi_sw_batch.c (SSE2) and rapi_sw_batch_avx2.c (AVX2).
+ * The including file defines:
+ *
+ *   SW_LANES         number of 16-bit lanes in a vector
+ *   sw_vec           the vector type
+ *   sw_set1, sw_adds, sw_subs, sw_max, sw_and, sw_or, sw_cmpeq, sw_loadu,
+ *   sw_storeu        the 16-bit vector operations
+ *   SW_KERNEL        name of the rapi_sw_lanes_fn to define
+ *
+ * and SW_KERNEL is defined as a static function:  the file exports it
+ * through a pointer.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "rapi_sw_batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Base code used to pad sequences shorter than the longest one in a lane group.
+#define SW_PAD_BASE    5
+#define SW_N_CODES     6
+// Substitution score against padding.  Low enough to keep any path through
+// padded cells from scoring above the real cells, high enough not to
+// overflow when added to a 16-bit score.
+#define SW_PAD_SCORE   (-0x4000)
+// Scores above this are computed with the scalar kernel.
+#define SW_MAX_SCORE_16 30000
+
+static inline int sw_max_int(int a, int b) { return a > b ? a : b; }
+
+typedef struct {
+	int tlen, qlen;
+	int index;
+} sw_job_key;
+
+static int _cmp_job_keys(const void* a, const void* b)
+{
+	const sw_job_key* ka = a;
+	const sw_job_key* kb = b;
+	if (ka->tlen != kb->tlen) return ka->tlen < kb->tlen ? -1 : 1;
+	if (ka->qlen != kb->qlen) return ka->qlen < kb->qlen ? -1 : 1;
+	return ka->index - kb->index;
+}
+
+static int _max_match_score(const int8_t mat[25])
+{
+	int m = 0;
+	for (int i = 0; i < 25; ++i)
+		m = sw_max_int(m, mat[i]);
+	return m;
+}
+
+typedef struct {
+	sw_vec* P; // profile: for each query position, SW_N_CODES vectors of scores (one per target base)
+	sw_vec* H;
+	sw_vec* E;
+	int capacity; // query positions allocated
+} sw_buffers;
+
+static int _reserve_buffers(sw_buffers* buf, int qlen)
+{
+	if (qlen <= buf->capacity)
+		return 0;
+	_mm_free(buf->P); _mm_free(buf->H); _mm_free(buf->E);
+	buf->P = _mm_malloc((size_t)qlen * SW_N_CODES * sizeof(sw_vec), sizeof(sw_vec));
+	buf->H = _mm_malloc((size_t)qlen * sizeof(sw_vec), sizeof(sw_vec));
+	buf->E = _mm_malloc((size_t)qlen * sizeof(sw_vec), sizeof(sw_vec));
+	if (!buf->P || !buf->H || !buf->E) {
+		_mm_free(buf->P); _mm_free(buf->H); _mm_free(buf->E);
+		memset(buf, 0, sizeof(*buf));
+		return -1;
+	}
+	buf->capacity = qlen;
+	return 0;
+}
+
+/*
+ * Align the `n` (<= SW_LANES) problems in `group` simultaneously.  Lanes
+ * beyond `n`, and positions beyond each problem's own query and target
+ * length, are filled with SW_PAD_BASE.
+ */
+static void _sw_lanes(const rapi_sw_job* group[], int n, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, sw_buffers* buf, int* scores)
+{
+	int16_t lanes[SW_LANES] __attribute__((aligned(32)));
+	int qmax = 0, tmax = 0;
+	for (int k = 0; k < n; ++k) {
+		qmax = sw_max_int(qmax, group[k]->qlen);
+		tmax = sw_max_int(tmax, group[k]->tlen);
+	}
+
+	// query profile:  P[j * SW_N_CODES + c] holds, in lane k, the score of
+	// target base c against base j of query k
+	for (int j = 0; j < qmax; ++j) {
+		for (int c = 0; c < SW_N_CODES; ++c) {
+			for (int k = 0; k < SW_LANES; ++k) {
+				if (k >= n || j >= group[k]->qlen || c == SW_PAD_BASE)
+					lanes[k] = SW_PAD_SCORE;
+				else
+					lanes[k] = mat[c * 5 + group[k]->query[j]];
+			}
+			buf->P[j * SW_N_CODES + c] = sw_loadu(lanes);
+		}
+		buf->H[j] = buf->E[j] = sw_set1(0);
+	}
+
+	const sw_vec zero = sw_set1(0);
+	const sw_vec oe_del = sw_set1(o_del + e_del), v_e_del = sw_set1(e_del);
+	const sw_vec oe_ins = sw_set1(o_ins + e_ins), v_e_ins = sw_set1(e_ins);
+	sw_vec gmax = zero;
+
+	for (int i = 0; i < tmax; ++i) {
+		sw_vec masks[SW_N_CODES];
+		for (int k = 0; k < SW_LANES; ++k)
+			lanes[k] = (k < n && i < group[k]->tlen) ? group[k]->target[i] : SW_PAD_BASE;
+		const sw_vec tv = sw_loadu(lanes);
+		for (int c = 0; c < SW_N_CODES; ++c)
+			masks[c] = sw_cmpeq(tv, sw_set1(c));
+
+		sw_vec h_diag = zero, f = zero;
+		const sw_vec* P = buf->P;
+		for (int j = 0; j < qmax; ++j, P += SW_N_CODES) {
+			sw_vec s = sw_and(masks[0], P[0]);
+			for (int c = 1; c < SW_N_CODES; ++c)
+				s = sw_or(s, sw_and(masks[c], P[c]));
+
+			sw_vec e = buf->E[j];
+			sw_vec h = sw_adds(h_diag, s);
+			h = sw_max(h, e);
+			h = sw_max(h, f);
+			h = sw_max(h, zero);
+			gmax = sw_max(gmax, h);
+			h_diag = buf->H[j];
+			buf->H[j] = h;
+			buf->E[j] = sw_max(sw_subs(h, oe_del), sw_subs(e, v_e_del)); // E(i+1,j)
+			f = sw_max(sw_subs(h, oe_ins), sw_subs(f, v_e_ins));         // F(i,j+1)
+		}
+	}
+
+	sw_storeu(lanes, gmax);
+	for (int k = 0; k < n; ++k)
+		scores[k] = lanes[k];
+}
+
+static int SW_KERNEL(int n_jobs, const rapi_sw_job* jobs, const int8_t mat[25],
+		int o_del, int e_del, int o_ins, int e_ins, int* scores)
+{
+	if (n_jobs <= 0)
+		return 0;
+
+	// Sort the problems by size so that each lane group has little padding.
+	sw_job_key* keys = malloc(n_jobs * sizeof(keys[0]));
+	if (!keys)
+		return -1;
+	for (int i = 0; i < n_jobs; ++i) {
+		keys[i].tlen = jobs[i].tlen;
+		keys[i].qlen = jobs[i].qlen;
+		keys[i].index = i;
+	}
+	qsort(keys, n_jobs, sizeof(keys[0]), _cmp_job_keys);
+
+	const int max_match = _max_match_score(mat);
+	sw_buffers buf = { NULL, NULL, NULL, 0 };
+	int error = 0;
+
+	for (int g = 0; g < n_jobs && !error; g += SW_LANES) {
+		const rapi_sw_job* group[SW_LANES];
+		int group_scores[SW_LANES];
+		int n = n_jobs - g < SW_LANES ? n_jobs - g : SW_LANES;
+		int qmax = 0;
+
+		for (int k = 0; k < n; ++k) {
+			group[k] = &jobs[keys[g + k].index];
+			qmax = sw_max_int(qmax, group[k]->qlen);
+		}
+
+		if ((long)qmax * max_match > SW_MAX_SCORE_16 || _reserve_buffers(&buf, qmax) != 0) {
+			for (int k = 0; k < n && !error; ++k) {
+				group_scores[k] = rapi_sw_score1(group[k], mat, o_del, e_del, o_ins, e_ins);
+				error = group_scores[k] < 0;
+			}
+		}
+		else
+			_sw_lanes(group, n, mat, o_del, e_del, o_ins, e_ins, &buf, group_scores);
+
+		for (int k = 0; k < n; ++k)
+			scores[keys[g + k].index] = group_scores[k];
+	}
+
+	_mm_free(buf.P); _mm_free(buf.H); _mm_free(buf.E);
+	free(keys);
+	return error ? -1 : 0;
+}
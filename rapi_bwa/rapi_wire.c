@@ -0,0 +1,394 @@
+/*
+ * rapi_wire.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "rapi_wire.h"
+#include "rapi_aln_cache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WIRE_NULL_STR 0xFFFFFFFFu
+
+/******** transport ********/
+
+static rapi_error_t _send_all(int fd, const void* buf, size_t n)
+{
+	const char* p = buf;
+	while (n > 0) {
+		ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return RAPI_GENERIC_ERROR;
+		}
+		p += w;
+		n -= w;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t _recv_all(int fd, void* buf, size_t n)
+{
+	char* p = buf;
+	while (n > 0) {
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) // error or closed connection
+			return RAPI_GENERIC_ERROR;
+		p += r;
+		n -= r;
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_wire_send(int fd, int type, int flags, const kstring_t* payload)
+{
+	rapi_wire_hdr hdr;
+	hdr.magic = RAPI_WIRE_MAGIC;
+	hdr.type = type;
+	hdr.flags = flags;
+	hdr.length = payload ? payload->l : 0;
+
+	rapi_error_t error = _send_all(fd, &hdr, sizeof(hdr));
+	if (error == RAPI_NO_ERROR && hdr.length > 0)
+		error = _send_all(fd, payload->s, payload->l);
+	return error;
+}
+
+rapi_error_t rapi_wire_recv(int fd, rapi_wire_hdr* hdr, kstring_t* payload)
+{
+	if (_recv_all(fd, hdr, sizeof(*hdr)) != RAPI_NO_ERROR)
+		return RAPI_GENERIC_ERROR;
+	if (hdr->magic != RAPI_WIRE_MAGIC || hdr->length > RAPI_WIRE_MAX_PAYLOAD)
+		return RAPI_GENERIC_ERROR;
+
+	payload->l = 0;
+	if (ks_resize(payload, hdr->length + 1) != 0)
+		return RAPI_MEMORY_ERROR;
+	if (_recv_all(fd, payload->s, hdr->length) != RAPI_NO_ERROR)
+		return RAPI_GENERIC_ERROR;
+	payload->l = hdr->length;
+	return RAPI_NO_ERROR;
+}
+
+/******** scalars and strings ********/
+
+void rapi_wire_put_u32(kstring_t* out, uint32_t v) { kputsn_(&v, sizeof(v), out); }
+void rapi_wire_put_i64(kstring_t* out, int64_t v)  { kputsn_(&v, sizeof(v), out); }
+
+void rapi_wire_put_str(kstring_t* out, const char* s)
+{
+	if (NULL == s) {
+		rapi_wire_put_u32(out, WIRE_NULL_STR);
+		return;
+	}
+	uint32_t len = strlen(s);
+	rapi_wire_put_u32(out, len);
+	kputsn_(s, len, out);
+}
+
+static rapi_error_t _get_bytes(rapi_wire_cursor* in, void* v, size_t n)
+{
+	if ((size_t)(in->end - in->p) < n)
+		return RAPI_PARAM_ERROR;
+	memcpy(v, in->p, n);
+	in->p += n;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_wire_get_u32(rapi_wire_cursor* in, uint32_t* v) { return _get_bytes(in, v, sizeof(*v)); }
+rapi_error_t rapi_wire_get_i64(rapi_wire_cursor* in, int64_t* v)  { return _get_bytes(in, v, sizeof(*v)); }
+
+rapi_error_t rapi_wire_get_str(rapi_wire_cursor* in, const char** s, uint32_t* len)
+{
+	rapi_error_t error = rapi_wire_get_u32(in, len);
+	if (error) return error;
+	if (*len == WIRE_NULL_STR) {
+		*s = NULL;
+		*len = 0;
+		return RAPI_NO_ERROR;
+	}
+	if ((size_t)(in->end - in->p) < *len)
+		return RAPI_PARAM_ERROR;
+	*s = in->p;
+	in->p += *len;
+	return RAPI_NO_ERROR;
+}
+
+static char* _strndup(const char* s, size_t len)
+{
+	char* copy = malloc(len + 1);
+	if (copy) {
+		memcpy(copy, s, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+/******** references ********/
+
+void rapi_wire_put_contigs(kstring_t* out, const rapi_ref* ref)
+{
+	rapi_wire_put_u32(out, ref->n_contigs);
+	for (int c = 0; c < ref->n_contigs; ++c) {
+		rapi_wire_put_str(out, ref->contigs[c].name);
+		rapi_wire_put_i64(out, ref->contigs[c].len);
+	}
+}
+
+rapi_error_t rapi_wire_get_contigs(rapi_wire_cursor* in, rapi_ref* ref)
+{
+	uint32_t n_contigs;
+	rapi_error_t error = rapi_wire_get_u32(in, &n_contigs);
+	if (error) return error;
+
+	ref->contigs = calloc(n_contigs > 0 ? n_contigs : 1, sizeof(rapi_contig));
+	if (NULL == ref->contigs)
+		return RAPI_MEMORY_ERROR;
+	ref->n_contigs = n_contigs;
+
+	for (uint32_t c = 0; c < n_contigs; ++c) {
+		const char* name;
+		uint32_t len;
+		int64_t contig_len;
+		if ((error = rapi_wire_get_str(in, &name, &len)) || (error = rapi_wire_get_i64(in, &contig_len)))
+			return error;
+		ref->contigs[c].name = _strndup(name ? name : "", len);
+		if (NULL == ref->contigs[c].name)
+			return RAPI_MEMORY_ERROR;
+		ref->contigs[c].len = contig_len;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/******** reads ********/
+
+void rapi_wire_put_reads(kstring_t* out, const rapi_batch* batch, rapi_ssize_t start_frag, rapi_ssize_t end_frag)
+{
+	for (rapi_ssize_t f = start_frag; f < end_frag; ++f) {
+		for (int r = 0; r < batch->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(batch, f, r);
+			rapi_wire_put_str(out, read->id);
+			rapi_wire_put_str(out, read->seq);
+			rapi_wire_put_str(out, read->qual);
+		}
+	}
+}
+
+rapi_error_t rapi_wire_get_reads(rapi_wire_cursor* in, rapi_batch* batch, rapi_ssize_t n_frags)
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+	kstring_t buf = { 0, 0, NULL };
+
+	for (rapi_ssize_t f = 0; f < n_frags && !error; ++f) {
+		for (int r = 0; r < batch->n_reads_frag && !error; ++r) {
+			const char *id, *seq, *qual;
+			uint32_t id_len, seq_len, qual_len;
+			if ((error = rapi_wire_get_str(in, &id, &id_len))
+			    || (error = rapi_wire_get_str(in, &seq, &seq_len))
+			    || (error = rapi_wire_get_str(in, &qual, &qual_len)))
+				break;
+			// rapi_set_read wants NUL-terminated strings
+			buf.l = 0;
+			kputsn(id ? id : "", id_len, &buf);     kputc('\0', &buf);
+			const size_t seq_off = buf.l;
+			kputsn(seq ? seq : "", seq_len, &buf);  kputc('\0', &buf);
+			const size_t qual_off = buf.l;
+			kputsn(qual ? qual : "", qual_len, &buf);
+			if (NULL == buf.s)
+				error = RAPI_MEMORY_ERROR;
+			else // qualities travel as stored, i.e., Sanger-encoded
+				error = rapi_set_read(batch, f, r, buf.s, buf.s + seq_off, qual ? buf.s + qual_off : NULL, 33);
+		}
+	}
+	free(buf.s);
+	return error;
+}
+
+/******** alignments ********/
+
+void rapi_wire_put_alignments(kstring_t* out, const rapi_ref* ref, const rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag)
+{
+	for (rapi_ssize_t f = start_frag; f < end_frag; ++f) {
+		for (int r = 0; r < batch->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(batch, f, r);
+			rapi_wire_put_u32(out, read->n_alignments);
+			for (int a = 0; a < read->n_alignments; ++a) {
+				const rapi_alignment* aln = &read->alignments[a];
+				rapi_wire_put_u32(out, aln->contig ? (uint32_t)(aln->contig - ref->contigs) : WIRE_NULL_STR);
+				rapi_wire_put_i64(out, aln->pos);
+				rapi_wire_put_u32(out, aln->score);
+				rapi_wire_put_u32(out, aln->mapq
+				    | aln->paired << 8 | aln->prop_paired << 9 | aln->mapped << 10
+				    | aln->reverse_strand << 11 | aln->secondary_aln << 12 | aln->duplicate << 13);
+				rapi_wire_put_u32(out, aln->n_mismatches | aln->n_gap_opens << 8
+				    | aln->n_gap_extensions << 16 | (uint32_t)aln->n_cigar_ops << 24);
+				for (int c = 0; c < aln->n_cigar_ops; ++c)
+					rapi_wire_put_u32(out, aln->cigar_ops[c].op | aln->cigar_ops[c].len << 4);
+
+				rapi_wire_put_u32(out, kv_size(aln->tags));
+				for (size_t t = 0; t < kv_size(aln->tags); ++t) {
+					const rapi_tag* tag = &kv_A(aln->tags, t);
+					rapi_wire_put_str(out, tag->key);
+					rapi_wire_put_u32(out, tag->type);
+					switch (tag->type) {
+					case RAPI_VTYPE_CHAR: rapi_wire_put_u32(out, (unsigned char)tag->value.character); break;
+					case RAPI_VTYPE_INT:  rapi_wire_put_i64(out, tag->value.integer); break;
+					case RAPI_VTYPE_REAL: kputsn_(&tag->value.real, sizeof(tag->value.real), out); break;
+					case RAPI_VTYPE_TEXT: rapi_wire_put_str(out, tag->value.text.s ? tag->value.text.s : ""); break;
+					}
+				}
+			}
+		}
+	}
+}
+
+static rapi_error_t _get_tag(rapi_wire_cursor* in, rapi_tag* tag)
+{
+	const char* key;
+	uint32_t key_len, type, u;
+	int64_t i;
+	rapi_error_t error;
+
+	if ((error = rapi_wire_get_str(in, &key, &key_len)) || (error = rapi_wire_get_u32(in, &type)))
+		return error;
+	if (key_len > RAPI_MAX_TAG_LEN)
+		return RAPI_PARAM_ERROR;
+	memset(tag, 0, sizeof(*tag));
+	memcpy(tag->key, key, key_len);
+
+	switch (type) {
+	case RAPI_VTYPE_CHAR:
+		if ((error = rapi_wire_get_u32(in, &u))) return error;
+		rapi_tag_set_char(tag, (char)u);
+		break;
+	case RAPI_VTYPE_INT:
+		if ((error = rapi_wire_get_i64(in, &i))) return error;
+		rapi_tag_set_long(tag, i);
+		break;
+	case RAPI_VTYPE_REAL: {
+		double d;
+		if ((error = _get_bytes(in, &d, sizeof(d)))) return error;
+		rapi_tag_set_dbl(tag, d);
+		break;
+	}
+	case RAPI_VTYPE_TEXT: {
+		const char* s;
+		uint32_t len;
+		if ((error = rapi_wire_get_str(in, &s, &len))) return error;
+		tag->type = RAPI_VTYPE_TEXT;
+		rapi_kstr_init(&tag->value.text);
+		kputsn(s ? s : "", len, &tag->value.text);
+		break;
+	}
+	default:
+		return RAPI_PARAM_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t _get_alignment(rapi_wire_cursor* in, const rapi_ref* ref, rapi_alignment* aln)
+{
+	uint32_t contig, score, w0, w1, n_tags;
+	int64_t pos;
+	rapi_error_t error;
+
+	if ((error = rapi_wire_get_u32(in, &contig)) || (error = rapi_wire_get_i64(in, &pos))
+	    || (error = rapi_wire_get_u32(in, &score)) || (error = rapi_wire_get_u32(in, &w0))
+	    || (error = rapi_wire_get_u32(in, &w1)))
+		return error;
+	if (contig != WIRE_NULL_STR && contig >= (uint32_t)ref->n_contigs)
+		return RAPI_PARAM_ERROR;
+
+	aln->contig = contig == WIRE_NULL_STR ? NULL : &ref->contigs[contig];
+	aln->pos = pos;
+	aln->score = (int)score;
+	aln->mapq = w0 & 0xff;
+	aln->paired = (w0 >> 8) & 1;
+	aln->prop_paired = (w0 >> 9) & 1;
+	aln->mapped = (w0 >> 10) & 1;
+	aln->reverse_strand = (w0 >> 11) & 1;
+	aln->secondary_aln = (w0 >> 12) & 1;
+	aln->duplicate = (w0 >> 13) & 1;
+	aln->n_mismatches = w1 & 0xff;
+	aln->n_gap_opens = (w1 >> 8) & 0xff;
+	aln->n_gap_extensions = (w1 >> 16) & 0xff;
+	aln->n_cigar_ops = (w1 >> 24) & 0xff;
+
+	if (aln->n_cigar_ops > 0) {
+		aln->cigar_ops = malloc(aln->n_cigar_ops * sizeof(aln->cigar_ops[0]));
+		if (NULL == aln->cigar_ops)
+			return RAPI_MEMORY_ERROR;
+		for (int c = 0; c < aln->n_cigar_ops; ++c) {
+			uint32_t v;
+			if ((error = rapi_wire_get_u32(in, &v))) return error;
+			aln->cigar_ops[c].op = v & 0xf;
+			aln->cigar_ops[c].len = v >> 4;
+		}
+	}
+
+	if ((error = rapi_wire_get_u32(in, &n_tags)))
+		return error;
+	for (uint32_t t = 0; t < n_tags; ++t) {
+		rapi_tag* tag = kv_pushp(rapi_tag, aln->tags);
+		if (NULL == tag)
+			return RAPI_MEMORY_ERROR;
+		if ((error = _get_tag(in, tag))) {
+			aln->tags.n -= 1;
+			return error;
+		}
+	}
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_wire_get_alignments(rapi_wire_cursor* in, const rapi_ref* ref, rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag)
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	for (rapi_ssize_t f = start_frag; f < end_frag && !error; ++f) {
+		for (int r = 0; r < batch->n_reads_frag && !error; ++r) {
+			rapi_read* read = rapi_get_read(batch, f, r);
+			uint32_t n_alignments;
+			rapi_read_free_alignments(read);
+			if ((error = rapi_wire_get_u32(in, &n_alignments)) || n_alignments == 0)
+				continue;
+			if (n_alignments > UINT8_MAX) {
+				error = RAPI_PARAM_ERROR;
+				continue;
+			}
+			read->alignments = calloc(n_alignments, sizeof(rapi_alignment));
+			if (NULL == read->alignments) {
+				error = RAPI_MEMORY_ERROR;
+				continue;
+			}
+			read->n_alignments = n_alignments;
+			for (uint32_t a = 0; a < n_alignments && !error; ++a)
+				error = _get_alignment(in, ref, &read->alignments[a]);
+		}
+	}
+	return error;
+}
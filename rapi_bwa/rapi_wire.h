@@ -0,0 +1,111 @@
+/*
+ * rapi_wire.h - binary framing for the alignment daemon protocol
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __RAPI_WIRE_H__
+#define __RAPI_WIRE_H__
+
+#include <rapi.h>
+
+/*
+ * Every message is a rapi_wire_hdr followed by `length` bytes of payload.
+ * The daemon only listens on a Unix domain socket, so integers are sent in
+ * the host's byte order.  Strings are a uint32 length and the bytes,
+ * without the terminating NUL.
+ *
+ *   REF_LOAD    client -> daemon   path
+ *   REF_INFO    daemon -> client   uint32 ref id, uint32 n_contigs,
+ *                                  n_contigs x (name, int64 len)
+ *   ALIGN       client -> daemon   uint32 ref id, uint32 n_reads_frag,
+ *                                  int64 n_frags, reads (see rapi_wire_put_reads)
+ *   ALIGNMENTS  daemon -> client   alignments (see rapi_wire_put_alignments)
+ *   SAM         daemon -> client   SAM text (if ALIGN had RAPI_WIRE_F_SAM)
+ *   ERROR       daemon -> client   int32 rapi_error_t
+ */
+
+#define RAPI_WIRE_MAGIC       0x49504152 // "RAPI"
+#define RAPI_WIRE_MAX_PAYLOAD (1u << 31)
+
+enum rapi_wire_msg {
+	RAPI_MSG_REF_LOAD = 1,
+	RAPI_MSG_REF_INFO,
+	RAPI_MSG_ALIGN,
+	RAPI_MSG_ALIGNMENTS,
+	RAPI_MSG_SAM,
+	RAPI_MSG_ERROR
+};
+
+// ALIGN flags
+#define RAPI_WIRE_F_SAM 0x1 // reply with SAM instead of alignments
+
+typedef struct {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t flags;
+	uint32_t length;
+} rapi_wire_hdr;
+
+/** Read cursor over a received payload. */
+typedef struct {
+	const char* p;
+	const char* end;
+} rapi_wire_cursor;
+
+rapi_error_t rapi_wire_send(int fd, int type, int flags, const kstring_t* payload);
+
+/**
+ * Receive a message.  `payload` is overwritten with its payload.
+ *
+ * \return RAPI_NO_ERROR; RAPI_GENERIC_ERROR if the peer closed the
+ *         connection or sent a malformed header.
+ */
+rapi_error_t rapi_wire_recv(int fd, rapi_wire_hdr* hdr, kstring_t* payload);
+
+/* Payload encoding.  The get functions return RAPI_PARAM_ERROR if the
+ * payload is truncated. */
+
+void rapi_wire_put_u32(kstring_t* out, uint32_t v);
+void rapi_wire_put_i64(kstring_t* out, int64_t v);
+void rapi_wire_put_str(kstring_t* out, const char* s);
+
+rapi_error_t rapi_wire_get_u32(rapi_wire_cursor* in, uint32_t* v);
+rapi_error_t rapi_wire_get_i64(rapi_wire_cursor* in, int64_t* v);
+/** Point `s` into the payload; the string is *not* NUL-terminated. */
+rapi_error_t rapi_wire_get_str(rapi_wire_cursor* in, const char** s, uint32_t* len);
+
+/** Contig names and lengths of `ref`. */
+void rapi_wire_put_contigs(kstring_t* out, const rapi_ref* ref);
+/** Fill `ref` with the contigs written by rapi_wire_put_contigs. */
+rapi_error_t rapi_wire_get_contigs(rapi_wire_cursor* in, rapi_ref* ref);
+
+/** Ids, sequences and qualities of the reads of fragments [start_frag, end_frag). */
+void rapi_wire_put_reads(kstring_t* out, const rapi_batch* batch, rapi_ssize_t start_frag, rapi_ssize_t end_frag);
+/** Set reads [0, n_frags) of `batch`, which must have room for them. */
+rapi_error_t rapi_wire_get_reads(rapi_wire_cursor* in, rapi_batch* batch, rapi_ssize_t n_frags);
+
+/** Alignments of the reads of fragments [start_frag, end_frag).  Contigs
+ * are sent as indices into `ref`. */
+void rapi_wire_put_alignments(kstring_t* out, const rapi_ref* ref, const rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag);
+/** Set the alignments of the reads of fragments [start_frag, end_frag),
+ * replacing any they had. */
+rapi_error_t rapi_wire_get_alignments(rapi_wire_cursor* in, const rapi_ref* ref, rapi_batch* batch,
+		rapi_ssize_t start_frag, rapi_ssize_t end_frag);
+
+#endif
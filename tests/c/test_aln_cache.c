@@ -0,0 +1,207 @@
+/*
+ * test_aln_cache.c
+ *
+ * The cross-batch alignment result cache (result_cache_size).
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+#include "rapi_aln_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FRAGS 300
+#define FINGERPRINT 31
+
+/* A reference with `n` contigs and no index:  enough for the cache. */
+static void _fake_ref(rapi_ref* ref, int n)
+{
+	memset(ref, 0, sizeof(*ref));
+	ref->n_contigs = n;
+	ref->contigs = calloc(n, sizeof(ref->contigs[0]));
+	if (NULL == ref->contigs)
+		exit(2);
+}
+
+/* A single-end fragment with one alignment to `contig`. */
+static void _fragment(rapi_batch* batch, const char* seq, rapi_contig* contig)
+{
+	if (rapi_reads_alloc(batch, 1, 1) != RAPI_NO_ERROR
+	    || rapi_set_read(batch, 0, 0, "frag", seq, NULL, 33) != RAPI_NO_ERROR)
+		exit(2);
+	rapi_read* read = rapi_get_read(batch, 0, 0);
+	read->alignments = calloc(1, sizeof(read->alignments[0]));
+	if (NULL == read->alignments)
+		exit(2);
+	read->n_alignments = 1;
+	read->alignments[0].contig = contig;
+	read->alignments[0].mapped = contig != NULL;
+	read->alignments[0].pos = 1234;
+	read->alignments[0].score = 40;
+}
+
+static void test_cache_rebinds_contigs(void)
+{
+	rapi_aln_cache* cache = rapi_aln_cache_new(100);
+	rapi_ref ref;
+	_fake_ref(&ref, 3);
+	rapi_batch stored;
+	_fragment(&stored, "ACGTACGTAC", &ref.contigs[2]);
+	RT_CHECK_OK(rapi_aln_cache_put(cache, FINGERPRINT, &ref, rapi_get_read(&stored, 0, 0), 1));
+
+	// as if the reference had been freed and loaded again
+	free(ref.contigs);
+	_fake_ref(&ref, 3);
+
+	rapi_batch found;
+	_fragment(&found, "ACGTACGTAC", NULL);
+	rapi_read* read = rapi_get_read(&found, 0, 0);
+	rapi_read_free_alignments(read);
+	RT_CHECK(rapi_aln_cache_get(cache, FINGERPRINT, &ref, read, 1) == 1);
+	RT_CHECK(read->n_alignments == 1 && read->alignments[0].contig == &ref.contigs[2]);
+	RT_CHECK(read->alignments[0].pos == 1234 && read->alignments[0].score == 40);
+
+	rapi_reads_free(&found);
+	rapi_reads_free(&stored);
+	free(ref.contigs);
+	rapi_aln_cache_free(cache);
+}
+
+static void test_cache_misses(void)
+{
+	rapi_aln_cache* cache = rapi_aln_cache_new(100);
+	rapi_ref ref, small_ref;
+	_fake_ref(&ref, 3);
+	_fake_ref(&small_ref, 2);
+	rapi_batch stored;
+	_fragment(&stored, "ACGTACGTAC", &ref.contigs[2]);
+	RT_CHECK_OK(rapi_aln_cache_put(cache, FINGERPRINT, &ref, rapi_get_read(&stored, 0, 0), 1));
+
+	rapi_batch found;
+	_fragment(&found, "ACGTACGTAC", NULL);
+	rapi_read* read = rapi_get_read(&found, 0, 0);
+	rapi_read_free_alignments(read);
+	// other options or reference
+	RT_CHECK(rapi_aln_cache_get(cache, FINGERPRINT + 1, &ref, read, 1) == 0);
+	// a reference without the contig
+	RT_CHECK(rapi_aln_cache_get(cache, FINGERPRINT, &small_ref, read, 1) == 0);
+	RT_CHECK(read->n_alignments == 0 && read->alignments == NULL);
+	// other sequence
+	rapi_batch other;
+	_fragment(&other, "ACGTACGTAA", NULL);
+	rapi_read_free_alignments(rapi_get_read(&other, 0, 0));
+	RT_CHECK(rapi_aln_cache_get(cache, FINGERPRINT, &ref, rapi_get_read(&other, 0, 0), 1) == 0);
+
+	rapi_reads_free(&other);
+	rapi_reads_free(&found);
+	rapi_reads_free(&stored);
+	free(small_ref.contigs);
+	free(ref.contigs);
+	rapi_aln_cache_free(cache);
+}
+
+static void test_cache_rejects_foreign_contigs(void)
+{
+	rapi_aln_cache* cache = rapi_aln_cache_new(100);
+	rapi_ref ref, other_ref;
+	_fake_ref(&ref, 3);
+	_fake_ref(&other_ref, 3);
+	rapi_batch stored;
+	_fragment(&stored, "ACGTACGTAC", &other_ref.contigs[1]);
+	RT_CHECK(rapi_aln_cache_put(cache, FINGERPRINT, &ref, rapi_get_read(&stored, 0, 0), 1) == RAPI_PARAM_ERROR);
+
+	rapi_reads_free(&stored);
+	free(other_ref.contigs);
+	free(ref.contigs);
+	rapi_aln_cache_free(cache);
+}
+
+static void test_cache_unmapped(void)
+{
+	rapi_aln_cache* cache = rapi_aln_cache_new(100);
+	rapi_ref ref;
+	_fake_ref(&ref, 1);
+	rapi_batch stored;
+	_fragment(&stored, "ACGTACGTAC", NULL);
+	RT_CHECK_OK(rapi_aln_cache_put(cache, FINGERPRINT, &ref, rapi_get_read(&stored, 0, 0), 1));
+
+	rapi_batch found;
+	_fragment(&found, "ACGTACGTAC", NULL);
+	rapi_read* read = rapi_get_read(&found, 0, 0);
+	rapi_read_free_alignments(read);
+	RT_CHECK(rapi_aln_cache_get(cache, FINGERPRINT, &ref, read, 1) == 1);
+	RT_CHECK(read->n_alignments == 1 && read->alignments[0].contig == NULL && !read->alignments[0].mapped);
+
+	rapi_reads_free(&found);
+	rapi_reads_free(&stored);
+	free(ref.contigs);
+	rapi_aln_cache_free(cache);
+}
+
+/* Aligning the same reads again after reloading the reference hits the cache. */
+static void test_cache_across_ref_reload(void)
+{
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "result_cache_size", 2 * N_FRAGS);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+
+	rapi_batch first, second;
+	rt_simulated_pairs(&first, N_FRAGS, 100, 300, 31);
+	rt_copy_batch(&second, &first);
+
+	rapi_ref ref;
+	rt_load_mini_ref(&ref);
+	RT_CHECK_OK(rapi_align_reads(&ref, &first, 0, first.n_frags, state));
+	RT_CHECK(rt_get_stat(state, "cache_hits") == 0);
+	rapi_ref_free(&ref);
+
+	rt_load_mini_ref(&ref);
+	RT_CHECK_OK(rapi_align_reads(&ref, &second, 0, second.n_frags, state));
+	RT_CHECK(rt_get_stat(state, "cache_hits") == N_FRAGS);
+	RT_CHECK(rt_same_batch_alignments(&first, &second));
+	for (rapi_ssize_t f = 0; f < second.n_frags; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(&second, f, r);
+			for (int a = 0; a < read->n_alignments; ++a)
+				RT_CHECK(NULL == read->alignments[a].contig || read->alignments[a].contig == &ref.contigs[0]);
+		}
+	}
+	rapi_ref_free(&ref);
+
+	rapi_reads_free(&second);
+	rapi_reads_free(&first);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+}
+
+int main(void)
+{
+	rt_init();
+
+	RT_RUN(test_cache_rebinds_contigs);
+	RT_RUN(test_cache_misses);
+	RT_RUN(test_cache_rejects_foreign_contigs);
+	RT_RUN(test_cache_unmapped);
+	RT_RUN(test_cache_across_ref_reload);
+
+	rapi_shutdown();
+	return RT_RESULT();
+}
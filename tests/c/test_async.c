@@ -0,0 +1,378 @@
+/*
+ * test_async.c
+ *
+ * rapi_align_reads_async:  the completion callback, detached jobs,
+ * rapi_align_job_poll, jobs still queued when their state is freed, and the
+ * library-wide thread budget shared by the states' jobs.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // nanosleep, sysconf
+
+#include "test_utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_FRAGS 200
+#define N_JOBS 3
+
+static rapi_ref ref;
+
+/* What a completion callback saw. */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n_calls;
+	rapi_error_t result;
+} completion;
+
+static void _completion_init(completion* c)
+{
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	c->n_calls = 0;
+	c->result = RAPI_GENERIC_ERROR;
+}
+
+static void _completion_destroy(completion* c)
+{
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+}
+
+static void _on_complete(rapi_error_t result, void* user_data)
+{
+	completion* c = user_data;
+	pthread_mutex_lock(&c->lock);
+	c->n_calls += 1;
+	c->result = result;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void _completion_wait(completion* c)
+{
+	pthread_mutex_lock(&c->lock);
+	while (c->n_calls == 0)
+		pthread_cond_wait(&c->cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Fragment callback that holds up the first fragment of a call until the
+ * test lets it go, so that the jobs behind it are known to be queued.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started, released;
+} gate;
+
+static void _gate_init(gate* g)
+{
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	g->started = g->released = 0;
+}
+
+static void _gate_destroy(gate* g)
+{
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->lock);
+}
+
+static void _gate_frag(const rapi_batch* batch, rapi_ssize_t frag, void* user_data)
+{
+	(void)batch; (void)frag;
+	gate* g = user_data;
+	pthread_mutex_lock(&g->lock);
+	g->started = 1;
+	pthread_cond_broadcast(&g->cond);
+	while (!g->released)
+		pthread_cond_wait(&g->cond, &g->lock);
+	pthread_mutex_unlock(&g->lock);
+}
+
+static void _gate_wait_started(gate* g)
+{
+	pthread_mutex_lock(&g->lock);
+	while (!g->started)
+		pthread_cond_wait(&g->cond, &g->lock);
+	pthread_mutex_unlock(&g->lock);
+}
+
+static void _gate_release(gate* g)
+{
+	pthread_mutex_lock(&g->lock);
+	g->released = 1;
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
+
+/* The callback runs once, with the job's result, before the job is seen as done. */
+static void test_async_callback(void)
+{
+	rapi_batch expected, batch;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 71);
+	rt_copy_batch(&batch, &expected);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	completion c;
+	_completion_init(&c);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	rapi_align_job* job;
+	RT_CHECK_OK(rapi_align_reads_async(&ref, &batch, 0, N_FRAGS, state, _on_complete, &c, &job));
+
+	int done = 0;
+	while (!done)
+		RT_CHECK_OK(rapi_align_job_poll(job, &done));
+	pthread_mutex_lock(&c.lock);
+	RT_CHECK(c.n_calls == 1);
+	RT_CHECK(c.result == RAPI_NO_ERROR);
+	pthread_mutex_unlock(&c.lock);
+	RT_CHECK_OK(rapi_align_job_wait(job));
+	RT_CHECK_OK(rapi_align_job_free(job));
+	RT_CHECK(c.n_calls == 1);
+	RT_CHECK(rt_same_batch_alignments(&expected, &batch));
+
+	rapi_aligner_state_free(state);
+	_completion_destroy(&c);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+}
+
+/* Without a handle, the callback is the only way to learn the job is done. */
+static void test_async_detached(void)
+{
+	rapi_batch expected, batch;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 710);
+	rt_copy_batch(&batch, &expected);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	completion c;
+	_completion_init(&c);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads_async(&ref, &batch, 0, N_FRAGS, state, _on_complete, &c, NULL));
+	_completion_wait(&c);
+	RT_CHECK(c.result == RAPI_NO_ERROR);
+	RT_CHECK(rt_same_batch_alignments(&expected, &batch));
+
+	// freeing the state right after a detached job must not touch the job
+	RT_CHECK_OK(rapi_align_reads_async(&ref, &batch, 0, N_FRAGS, state, NULL, NULL, NULL));
+	rapi_aligner_state_free(state);
+
+	_completion_destroy(&c);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+}
+
+/* A job queued behind a running one on the same state isn't done. */
+static void test_async_poll(void)
+{
+	rapi_batch first, second;
+	rt_simulated_pairs(&first, N_FRAGS, 100, 300, 7100);
+	rt_copy_batch(&second, &first);
+	rapi_opts opts;
+	rt_opts_init(&opts, 1);
+
+	gate g;
+	_gate_init(&g);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(state, _gate_frag, &g, 1));
+	rapi_align_job *job1, *job2;
+	RT_CHECK_OK(rapi_align_reads_async(&ref, &first, 0, N_FRAGS, state, NULL, NULL, &job1));
+	RT_CHECK_OK(rapi_align_reads_async(&ref, &second, 0, N_FRAGS, state, NULL, NULL, &job2));
+	_gate_wait_started(&g);
+
+	int done = -1;
+	RT_CHECK_OK(rapi_align_job_poll(job1, &done));
+	RT_CHECK(done == 0);
+	done = -1;
+	RT_CHECK_OK(rapi_align_job_poll(job2, &done));
+	RT_CHECK(done == 0);
+	RT_CHECK(rapi_align_job_poll(job1, NULL) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_align_job_poll(NULL, &done) == RAPI_PARAM_ERROR);
+
+	_gate_release(&g);
+	RT_CHECK_OK(rapi_align_job_wait(job1));
+	RT_CHECK_OK(rapi_align_job_poll(job1, &done));
+	RT_CHECK(done == 1);
+	RT_CHECK_OK(rapi_align_job_wait(job2));
+	RT_CHECK_OK(rapi_align_job_poll(job2, &done));
+	RT_CHECK(done == 1);
+	RT_CHECK(rt_same_batch_alignments(&first, &second));
+
+	RT_CHECK_OK(rapi_align_job_free(job1));
+	RT_CHECK_OK(rapi_align_job_free(job2));
+	rapi_aligner_state_free(state);
+	_gate_destroy(&g);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&second);
+	rapi_reads_free(&first);
+}
+
+static void* _free_state(void* arg)
+{
+	rapi_aligner_state_free(arg);
+	return NULL;
+}
+
+/*
+ * Freeing the state cancels the running job and the queued ones; their
+ * handles stay valid and report RAPI_CANCELLED.
+ */
+static void test_async_free_state_with_queued_jobs(void)
+{
+	rapi_batch batches[N_JOBS];
+	rt_simulated_pairs(&batches[0], N_FRAGS, 100, 300, 71000);
+	for (int j = 1; j < N_JOBS; ++j)
+		rt_copy_batch(&batches[j], &batches[0]);
+	rapi_opts opts;
+	rt_opts_init(&opts, 1);
+
+	gate g;
+	_gate_init(&g);
+	completion c[N_JOBS];
+	rapi_align_job* jobs[N_JOBS];
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(state, _gate_frag, &g, 1));
+	for (int j = 0; j < N_JOBS; ++j) {
+		_completion_init(&c[j]);
+		RT_CHECK_OK(rapi_align_reads_async(&ref, &batches[j], 0, N_FRAGS, state, _on_complete, &c[j], &jobs[j]));
+	}
+	_gate_wait_started(&g);
+
+	// rapi_aligner_state_free waits for the running job, which waits for the gate
+	pthread_t freeing;
+	RT_CHECK(pthread_create(&freeing, NULL, _free_state, state) == 0);
+	const struct timespec pause = { 0, 200 * 1000 * 1000 };
+	nanosleep(&pause, NULL);
+	_gate_release(&g);
+	pthread_join(freeing, NULL);
+
+	for (int j = 0; j < N_JOBS; ++j) {
+		RT_CHECK(rapi_align_job_wait(jobs[j]) == RAPI_CANCELLED);
+		RT_CHECK(c[j].n_calls == 1 && c[j].result == RAPI_CANCELLED);
+		RT_CHECK_OK(rapi_align_job_free(jobs[j]));
+		_completion_destroy(&c[j]);
+	}
+	for (int j = 1; j < N_JOBS; ++j)
+		RT_CHECK(rt_n_mapped(&batches[j]) == 0);
+
+	_gate_destroy(&g);
+	rapi_opts_free(&opts);
+	for (int j = 0; j < N_JOBS; ++j)
+		rapi_reads_free(&batches[j]);
+}
+
+/*
+ * Jobs of states that each want every processor don't overlap:  no state
+ * reports its first fragment while another is between its first and last.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	int n_in_progress;
+	int n_overlaps;
+} budget_watch;
+
+typedef struct {
+	budget_watch* watch;
+	int n_reported;
+} budget_state;
+
+static void _budget_frag(const rapi_batch* batch, rapi_ssize_t frag, void* user_data)
+{
+	(void)frag;
+	budget_state* s = user_data;
+	pthread_mutex_lock(&s->watch->lock);
+	s->n_reported += 1;
+	if (s->n_reported == 1) {
+		s->watch->n_overlaps += s->watch->n_in_progress > 0;
+		s->watch->n_in_progress += 1;
+	}
+	if (s->n_reported == batch->n_frags)
+		s->watch->n_in_progress -= 1;
+	pthread_mutex_unlock(&s->watch->lock);
+}
+
+static void test_async_thread_budget(void)
+{
+	const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	rapi_batch expected, batches[N_JOBS];
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 710000);
+	rapi_opts opts;
+	rt_opts_init(&opts, n_cpus > 0 ? (int)n_cpus : 1);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	budget_watch watch = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+	budget_state data[N_JOBS];
+	rapi_aligner_state* states[N_JOBS];
+	rapi_align_job* jobs[N_JOBS];
+	for (int j = 0; j < N_JOBS; ++j) {
+		rt_copy_batch(&batches[j], &expected);
+		data[j].watch = &watch;
+		data[j].n_reported = 0;
+		RT_CHECK_OK(rapi_aligner_state_init(&states[j], &opts));
+		RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(states[j], _budget_frag, &data[j], 0));
+	}
+	for (int j = 0; j < N_JOBS; ++j)
+		RT_CHECK_OK(rapi_align_reads_async(&ref, &batches[j], 0, N_FRAGS, states[j], NULL, NULL, &jobs[j]));
+	for (int j = 0; j < N_JOBS; ++j) {
+		RT_CHECK_OK(rapi_align_job_free(jobs[j]));
+		RT_CHECK(data[j].n_reported == N_FRAGS);
+		RT_CHECK(rt_same_batch_alignments(&expected, &batches[j]));
+	}
+	RT_CHECK(watch.n_overlaps == 0);
+
+	for (int j = 0; j < N_JOBS; ++j) {
+		rapi_aligner_state_free(states[j]);
+		rapi_reads_free(&batches[j]);
+	}
+	pthread_mutex_destroy(&watch.lock);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_async_callback);
+	RT_RUN(test_async_detached);
+	RT_RUN(test_async_poll);
+	RT_RUN(test_async_free_state_with_queued_jobs);
+	RT_RUN(test_async_thread_budget);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
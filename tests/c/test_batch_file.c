@@ -0,0 +1,286 @@
+/*
+ * test_batch_file.c
+ *
+ * Binary batch images (rapi_batch_file.h):  a batch survives serialization,
+ * mapping and loading, and damaged images are refused.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_batch_file.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FRAGS 200
+
+static rapi_ref ref;
+
+static int _same_str(const char* a, const char* b)
+{
+	return (a == NULL) == (b == NULL) && (a == NULL || strcmp(a, b) == 0);
+}
+
+static int _same_tags(const rapi_alignment* a, const rapi_alignment* b)
+{
+	if (kv_size(a->tags) != kv_size(b->tags))
+		return 0;
+	for (size_t t = 0; t < kv_size(a->tags); ++t) {
+		const rapi_tag* x = &kv_A(a->tags, t);
+		const rapi_tag* y = &kv_A(b->tags, t);
+		if (strcmp(x->key, y->key) != 0 || x->type != y->type)
+			return 0;
+		if ((x->type == RAPI_VTYPE_TEXT && strcmp(x->value.text.s, y->value.text.s) != 0)
+		    || (x->type == RAPI_VTYPE_INT && x->value.integer != y->value.integer)
+		    || (x->type == RAPI_VTYPE_REAL && x->value.real != y->value.real)
+		    || (x->type == RAPI_VTYPE_CHAR && x->value.character != y->value.character))
+			return 0;
+	}
+	return 1;
+}
+
+/* Whether fragments [0, n) of `a` are fragments [start, start + n) of `b`:  reads, alignments and tags. */
+static int _same_frags(const rapi_batch* a, const rapi_batch* b, rapi_ssize_t start, rapi_ssize_t n)
+{
+	for (rapi_ssize_t f = 0; f < n; ++f) {
+		for (int r = 0; r < a->n_reads_frag; ++r) {
+			const rapi_read* x = rapi_get_read(a, f, r);
+			const rapi_read* y = rapi_get_read(b, start + f, r);
+			if (!_same_str(x->id, y->id) || !_same_str(x->seq, y->seq) || !_same_str(x->qual, y->qual)
+			    || x->length != y->length || !rt_same_alignments(x, y))
+				return 0;
+			for (int k = 0; k < x->n_alignments; ++k) {
+				if (!_same_tags(&x->alignments[k], &y->alignments[k]))
+					return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* An aligned batch, with a tag of each type on the first alignment of the first read. */
+static void _aligned_batch(rapi_batch* batch)
+{
+	rt_simulated_pairs(batch, N_FRAGS, 100, 300, 40);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rt_align(&ref, batch, &opts));
+	rapi_opts_free(&opts);
+
+	rapi_read* read = rapi_get_read(batch, 0, 0);
+	RT_CHECK(read->n_alignments > 0);
+	rapi_tag tag;
+	rapi_tag_set_key(&tag, "ZT");
+	rapi_tag_set_text(&tag, "some text");
+	kv_push(rapi_tag, read->alignments[0].tags, tag);
+	rapi_tag_set_key(&tag, "ZC");
+	rapi_tag_set_char(&tag, 'x');
+	kv_push(rapi_tag, read->alignments[0].tags, tag);
+	rapi_tag_set_key(&tag, "ZR");
+	rapi_tag_set_dbl(&tag, 0.25);
+	kv_push(rapi_tag, read->alignments[0].tags, tag);
+}
+
+static void test_batch_file_round_trip(void)
+{
+	rapi_batch expected, batch;
+	_aligned_batch(&expected);
+
+	kstring_t image = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_batch_serialize(&ref, &expected, 0, N_FRAGS, &image));
+	char* path = rt_tmp_path("batch.bin");
+	FILE* f = fopen(path, "wb");
+	RT_CHECK(f && fwrite(image.s, 1, image.l, f) == image.l);
+	RT_CHECK(f && fclose(f) == 0);
+
+	rapi_mapped_batch mb;
+	RT_CHECK_OK(rapi_batch_map_file(&mb, path));
+	RT_CHECK(mb.n_frags == N_FRAGS && mb.n_reads_frag == 2 && mb.n_contigs == ref.n_contigs);
+	RT_CHECK(strcmp(rapi_mapped_str(&mb, rapi_mapped_get_read(&mb, 1, 0)->id), rapi_get_read(&expected, 1, 0)->id) == 0);
+
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 1));
+	RT_CHECK_OK(rapi_batch_load(&mb, &ref, &batch));
+	RT_CHECK(batch.n_frags == N_FRAGS && _same_frags(&batch, &expected, 0, N_FRAGS));
+	RT_CHECK_OK(rapi_batch_unmap(&mb));
+
+	remove(path);
+	free(path);
+	free(image.s);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+}
+
+/* A slice appended to a buffer that doesn't end on an 8-byte boundary. */
+static void test_batch_file_slice(void)
+{
+	rapi_batch expected, batch;
+	_aligned_batch(&expected);
+
+	kstring_t image = { 0, 0, NULL };
+	kputs("abc", &image);
+	RT_CHECK_OK(rapi_batch_serialize(&ref, &expected, 50, 150, &image));
+	RT_CHECK(image.l > 8);
+
+	rapi_mapped_batch mb;
+	RT_CHECK_OK(rapi_batch_map(&mb, image.s + 8, image.l - 8));
+	RT_CHECK(mb.n_frags == 100);
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 1));
+	RT_CHECK_OK(rapi_batch_load(&mb, &ref, &batch));
+	RT_CHECK(batch.n_frags == 100 && _same_frags(&batch, &expected, 50, 100));
+	RT_CHECK_OK(rapi_batch_unmap(&mb));
+
+	free(image.s);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+}
+
+static void test_batch_file_unaligned_reads(void)
+{
+	rapi_batch reads, batch;
+	rt_simulated_pairs(&reads, 20, 100, 300, 400);
+
+	kstring_t image = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_batch_serialize(&ref, &reads, 0, reads.n_frags, &image));
+	rapi_mapped_batch mb;
+	RT_CHECK_OK(rapi_batch_map(&mb, image.s, image.l));
+	RT_CHECK(mb.header->n_alignments == 0);
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 1));
+	RT_CHECK_OK(rapi_batch_load(&mb, &ref, &batch));
+	RT_CHECK(_same_frags(&batch, &reads, 0, reads.n_frags));
+	RT_CHECK_OK(rapi_batch_unmap(&mb));
+
+	free(image.s);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&reads);
+}
+
+/* A reference with the same number of contigs but another name or length is refused. */
+static void test_batch_file_other_reference(void)
+{
+	rapi_batch expected, batch;
+	_aligned_batch(&expected);
+	kstring_t image = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_batch_serialize(&ref, &expected, 0, N_FRAGS, &image));
+	rapi_mapped_batch mb;
+	RT_CHECK_OK(rapi_batch_map(&mb, image.s, image.l));
+	RT_CHECK(mb.ref_fingerprint == rapi_batch_ref_fingerprint(&ref));
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 1));
+
+	// a shallow copy of the reference, with its own contig array
+	rapi_ref other = ref;
+	other.contigs = malloc(ref.n_contigs * sizeof(other.contigs[0]));
+	memcpy(other.contigs, ref.contigs, ref.n_contigs * sizeof(other.contigs[0]));
+
+	other.contigs[0].len += 1;
+	RT_CHECK(rapi_batch_ref_fingerprint(&other) != mb.ref_fingerprint);
+	RT_CHECK(rapi_batch_load(&mb, &other, &batch) == RAPI_PARAM_ERROR);
+
+	other.contigs[0].len = ref.contigs[0].len;
+	other.contigs[0].name = "chrX";
+	RT_CHECK(rapi_batch_load(&mb, &other, &batch) == RAPI_PARAM_ERROR);
+
+	other.contigs[0].name = ref.contigs[0].name;
+	RT_CHECK_OK(rapi_batch_load(&mb, &other, &batch));
+	RT_CHECK(_same_frags(&batch, &expected, 0, N_FRAGS));
+
+	free(other.contigs);
+	RT_CHECK_OK(rapi_batch_unmap(&mb));
+	free(image.s);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+}
+
+/* Map and load `size` bytes at `data`;  if the mapping works, the load must fail. */
+static rapi_error_t _map_and_load(const char* data, size_t size)
+{
+	rapi_mapped_batch mb;
+	rapi_error_t error = rapi_batch_map(&mb, data, size);
+	if (error != RAPI_NO_ERROR)
+		return error;
+
+	rapi_batch batch;
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 1));
+	error = rapi_batch_load(&mb, &ref, &batch);
+	RT_CHECK(error != RAPI_NO_ERROR);
+	RT_CHECK(rapi_get_read(&batch, 0, 0)->id == NULL); // the reads loaded before the error are cleared
+	rapi_reads_free(&batch);
+	rapi_batch_unmap(&mb);
+	return error;
+}
+
+static void test_batch_file_damaged(void)
+{
+	rapi_batch expected;
+	_aligned_batch(&expected);
+	kstring_t image = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_batch_serialize(&ref, &expected, 0, N_FRAGS, &image));
+	rapi_reads_free(&expected);
+
+	char* copy = malloc(image.l); // 8-byte aligned
+	rapi_bin_header* hdr = (rapi_bin_header*)copy;
+
+	memcpy(copy, image.s, image.l);
+	hdr->magic[0] = 'X';
+	RT_CHECK(_map_and_load(copy, image.l) == RAPI_PARAM_ERROR);
+
+	memcpy(copy, image.s, image.l);
+	hdr->version += 1;
+	RT_CHECK(_map_and_load(copy, image.l) == RAPI_OP_NOT_SUPPORTED_ERROR);
+
+	memcpy(copy, image.s, image.l);
+	RT_CHECK(_map_and_load(copy, image.l / 2) != RAPI_NO_ERROR); // truncated
+	RT_CHECK(_map_and_load(copy, sizeof(*hdr) - 1) != RAPI_NO_ERROR);
+
+	memcpy(copy, image.s, image.l);
+	((rapi_bin_read*)(copy + hdr->reads_off))[3].id = hdr->strings_size + 10;
+	RT_CHECK(_map_and_load(copy, image.l) != RAPI_NO_ERROR);
+
+	memcpy(copy, image.s, image.l);
+	((rapi_bin_read*)(copy + hdr->reads_off))[3].n_alignments = hdr->n_alignments + 1;
+	RT_CHECK(_map_and_load(copy, image.l) != RAPI_NO_ERROR);
+
+	memcpy(copy, image.s, image.l);
+	RT_CHECK(hdr->n_alignments > 0);
+	((rapi_bin_alignment*)(copy + hdr->alignments_off))[0].contig = ref.n_contigs;
+	RT_CHECK(_map_and_load(copy, image.l) != RAPI_NO_ERROR);
+
+	memcpy(copy, image.s, image.l);
+	((rapi_bin_alignment*)(copy + hdr->alignments_off))[0].cigar_ops = hdr->n_cigar_ops;
+	((rapi_bin_alignment*)(copy + hdr->alignments_off))[0].n_cigar_ops = 1;
+	RT_CHECK(_map_and_load(copy, image.l) != RAPI_NO_ERROR);
+
+	free(copy);
+	free(image.s);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_batch_file_round_trip);
+	RT_RUN(test_batch_file_slice);
+	RT_RUN(test_batch_file_unaligned_reads);
+	RT_RUN(test_batch_file_damaged);
+	RT_RUN(test_batch_file_other_reference);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,200 @@
+/*
+ * test_budget.c
+ *
+ * Limits on the alignment work:  rescue_cell_budget, read_seed_budget,
+ * batch_deadline_ms and max_occ.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <string.h>
+
+#define N_FRAGS 200
+
+static rapi_ref ref;
+
+/* Value of the ZB tag of the read's first alignment;  0 if it hasn't got one. */
+static long _budget_tag(const rapi_read* read)
+{
+	if (read->n_alignments == 0)
+		return 0;
+	const rapi_alignment* aln = &read->alignments[0];
+	for (int t = 0; t < kv_size(aln->tags); ++t) {
+		long value;
+		if (strcmp(kv_A(aln->tags, t).key, "ZB") == 0 && rapi_tag_get_long(&kv_A(aln->tags, t), &value) == RAPI_NO_ERROR)
+			return value;
+	}
+	return 0;
+}
+
+/*
+ * Pairs whose second read has a mismatch every 12 bases:  it has no seed
+ * as long as BWA's minimum (19), so it can only be found by mate rescue.
+ */
+static void _rescue_pairs(rapi_batch* batch, unsigned seed)
+{
+	rt_simulated_pairs(batch, N_FRAGS, 100, 300, seed);
+	for (rapi_ssize_t f = 0; f < batch->n_frags; ++f) {
+		rapi_read* read = rapi_get_read(batch, f, 1);
+		for (unsigned i = 6; i < read->length; i += 12)
+			read->seq[i] = read->seq[i] == 'A' ? 'C' : 'A';
+	}
+}
+
+static long _align(rapi_batch* batch, const char* param, long value, const char* stat)
+{
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	if (param)
+		rt_set_param(&opts, param, value);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, batch, 0, batch->n_frags, state));
+	const long result = stat ? rt_get_stat(state, stat) : 0;
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	return result;
+}
+
+static void test_rescue_cell_budget(void)
+{
+	rapi_batch unlimited, limited;
+	_rescue_pairs(&unlimited, 33);
+	rt_copy_batch(&limited, &unlimited);
+
+	RT_CHECK(_align(&unlimited, NULL, 0, NULL) == 0);
+	RT_CHECK(rt_n_mapped(&unlimited) > N_FRAGS); // some mates were rescued
+
+	const long n_hits = _align(&limited, "rescue_cell_budget", 1, "budget_hits");
+	RT_CHECK(n_hits > 0);
+	long n_tagged = 0;
+	for (rapi_ssize_t f = 0; f < limited.n_frags; ++f) {
+		const long tag = _budget_tag(rapi_get_read(&limited, f, 0));
+		RT_CHECK(tag == 0 || tag == 1);
+		n_tagged += tag == 1;
+	}
+	RT_CHECK(n_tagged == n_hits);
+	RT_CHECK(rt_n_mapped(&limited) < rt_n_mapped(&unlimited));
+
+	rapi_reads_free(&limited);
+	rapi_reads_free(&unlimited);
+}
+
+static void test_batch_deadline(void)
+{
+	// far more work than fits in a millisecond
+	rapi_batch batch;
+	rt_simulated_pairs(&batch, 20 * N_FRAGS, 100, 300, 330);
+	const long n_hits = _align(&batch, "batch_deadline_ms", 1, "deadline_hits");
+	RT_CHECK(n_hits > 0);
+
+	long n_tagged = 0;
+	for (rapi_ssize_t f = 0; f < batch.n_frags; ++f) {
+		const rapi_read* read = rapi_get_read(&batch, f, 0);
+		const long tag = _budget_tag(read);
+		RT_CHECK((tag & ~3) == 0);
+		n_tagged += (tag & 2) != 0;
+	}
+	RT_CHECK(n_tagged == n_hits);
+	rapi_reads_free(&batch);
+}
+
+/*
+ * Pairs whose second read has mismatches at 25, 50 and 75:  it has at least
+ * four SMEMs, each found once in the mini reference.  The first read has at
+ * most two.
+ */
+static void _seed_pairs(rapi_batch* batch, unsigned seed)
+{
+	rt_simulated_pairs(batch, N_FRAGS, 100, 300, seed);
+	for (rapi_ssize_t f = 0; f < batch->n_frags; ++f) {
+		rapi_read* read = rapi_get_read(batch, f, 1);
+		for (unsigned i = 25; i < read->length; i += 25)
+			read->seq[i] = read->seq[i] == 'A' ? 'C' : 'A';
+	}
+}
+
+static void test_read_seed_budget(void)
+{
+	rapi_batch unlimited, limited, loose;
+	_seed_pairs(&unlimited, 34);
+	rt_copy_batch(&limited, &unlimited);
+	rt_copy_batch(&loose, &unlimited);
+
+	RT_CHECK(_align(&unlimited, NULL, 0, "budget_hits") == 0);
+	RT_CHECK(_align(&loose, "read_seed_budget", 1000, "budget_hits") == 0);
+	RT_CHECK(rt_same_batch_alignments(&unlimited, &loose));
+
+	// every second read is over the budget;  with a fixed insert size model its mate rescues it
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "read_seed_budget", 3);
+	rt_set_param_dbl(&opts, "isize_mean", 300);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, &limited, 0, limited.n_frags, state));
+	RT_CHECK(rt_get_stat(state, "budget_hits") == N_FRAGS);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+
+	int n_wrong = 0;
+	for (rapi_ssize_t f = 0; f < limited.n_frags; ++f) {
+		for (int r = 0; r < 2; ++r)
+			n_wrong += _budget_tag(rapi_get_read(&limited, f, r)) != 4;
+		// not seeded, but found by mate rescue where the unlimited run put it
+		const rapi_read* a = rapi_get_read(&unlimited, f, 1);
+		const rapi_read* b = rapi_get_read(&limited, f, 1);
+		if (a->n_alignments > 0 && a->alignments[0].mapped)
+			n_wrong += b->n_alignments == 0 || !b->alignments[0].mapped || b->alignments[0].pos != a->alignments[0].pos;
+	}
+	RT_CHECK(n_wrong == 0);
+	RT_CHECK(rt_n_mapped(&unlimited) > N_FRAGS);
+
+	rapi_reads_free(&loose);
+	rapi_reads_free(&limited);
+	rapi_reads_free(&unlimited);
+}
+
+static void test_max_occ(void)
+{
+	rapi_batch plain, capped;
+	rt_simulated_pairs(&plain, N_FRAGS, 100, 300, 3300);
+	rt_copy_batch(&capped, &plain);
+	_align(&plain, NULL, 0, NULL);
+	// the mini reference has no seeds anywhere near this frequent
+	_align(&capped, "max_occ", 500, NULL);
+	RT_CHECK(rt_same_batch_alignments(&plain, &capped));
+	rapi_reads_free(&capped);
+	rapi_reads_free(&plain);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_rescue_cell_budget);
+	RT_RUN(test_read_seed_budget);
+	RT_RUN(test_batch_deadline);
+	RT_RUN(test_max_occ);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
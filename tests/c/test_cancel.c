@@ -0,0 +1,117 @@
+/*
+ * test_cancel.c
+ *
+ * rapi_aligner_state_cancel:  it only affects the call in progress, and the
+ * fragments finished before it keep their alignments.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <stdlib.h>
+
+#define N_FRAGS 200
+#define CANCEL_AFTER 50
+
+static rapi_ref ref;
+
+typedef struct {
+	rapi_aligner_state* state;
+	char* reported;
+	int n_reported;
+} cancel_data;
+
+/* Fragment callback that cancels the call after CANCEL_AFTER fragments. */
+static void _cancel_after(const rapi_batch* batch, rapi_ssize_t frag, void* user_data)
+{
+	(void)batch;
+	cancel_data* data = user_data;
+	data->reported[frag] = 1;
+	if (++data->n_reported == CANCEL_AFTER)
+		RT_CHECK_OK(rapi_aligner_state_cancel(data->state));
+}
+
+static void test_cancel_keeps_reported_fragments(void)
+{
+	rapi_batch expected, batch;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 34);
+	rt_copy_batch(&batch, &expected);
+
+	rapi_opts opts;
+	rt_opts_init(&opts, 1); // one thread in order:  the reported fragments are the finished ones
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	cancel_data data = { NULL, calloc(N_FRAGS, 1), 0 };
+	RT_CHECK_OK(rapi_aligner_state_init(&data.state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(data.state, _cancel_after, &data, 1));
+	RT_CHECK(rapi_align_reads(&ref, &batch, 0, N_FRAGS, data.state) == RAPI_CANCELLED);
+	RT_CHECK(data.n_reported >= CANCEL_AFTER && data.n_reported < N_FRAGS);
+	for (int f = 0; f < N_FRAGS; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(&batch, f, r);
+			if (data.reported[f])
+				RT_CHECK(rt_same_alignments(read, rapi_get_read(&expected, f, r)));
+			else
+				RT_CHECK(read->n_alignments == 0);
+		}
+	}
+
+	// the request doesn't carry over to the next call
+	RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(data.state, NULL, NULL, 0));
+	rapi_reads_free(&batch);
+	rt_copy_batch(&batch, &expected);
+	RT_CHECK_OK(rapi_align_reads(&ref, &batch, 0, N_FRAGS, data.state));
+	RT_CHECK(rt_same_batch_alignments(&expected, &batch));
+
+	rapi_aligner_state_free(data.state);
+	free(data.reported);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+}
+
+static void test_cancel_without_call(void)
+{
+	rapi_batch batch;
+	rt_simulated_pairs(&batch, 20, 100, 300, 340);
+
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_cancel(state));
+	RT_CHECK_OK(rapi_align_reads(&ref, &batch, 0, batch.n_frags, state));
+	RT_CHECK(rt_n_mapped(&batch) > 0);
+
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_cancel_keeps_reported_fragments);
+	RT_RUN(test_cancel_without_call);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
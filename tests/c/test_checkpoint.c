@@ -0,0 +1,197 @@
+/*
+ * test_checkpoint.c
+ *
+ * Checkpointed runs (rapi_checkpoint.h):  a run interrupted after some
+ * batches, with a partly written batch after its last checkpoint, and then
+ * resumed writes the same bytes as a run that wasn't interrupted.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_checkpoint.h>
+#include <rapi_utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_BATCHES 5
+#define BATCH_FRAGS 100
+
+static rapi_ref ref;
+static rapi_batch reads; // N_BATCHES * BATCH_FRAGS pairs
+
+/*
+ * Align `reads` batch by batch with SAM output to `out_path`, taking a
+ * checkpoint at `cp_path` after each batch, and resuming from it if there's
+ * one.  If `stop_before` is a batch index, write half of that batch's
+ * records without a checkpoint and return, as if the run had crashed.
+ */
+static void _run(const char* out_path, const char* cp_path, int stop_before)
+{
+	rapi_batch batch;
+	rt_copy_batch(&batch, &reads);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	rapi_checkpoint cp;
+	RT_CHECK_OK(rapi_checkpoint_init(&cp));
+	kstring_t sam = { 0, 0, NULL };
+
+	FILE* out;
+	rapi_error_t error = rapi_checkpoint_read(&cp, cp_path);
+	if (error == RAPI_NO_ERROR) {
+		RT_CHECK(cp.n_inputs == 1 && cp.input_offsets[0] == cp.n_batches * BATCH_FRAGS);
+		RT_CHECK_OK(rapi_aligner_state_restore(state, cp.state.s, cp.state.l));
+		out = fopen(out_path, "r+");
+		RT_CHECK(out != NULL);
+		RT_CHECK_OK(rapi_checkpoint_resume_output(&cp, out));
+	}
+	else {
+		RT_CHECK(error == RAPI_PARAM_ERROR); // no checkpoint yet
+		cp.n_inputs = 1;
+		out = fopen(out_path, "w");
+		RT_CHECK(out != NULL);
+		RT_CHECK_OK(rapi_format_sam_hdr(&ref, &sam));
+		fprintf(out, "%s\n", sam.s);
+	}
+
+	for (int b = cp.n_batches; b < N_BATCHES; ++b) {
+		const rapi_ssize_t start = b * BATCH_FRAGS, end = start + BATCH_FRAGS;
+		RT_CHECK_OK(rapi_align_reads(&ref, &batch, start, end, state));
+		const rapi_ssize_t n_written = b == stop_before ? BATCH_FRAGS / 2 : BATCH_FRAGS;
+		for (rapi_ssize_t f = start; f < start + n_written; ++f) {
+			sam.l = 0;
+			RT_CHECK_OK(rapi_format_sam_b(&batch, f, &sam));
+			fprintf(out, "%s\n", sam.s);
+		}
+		if (b == stop_before)
+			break;
+		cp.n_batches += 1;
+		cp.input_offsets[0] = end;
+		RT_CHECK_OK(rapi_checkpoint_commit(&cp, cp_path, state, out));
+	}
+
+	RT_CHECK(fclose(out) == 0);
+	free(sam.s);
+	rapi_checkpoint_free(&cp);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+}
+
+static char* _read_file(const char* path, size_t* size)
+{
+	kstring_t data = { 0, 0, NULL };
+	FILE* f = fopen(path, "rb");
+	RT_CHECK(f != NULL);
+	char chunk[4096];
+	size_t n;
+	while (f && (n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		kputsn(chunk, n, &data);
+	if (f)
+		fclose(f);
+	*size = data.l;
+	return data.s;
+}
+
+static int _same_files(const char* a, const char* b)
+{
+	size_t size_a, size_b;
+	char* data_a = _read_file(a, &size_a);
+	char* data_b = _read_file(b, &size_b);
+	const int same = size_a == size_b && size_a > 0 && memcmp(data_a, data_b, size_a) == 0;
+	free(data_a);
+	free(data_b);
+	return same;
+}
+
+/* Interrupt before batch `stop_before`, resume, and compare with `expected_path`. */
+static void _check_resume(const char* expected_path, int stop_before)
+{
+	char* out_path = rt_tmp_path("checkpoint_resumed.sam");
+	char* cp_path = rt_tmp_path("checkpoint_resumed.ckpt");
+	remove(cp_path);
+
+	_run(out_path, cp_path, stop_before);
+	RT_CHECK(!_same_files(expected_path, out_path));
+	_run(out_path, cp_path, -1);
+	RT_CHECK(_same_files(expected_path, out_path));
+
+	remove(out_path);
+	remove(cp_path);
+	free(out_path);
+	free(cp_path);
+}
+
+static void test_checkpoint_resume_same_output(void)
+{
+	char* expected_path = rt_tmp_path("checkpoint_expected.sam");
+	char* cp_path = rt_tmp_path("checkpoint_expected.ckpt");
+	remove(cp_path);
+	_run(expected_path, cp_path, -1);
+
+	_check_resume(expected_path, 3);
+	_check_resume(expected_path, 1);
+	_check_resume(expected_path, 0); // before the first checkpoint:  starts afresh
+
+	remove(expected_path);
+	remove(cp_path);
+	free(expected_path);
+	free(cp_path);
+}
+
+static void test_checkpoint_read_errors(void)
+{
+	rapi_checkpoint cp;
+	RT_CHECK_OK(rapi_checkpoint_init(&cp));
+
+	char* path = rt_tmp_path("checkpoint_missing.ckpt");
+	remove(path);
+	RT_CHECK(rapi_checkpoint_read(&cp, path) == RAPI_PARAM_ERROR);
+
+	// a path that can't be opened for another reason than not existing
+	FILE* f = fopen(path, "w");
+	RT_CHECK(f && fputs("not a checkpoint", f) != EOF && fclose(f) == 0);
+	kstring_t under_file = { 0, 0, NULL };
+	ksprintf(&under_file, "%s/checkpoint", path);
+	RT_CHECK(rapi_checkpoint_read(&cp, under_file.s) == RAPI_GENERIC_ERROR);
+	// and a corrupt one
+	RT_CHECK(rapi_checkpoint_read(&cp, path) == RAPI_GENERIC_ERROR);
+
+	remove(path);
+	free(under_file.s);
+	free(path);
+	rapi_checkpoint_free(&cp);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+	rt_simulated_pairs(&reads, N_BATCHES * BATCH_FRAGS, 100, 300, 41);
+
+	RT_RUN(test_checkpoint_resume_same_output);
+	RT_RUN(test_checkpoint_read_errors);
+
+	rapi_reads_free(&reads);
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
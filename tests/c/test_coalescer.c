@@ -0,0 +1,224 @@
+/*
+ * test_coalescer.c
+ *
+ * Request coalescing (rapi_coalescer):  concurrent clients get the
+ * alignments and filter marks of their own reads, and fragment callbacks
+ * see the clients' batches.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_coalescer.h>
+#include <rapi_regions.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define N_CLIENTS 4
+#define N_REQUESTS 10 // per client
+#define REQUEST_FRAGS 15
+
+static rapi_ref ref;
+
+typedef struct {
+	rapi_coalescer* coalescer;
+	const rapi_batch* expected; // all the fragments, aligned directly
+	int client;
+	int n_wrong;
+} client_data;
+
+/* Index in `expected` of fragment `frag` of request `request` of client `client`. */
+static inline rapi_ssize_t _frag_of(int client, int request, rapi_ssize_t frag)
+{
+	return (client * N_REQUESTS + request) * REQUEST_FRAGS + frag;
+}
+
+/*
+ * Whether `read` got the same result as `expected`:  the same filter marks
+ * and, if `expected` is placed uniquely, the same alignments.  Repeats may
+ * be placed differently, since the tie-breaking depends on the position in
+ * the batch.
+ */
+static int _same_result(const rapi_read* read, const rapi_read* expected)
+{
+	if (read->off_target != expected->off_target || read->host != expected->host)
+		return 0;
+	if (expected->n_alignments > 0 && expected->alignments[0].mapq > 0)
+		return rt_same_alignments(read, expected);
+	return read->n_alignments > 0;
+}
+
+static void* _client(void* arg)
+{
+	client_data* data = arg;
+	for (int q = 0; q < N_REQUESTS; ++q) {
+		rapi_batch request;
+		if (rapi_reads_alloc(&request, 2, REQUEST_FRAGS) != RAPI_NO_ERROR)
+			exit(2);
+		for (int f = 0; f < REQUEST_FRAGS; ++f) {
+			for (int r = 0; r < 2; ++r) {
+				const rapi_read* read = rapi_get_read(data->expected, _frag_of(data->client, q, f), r);
+				if (rapi_set_read(&request, f, r, read->id, read->seq, read->qual, 33) != RAPI_NO_ERROR)
+					exit(2);
+			}
+		}
+		if (rapi_coalescer_align(data->coalescer, &request, REQUEST_FRAGS) != RAPI_NO_ERROR)
+			data->n_wrong += REQUEST_FRAGS;
+		else {
+			for (int f = 0; f < REQUEST_FRAGS; ++f) {
+				for (int r = 0; r < 2; ++r) {
+					if (!_same_result(rapi_get_read(&request, f, r), rapi_get_read(data->expected, _frag_of(data->client, q, f), r)))
+						data->n_wrong += 1;
+				}
+			}
+		}
+		rapi_reads_free(&request);
+	}
+	return NULL;
+}
+
+/* Align `expected` directly, then through a coalescer from N_CLIENTS threads, with the same state settings. */
+static void _check_clients(const rapi_regions* regions)
+{
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	// a fixed model, so that the coalesced batches pair reads as the whole batch does
+	rt_set_param_dbl(&opts, "isize_mean", 300);
+	rt_set_param_dbl(&opts, "isize_std", 30);
+
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, N_CLIENTS * N_REQUESTS * REQUEST_FRAGS, 100, 300, 37);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_regions(state, regions, 0));
+	RT_CHECK_OK(rapi_align_reads(&ref, &expected, 0, expected.n_frags, state));
+	rapi_aligner_state_free(state);
+
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_regions(state, regions, 0));
+	rapi_coalescer* coalescer;
+	RT_CHECK_OK(rapi_coalescer_init(&coalescer, &ref, state, 2, 2 * REQUEST_FRAGS, 5));
+
+	pthread_t threads[N_CLIENTS];
+	client_data data[N_CLIENTS];
+	for (int c = 0; c < N_CLIENTS; ++c) {
+		data[c].coalescer = coalescer;
+		data[c].expected = &expected;
+		data[c].client = c;
+		data[c].n_wrong = 0;
+		pthread_create(&threads[c], NULL, _client, &data[c]);
+	}
+	for (int c = 0; c < N_CLIENTS; ++c) {
+		pthread_join(threads[c], NULL);
+		RT_CHECK(data[c].n_wrong == 0);
+	}
+
+	RT_CHECK_OK(rapi_coalescer_free(coalescer));
+	rapi_aligner_state_free(state);
+	rapi_reads_free(&expected);
+	rapi_opts_free(&opts);
+}
+
+static void test_coalesced_alignments(void)
+{
+	_check_clients(NULL);
+}
+
+/* The region filter's marks reach the clients' reads. */
+static void test_coalesced_off_target_marks(void)
+{
+	int len;
+	free(rt_mini_ref_seq(&len));
+	rapi_regions* regions;
+	RT_CHECK_OK(rapi_regions_init(&regions, &ref));
+	RT_CHECK_OK(rapi_regions_add(regions, 0, 0, len / 2));
+	RT_CHECK_OK(rapi_regions_index(regions));
+	_check_clients(regions);
+	rapi_regions_free(regions);
+}
+
+typedef struct {
+	pthread_mutex_t lock;
+	const rapi_batch* request;
+	int n_reports[REQUEST_FRAGS];
+	int n_wrong;
+} report_log;
+
+static void _log_fragment(const rapi_batch* batch, rapi_ssize_t frag, void* user_data)
+{
+	report_log* log = user_data;
+	pthread_mutex_lock(&log->lock);
+	if (batch != log->request || frag < 0 || frag >= REQUEST_FRAGS)
+		log->n_wrong += 1;
+	else {
+		log->n_reports[frag] += 1;
+		for (int r = 0; r < 2; ++r) {
+			if (rapi_get_read(batch, frag, r)->n_alignments == 0)
+				log->n_wrong += 1;
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+}
+
+/* The callback is told the request's batch and the fragment's index in it. */
+static void test_coalesced_fragment_callback(void)
+{
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	rapi_coalescer* coalescer;
+	RT_CHECK_OK(rapi_coalescer_init(&coalescer, &ref, state, 2, 4 * REQUEST_FRAGS, 5));
+
+	report_log log;
+	pthread_mutex_init(&log.lock, NULL);
+	RT_CHECK_OK(rapi_coalescer_set_fragment_callback(coalescer, _log_fragment, &log, 1));
+	for (int q = 0; q < 3; ++q) {
+		rapi_batch request;
+		rt_simulated_pairs(&request, REQUEST_FRAGS, 100, 300, 370 + q);
+		log.request = &request;
+		log.n_wrong = 0;
+		for (int f = 0; f < REQUEST_FRAGS; ++f)
+			log.n_reports[f] = 0;
+		RT_CHECK_OK(rapi_coalescer_align(coalescer, &request, REQUEST_FRAGS));
+		RT_CHECK(log.n_wrong == 0);
+		for (int f = 0; f < REQUEST_FRAGS; ++f)
+			RT_CHECK(log.n_reports[f] == 1);
+		rapi_reads_free(&request);
+	}
+
+	RT_CHECK_OK(rapi_coalescer_free(coalescer));
+	pthread_mutex_destroy(&log.lock);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_coalesced_alignments);
+	RT_RUN(test_coalesced_off_target_marks);
+	RT_RUN(test_coalesced_fragment_callback);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
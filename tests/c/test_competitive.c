@@ -0,0 +1,195 @@
+/*
+ * test_competitive.c
+ *
+ * Competitive alignment (rapi_align_reads_competitive):  each reference is
+ * aligned as rapi_align_reads would, fragments are classified by their
+ * best reference, and the state's insert size model isn't carried from one
+ * reference to the next.  The mini reference stands in for two references
+ * that can't be told apart.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_metrics.h>
+
+#include <stdlib.h>
+
+#define N_FRAGS 400
+
+static rapi_ref ref;
+
+/* Whether `hit` is the primary alignment of `read`. */
+static int _same_hit(const rapi_ref_hit* hit, const rapi_read* read)
+{
+	const rapi_alignment* aln = read->n_alignments > 0 ? &read->alignments[0] : NULL;
+	if (NULL == aln || !aln->mapped)
+		return hit->contig == -1;
+	return hit->contig == aln->contig - ref.contigs && hit->pos == aln->pos && hit->score == aln->score
+	    && hit->mapq == aln->mapq && hit->reverse_strand == aln->reverse_strand;
+}
+
+/*
+ * Align a copy of `expected` competitively to the mini reference `n_refs`
+ * times over with a new state made with `opts`, and check the result
+ * against `expected`, aligned directly.
+ */
+static void _check_competitive(const rapi_batch* expected, const rapi_opts* opts, int n_refs)
+{
+	rapi_ref refs[2] = { ref, ref };
+	rapi_batch batch;
+	rt_copy_batch(&batch, expected);
+	rapi_ref_hit* hits = malloc(batch.n_frags * 2 * n_refs * sizeof(hits[0]));
+	int* classes = malloc(batch.n_frags * sizeof(classes[0]));
+	if (NULL == hits || NULL == classes)
+		exit(2);
+
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, opts));
+	RT_CHECK_OK(rapi_align_reads_competitive(refs, n_refs, &batch, 0, batch.n_frags, state, 0, hits, classes));
+	RT_CHECK(rt_same_batch_alignments(&batch, expected));
+
+	int n_wrong = 0, n_mapped = 0;
+	for (int f = 0; f < batch.n_frags; ++f) {
+		int mapped = 0;
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(expected, f, r);
+			mapped |= read->n_alignments > 0 && read->alignments[0].mapped;
+			for (int i = 0; i < n_refs; ++i)
+				n_wrong += !_same_hit(&hits[(f * 2 + r) * n_refs + i], read);
+		}
+		n_mapped += mapped;
+		// with the same reference twice, the scores tie
+		n_wrong += classes[f] != (!mapped ? RAPI_REF_UNMAPPED : n_refs > 1 ? RAPI_REF_AMBIGUOUS : 0);
+	}
+	RT_CHECK(n_wrong == 0);
+	RT_CHECK(n_mapped > 0);
+
+	rapi_aligner_state_free(state);
+	free(classes);
+	free(hits);
+	rapi_reads_free(&batch);
+}
+
+static void test_competitive_same_as_direct(void)
+{
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 50);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	_check_competitive(&expected, &opts, 1);
+	_check_competitive(&expected, &opts, 2);
+
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+/* The same with a fixed insert size model, which every pass uses. */
+static void test_competitive_fixed_insert_size(void)
+{
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 500);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rt_set_param_dbl(&opts, "isize_mean", 300);
+	rt_set_param_dbl(&opts, "isize_std", 30);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	_check_competitive(&expected, &opts, 2);
+
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+/* A model estimated against one of the references doesn't stay in the state. */
+static void test_competitive_leaves_insert_size(void)
+{
+	rapi_batch batch;
+	rt_simulated_pairs(&batch, N_FRAGS, 100, 300, 5000);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rapi_ref refs[2] = { ref, ref };
+	rapi_ref_hit* hits = malloc(batch.n_frags * 2 * 2 * sizeof(hits[0]));
+	int* classes = malloc(batch.n_frags * sizeof(classes[0]));
+	if (NULL == hits || NULL == classes)
+		exit(2);
+
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads_competitive(refs, 2, &batch, 0, batch.n_frags, state, 0, hits, classes));
+	kstring_t snapshot = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_aligner_state_save(state, &snapshot));
+	RT_CHECK(rapi_aligner_state_set_insert_size(state, snapshot.s, snapshot.l) == RAPI_PARAM_ERROR); // no model
+
+	// while a direct call keeps its estimate
+	snapshot.l = 0;
+	RT_CHECK_OK(rapi_align_reads(&ref, &batch, 0, batch.n_frags, state));
+	RT_CHECK_OK(rapi_aligner_state_save(state, &snapshot));
+	RT_CHECK_OK(rapi_aligner_state_set_insert_size(state, snapshot.s, snapshot.l));
+
+	rapi_aligner_state_free(state);
+	free(snapshot.s);
+	free(classes);
+	free(hits);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+}
+
+static void test_competitive_errors(void)
+{
+	rapi_batch batch;
+	rt_simulated_pairs(&batch, 10, 100, 300, 50000);
+	rapi_opts opts;
+	rt_opts_init(&opts, 1);
+	rapi_ref_hit hits[10 * 2];
+	int classes[10];
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+
+	RT_CHECK(rapi_align_reads_competitive(&ref, 0, &batch, 0, 10, state, 0, hits, classes) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_align_reads_competitive(&ref, 1, &batch, 0, 10, state, -1, hits, classes) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_align_reads_competitive(&ref, 1, &batch, 0, 10, state, 0, NULL, classes) == RAPI_PARAM_ERROR);
+
+	rapi_metrics* metrics;
+	RT_CHECK_OK(rapi_metrics_init(&metrics, &ref, 1000, 1000));
+	RT_CHECK_OK(rapi_aligner_state_set_metrics(state, metrics));
+	RT_CHECK(rapi_align_reads_competitive(&ref, 1, &batch, 0, 10, state, 0, hits, classes) == RAPI_OP_NOT_SUPPORTED_ERROR);
+	RT_CHECK_OK(rapi_aligner_state_set_metrics(state, NULL));
+	rapi_metrics_free(metrics);
+
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_competitive_same_as_direct);
+	RT_RUN(test_competitive_fixed_insert_size);
+	RT_RUN(test_competitive_leaves_insert_size);
+	RT_RUN(test_competitive_errors);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,200 @@
+/*
+ * test_daemon.c
+ *
+ * The alignment daemon and its client library, over a Unix socket in the
+ * temporary directory:  clients get the same alignments as a local
+ * rapi_align_reads, also when several connect and load the same reference
+ * at once.  Needs ../../daemon/rapi_daemon.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // fork, kill, nanosleep
+
+#include "test_utils.h"
+
+#include <rapi_client.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RT_DAEMON "../../daemon/rapi_daemon"
+#define N_CLIENTS 4
+
+static char* socket_path;
+static pid_t daemon_pid;
+static rapi_batch expected; // aligned locally
+
+/* Start the daemon and wait until it accepts connections;  exits if it doesn't. */
+static void _start_daemon(void)
+{
+	socket_path = rt_tmp_path("daemon.sock");
+	daemon_pid = fork();
+	if (daemon_pid < 0)
+		exit(2);
+	if (daemon_pid == 0) {
+		execl(RT_DAEMON, RT_DAEMON, "-s", socket_path, "-t", "4", "-j", "2", (char*)NULL);
+		_exit(127);
+	}
+
+	const struct timespec pause = { 0, 100 * 1000 * 1000 };
+	for (int i = 0; i < 100; ++i) {
+		rapi_client* client;
+		if (rapi_client_connect(&client, socket_path) == RAPI_NO_ERROR) {
+			rapi_client_close(client);
+			return;
+		}
+		nanosleep(&pause, NULL);
+	}
+	fprintf(stderr, "The daemon (%s) didn't start\n", RT_DAEMON);
+	kill(daemon_pid, SIGKILL);
+	exit(2);
+}
+
+static void _stop_daemon(void)
+{
+	int status;
+	kill(daemon_pid, SIGTERM);
+	waitpid(daemon_pid, &status, 0);
+	RT_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	free(socket_path);
+}
+
+/*
+ * Connect, load the mini reference and align a copy of `expected`.
+ * \return 0 if the alignments are the same, 1 if not, -1 if a call fails.
+ */
+static int _align_with_daemon(void)
+{
+	rapi_client* client;
+	rapi_ref ref;
+	rapi_batch batch;
+	int result = 0;
+
+	rt_copy_batch(&batch, &expected);
+	if (rapi_client_connect(&client, socket_path) != RAPI_NO_ERROR)
+		return -1;
+	if (rapi_client_ref_load(client, RT_MINI_REF, &ref) != RAPI_NO_ERROR)
+		result = -1;
+	else {
+		if (rapi_client_align_reads(client, &ref, &batch, 0, batch.n_frags) != RAPI_NO_ERROR)
+			result = -1;
+		else if (!rt_same_batch_alignments(&expected, &batch))
+			result = 1;
+		rapi_client_ref_free(&ref);
+	}
+	rapi_client_close(client);
+	rapi_reads_free(&batch);
+	return result;
+}
+
+static void test_daemon_same_alignments(void)
+{
+	RT_CHECK(_align_with_daemon() == 0);
+	RT_CHECK(_align_with_daemon() == 0); // the reference is already loaded
+}
+
+static void* _client(void* arg)
+{
+	*(int*)arg = _align_with_daemon();
+	return NULL;
+}
+
+/* A fresh daemon:  the clients ask for the reference while it's being loaded. */
+static void test_daemon_concurrent_clients(void)
+{
+	_stop_daemon();
+	_start_daemon();
+
+	pthread_t threads[N_CLIENTS];
+	int results[N_CLIENTS];
+	for (int c = 0; c < N_CLIENTS; ++c)
+		pthread_create(&threads[c], NULL, _client, &results[c]);
+	for (int c = 0; c < N_CLIENTS; ++c) {
+		pthread_join(threads[c], NULL);
+		RT_CHECK(results[c] == 0);
+	}
+}
+
+static void test_daemon_missing_reference(void)
+{
+	rapi_client* client;
+	rapi_ref ref;
+	RT_CHECK_OK(rapi_client_connect(&client, socket_path));
+	RT_CHECK(rapi_client_ref_load(client, "no_such_reference.fasta", &ref) != RAPI_NO_ERROR);
+	RT_CHECK(rapi_client_ref_load(client, "no_such_reference.fasta", &ref) != RAPI_NO_ERROR); // retried
+	RT_CHECK_OK(rapi_client_close(client));
+	RT_CHECK(_align_with_daemon() == 0); // the daemon and the other references are fine
+}
+
+static void test_daemon_socket_mode(void)
+{
+	struct stat st;
+	RT_CHECK(stat(socket_path, &st) == 0);
+	RT_CHECK(S_ISSOCK(st.st_mode) && (st.st_mode & 0777) == 0600);
+}
+
+/* A connected client doesn't keep the daemon from shutting down cleanly. */
+static void test_daemon_stop_with_client(void)
+{
+	rapi_client* client;
+	rapi_ref ref;
+	rapi_batch batch;
+	rt_copy_batch(&batch, &expected);
+	RT_CHECK_OK(rapi_client_connect(&client, socket_path));
+	RT_CHECK_OK(rapi_client_ref_load(client, RT_MINI_REF, &ref));
+
+	_stop_daemon(); // checks the exit status
+	RT_CHECK(rapi_client_align_reads(client, &ref, &batch, 0, batch.n_frags) != RAPI_NO_ERROR);
+	rapi_client_ref_free(&ref);
+	rapi_client_close(client);
+	rapi_reads_free(&batch);
+
+	_start_daemon();
+	RT_CHECK(_align_with_daemon() == 0);
+}
+
+int main(void)
+{
+	rt_init();
+	rapi_ref ref;
+	rt_load_mini_ref(&ref);
+	rt_simulated_pairs(&expected, 300, 100, 300, 38);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	if (rt_align(&ref, &expected, &opts) != RAPI_NO_ERROR)
+		return 2;
+	rapi_opts_free(&opts);
+	rapi_ref_free(&ref);
+
+	_start_daemon();
+	RT_RUN(test_daemon_same_alignments);
+	RT_RUN(test_daemon_concurrent_clients);
+	RT_RUN(test_daemon_missing_reference);
+	RT_RUN(test_daemon_socket_mode);
+	RT_RUN(test_daemon_stop_with_client);
+	_stop_daemon();
+
+	rapi_reads_free(&expected);
+	rapi_shutdown();
+	return RT_RESULT();
+}
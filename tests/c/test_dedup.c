@@ -0,0 +1,223 @@
+/*
+ * test_dedup.c
+ *
+ * Duplicate collapsing (dedup_reads):  fragments with the same sequences are
+ * aligned once, and each gets the alignments it would get on its own, with
+ * its own name and qualities;  the collapse ratio is in the statistics.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_utils.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_UNIQUE 300
+#define N_DUPS   150 // copies of the even fragments, with other names and qualities
+#define N_NEAR   30  // copies of the odd fragments with one base changed:  not duplicates
+#define N_FRAGS  (N_UNIQUE + N_DUPS + N_NEAR)
+
+static rapi_ref ref;
+
+/* Index of the fragment that duplicate `f` (>= N_UNIQUE) copies. */
+static int _original(int f)
+{
+	return f < N_UNIQUE + N_DUPS ? 2 * (f - N_UNIQUE) : 2 * (f - N_UNIQUE - N_DUPS) + 1;
+}
+
+static void _make_batch(rapi_batch* batch, unsigned seed)
+{
+	rapi_batch src;
+	rt_simulated_pairs(&src, N_UNIQUE, 100, 300, seed);
+	if (rapi_reads_alloc(batch, 2, N_FRAGS) != RAPI_NO_ERROR)
+		exit(2);
+	char name[32], seq[101], qual[101];
+	for (int f = 0; f < N_FRAGS; ++f) {
+		const int g = f < N_UNIQUE ? f : _original(f);
+		snprintf(name, sizeof(name), f < N_UNIQUE ? "sim_%06d" : "copy_%06d", f);
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(&src, g, r);
+			memcpy(seq, read->seq, read->length + 1);
+			memcpy(qual, read->qual, read->length + 1);
+			if (f >= N_UNIQUE) {
+				for (unsigned i = 0; i < read->length; ++i)
+					qual[i] = '#' + (f + r + i) % 40;
+			}
+			if (f >= N_UNIQUE + N_DUPS && r == 1)
+				seq[50] = seq[50] == 'A' ? 'C' : 'A';
+			if (rapi_set_read(batch, f, r, name, seq, qual, 33) != RAPI_NO_ERROR)
+				exit(2);
+		}
+	}
+	rapi_reads_free(&src);
+}
+
+/* Align `batch` with dedup_reads set to `dedup`;  return the collapse ratio statistic in `ratio`. */
+static void _align(rapi_batch* batch, int dedup, long* n_fragments, long* n_collapsed, double* ratio)
+{
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "dedup_reads", dedup);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, batch, 0, batch->n_frags, state));
+	*n_fragments = rt_get_stat(state, "dedup_fragments");
+	*n_collapsed = rt_get_stat(state, "dedup_collapsed");
+
+	rapi_param_list stats;
+	kv_init(stats);
+	*ratio = -1;
+	RT_CHECK_OK(rapi_aligner_state_get_stats(state, &stats));
+	for (int i = 0; i < kv_size(stats); ++i) {
+		if (strcmp(rapi_param_get_name(&kv_A(stats, i)), "dedup_collapse_ratio") == 0)
+			RT_CHECK(rapi_param_get_dbl(&kv_A(stats, i), ratio) == RAPI_NO_ERROR);
+	}
+	rapi_param_list_free(&stats);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+}
+
+/* The reads placed uniquely without collapsing get the same alignments with it. */
+static void test_dedup_same_alignments(void)
+{
+	rapi_batch plain, dedup;
+	long n_fragments, n_collapsed;
+	double ratio;
+	_make_batch(&plain, 30);
+	rt_copy_batch(&dedup, &plain);
+
+	_align(&plain, 0, &n_fragments, &n_collapsed, &ratio);
+	RT_CHECK(n_fragments == 0 && n_collapsed == 0 && ratio == 0.0);
+	_align(&dedup, 1, &n_fragments, &n_collapsed, &ratio);
+
+	int n_checked = 0, n_wrong = 0;
+	for (int f = 0; f < N_FRAGS; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(&plain, f, r);
+			if (read->n_alignments == 0 || !read->alignments[0].mapped || read->alignments[0].mapq == 0)
+				continue; // ties may be broken differently
+			n_checked += 1;
+			n_wrong += !rt_same_alignments(read, rapi_get_read(&dedup, f, r));
+		}
+	}
+	RT_CHECK(n_wrong == 0);
+	RT_CHECK(n_checked > N_FRAGS);
+
+	rapi_reads_free(&dedup);
+	rapi_reads_free(&plain);
+}
+
+/* The copies and their originals are placed the same way. */
+static void test_dedup_copies(void)
+{
+	rapi_batch batch;
+	long n_fragments, n_collapsed;
+	double ratio;
+	_make_batch(&batch, 31);
+	_align(&batch, 1, &n_fragments, &n_collapsed, &ratio);
+
+	int n_wrong = 0;
+	for (int f = N_UNIQUE; f < N_UNIQUE + N_DUPS; ++f) {
+		for (int r = 0; r < 2; ++r)
+			n_wrong += !rt_same_alignments(rapi_get_read(&batch, f, r), rapi_get_read(&batch, _original(f), r));
+	}
+	RT_CHECK(n_wrong == 0);
+	rapi_reads_free(&batch);
+}
+
+/* Split a SAM line into its first 11 fields;  returns the number found. */
+static int _sam_fields(char* line, char* fields[11])
+{
+	int n = 0;
+	for (char* p = strtok(line, "\t"); p != NULL && n < 11; p = strtok(NULL, "\t"))
+		fields[n++] = p;
+	return n;
+}
+
+/* In the SAM output, each copy has its own name and qualities. */
+static void test_dedup_names_and_qualities(void)
+{
+	rapi_batch batch;
+	long n_fragments, n_collapsed;
+	double ratio;
+	_make_batch(&batch, 32);
+	_align(&batch, 1, &n_fragments, &n_collapsed, &ratio);
+
+	kstring_t sam = { 0, 0, NULL };
+	int n_wrong = 0;
+	for (int f = 0; f < N_FRAGS; ++f) {
+		sam.l = 0;
+		RT_CHECK_OK(rapi_format_sam_b(&batch, f, &sam));
+		char* lines[2] = { sam.s, strchr(sam.s, '\n') };
+		RT_CHECK(lines[1] != NULL);
+		if (NULL == lines[1])
+			continue;
+		*lines[1]++ = '\0';
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(&batch, f, r);
+			char* eol = strchr(lines[r], '\n');
+			if (eol)
+				*eol = '\0';
+			char* fields[11];
+			if (_sam_fields(lines[r], fields) != 11) {
+				n_wrong += 1;
+				continue;
+			}
+			const int rev = (atoi(fields[1]) & 0x10) != 0;
+			n_wrong += strcmp(fields[0], read->id) != 0;
+			// the qualities are reversed with the sequence
+			for (unsigned i = 0; i < read->length; ++i)
+				n_wrong += fields[10][rev ? read->length - 1 - i : i] != read->qual[i];
+		}
+	}
+	RT_CHECK(n_wrong == 0);
+	free(sam.s);
+	rapi_reads_free(&batch);
+}
+
+/* Only the exact copies are collapsed, and the statistics say how many. */
+static void test_dedup_stats(void)
+{
+	rapi_batch batch;
+	long n_fragments, n_collapsed;
+	double ratio;
+	_make_batch(&batch, 33);
+	_align(&batch, 1, &n_fragments, &n_collapsed, &ratio);
+	RT_CHECK(n_fragments == N_FRAGS);
+	RT_CHECK(n_collapsed == N_DUPS);
+	RT_CHECK(fabs(ratio - (double)N_DUPS / N_FRAGS) < 1e-9);
+	rapi_reads_free(&batch);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_dedup_same_alignments);
+	RT_RUN(test_dedup_copies);
+	RT_RUN(test_dedup_names_and_qualities);
+	RT_RUN(test_dedup_stats);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,153 @@
+/*
+ * test_deterministic.c
+ *
+ * The deterministic option:  paired reads need a given insert size model,
+ * and with one the alignments don't depend on how the reads are batched.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <stdlib.h>
+
+#define N_FRAGS 600
+
+static rapi_ref ref;
+
+/*
+ * Align a copy of `reads` with `state` in calls over the fragment ranges
+ * delimited by `bounds` (n_bounds + 1 of them, from 0 to the end).
+ */
+static void _align_in_batches(rapi_batch* batch, const rapi_batch* reads, rapi_aligner_state* state,
+		const int* bounds, int n_bounds)
+{
+	rt_copy_batch(batch, reads);
+	rapi_ssize_t start = 0;
+	for (int b = 0; b <= n_bounds; ++b) {
+		const rapi_ssize_t end = b < n_bounds ? bounds[b] : reads->n_frags;
+		RT_CHECK_OK(rapi_align_reads(&ref, batch, start, end, state));
+		start = end;
+	}
+}
+
+static void test_deterministic_needs_model(void)
+{
+	rapi_batch batch;
+	rt_simulated_pairs(&batch, 20, 100, 300, 42);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "deterministic", 1);
+
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK(rapi_align_reads(&ref, &batch, 0, batch.n_frags, state) == RAPI_PARAM_ERROR);
+
+	// nor does a snapshot of a state that has no model give it one
+	kstring_t snapshot = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_aligner_state_save(state, &snapshot));
+	RT_CHECK(rapi_aligner_state_set_insert_size(state, snapshot.s, snapshot.l) == RAPI_PARAM_ERROR);
+	RT_CHECK_OK(rapi_aligner_state_restore(state, snapshot.s, snapshot.l));
+	RT_CHECK(rapi_align_reads(&ref, &batch, 0, batch.n_frags, state) == RAPI_PARAM_ERROR);
+
+	free(snapshot.s);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+}
+
+static void test_deterministic_fixed_model(void)
+{
+	rapi_batch reads, whole, split;
+	rt_simulated_pairs(&reads, N_FRAGS, 100, 300, 420);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "deterministic", 1);
+	rt_set_param_dbl(&opts, "isize_mean", 300);
+	rt_set_param_dbl(&opts, "isize_std", 30);
+
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	_align_in_batches(&whole, &reads, state, NULL, 0);
+	rapi_aligner_state_free(state);
+
+	const int bounds[] = { 137, 400, 401 };
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	_align_in_batches(&split, &reads, state, bounds, 3);
+	rapi_aligner_state_free(state);
+
+	RT_CHECK(rt_n_mapped(&whole) > 0);
+	RT_CHECK(rt_same_batch_alignments(&whole, &split));
+
+	rapi_reads_free(&split);
+	rapi_reads_free(&whole);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&reads);
+}
+
+/* A model estimated by a pilot run, loaded either way. */
+static void test_deterministic_snapshot_model(void)
+{
+	rapi_batch reads, pilot, whole, split;
+	rt_simulated_pairs(&reads, N_FRAGS, 100, 300, 4200);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+
+	rapi_aligner_state* state;
+	rt_simulated_pairs(&pilot, 300, 100, 300, 42000);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, &pilot, 0, pilot.n_frags, state));
+	kstring_t snapshot = { 0, 0, NULL };
+	RT_CHECK_OK(rapi_aligner_state_save(state, &snapshot));
+	rapi_aligner_state_free(state);
+
+	rt_set_param(&opts, "deterministic", 1);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_restore(state, snapshot.s, snapshot.l));
+	_align_in_batches(&whole, &reads, state, NULL, 0);
+	rapi_aligner_state_free(state);
+
+	const int bounds[] = { 250 };
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_insert_size(state, snapshot.s, snapshot.l));
+	_align_in_batches(&split, &reads, state, bounds, 1);
+	rapi_aligner_state_free(state);
+
+	RT_CHECK(rt_n_mapped(&whole) > 0);
+	RT_CHECK(rt_same_batch_alignments(&whole, &split));
+
+	free(snapshot.s);
+	rapi_reads_free(&split);
+	rapi_reads_free(&whole);
+	rapi_reads_free(&pilot);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&reads);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_deterministic_needs_model);
+	RT_RUN(test_deterministic_fixed_model);
+	RT_RUN(test_deterministic_snapshot_model);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,336 @@
+/*
+ * test_dupmark.c
+ *
+ * Duplicate marking (rapi_dupmark):  Picard's signatures for pairs and
+ * single ends, across batches and independently of the number of threads.
+ * Most tests use an in-memory reference and alignments made up by the test;
+ * the last one aligns, to check that the fragments dedup_reads gives
+ * copied alignments are marked like any other duplicates.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // rand_r
+
+#include "test_utils.h"
+
+#include <rapi_dupmark.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define READ_LEN 50
+#define UNMAPPED -1
+
+static rapi_contig contigs[2] = { { "ctg0", 100000 }, { "ctg1", 100000 } };
+static rapi_ref fake_ref = { "in-memory", 2, contigs, NULL };
+
+/* An end of a made-up fragment. */
+typedef struct {
+	int contig; // UNMAPPED for none
+	int pos;
+	int reverse;
+	int clip;   // soft-clipped bases at the read's 5' end
+	int secondary; // add a secondary alignment
+} end_spec;
+
+static void _place(rapi_read* read, const end_spec* e)
+{
+	if (e->contig == UNMAPPED)
+		return;
+	read->n_alignments = e->secondary ? 2 : 1;
+	read->alignments = calloc(read->n_alignments, sizeof(rapi_alignment));
+	if (NULL == read->alignments)
+		exit(2);
+	for (int a = 0; a < read->n_alignments; ++a) {
+		rapi_alignment* aln = &read->alignments[a];
+		aln->cigar_ops = calloc(2, sizeof(rapi_cigar));
+		if (NULL == aln->cigar_ops)
+			exit(2);
+		aln->contig = &contigs[a == 0 ? e->contig : 1 - e->contig];
+		aln->pos = a == 0 ? e->pos : 5000;
+		aln->mapped = 1;
+		aln->secondary_aln = a > 0;
+		aln->reverse_strand = e->reverse;
+		// the 5' clip comes first on the forward strand, last on the reverse
+		const rapi_cigar clip = { RAPI_CIG_S, e->clip };
+		const rapi_cigar match = { RAPI_CIG_M, READ_LEN - e->clip };
+		aln->n_cigar_ops = 0;
+		if (e->clip && !e->reverse)
+			aln->cigar_ops[aln->n_cigar_ops++] = clip;
+		aln->cigar_ops[aln->n_cigar_ops++] = match;
+		if (e->clip && e->reverse)
+			aln->cigar_ops[aln->n_cigar_ops++] = clip;
+	}
+}
+
+/* A batch of `n` made-up fragments with ends `specs[2 * f]` and `specs[2 * f + 1]`. */
+static void _make_batch(rapi_batch* batch, const end_spec* specs, int n, int n_reads_frag)
+{
+	char seq[READ_LEN + 1], qual[READ_LEN + 1];
+	memset(seq, 'A', READ_LEN);
+	memset(qual, 'I', READ_LEN);
+	seq[READ_LEN] = qual[READ_LEN] = '\0';
+	if (rapi_reads_alloc(batch, n_reads_frag, n) != RAPI_NO_ERROR)
+		exit(2);
+	for (int f = 0; f < n; ++f) {
+		for (int r = 0; r < n_reads_frag; ++r) {
+			if (rapi_set_read(batch, f, r, "frag", seq, qual, 33) != RAPI_NO_ERROR)
+				exit(2);
+			_place(rapi_get_read(batch, f, r), &specs[n_reads_frag * f + r]);
+		}
+	}
+}
+
+/* Whether all the alignments of fragment `f` have duplicate == `expected`. */
+static int _marked(const rapi_batch* batch, int f, int expected)
+{
+	for (int r = 0; r < batch->n_reads_frag; ++r) {
+		const rapi_read* read = rapi_get_read(batch, f, r);
+		for (int a = 0; a < read->n_alignments; ++a) {
+			if (read->alignments[a].duplicate != expected)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void test_dupmark_pairs(void)
+{
+	const end_spec specs[] = {
+		{ 0, 1000, 0, 0, 0 }, { 0, 1300, 1, 0, 0 }, // kept
+		{ 0, 1300, 1, 0, 0 }, { 0, 1000, 0, 0, 0 }, // the same ends, mates swapped
+		{ 0, 1005, 0, 5, 1 }, { 0, 1300, 1, 0, 0 }, // clipped to the same 5' end, with a secondary alignment
+		{ 0, 1000, 0, 0, 0 }, { 0, 1300, 1, 5, 0 }, // reverse read clipped at its 5' end:  the same end again
+		{ 0, 1000, 0, 0, 0 }, { 0, 1300, 0, 0, 0 }, // different strand
+		{ 0, 1000, 0, 0, 0 }, { 1, 1300, 1, 0, 0 }, // different contig
+		{ 0, 1001, 0, 0, 0 }, { 0, 1300, 1, 0, 0 }, // different position
+		{ UNMAPPED }, { UNMAPPED },
+		{ UNMAPPED }, { UNMAPPED },                  // unmapped pairs are never duplicates
+	};
+	const int expected[] = { 0, 1, 1, 1, 0, 0, 0, 0, 0 };
+	const int n = sizeof(expected) / sizeof(expected[0]);
+	rapi_batch batch;
+	_make_batch(&batch, specs, n, 2);
+
+	rapi_dupmark* dupmark;
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark, &fake_ref, 1 << 20, 2));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark, &batch, 0, n));
+	for (int f = 0; f < n; ++f)
+		RT_CHECK(_marked(&batch, f, expected[f]));
+
+	rapi_dupmark_stats stats;
+	RT_CHECK_OK(rapi_dupmark_get_stats(dupmark, &stats));
+	RT_CHECK(stats.n_pairs == 7 && stats.n_unmapped == 2 && stats.n_fragments == 0);
+	RT_CHECK(stats.n_pair_duplicates == 3 && stats.n_fragment_duplicates == 0);
+
+	RT_CHECK_OK(rapi_dupmark_free(dupmark));
+	rapi_reads_free(&batch);
+}
+
+/* Single ends and pairs with one read mapped, which are keyed by that end. */
+static void test_dupmark_single_ends(void)
+{
+	const end_spec specs[] = {
+		{ 0, 2000, 0, 0, 0 }, { UNMAPPED },         // kept
+		{ UNMAPPED }, { 0, 2000, 0, 0, 0 },         // the same end
+		{ 0, 2000, 0, 0, 0 }, { 0, 2400, 1, 0, 0 }, // a pair on it:  Picard would have kept the pair
+		{ 0, 3000, 0, 0, 0 }, { 0, 3300, 1, 0, 0 }, // a pair first
+		{ 0, 3300, 1, 0, 0 }, { UNMAPPED },         // then a single end on one of its ends
+	};
+	const int expected[] = { 0, 1, 0, 0, 1 };
+	const int n = sizeof(expected) / sizeof(expected[0]);
+	rapi_batch batch;
+	_make_batch(&batch, specs, n, 2);
+
+	rapi_dupmark* dupmark;
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark, &fake_ref, 1 << 20, 1));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark, &batch, 0, n));
+	for (int f = 0; f < n; ++f)
+		RT_CHECK(_marked(&batch, f, expected[f]));
+	// the unmapped mate of a duplicate is marked too
+	RT_CHECK(rapi_get_read(&batch, 1, 0)->n_alignments == 0 && rapi_get_read(&batch, 1, 1)->alignments[0].duplicate);
+
+	rapi_dupmark_stats stats;
+	RT_CHECK_OK(rapi_dupmark_get_stats(dupmark, &stats));
+	RT_CHECK(stats.n_fragments == 3 && stats.n_pairs == 2);
+	RT_CHECK(stats.n_fragment_duplicates == 2 && stats.n_pair_duplicates == 0 && stats.n_late == 1);
+
+	RT_CHECK_OK(rapi_dupmark_free(dupmark));
+	rapi_reads_free(&batch);
+}
+
+/* Signatures are remembered from one batch to the next;  slices leave the other fragments alone. */
+static void test_dupmark_across_batches(void)
+{
+	const end_spec specs[] = {
+		{ 0, 1000, 0, 0, 0 }, { 0, 1300, 1, 0, 0 },
+		{ 1, 500, 1, 0, 0 }, { 1, 200, 0, 0, 0 },
+	};
+	rapi_batch first, second;
+	_make_batch(&first, specs, 2, 2);
+	_make_batch(&second, specs, 2, 2);
+
+	rapi_dupmark* dupmark;
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark, &fake_ref, 1 << 20, 2));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark, &first, 0, 2));
+	RT_CHECK(_marked(&first, 0, 0) && _marked(&first, 1, 0));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark, &second, 1, 2));
+	RT_CHECK(_marked(&second, 0, 0) && _marked(&second, 1, 1));
+	RT_CHECK(rapi_dupmark_batch(dupmark, &second, 1, 3) == RAPI_PARAM_ERROR);
+
+	RT_CHECK_OK(rapi_dupmark_free(dupmark));
+	rapi_reads_free(&second);
+	rapi_reads_free(&first);
+}
+
+/* `n` made-up pairs on a few positions, so that many are duplicates. */
+static void _random_pairs(rapi_batch* batch, int n, unsigned seed)
+{
+	end_spec* specs = calloc(2 * n, sizeof(end_spec));
+	if (NULL == specs)
+		exit(2);
+	for (int i = 0; i < 2 * n; ++i) {
+		const int r = rand_r(&seed);
+		if (r % 20 == 0)
+			specs[i].contig = UNMAPPED;
+		else {
+			specs[i].contig = r % 2;
+			specs[i].pos = 1000 + (r >> 8) % 3000;
+			specs[i].reverse = (r >> 4) % 2;
+		}
+	}
+	_make_batch(batch, specs, n, 2);
+	free(specs);
+}
+
+static void test_dupmark_threads(void)
+{
+	const int n = 5000;
+	rapi_batch one, four;
+	_random_pairs(&one, n, 46);
+	_random_pairs(&four, n, 46);
+
+	rapi_dupmark* dupmark[2];
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark[0], &fake_ref, 1 << 20, 1));
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark[1], &fake_ref, 1 << 20, 4));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark[0], &one, 0, n));
+	for (int f = 0; f < n; f += 1000)
+		RT_CHECK_OK(rapi_dupmark_batch(dupmark[1], &four, f, f + 1000));
+
+	int n_wrong = 0, n_duplicates = 0;
+	for (int f = 0; f < n; ++f) {
+		const int dup = !_marked(&one, f, 0);
+		n_duplicates += dup;
+		n_wrong += !_marked(&one, f, dup) || !_marked(&four, f, dup);
+	}
+	RT_CHECK(n_duplicates > 0 && n_wrong == 0);
+
+	rapi_dupmark_stats stats[2];
+	RT_CHECK_OK(rapi_dupmark_get_stats(dupmark[0], &stats[0]));
+	RT_CHECK_OK(rapi_dupmark_get_stats(dupmark[1], &stats[1]));
+	RT_CHECK(memcmp(&stats[0], &stats[1], sizeof(stats[0])) == 0);
+	RT_CHECK(stats[0].n_pair_duplicates + stats[0].n_fragment_duplicates == (uint64_t)n_duplicates);
+
+	rapi_dupmark_free(dupmark[0]);
+	rapi_dupmark_free(dupmark[1]);
+	rapi_reads_free(&four);
+	rapi_reads_free(&one);
+}
+
+/* With the table full, new signatures are counted and not remembered. */
+static void test_dupmark_memory_budget(void)
+{
+	const int n = 100000; // more signatures than the smallest table holds
+	rapi_batch batch;
+	end_spec* specs = calloc(2 * n, sizeof(end_spec));
+	if (NULL == specs)
+		exit(2);
+	for (int f = 0; f < n; ++f) {
+		specs[2 * f] = (end_spec){ 0, 1 + f, 0, 0, 0 };
+		specs[2 * f + 1] = (end_spec){ 1, 1 + f, 1, 0, 0 };
+	}
+	_make_batch(&batch, specs, n, 2);
+	free(specs);
+
+	rapi_dupmark* dupmark;
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark, &fake_ref, 0, 2));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark, &batch, 0, n));
+	rapi_dupmark_stats stats;
+	RT_CHECK_OK(rapi_dupmark_get_stats(dupmark, &stats));
+	RT_CHECK(stats.n_untracked > 0 && stats.n_pair_duplicates == 0);
+	RT_CHECK_OK(rapi_dupmark_free(dupmark));
+	rapi_reads_free(&batch);
+}
+
+/*
+ * dedup_reads aligns each distinct sequence once and copies its alignments
+ * to the fragments repeating it, without flagging them:  the marking is
+ * left to rapi_dupmark, which sees them as duplicates by position.
+ */
+static void test_dupmark_after_dedup_reads(void)
+{
+	rapi_ref ref;
+	rt_load_mini_ref(&ref);
+	rapi_batch batch;
+	rt_simulated_pairs(&batch, 300, 100, 300, 460);
+	for (int f = 1; f < 300; f += 3) { // every third fragment repeats the one before
+		for (int r = 0; r < 2; ++r) {
+			rapi_read* dup = rapi_get_read(&batch, f, r);
+			memcpy(dup->seq, rapi_get_read(&batch, f - 1, r)->seq, dup->length);
+		}
+	}
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "dedup_reads", 1);
+	RT_CHECK_OK(rt_align(&ref, &batch, &opts));
+	for (int f = 0; f < 300; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* read = rapi_get_read(&batch, f, r);
+			RT_CHECK(read->n_alignments == 0 || !read->alignments[0].duplicate);
+		}
+	}
+
+	rapi_dupmark* dupmark;
+	RT_CHECK_OK(rapi_dupmark_init(&dupmark, &ref, 1 << 20, 2));
+	RT_CHECK_OK(rapi_dupmark_batch(dupmark, &batch, 0, batch.n_frags));
+	for (int f = 1; f < 300; f += 3) {
+		const rapi_read* read = rapi_get_read(&batch, f, 0);
+		if (read->n_alignments > 0 && read->alignments[0].mapped)
+			RT_CHECK(_marked(&batch, f, 1));
+	}
+
+	RT_CHECK_OK(rapi_dupmark_free(dupmark));
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+	rapi_ref_free(&ref);
+}
+
+int main(void)
+{
+	rt_init();
+
+	RT_RUN(test_dupmark_pairs);
+	RT_RUN(test_dupmark_single_ends);
+	RT_RUN(test_dupmark_across_batches);
+	RT_RUN(test_dupmark_threads);
+	RT_RUN(test_dupmark_memory_budget);
+	RT_RUN(test_dupmark_after_dedup_reads);
+
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,287 @@
+/*
+ * test_fastq.c
+ *
+ * FASTQ chunk index (rapi_fastq.h):  chunks of plain and gzip files, single
+ * or paired, start at the right records and read back every record once;
+ * saved indices load back;  paired files out of sync and files changed
+ * since they were indexed are refused.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_fastq.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define N_RECORDS 1000
+#define RECORDS_PER_CHUNK 64
+#define MEMBER_RECORDS 100 // records per gzip member in multi-member files
+
+enum { PLAIN, GZIP, GZIP_MEMBERS };
+
+/* Record `rec` of mate `mate` (0 or 1);  names are the same in both mates. */
+static void _record(kstring_t* out, int rec, int mate)
+{
+	const int len = 50 + (rec * 7 + mate) % 40;
+	ksprintf(out, "@frag%d\n", rec);
+	for (int i = 0; i < len; ++i)
+		kputc("ACGT"[(rec * 31 + i * 17 + mate * 5 + i * i) % 4], out);
+	kputs("\n+\n", out);
+	for (int i = 0; i < len; ++i)
+		kputc('#' + (rec + i) % 40, out);
+	kputc('\n', out);
+}
+
+/*
+ * Write mate `mate` of the test reads to `path` in `format`, with record
+ * `bad_rec` renamed if non-negative.  Put the uncompressed offset of each
+ * chunk in `chunk_off`, if not NULL.
+ */
+static void _write_fastq(const char* path, int format, int mate, int bad_rec, uint64_t* chunk_off)
+{
+	kstring_t text = { 0, 0, NULL };
+	size_t member_start = 0; // in `text`
+	FILE* f = fopen(path, "wb");
+	if (NULL == f)
+		exit(2);
+	for (int rec = 0; rec < N_RECORDS; ++rec) {
+		if (chunk_off && rec % RECORDS_PER_CHUNK == 0)
+			chunk_off[rec / RECORDS_PER_CHUNK] = text.l;
+		const size_t start = text.l;
+		_record(&text, rec, mate);
+		if (rec == bad_rec)
+			text.s[start + 1] = 'X';
+		if (format == GZIP_MEMBERS && (rec + 1) % MEMBER_RECORDS == 0) {
+			// each member is a complete gzip stream, as in BGZF
+			uLongf size = compressBound(text.l - member_start) + 64;
+			char* buf = malloc(size);
+			z_stream strm;
+			memset(&strm, 0, sizeof(strm));
+			if (NULL == buf || deflateInit2(&strm, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				exit(2);
+			strm.next_in = (Bytef*)text.s + member_start;
+			strm.avail_in = text.l - member_start;
+			strm.next_out = (Bytef*)buf;
+			strm.avail_out = size;
+			if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+				exit(2);
+			fwrite(buf, 1, strm.total_out, f);
+			deflateEnd(&strm);
+			free(buf);
+			member_start = text.l;
+		}
+	}
+	if (format == PLAIN)
+		fwrite(text.s, 1, text.l, f);
+	fclose(f);
+	if (format == GZIP) {
+		gzFile gz = gzopen(path, "wb");
+		if (NULL == gz || gzwrite(gz, text.s, text.l) != (int)text.l || gzclose(gz) != Z_OK)
+			exit(2);
+	}
+	free(text.s);
+}
+
+/* Whether fragment `f` of `batch` is record `rec` of the test reads. */
+static int _is_record(const rapi_batch* batch, int f, int rec)
+{
+	kstring_t expected = { 0, 0, NULL };
+	int same = 1;
+	for (int r = 0; r < batch->n_reads_frag && same; ++r) {
+		const rapi_read* read = rapi_get_read(batch, f, r);
+		expected.l = 0;
+		_record(&expected, rec, r);
+		// "@name\nseq\n+\nqual\n"
+		char* name = expected.s + 1;
+		char* seq = strchr(name, '\n') + 1;
+		char* qual = strchr(strchr(seq, '\n') + 1, '\n') + 1;
+		seq[-1] = qual[-3] = qual[strlen(qual) - 1] = '\0';
+		same = strcmp(read->id, name) == 0 && strcmp(read->seq, seq) == 0 && strcmp(read->qual, qual) == 0;
+	}
+	free(expected.s);
+	return same;
+}
+
+/*
+ * Read chunk `chunk` (or the whole files, if `idx` is NULL) in batches of
+ * 10 and check that it holds records [first, first + n).
+ */
+static void _check_chunk(const rapi_fastq_index* idx, const char* path1, const char* path2,
+		int64_t chunk, int64_t first, int64_t n)
+{
+	rapi_fastq_reader* reader;
+	rapi_batch batch;
+	const int n_files = path2 ? 2 : 1;
+	RT_CHECK_OK(rapi_reads_alloc(&batch, n_files, 10));
+	RT_CHECK_OK(rapi_fastq_reader_open(&reader, idx, path1, path2, chunk));
+
+	int64_t rec = first;
+	int n_frags, n_wrong = 0;
+	do {
+		RT_CHECK_OK(rapi_fastq_read_batch(reader, &batch, 10, &n_frags));
+		for (int f = 0; f < n_frags; ++f, ++rec)
+			n_wrong += !_is_record(&batch, f, rec);
+	} while (n_frags > 0);
+	RT_CHECK(n_wrong == 0);
+	RT_CHECK(rec == first + n);
+
+	RT_CHECK_OK(rapi_fastq_reader_close(reader));
+	rapi_reads_free(&batch);
+}
+
+/* Check the chunks of `idx` against the test reads, reading some of them. */
+static void _check_index(const rapi_fastq_index* idx, const char* path1, const char* path2,
+		const uint64_t* chunk_off)
+{
+	const int64_t n_chunks = (N_RECORDS + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK;
+	RT_CHECK(rapi_fastq_index_n_files(idx) == (path2 ? 2 : 1));
+	RT_CHECK(rapi_fastq_index_n_records(idx) == N_RECORDS);
+	RT_CHECK(rapi_fastq_index_n_chunks(idx) == n_chunks);
+
+	for (int64_t c = 0; c < n_chunks; ++c) {
+		int64_t first, n;
+		uint64_t offsets[2];
+		RT_CHECK_OK(rapi_fastq_index_chunk(idx, c, &first, &n, offsets));
+		RT_CHECK(first == c * RECORDS_PER_CHUNK);
+		RT_CHECK(n == (c < n_chunks - 1 ? RECORDS_PER_CHUNK : N_RECORDS - c * RECORDS_PER_CHUNK));
+		RT_CHECK(offsets[0] == chunk_off[c]);
+		if (c == 0 || c == 1 || c == n_chunks / 2 || c == n_chunks - 1)
+			_check_chunk(idx, path1, path2, c, first, n);
+	}
+	RT_CHECK(rapi_fastq_index_chunk(idx, n_chunks, NULL, NULL, NULL) != RAPI_NO_ERROR);
+}
+
+/* Index and read the test reads written in `format`, single and paired. */
+static void _check_format(int format, uint64_t span)
+{
+	char* path1 = rt_tmp_path("reads_1.fq");
+	char* path2 = rt_tmp_path("reads_2.fq");
+	uint64_t chunk_off[2][N_RECORDS / RECORDS_PER_CHUNK + 1];
+	_write_fastq(path1, format, 0, -1, chunk_off[0]);
+	_write_fastq(path2, format, 1, -1, chunk_off[1]);
+
+	rapi_fastq_index* idx;
+	RT_CHECK_OK(rapi_fastq_index_build(&idx, path1, NULL, RECORDS_PER_CHUNK, span, 3));
+	_check_index(idx, path1, NULL, chunk_off[0]);
+	rapi_fastq_index_free(idx);
+
+	RT_CHECK_OK(rapi_fastq_index_build(&idx, path1, path2, RECORDS_PER_CHUNK, span, 3));
+	_check_index(idx, path1, path2, chunk_off[0]);
+	for (int64_t c = 0; c < rapi_fastq_index_n_chunks(idx); ++c) {
+		uint64_t offsets[2];
+		RT_CHECK_OK(rapi_fastq_index_chunk(idx, c, NULL, NULL, offsets));
+		RT_CHECK(offsets[1] == chunk_off[1][c]);
+	}
+	rapi_fastq_index_free(idx);
+
+	_check_chunk(NULL, path1, path2, 0, 0, N_RECORDS); // no index
+
+	remove(path1);
+	remove(path2);
+	free(path1);
+	free(path2);
+}
+
+static void test_fastq_plain(void)
+{
+	_check_format(PLAIN, 0);
+}
+
+static void test_fastq_gzip(void)
+{
+	_check_format(GZIP, 0);
+	_check_format(GZIP, 4096); // many access points with windows
+}
+
+static void test_fastq_gzip_members(void)
+{
+	_check_format(GZIP_MEMBERS, 4096);
+}
+
+static void test_fastq_save_load(void)
+{
+	char* path1 = rt_tmp_path("reads_1.fq.gz");
+	char* path2 = rt_tmp_path("reads_2.fq.gz");
+	char* idx_path = rt_tmp_path("reads.fqi");
+	uint64_t chunk_off[N_RECORDS / RECORDS_PER_CHUNK + 1];
+	_write_fastq(path1, GZIP, 0, -1, chunk_off);
+	_write_fastq(path2, GZIP, 1, -1, NULL);
+
+	rapi_fastq_index* idx;
+	RT_CHECK_OK(rapi_fastq_index_build(&idx, path1, path2, RECORDS_PER_CHUNK, 4096, 2));
+	RT_CHECK_OK(rapi_fastq_index_save(idx, idx_path));
+	rapi_fastq_index_free(idx);
+	RT_CHECK_OK(rapi_fastq_index_load(&idx, idx_path));
+	_check_index(idx, path1, path2, chunk_off);
+
+	// a file changed since it was indexed
+	_write_fastq(path2, PLAIN, 1, -1, NULL);
+	rapi_fastq_reader* reader;
+	RT_CHECK(rapi_fastq_reader_open(&reader, idx, path1, path2, 0) != RAPI_NO_ERROR);
+	rapi_fastq_index_free(idx);
+
+	// not an index
+	RT_CHECK(rapi_fastq_index_load(&idx, path1) != RAPI_NO_ERROR);
+
+	remove(path1);
+	remove(path2);
+	remove(idx_path);
+	free(path1);
+	free(path2);
+	free(idx_path);
+}
+
+static void test_fastq_pairs_out_of_sync(void)
+{
+	char* path1 = rt_tmp_path("reads_1.fq");
+	char* path2 = rt_tmp_path("reads_2.fq");
+	_write_fastq(path1, PLAIN, 0, -1, NULL);
+	_write_fastq(path2, PLAIN, 1, 5, NULL);
+
+	rapi_fastq_reader* reader;
+	rapi_batch batch;
+	int n_frags;
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 10));
+	RT_CHECK_OK(rapi_fastq_reader_open(&reader, NULL, path1, path2, 0));
+	RT_CHECK(rapi_fastq_read_batch(reader, &batch, 10, &n_frags) == RAPI_PARAM_ERROR);
+	RT_CHECK_OK(rapi_fastq_reader_close(reader));
+	rapi_reads_free(&batch);
+
+	remove(path1);
+	remove(path2);
+	free(path1);
+	free(path2);
+}
+
+int main(void)
+{
+	rt_init();
+
+	RT_RUN(test_fastq_plain);
+	RT_RUN(test_fastq_gzip);
+	RT_RUN(test_fastq_gzip_members);
+	RT_RUN(test_fastq_save_load);
+	RT_RUN(test_fastq_pairs_out_of_sync);
+
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,172 @@
+/*
+ * test_fragment_callback.c
+ *
+ * Streaming of finished fragments (rapi_aligner_state_set_fragment_callback):
+ * every fragment is reported once, with its final alignments, in index
+ * order when asked.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define N_FRAGS 500
+
+static rapi_ref ref;
+
+typedef struct {
+	pthread_mutex_t lock;
+	const rapi_batch* expected; // final alignments of the batch
+	int* n_reports;             // per fragment
+	rapi_ssize_t last;          // last fragment reported
+	int out_of_order;           // a fragment was reported before a preceding one
+	int wrong_alignments;       // a fragment was reported without its final alignments
+} report_log;
+
+static void _log_fragment(const rapi_batch* batch, rapi_ssize_t frag, void* user_data)
+{
+	report_log* log = user_data;
+	pthread_mutex_lock(&log->lock);
+	log->n_reports[frag] += 1;
+	if (frag < log->last)
+		log->out_of_order = 1;
+	log->last = frag;
+	for (int r = 0; r < batch->n_reads_frag; ++r) {
+		if (!rt_same_alignments(rapi_get_read(batch, frag, r), rapi_get_read(log->expected, frag, r)))
+			log->wrong_alignments = 1;
+	}
+	pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * Align a copy of `expected`, which already has its alignments, with
+ * `state` and the callback set, and check what it was told.  `start` and
+ * `end` delimit the fragments to align.
+ */
+static void _check_reports(const rapi_batch* expected, rapi_aligner_state* state, int in_order, int start, int end)
+{
+	rapi_batch batch;
+	rt_copy_batch(&batch, expected);
+
+	report_log log;
+	pthread_mutex_init(&log.lock, NULL);
+	log.expected = expected;
+	log.n_reports = calloc(expected->n_frags, sizeof(int));
+	log.last = -1;
+	log.out_of_order = log.wrong_alignments = 0;
+
+	RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(state, _log_fragment, &log, in_order));
+	RT_CHECK_OK(rapi_align_reads(&ref, &batch, start, end, state));
+
+	for (int f = 0; f < expected->n_frags; ++f)
+		RT_CHECK(log.n_reports[f] == (f >= start && f < end ? 1 : 0));
+	RT_CHECK(!log.wrong_alignments);
+	if (in_order)
+		RT_CHECK(!log.out_of_order);
+
+	RT_CHECK_OK(rapi_aligner_state_set_fragment_callback(state, NULL, NULL, 0));
+	pthread_mutex_destroy(&log.lock);
+	free(log.n_reports);
+	rapi_reads_free(&batch);
+}
+
+/* Check the reports of aligning `expected` with a new state made with `opts`. */
+static void _check_new_state(const rapi_batch* expected, const rapi_opts* opts, int in_order, int start, int end)
+{
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, opts));
+	_check_reports(expected, state, in_order, start, end);
+	rapi_aligner_state_free(state);
+}
+
+static void test_reports_in_order(void)
+{
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 36);
+	rapi_opts opts;
+	rt_opts_init(&opts, 4);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	_check_new_state(&expected, &opts, 1, 0, N_FRAGS);
+	rt_set_param(&opts, "reorder_reads", 1); // fragments finish out of order
+	_check_new_state(&expected, &opts, 1, 0, N_FRAGS);
+
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+static void test_reports_unordered(void)
+{
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 360);
+	rapi_opts opts;
+	rt_opts_init(&opts, 4);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	_check_new_state(&expected, &opts, 0, 0, N_FRAGS);
+	_check_new_state(&expected, &opts, 0, 100, 200); // a slice of the batch
+
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+/* Duplicates and cache hits are done without alignment work, but are reported all the same. */
+static void test_reports_duplicates_and_cache_hits(void)
+{
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, N_FRAGS, 100, 300, 3600);
+	for (int f = 1; f < N_FRAGS; f += 3) { // every third fragment repeats the one before
+		for (int r = 0; r < 2; ++r) {
+			rapi_read* dup = rapi_get_read(&expected, f, r);
+			const rapi_read* orig = rapi_get_read(&expected, f - 1, r);
+			for (int i = 0; i < dup->length && i < orig->length; ++i)
+				dup->seq[i] = orig->seq[i];
+		}
+	}
+	rapi_opts opts;
+	rt_opts_init(&opts, 4);
+	rt_set_param(&opts, "dedup_reads", 1);
+	rt_set_param(&opts, "result_cache_size", N_FRAGS);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	_check_reports(&expected, state, 1, 0, N_FRAGS); // duplicates
+	_check_reports(&expected, state, 1, 0, N_FRAGS); // all cache hits
+	_check_reports(&expected, state, 0, 0, N_FRAGS);
+	rapi_aligner_state_free(state);
+
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_reports_in_order);
+	RT_RUN(test_reports_unordered);
+	RT_RUN(test_reports_duplicates_and_cache_hits);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,369 @@
+/*
+ * test_host_filter.c
+ *
+ * The host k-mer filter (rapi_host_filter.h):  it holds every k-mer of the
+ * host and few others, survives saving and loading, is rebuilt by
+ * rapi_host_filter_open when the FASTA file or the parameters change, and
+ * keeps host fragments out of the aligner.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // rand_r, getpid, utimensat
+
+#include "test_utils.h"
+
+#include <rapi_host_filter.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define HOST_LEN 20000
+#define QUERY_LEN 100
+#define N_QUERIES 500
+
+static char* host[2];    // the host contigs
+static char* foreign;    // a sequence that isn't in the host
+static char* fasta_path; // host[0] and host[1]
+
+/* Random bases from the high bits of a 64-bit LCG:  rand_r's sequences of nearby seeds share k-mers. */
+static char* _random_seq(int len, uint64_t seed)
+{
+	char* seq = malloc(len + 1);
+	if (NULL == seq)
+		exit(2);
+	for (int i = 0; i < len; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		seq[i] = "ACGT"[seed >> 62];
+	}
+	seq[len] = '\0';
+	return seq;
+}
+
+/* Write the `n` sequences in `seqs` to a FASTA file at `path`, with 60 bases per line;  gzipped if `gz`. */
+static void _write_fasta(const char* path, char* const* seqs, int n, int gz)
+{
+	kstring_t text = { 0, 0, NULL };
+	for (int s = 0; s < n; ++s) {
+		ksprintf(&text, ">contig%d some description\n", s);
+		const int len = strlen(seqs[s]);
+		for (int i = 0; i < len; i += 60) {
+			kputsn(seqs[s] + i, len - i < 60 ? len - i : 60, &text);
+			kputc('\n', &text);
+		}
+	}
+	if (gz) {
+		gzFile f = gzopen(path, "wb");
+		RT_CHECK(f && gzwrite(f, text.s, text.l) == (int)text.l);
+		RT_CHECK(f && gzclose(f) == Z_OK);
+	}
+	else {
+		FILE* f = fopen(path, "w");
+		RT_CHECK(f && fwrite(text.s, 1, text.l, f) == text.l);
+		RT_CHECK(f && fclose(f) == 0);
+	}
+	free(text.s);
+}
+
+static void _reverse_complement(char* seq, int len)
+{
+	for (int i = 0, j = len - 1; i <= j; ++i, --j) {
+		const char a = seq[i], b = seq[j];
+		seq[i] = b == 'A' ? 'T' : b == 'C' ? 'G' : b == 'G' ? 'C' : b == 'T' ? 'A' : b;
+		seq[j] = a == 'A' ? 'T' : a == 'C' ? 'G' : a == 'G' ? 'C' : a == 'T' ? 'A' : a;
+	}
+}
+
+/*
+ * Count the k-mers of random windows of `seq` (forward and reverse
+ * complemented) in `*n_kmers`, and the ones in the filter in `*n_hits`.
+ */
+static void _count_windows(const rapi_host_filter* filter, const char* seq, unsigned seed, long* n_kmers, long* n_hits)
+{
+	char window[QUERY_LEN];
+	*n_kmers = *n_hits = 0;
+	for (int q = 0; q < N_QUERIES; ++q) {
+		memcpy(window, seq + rand_r(&seed) % (HOST_LEN - QUERY_LEN), QUERY_LEN);
+		if (q % 2)
+			_reverse_complement(window, QUERY_LEN);
+		int k, h;
+		rapi_host_filter_count(filter, window, QUERY_LEN, &k, &h);
+		*n_kmers += k;
+		*n_hits += h;
+	}
+}
+
+/* All the host k-mers are in the filter, and about 1% of the others. */
+static void _check_filter(const rapi_host_filter* filter)
+{
+	const int k = rapi_host_filter_k(filter);
+	long n_kmers, n_hits;
+	for (int c = 0; c < 2; ++c) {
+		_count_windows(filter, host[c], 49 + c, &n_kmers, &n_hits);
+		RT_CHECK(n_kmers == (long)N_QUERIES * (QUERY_LEN - k + 1) && n_hits == n_kmers);
+	}
+	_count_windows(filter, foreign, 490, &n_kmers, &n_hits);
+	RT_CHECK(n_kmers == (long)N_QUERIES * (QUERY_LEN - k + 1) && n_hits < n_kmers / 20);
+}
+
+/* Whether `a` and `b` find the same k-mers in the host and in the foreign sequence. */
+static int _same_filter(const rapi_host_filter* a, const rapi_host_filter* b)
+{
+	if (rapi_host_filter_k(a) != rapi_host_filter_k(b) || rapi_host_filter_size(a) != rapi_host_filter_size(b))
+		return 0;
+	const char* seqs[3] = { host[0], host[1], foreign };
+	for (int s = 0; s < 3; ++s) {
+		for (int i = 0; i + QUERY_LEN <= HOST_LEN; i += 7) {
+			int ka, ha, kb, hb;
+			rapi_host_filter_count(a, seqs[s] + i, QUERY_LEN, &ka, &ha);
+			rapi_host_filter_count(b, seqs[s] + i, QUERY_LEN, &kb, &hb);
+			if (ka != kb || ha != hb)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void test_host_filter_build(void)
+{
+	rapi_host_filter* filter;
+	RT_CHECK_OK(rapi_host_filter_build(&filter, fasta_path, RAPI_HOST_FILTER_DEFAULT_K, 0, 2));
+	RT_CHECK(rapi_host_filter_k(filter) == RAPI_HOST_FILTER_DEFAULT_K);
+	RT_CHECK(rapi_host_filter_size(filter) > 0);
+	_check_filter(filter);
+
+	// ambiguous bases interrupt the k-mers
+	char window[QUERY_LEN];
+	memcpy(window, host[0], QUERY_LEN);
+	window[50] = 'N';
+	int n_kmers, n_hits;
+	rapi_host_filter_count(filter, window, QUERY_LEN, &n_kmers, &n_hits);
+	RT_CHECK(n_kmers == 2 * (50 - RAPI_HOST_FILTER_DEFAULT_K) + 1 && n_hits == n_kmers);
+	rapi_host_filter_count(filter, window, 20, &n_kmers, &n_hits);
+	RT_CHECK(n_kmers == 0 && n_hits == 0);
+	rapi_host_filter_free(filter);
+
+	// with a shorter k, a given size, more threads and a gzipped file
+	char* gz_path = rt_tmp_path("host.fa.gz");
+	_write_fasta(gz_path, host, 2, 1);
+	rapi_host_filter* plain;
+	RT_CHECK_OK(rapi_host_filter_build(&plain, fasta_path, 21, 1 << 16, 1));
+	RT_CHECK(rapi_host_filter_k(plain) == 21 && rapi_host_filter_size(plain) == 1 << 16);
+	_check_filter(plain);
+	RT_CHECK_OK(rapi_host_filter_build(&filter, gz_path, 21, 1 << 16, 4));
+	RT_CHECK(_same_filter(filter, plain));
+	rapi_host_filter_free(filter);
+	rapi_host_filter_free(plain);
+	remove(gz_path);
+	free(gz_path);
+
+	RT_CHECK(rapi_host_filter_build(&filter, fasta_path, RAPI_HOST_FILTER_MAX_K + 1, 0, 1) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_host_filter_build(&filter, "no_such_file.fa", 21, 0, 1) == RAPI_GENERIC_ERROR);
+}
+
+static void test_host_filter_save_load(void)
+{
+	rapi_host_filter* filter;
+	rapi_host_filter* loaded;
+	RT_CHECK_OK(rapi_host_filter_build(&filter, fasta_path, 25, 0, 2));
+	char* path = rt_tmp_path("filter.bloom");
+	RT_CHECK_OK(rapi_host_filter_save(filter, path));
+	RT_CHECK_OK(rapi_host_filter_load(&loaded, path));
+	RT_CHECK(_same_filter(loaded, filter));
+	rapi_host_filter_free(loaded);
+
+	// the temporary file is gone
+	kstring_t tmp_path = { 0, 0, NULL };
+	ksprintf(&tmp_path, "%s.%ld.tmp", path, (long)getpid());
+	struct stat st;
+	RT_CHECK(stat(tmp_path.s, &st) != 0);
+	free(tmp_path.s);
+
+	// truncated
+	RT_CHECK(stat(path, &st) == 0);
+	RT_CHECK(truncate(path, st.st_size - 1) == 0);
+	RT_CHECK(rapi_host_filter_load(&loaded, path) == RAPI_GENERIC_ERROR);
+	// not a filter
+	FILE* f = fopen(path, "w");
+	RT_CHECK(f && fputs("not a filter, but long enough to hold a header", f) >= 0);
+	RT_CHECK(f && fclose(f) == 0);
+	RT_CHECK(rapi_host_filter_load(&loaded, path) == RAPI_GENERIC_ERROR);
+	RT_CHECK(rapi_host_filter_load(&loaded, "no_such_file.bloom") == RAPI_GENERIC_ERROR);
+
+	remove(path);
+	free(path);
+	rapi_host_filter_free(filter);
+}
+
+/* The inode of the saved filter of `fasta`:  a new one when rapi_host_filter_open saves again. */
+static ino_t _saved_inode(const char* fasta)
+{
+	kstring_t path = { 0, 0, NULL };
+	ksprintf(&path, "%s.bloom", fasta);
+	struct stat st;
+	const int found = stat(path.s, &st) == 0;
+	free(path.s);
+	RT_CHECK(found);
+	return found ? st.st_ino : 0;
+}
+
+/* Open the filter of `fasta` and return whether it was built rather than loaded. */
+static int _open_builds(const char* fasta, int k, size_t n_bytes)
+{
+	const ino_t before = _saved_inode(fasta);
+	rapi_host_filter* filter;
+	RT_CHECK_OK(rapi_host_filter_open(&filter, fasta, k, n_bytes, 2));
+	RT_CHECK(rapi_host_filter_k(filter) == k);
+	if (n_bytes > 0)
+		RT_CHECK(rapi_host_filter_size(filter) == n_bytes);
+	_check_filter(filter);
+	rapi_host_filter_free(filter);
+	return _saved_inode(fasta) != before;
+}
+
+static void test_host_filter_open(void)
+{
+	char* fasta = rt_tmp_path("open.fa");
+	kstring_t saved = { 0, 0, NULL };
+	ksprintf(&saved, "%s.bloom", fasta);
+	_write_fasta(fasta, host, 2, 0);
+
+	rapi_host_filter* filter;
+	RT_CHECK_OK(rapi_host_filter_open(&filter, fasta, 25, 0, 2));
+	rapi_host_filter* loaded;
+	RT_CHECK_OK(rapi_host_filter_load(&loaded, saved.s));
+	RT_CHECK(_same_filter(loaded, filter));
+	rapi_host_filter_free(loaded);
+	rapi_host_filter_free(filter);
+
+	RT_CHECK(!_open_builds(fasta, 25, 0));        // the same:  loaded
+	RT_CHECK(_open_builds(fasta, 27, 0));         // another k
+	RT_CHECK(!_open_builds(fasta, 27, 0));
+	RT_CHECK(_open_builds(fasta, 27, 1 << 16));   // another size
+	RT_CHECK(!_open_builds(fasta, 27, 1 << 16));
+
+	// the FASTA file changes:  its size, or just its modification time
+	char* seqs[3] = { host[0], host[1], _random_seq(1000, 4903) };
+	_write_fasta(fasta, seqs, 3, 0);
+	RT_CHECK(_open_builds(fasta, 27, 1 << 16));
+	RT_CHECK_OK(rapi_host_filter_open(&filter, fasta, 27, 1 << 16, 2));
+	int n_kmers, n_hits;
+	rapi_host_filter_count(filter, seqs[2], QUERY_LEN, &n_kmers, &n_hits);
+	RT_CHECK(n_kmers > 0 && n_hits == n_kmers);
+	rapi_host_filter_free(filter);
+	free(seqs[2]);
+	_write_fasta(fasta, host, 2, 0);
+	RT_CHECK(_open_builds(fasta, 27, 1 << 16));
+	const struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+	RT_CHECK(utimensat(AT_FDCWD, fasta, times, 0) == 0);
+	RT_CHECK(_open_builds(fasta, 27, 1 << 16));
+	RT_CHECK(!_open_builds(fasta, 27, 1 << 16));
+
+	// a damaged file is replaced
+	FILE* f = fopen(saved.s, "w");
+	RT_CHECK(f && fclose(f) == 0);
+	RT_CHECK(_open_builds(fasta, 27, 1 << 16));
+
+	remove(saved.s);
+	remove(fasta);
+	free(saved.s);
+	free(fasta);
+}
+
+/* Fragments from the host are marked and left without alignments;  the others are aligned as usual. */
+static void test_host_filter_aligner(void)
+{
+	rapi_ref ref;
+	rt_load_mini_ref(&ref);
+	int len;
+	char* ref_seq = rt_mini_ref_seq(&len);
+	ref_seq[len / 2] = '\0';
+	char* host_path = rt_tmp_path("first_half.fa");
+	_write_fasta(host_path, &ref_seq, 1, 0);
+	free(ref_seq);
+	rapi_host_filter* filter;
+	RT_CHECK_OK(rapi_host_filter_build(&filter, host_path, 25, 0, 2));
+	remove(host_path);
+	free(host_path);
+
+	rapi_batch expected, batch;
+	rt_simulated_pairs(&expected, 600, 100, 300, 49);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+	rt_copy_batch(&batch, &expected);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_host_filter(state, filter, 0.5));
+	RT_CHECK_OK(rapi_align_reads(&ref, &batch, 0, batch.n_frags, state));
+
+	int n_host = 0, n_wrong = 0;
+	for (int f = 0; f < batch.n_frags; ++f) {
+		const rapi_read* reads = rapi_get_read(&batch, f, 0);
+		const rapi_read* exp = rapi_get_read(&expected, f, 0);
+		n_host += reads[0].host;
+		n_wrong += reads[1].host != reads[0].host;
+		// a pair aligned well inside one half is host exactly if that's the first half
+		const int aligned = exp[0].n_alignments > 0 && exp[0].alignments[0].mapq > 0 && exp[0].alignments[0].mapped;
+		if (aligned && exp[0].alignments[0].pos < len / 2 - 1000)
+			n_wrong += !reads[0].host;
+		if (aligned && exp[0].alignments[0].pos > len / 2 + 1000)
+			n_wrong += reads[0].host;
+		for (int r = 0; r < 2; ++r) {
+			if (reads[0].host)
+				n_wrong += reads[r].n_alignments != 0;
+			else
+				n_wrong += !rt_same_alignments(&reads[r], &exp[r]);
+		}
+	}
+	RT_CHECK(n_wrong == 0);
+	RT_CHECK(n_host > 0 && n_host < batch.n_frags);
+
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+	rapi_reads_free(&expected);
+	rapi_host_filter_free(filter);
+	rapi_ref_free(&ref);
+}
+
+int main(void)
+{
+	rt_init();
+	host[0] = _random_seq(HOST_LEN, 4900);
+	host[1] = _random_seq(HOST_LEN, 4901);
+	foreign = _random_seq(HOST_LEN, 4902);
+	fasta_path = rt_tmp_path("host.fa");
+	_write_fasta(fasta_path, host, 2, 0);
+
+	RT_RUN(test_host_filter_build);
+	RT_RUN(test_host_filter_save_load);
+	RT_RUN(test_host_filter_open);
+	RT_RUN(test_host_filter_aligner);
+
+	remove(fasta_path);
+	free(fasta_path);
+	free(foreign);
+	free(host[1]);
+	free(host[0]);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,200 @@
+/*
+ * test_kmer_index.c
+ *
+ * The k-mer fast path (kmer_fast_path) and its index file.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FRAGS 500
+#define KMER_FILE RT_MINI_REF ".kmer"
+
+static rapi_ref ref;
+
+static void _opts(rapi_opts* opts, int fast_path)
+{
+	rt_opts_init(opts, 2);
+	rt_set_param(opts, "kmer_fast_path", fast_path);
+}
+
+/* Fill `se` with the first reads of `n_frags` simulated pairs, with reads of `read_len` bases. */
+static void _simulated_reads(rapi_batch* se, int n_frags, int read_len, unsigned seed)
+{
+	rapi_batch pairs;
+	rt_simulated_pairs(&pairs, n_frags, read_len, 3 * read_len, seed);
+	if (rapi_reads_alloc(se, 1, n_frags) != RAPI_NO_ERROR)
+		exit(2);
+	for (rapi_ssize_t f = 0; f < n_frags; ++f) {
+		const rapi_read* read = rapi_get_read(&pairs, f, 0);
+		if (rapi_set_read(se, f, 0, read->id, read->seq, read->qual, 33) != RAPI_NO_ERROR)
+			exit(2);
+	}
+	rapi_reads_free(&pairs);
+}
+
+/* Same placement and cigar;  the scores may differ. */
+static int _same_placement(const rapi_read* a, const rapi_read* b)
+{
+	if (a->n_alignments == 0 || b->n_alignments == 0)
+		return a->n_alignments == b->n_alignments;
+	const rapi_alignment* x = &a->alignments[0];
+	const rapi_alignment* y = &b->alignments[0];
+	if (x->mapped != y->mapped || x->contig != y->contig || x->pos != y->pos
+	    || x->reverse_strand != y->reverse_strand || x->n_cigar_ops != y->n_cigar_ops)
+		return 0;
+	for (int c = 0; c < x->n_cigar_ops; ++c) {
+		if (x->cigar_ops[c].op != y->cigar_ops[c].op || x->cigar_ops[c].len != y->cigar_ops[c].len)
+			return 0;
+	}
+	return 1;
+}
+
+/* Align `read_len`-base reads with and without the fast path and compare the placements. */
+static void _check_placements(int read_len, unsigned seed)
+{
+	rapi_batch plain, fast;
+	_simulated_reads(&plain, N_FRAGS, read_len, seed);
+	rt_copy_batch(&fast, &plain);
+
+	rapi_opts opts;
+	_opts(&opts, 0);
+	RT_CHECK_OK(rt_align(&ref, &plain, &opts));
+	rapi_opts_free(&opts);
+
+	rapi_aligner_state* state;
+	_opts(&opts, 1);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, &fast, 0, fast.n_frags, state));
+	RT_CHECK(rt_get_stat(state, "kmer_hits") > 0);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+
+	for (rapi_ssize_t f = 0; f < plain.n_frags; ++f) {
+		const rapi_read* a = rapi_get_read(&plain, f, 0);
+		const rapi_read* b = rapi_get_read(&fast, f, 0);
+		RT_CHECK(_same_placement(a, b));
+		// the fast path doesn't look for other hits, so it can't be surer than BWA
+		if (a->n_alignments > 0 && b->n_alignments > 0)
+			RT_CHECK(b->alignments[0].mapq <= a->alignments[0].mapq);
+	}
+
+	rapi_reads_free(&fast);
+	rapi_reads_free(&plain);
+}
+
+static void test_kmer_fast_path_placements(void)
+{
+	_check_placements(100, 32);
+}
+
+/* Reads too long for rapi_kmer_index_place's stack buffer. */
+static void test_kmer_fast_path_long_reads(void)
+{
+	_check_placements(700, 320);
+}
+
+static int _file_has_magic(const char* path, const char* magic)
+{
+	FILE* f = fopen(path, "rb");
+	if (NULL == f)
+		return 0;
+	char buf[8];
+	int ok = fread(buf, sizeof(buf), 1, f) == 1 && memcmp(buf, magic, sizeof(buf)) == 0;
+	fclose(f);
+	return ok;
+}
+
+static void test_kmer_index_file(void)
+{
+	remove(KMER_FILE);
+	rapi_batch batch;
+	_simulated_reads(&batch, 50, 100, 320);
+	rapi_opts opts;
+	_opts(&opts, 1);
+
+	RT_CHECK_OK(rt_align(&ref, &batch, &opts));
+	RT_CHECK(_file_has_magic(KMER_FILE, "RAPIKMR2"));
+
+	// a stale or broken file is replaced
+	FILE* f = fopen(KMER_FILE, "wb");
+	RT_CHECK(f != NULL);
+	if (f) {
+		fputs("RAPIKMR1 not an index", f);
+		fclose(f);
+	}
+	rapi_reads_free(&batch);
+	_simulated_reads(&batch, 50, 100, 320);
+	RT_CHECK_OK(rt_align(&ref, &batch, &opts));
+	RT_CHECK(_file_has_magic(KMER_FILE, "RAPIKMR2"));
+
+	rapi_opts_free(&opts);
+	rapi_reads_free(&batch);
+	remove(KMER_FILE);
+}
+
+/* A state keeps working when its reference is freed and loaded again. */
+static void test_kmer_index_ref_reload(void)
+{
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	_opts(&opts, 1);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+
+	rapi_batch first, second;
+	_simulated_reads(&first, 100, 100, 3200);
+	rt_copy_batch(&second, &first);
+
+	rapi_ref other;
+	rt_load_mini_ref(&other);
+	RT_CHECK_OK(rapi_align_reads(&other, &first, 0, first.n_frags, state));
+	rapi_ref_free(&other);
+	rt_load_mini_ref(&other);
+	RT_CHECK_OK(rapi_align_reads(&other, &second, 0, second.n_frags, state));
+	RT_CHECK(rt_same_batch_alignments(&first, &second));
+	for (rapi_ssize_t f = 0; f < second.n_frags; ++f) {
+		const rapi_read* read = rapi_get_read(&second, f, 0);
+		RT_CHECK(read->n_alignments == 0 || NULL == read->alignments[0].contig
+		         || read->alignments[0].contig == &other.contigs[0]);
+	}
+	rapi_ref_free(&other);
+
+	rapi_reads_free(&second);
+	rapi_reads_free(&first);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	remove(KMER_FILE);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_kmer_fast_path_placements);
+	RT_RUN(test_kmer_fast_path_long_reads);
+	RT_RUN(test_kmer_index_file);
+	RT_RUN(test_kmer_index_ref_reload);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,243 @@
+/*
+ * test_metrics.c
+ *
+ * QC metrics (rapi_metrics.h) of hand-built alignments against a made-up
+ * reference:  flagstat counts, the MAPQ and insert size histograms and the
+ * coverage bins have exact expected values, and collectors forked, filled
+ * and merged end up with the same counts as one filled directly.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_metrics.h>
+
+#include <string.h>
+
+#define BIN_SIZE 100
+#define MAX_ISIZE 500
+#define N_FRAGS 5
+
+static rapi_contig contigs[2] = {
+	{ .name = "chr1", .len = 1000 },
+	{ .name = "chr2", .len = 250 },
+};
+static rapi_ref ref = { .path = "made-up", .n_contigs = 2, .contigs = contigs };
+
+static rapi_cigar cig_50m[] = { { RAPI_CIG_M, 50 } };
+static rapi_cigar cig_del[] = { { RAPI_CIG_M, 30 }, { RAPI_CIG_D, 5 }, { RAPI_CIG_M, 20 } };
+static rapi_cigar cig_clip[] = { { RAPI_CIG_S, 10 }, { RAPI_CIG_M, 40 } };
+
+static rapi_alignment _aln(int contig, rapi_ssize_t pos, int mapq, int reverse, rapi_cigar* cigar, int n_ops)
+{
+	rapi_alignment aln;
+	memset(&aln, 0, sizeof(aln));
+	aln.contig = &contigs[contig];
+	aln.pos = pos;
+	aln.mapq = mapq;
+	aln.mapped = 1;
+	aln.paired = 1;
+	aln.reverse_strand = reverse;
+	aln.cigar_ops = cigar;
+	aln.n_cigar_ops = n_ops;
+	return aln;
+}
+
+/*
+ * Pairs, by fragment:
+ *   0. proper pair on chr1, 81 50M (spans bins 0 and 1) and 301 50M reverse;
+ *      insert size 270;
+ *   1. read 1 on chr1 at 951 30M5D20M (runs off the contig end), with a
+ *      supplementary alignment on chr2 at 1 10S40M and a secondary one on
+ *      chr2;  read 2 unmapped;
+ *   2. read 1 on chr1 at 501, read 2 on chr2 at 101 with MAPQ 4;
+ *   3. a duplicate proper pair on chr1, 101 and 601 reverse:  insert size
+ *      550, counted in the last bin, and no coverage;
+ *   4. both reads unmapped.
+ */
+static rapi_alignment alns[N_FRAGS][2][3];
+static rapi_read reads[N_FRAGS][2];
+
+static void _build_reads(void)
+{
+	memset(alns, 0, sizeof(alns));
+	memset(reads, 0, sizeof(reads));
+
+	alns[0][0][0] = _aln(0, 81, 60, 0, cig_50m, 1);
+	alns[0][1][0] = _aln(0, 301, 30, 1, cig_50m, 1);
+	alns[0][0][0].prop_paired = alns[0][1][0].prop_paired = 1;
+
+	alns[1][0][0] = _aln(0, 951, 3, 0, cig_del, 3);
+	alns[1][0][1] = _aln(1, 1, 3, 0, cig_clip, 2);
+	alns[1][0][2] = _aln(1, 201, 0, 0, cig_50m, 1);
+	alns[1][0][2].secondary_aln = 1;
+
+	alns[2][0][0] = _aln(0, 501, 20, 0, cig_50m, 1);
+	alns[2][1][0] = _aln(1, 101, 4, 1, cig_50m, 1);
+
+	alns[3][0][0] = _aln(0, 101, 60, 0, cig_50m, 1);
+	alns[3][1][0] = _aln(0, 601, 30, 1, cig_50m, 1);
+	for (int r = 0; r < 2; ++r)
+		alns[3][r][0].prop_paired = alns[3][r][0].duplicate = 1;
+
+	static const int n_alns[N_FRAGS][2] = { { 1, 1 }, { 3, 0 }, { 1, 1 }, { 1, 1 }, { 0, 0 } };
+	for (int f = 0; f < N_FRAGS; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			reads[f][r].length = 50;
+			reads[f][r].alignments = alns[f][r];
+			reads[f][r].n_alignments = n_alns[f][r];
+		}
+	}
+}
+
+/* Whether `metrics` has exactly the counts of the fragments built above. */
+static void _check_counts(const rapi_metrics* metrics)
+{
+	const rapi_flagstat* fs = rapi_metrics_flagstat(metrics);
+	RT_CHECK(fs->n_records == 12);
+	RT_CHECK(fs->n_secondary == 1);
+	RT_CHECK(fs->n_supplementary == 1);
+	RT_CHECK(fs->n_duplicates == 2);
+	RT_CHECK(fs->n_mapped == 9);
+	RT_CHECK(fs->n_paired == 10);
+	RT_CHECK(fs->n_read1 == 5);
+	RT_CHECK(fs->n_read2 == 5);
+	RT_CHECK(fs->n_proper_pairs == 4);
+	RT_CHECK(fs->n_both_mapped == 6);
+	RT_CHECK(fs->n_singletons == 1);
+	RT_CHECK(fs->n_mate_other_contig == 2);
+	RT_CHECK(fs->n_mate_other_contig_q5 == 1);
+
+	uint64_t mapq[RAPI_METRICS_MAPQ_BINS] = { 0 };
+	mapq[60] = 2;
+	mapq[30] = 2;
+	mapq[20] = 1;
+	mapq[4] = 1;
+	mapq[3] = 1;
+	RT_CHECK(memcmp(rapi_metrics_mapq_histogram(metrics), mapq, sizeof(mapq)) == 0);
+
+	int n_isize_bins = 0;
+	const uint64_t* isize = rapi_metrics_insert_size_histogram(metrics, &n_isize_bins);
+	RT_CHECK(n_isize_bins == MAX_ISIZE + 1);
+	uint64_t n_pairs = 0;
+	for (int i = 0; i < n_isize_bins; ++i)
+		n_pairs += isize[i];
+	RT_CHECK(n_pairs == 2 && isize[270] == 1 && isize[MAX_ISIZE] == 1);
+
+	static const uint64_t chr1_cov[] = { 20, 30, 0, 50, 0, 50, 0, 0, 0, 45 };
+	static const uint64_t chr2_cov[] = { 40, 50, 0 };
+	rapi_ssize_t n_bins = 0;
+	const uint64_t* cov = rapi_metrics_coverage(metrics, 0, &n_bins);
+	RT_CHECK(cov && n_bins == 10 && memcmp(cov, chr1_cov, sizeof(chr1_cov)) == 0);
+	cov = rapi_metrics_coverage(metrics, 1, &n_bins);
+	RT_CHECK(cov && n_bins == 3 && memcmp(cov, chr2_cov, sizeof(chr2_cov)) == 0);
+}
+
+static void test_metrics_counts(void)
+{
+	rapi_metrics* metrics;
+	RT_CHECK_OK(rapi_metrics_init(&metrics, &ref, BIN_SIZE, MAX_ISIZE));
+	RT_CHECK(rapi_metrics_coverage_bin_size(metrics) == BIN_SIZE);
+	for (int f = 0; f < N_FRAGS; ++f)
+		RT_CHECK_OK(rapi_metrics_add_fragment(metrics, reads[f], 2));
+	_check_counts(metrics);
+
+	RT_CHECK_OK(rapi_metrics_clear(metrics));
+	RT_CHECK(rapi_metrics_flagstat(metrics)->n_records == 0);
+	rapi_ssize_t n_bins = 0;
+	RT_CHECK(rapi_metrics_coverage(metrics, 0, &n_bins)[1] == 0);
+	rapi_metrics_free(metrics);
+}
+
+/* Unpaired reads only count as records, mapped or not. */
+static void test_metrics_single_reads(void)
+{
+	rapi_metrics* metrics;
+	RT_CHECK_OK(rapi_metrics_init(&metrics, &ref, BIN_SIZE, MAX_ISIZE));
+	RT_CHECK_OK(rapi_metrics_add_fragment(metrics, &reads[0][0], 1));
+	RT_CHECK_OK(rapi_metrics_add_fragment(metrics, &reads[4][0], 1));
+
+	const rapi_flagstat* fs = rapi_metrics_flagstat(metrics);
+	RT_CHECK(fs->n_records == 2 && fs->n_mapped == 1);
+	RT_CHECK(fs->n_paired == 0 && fs->n_read1 == 0 && fs->n_singletons == 0);
+	RT_CHECK(rapi_metrics_mapq_histogram(metrics)[60] == 1);
+	rapi_ssize_t n_bins = 0;
+	const uint64_t* cov = rapi_metrics_coverage(metrics, 0, &n_bins);
+	RT_CHECK(cov[0] == 20 && cov[1] == 30);
+	rapi_metrics_free(metrics);
+}
+
+/* Fragments split between two forks and merged give the same counts. */
+static void test_metrics_fork_merge(void)
+{
+	rapi_metrics* metrics;
+	RT_CHECK_OK(rapi_metrics_init(&metrics, &ref, BIN_SIZE, MAX_ISIZE));
+	rapi_metrics* forks[2];
+	for (int t = 0; t < 2; ++t)
+		RT_CHECK_OK(rapi_metrics_fork(&forks[t], metrics));
+	for (int f = 0; f < N_FRAGS; ++f)
+		RT_CHECK_OK(rapi_metrics_add_fragment(forks[f % 2], reads[f], 2));
+
+	rapi_ssize_t n_bins = 0;
+	RT_CHECK(rapi_metrics_coverage(forks[0], 0, &n_bins) == NULL);
+	RT_CHECK(rapi_metrics_merge(forks[0], metrics) == RAPI_PARAM_ERROR);
+
+	for (int t = 0; t < 2; ++t) {
+		RT_CHECK_OK(rapi_metrics_merge(metrics, forks[t]));
+		RT_CHECK(rapi_metrics_flagstat(forks[t])->n_records == 0);
+	}
+	_check_counts(metrics);
+
+	// a merged fork starts over
+	RT_CHECK_OK(rapi_metrics_merge(metrics, forks[0]));
+	_check_counts(metrics);
+
+	for (int t = 0; t < 2; ++t)
+		rapi_metrics_free(forks[t]);
+	rapi_metrics_free(metrics);
+}
+
+static void test_metrics_errors(void)
+{
+	rapi_metrics* metrics;
+	RT_CHECK(rapi_metrics_init(&metrics, &ref, 0, MAX_ISIZE) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_metrics_init(&metrics, &ref, BIN_SIZE, -1) == RAPI_PARAM_ERROR);
+	RT_CHECK_OK(rapi_metrics_init(&metrics, &ref, BIN_SIZE, MAX_ISIZE));
+	RT_CHECK(rapi_metrics_add_fragment(metrics, reads[0], 3) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_metrics_coverage(metrics, 2, &(rapi_ssize_t){ 0 }) == NULL);
+
+	rapi_metrics* other;
+	RT_CHECK_OK(rapi_metrics_init(&other, &ref, BIN_SIZE * 2, MAX_ISIZE));
+	RT_CHECK(rapi_metrics_merge(metrics, other) == RAPI_PARAM_ERROR);
+	rapi_metrics_free(other);
+	rapi_metrics_free(metrics);
+}
+
+int main(void)
+{
+	rt_init();
+	_build_reads();
+
+	RT_RUN(test_metrics_counts);
+	RT_RUN(test_metrics_single_reads);
+	RT_RUN(test_metrics_fork_merge);
+	RT_RUN(test_metrics_errors);
+
+	rapi_shutdown();
+	return RT_RESULT();
+}
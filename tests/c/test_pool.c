@@ -0,0 +1,138 @@
+/*
+ * test_pool.c
+ *
+ * The multi-process pool (rapi_pool):  its alignments don't depend on the
+ * number of workers, since they pair reads with one shared insert size
+ * model, and match a direct rapi_align_reads when that model is estimated
+ * from the whole batch.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_pool.h>
+
+#define RING_SIZE (1 << 20)
+
+static rapi_ref ref; // for the direct alignments
+
+/*
+ * Whether the reads of `a` and `b` in [start, end) got the same alignments,
+ * for the reads `b` places uniquely.  Repeats may be placed differently,
+ * since the tie-breaking depends on the position in the batch.
+ */
+static int _same_unique_alignments(const rapi_batch* a, const rapi_batch* b, int start, int end)
+{
+	for (int f = start; f < end; ++f) {
+		for (int r = 0; r < b->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(a, f, r);
+			const rapi_read* expected = rapi_get_read(b, f, r);
+			if (expected->n_alignments > 0 && expected->alignments[0].mapq > 0) {
+				if (!rt_same_alignments(read, expected))
+					return 0;
+			}
+			else if ((read->n_alignments > 0) != (expected->n_alignments > 0))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Align fragments [start, end) of a copy of `reads` with a new pool of `n_workers`. */
+static void _pool_align(rapi_batch* batch, const rapi_batch* reads, const rapi_opts* opts,
+		int n_workers, int start, int end)
+{
+	rapi_pool* pool;
+	rt_copy_batch(batch, reads);
+	RT_CHECK_OK(rapi_pool_init(&pool, RT_MINI_REF, opts, n_workers, RING_SIZE));
+	RT_CHECK_OK(rapi_pool_align_reads(pool, batch, start, end));
+	RT_CHECK_OK(rapi_pool_free(pool));
+}
+
+/* A batch smaller than the sample:  the shared model is the whole batch's, as in rapi_align_reads. */
+static void test_pool_same_as_direct(void)
+{
+	rapi_batch expected, batch;
+	rt_simulated_pairs(&expected, 600, 100, 300, 39);
+	rapi_opts opts;
+	rt_opts_init(&opts, 4);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	_pool_align(&batch, &expected, &opts, 3, 0, expected.n_frags);
+	RT_CHECK(_same_unique_alignments(&batch, &expected, 0, expected.n_frags));
+
+	rapi_reads_free(&batch);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+/* A batch larger than the sample:  one worker or three pair the reads the same way. */
+static void test_pool_independent_of_workers(void)
+{
+	rapi_batch reads, one, three;
+	rt_simulated_pairs(&reads, 5000, 100, 300, 390);
+	rapi_opts opts;
+	rt_opts_init(&opts, 3);
+
+	_pool_align(&one, &reads, &opts, 1, 0, reads.n_frags);
+	_pool_align(&three, &reads, &opts, 3, 0, reads.n_frags);
+	RT_CHECK(rt_n_mapped(&one) > 0);
+	RT_CHECK(_same_unique_alignments(&three, &one, 0, reads.n_frags));
+
+	rapi_reads_free(&three);
+	rapi_reads_free(&one);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&reads);
+}
+
+static void test_pool_slice(void)
+{
+	rapi_batch expected, batch;
+	rt_simulated_pairs(&expected, 400, 100, 300, 3900);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	// a fixed model, so that the slice pairs reads as the whole batch does
+	rt_set_param_dbl(&opts, "isize_mean", 300);
+	rt_set_param_dbl(&opts, "isize_std", 30);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+
+	_pool_align(&batch, &expected, &opts, 2, 100, 300);
+	RT_CHECK(_same_unique_alignments(&batch, &expected, 100, 300));
+	for (int f = 0; f < expected.n_frags; ++f) {
+		if (f < 100 || f >= 300)
+			RT_CHECK(rapi_get_read(&batch, f, 0)->n_alignments == 0 && rapi_get_read(&batch, f, 1)->n_alignments == 0);
+	}
+
+	rapi_reads_free(&batch);
+	rapi_opts_free(&opts);
+	rapi_reads_free(&expected);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_pool_same_as_direct);
+	RT_RUN(test_pool_independent_of_workers);
+	RT_RUN(test_pool_slice);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
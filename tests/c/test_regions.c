@@ -0,0 +1,368 @@
+/*
+ * test_regions.c
+ *
+ * Target regions (rapi_regions.h):  the interval tree answers overlap
+ * queries as a linear scan does, BED files are parsed and checked against
+ * the reference, and the aligner marks or drops the fragments that miss
+ * the regions.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // rand_r
+
+#include "test_utils.h"
+
+#include <rapi_regions.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CONTIG_LEN 1000000
+#define N_QUERIES 2000
+
+static rapi_contig contigs[3] = { { "ctg0", CONTIG_LEN }, { "ctg1", CONTIG_LEN }, { "ctg2", CONTIG_LEN } };
+static rapi_ref fake_ref = { "in-memory", 3, contigs, NULL };
+static rapi_ref ref; // the mini reference, for the aligner tests
+
+typedef struct {
+	int contig;
+	int64_t start, end;
+} interval;
+
+static int _scan_overlaps(const interval* a, int n, int contig, int64_t start, int64_t end)
+{
+	for (int i = 0; i < n; ++i) {
+		if (a[i].contig == contig && a[i].start < end && start < a[i].end)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * `n` random intervals on contigs 0 and 1 (contig 2 stays empty), most of
+ * them short, some spanning many others;  check random queries against a
+ * scan.
+ */
+static void _check_random(int n, unsigned seed)
+{
+	interval* a = malloc((n > 0 ? n : 1) * sizeof(a[0]));
+	if (NULL == a)
+		exit(2);
+	rapi_regions* regions;
+	RT_CHECK_OK(rapi_regions_init(&regions, &fake_ref));
+	for (int i = 0; i < n; ++i) {
+		a[i].contig = rand_r(&seed) % 2;
+		a[i].start = rand_r(&seed) % CONTIG_LEN;
+		const int64_t len = rand_r(&seed) % 10 == 0 ? rand_r(&seed) % 100000 : rand_r(&seed) % 300;
+		a[i].end = a[i].start + len; // may be empty
+		RT_CHECK_OK(rapi_regions_add(regions, a[i].contig, a[i].start, a[i].end));
+	}
+	RT_CHECK(rapi_regions_size(regions) == n);
+	RT_CHECK_OK(rapi_regions_index(regions));
+
+	int n_wrong = 0;
+	for (int q = 0; q < N_QUERIES; ++q) {
+		const int contig = rand_r(&seed) % 3;
+		const int64_t start = rand_r(&seed) % CONTIG_LEN;
+		const int64_t end = start + 1 + rand_r(&seed) % 500;
+		n_wrong += rapi_regions_overlaps(regions, contig, start, end) != _scan_overlaps(a, n, contig, start, end);
+	}
+	// the ends of the intervals, where off-by-one errors show
+	for (int i = 0; i < n; ++i) {
+		const interval* x = &a[i];
+		n_wrong += rapi_regions_overlaps(regions, x->contig, x->end, x->end + 1) != _scan_overlaps(a, n, x->contig, x->end, x->end + 1);
+		if (x->start > 0)
+			n_wrong += rapi_regions_overlaps(regions, x->contig, x->start - 1, x->start) != _scan_overlaps(a, n, x->contig, x->start - 1, x->start);
+	}
+	RT_CHECK(n_wrong == 0);
+
+	rapi_regions_free(regions);
+	free(a);
+}
+
+static void test_regions_same_as_scan(void)
+{
+	// empty, tiny, around powers of 2 (partially filled trees) and past the linear scan threshold
+	const int sizes[] = { 0, 1, 2, 3, 15, 16, 17, 31, 255, 256, 257, 1000, 5000 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+		_check_random(sizes[s], 48 + s);
+}
+
+/* A long interval at the start covers queries far to its right, past shorter intervals. */
+static void test_regions_nested(void)
+{
+	rapi_regions* regions;
+	RT_CHECK_OK(rapi_regions_init(&regions, &fake_ref));
+	RT_CHECK_OK(rapi_regions_add(regions, 0, 0, 500000));
+	for (int i = 0; i < 1000; ++i)
+		RT_CHECK_OK(rapi_regions_add(regions, 0, 10 + 100 * i, 20 + 100 * i));
+	RT_CHECK_OK(rapi_regions_add(regions, 1, 100, 200));
+	RT_CHECK_OK(rapi_regions_index(regions));
+
+	RT_CHECK(rapi_regions_overlaps(regions, 0, 499999, 500010));
+	RT_CHECK(!rapi_regions_overlaps(regions, 0, 500000, 500010));
+	RT_CHECK(rapi_regions_overlaps(regions, 0, 200000, 200001));
+	RT_CHECK(!rapi_regions_overlaps(regions, 1, 0, 100));
+	RT_CHECK(rapi_regions_overlaps(regions, 1, 0, 101));
+	RT_CHECK(rapi_regions_overlaps(regions, 1, 199, 1000));
+	RT_CHECK(!rapi_regions_overlaps(regions, 1, 200, 1000));
+	RT_CHECK(!rapi_regions_overlaps(regions, 2, 0, CONTIG_LEN));
+	rapi_regions_free(regions);
+}
+
+static void test_regions_errors(void)
+{
+	rapi_regions* regions;
+	RT_CHECK(rapi_regions_init(&regions, NULL) == RAPI_PARAM_ERROR);
+	RT_CHECK_OK(rapi_regions_init(&regions, &fake_ref));
+	RT_CHECK(rapi_regions_add(regions, -1, 0, 10) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_regions_add(regions, 3, 0, 10) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_regions_add(regions, 0, -1, 10) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_regions_add(regions, 0, 20, 10) == RAPI_PARAM_ERROR);
+	RT_CHECK(rapi_regions_size(regions) == 0);
+
+	RT_CHECK_OK(rapi_regions_add(regions, 0, 0, 10));
+	RT_CHECK(!rapi_regions_indexed(regions));
+	RT_CHECK(!rapi_regions_overlaps(regions, 0, 0, 10)); // not indexed
+	RT_CHECK_OK(rapi_regions_index(regions));
+	RT_CHECK(rapi_regions_indexed(regions) && rapi_regions_overlaps(regions, 0, 0, 10));
+	RT_CHECK(!rapi_regions_overlaps(regions, 5, 0, 10));
+
+	RT_CHECK_OK(rapi_regions_add(regions, 1, 0, 10)); // needs indexing again
+	RT_CHECK(!rapi_regions_indexed(regions));
+	RT_CHECK_OK(rapi_regions_index(regions));
+	RT_CHECK(rapi_regions_overlaps(regions, 1, 5, 6));
+	rapi_regions_free(regions);
+}
+
+/* Write `text` to a temporary BED file and load it into new regions;  returns the error. */
+static rapi_error_t _load_bed(const char* text, rapi_regions** ret_regions)
+{
+	char* path = rt_tmp_path("regions.bed");
+	FILE* f = fopen(path, "w");
+	RT_CHECK(f && fputs(text, f) >= 0);
+	RT_CHECK(f && fclose(f) == 0);
+	RT_CHECK_OK(rapi_regions_init(ret_regions, &fake_ref));
+	const rapi_error_t error = rapi_regions_load_bed(*ret_regions, path);
+	remove(path);
+	free(path);
+	return error;
+}
+
+static void test_regions_bed(void)
+{
+	rapi_regions* regions;
+	RT_CHECK_OK(_load_bed(
+	    "# a comment\n"
+	    "browser position ctg0:1-100\n"
+	    "track name=targets\n"
+	    "ctg1\t100\t200\tname\t0\t+\n"
+	    "ctg0 1000 1001\n"
+	    "\n"
+	    "ctg2\t5\t5\r\n",
+	    &regions));
+	RT_CHECK(rapi_regions_size(regions) == 3);
+	RT_CHECK_OK(rapi_regions_index(regions));
+	RT_CHECK(rapi_regions_overlaps(regions, 1, 150, 151) && !rapi_regions_overlaps(regions, 1, 200, 300));
+	RT_CHECK(rapi_regions_overlaps(regions, 0, 1000, 1001) && !rapi_regions_overlaps(regions, 0, 999, 1000));
+	RT_CHECK(!rapi_regions_overlaps(regions, 2, 0, 5) && !rapi_regions_overlaps(regions, 2, 6, 10));
+	rapi_regions_free(regions);
+
+	const char* bad[] = {
+		"ctg0\t100\t200\nchrX\t0\t10\n", // not in the reference
+		"ctg0\t100\n",                   // no end
+		"ctg0\t200\t100\n",              // end before start
+		"ctg0\t-1\t100\n",
+		"ctg0\t1x\t100\n",
+	};
+	for (size_t b = 0; b < sizeof(bad) / sizeof(bad[0]); ++b) {
+		RT_CHECK(_load_bed(bad[b], &regions) == RAPI_PARAM_ERROR);
+		rapi_regions_free(regions);
+	}
+
+	RT_CHECK_OK(rapi_regions_init(&regions, &fake_ref));
+	RT_CHECK(rapi_regions_load_bed(regions, "no_such_file.bed") == RAPI_GENERIC_ERROR);
+	rapi_regions_free(regions);
+}
+
+/* Give `read` one alignment at `pos` (1-based) on contig 0 with `n_ops` cigar operations. */
+static void _align_at(rapi_read* read, int pos, int secondary, const rapi_cigar* ops, int n_ops)
+{
+	rapi_alignment* alns = realloc(read->alignments, (read->n_alignments + 1) * sizeof(alns[0]));
+	if (NULL == alns)
+		exit(2);
+	read->alignments = alns;
+	rapi_alignment* aln = &alns[read->n_alignments++];
+	memset(aln, 0, sizeof(*aln));
+	aln->cigar_ops = malloc(n_ops * sizeof(rapi_cigar));
+	if (NULL == aln->cigar_ops)
+		exit(2);
+	memcpy(aln->cigar_ops, ops, n_ops * sizeof(rapi_cigar));
+	aln->n_cigar_ops = n_ops;
+	aln->contig = &contigs[0];
+	aln->pos = pos;
+	aln->mapped = 1;
+	aln->secondary_aln = secondary;
+}
+
+/* Alignments are judged by their reference span;  secondary alignments and unmapped reads don't count. */
+static void test_regions_fragment_overlaps(void)
+{
+	rapi_regions* regions;
+	RT_CHECK_OK(rapi_regions_init(&regions, &fake_ref));
+	RT_CHECK_OK(rapi_regions_add(regions, 0, 1000, 1100));
+	RT_CHECK_OK(rapi_regions_index(regions));
+
+	rapi_batch batch;
+	RT_CHECK_OK(rapi_reads_alloc(&batch, 2, 1));
+	RT_CHECK_OK(rapi_set_read(&batch, 0, 0, "frag", "ACGT", "IIII", 33));
+	RT_CHECK_OK(rapi_set_read(&batch, 0, 1, "frag", "ACGT", "IIII", 33));
+	rapi_read* reads = rapi_get_read(&batch, 0, 0);
+	RT_CHECK(!rapi_regions_fragment_overlaps(regions, reads, 2)); // unmapped
+
+	// 5S40M10D5I: 50 bases of reference, 951-1000 in SAM coordinates, 950-999 here
+	const rapi_cigar ops[] = { { RAPI_CIG_S, 5 }, { RAPI_CIG_M, 40 }, { RAPI_CIG_D, 10 }, { RAPI_CIG_I, 5 } };
+	_align_at(&reads[0], 951, 0, ops, 4);
+	RT_CHECK(!rapi_regions_fragment_overlaps(regions, reads, 2));
+	_align_at(&reads[1], 1050, 1, ops, 4); // secondary
+	RT_CHECK(!rapi_regions_fragment_overlaps(regions, reads, 2));
+	_align_at(&reads[1], 1101, 0, ops, 4); // starts at the end of the region
+	RT_CHECK(!rapi_regions_fragment_overlaps(regions, reads, 2));
+	reads[0].alignments[0].pos = 952; // its last base is the region's first
+	RT_CHECK(rapi_regions_fragment_overlaps(regions, reads, 2));
+	RT_CHECK(!rapi_regions_fragment_overlaps(regions, reads + 1, 1));
+	reads[1].alignments[1].pos = 1100 - 49;
+	RT_CHECK(rapi_regions_fragment_overlaps(regions, reads + 1, 1));
+
+	rapi_reads_free(&batch);
+	rapi_regions_free(regions);
+}
+
+/* Regions covering the first half of the mini reference. */
+static rapi_regions* _first_half(void)
+{
+	int len;
+	free(rt_mini_ref_seq(&len));
+	rapi_regions* regions;
+	RT_CHECK_OK(rapi_regions_init(&regions, &ref));
+	RT_CHECK_OK(rapi_regions_add(regions, 0, 0, len / 2));
+	RT_CHECK_OK(rapi_regions_index(regions));
+	return regions;
+}
+
+/*
+ * Align a copy of `expected` with `regions`, then again from the result
+ * cache, and check the marks against the alignments in `expected`:  a
+ * fragment is off target if none of its hits overlaps a region, so it
+ * can't have an alignment (secondary ones too) well into them.  Hits below
+ * the output threshold count as well, so the converse isn't checked.
+ * Off-target fragments lose their alignments with `drop`;  the others keep
+ * the same alignments.
+ */
+static void _check_filter(const rapi_batch* expected, const rapi_regions* regions, int drop)
+{
+	int len;
+	free(rt_mini_ref_seq(&len));
+	const int64_t margin = 1000; // more than the insert size:  rescued mates stay on the same side
+
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "result_cache_size", expected->n_frags);
+	rapi_aligner_state* state;
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_aligner_state_set_regions(state, regions, drop));
+
+	for (int pass = 0; pass < 2; ++pass) { // the second one from the cache
+		rapi_batch batch;
+		rt_copy_batch(&batch, expected);
+		RT_CHECK_OK(rapi_align_reads(&ref, &batch, 0, batch.n_frags, state));
+
+		int n_off_target = 0, n_wrong = 0;
+		for (int f = 0; f < batch.n_frags; ++f) {
+			int64_t min_pos = INT64_MAX;
+			for (int r = 0; r < 2; ++r) {
+				const rapi_read* read = rapi_get_read(expected, f, r);
+				for (int a = 0; a < read->n_alignments; ++a) {
+					if (read->alignments[a].mapped && read->alignments[a].pos < min_pos)
+						min_pos = read->alignments[a].pos;
+				}
+			}
+			const rapi_read* reads = rapi_get_read(&batch, f, 0);
+			const int off_target = reads[0].off_target;
+			n_off_target += off_target;
+			n_wrong += reads[1].off_target != off_target;
+			if (min_pos < len / 2 - margin)
+				n_wrong += off_target;
+			for (int r = 0; r < 2; ++r) {
+				if (drop && off_target)
+					n_wrong += reads[r].n_alignments != 0;
+				else
+					n_wrong += !rt_same_alignments(&reads[r], rapi_get_read(expected, f, r));
+			}
+		}
+		RT_CHECK(n_wrong == 0);
+		RT_CHECK(n_off_target > 0 && n_off_target < batch.n_frags);
+		rapi_reads_free(&batch);
+	}
+
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+}
+
+static void test_regions_filter(void)
+{
+	rapi_batch expected;
+	rt_simulated_pairs(&expected, 600, 100, 300, 48);
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rt_align(&ref, &expected, &opts));
+	rapi_opts_free(&opts);
+
+	rapi_regions* regions = _first_half();
+	_check_filter(&expected, regions, 0);
+	_check_filter(&expected, regions, 1);
+	rapi_regions_free(regions);
+	rapi_reads_free(&expected);
+
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_regions_init(&regions, &ref));
+	RT_CHECK(rapi_aligner_state_set_regions(state, regions, 0) == RAPI_PARAM_ERROR); // not indexed
+	rapi_regions_free(regions);
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+}
+
+int main(void)
+{
+	rt_init();
+
+	RT_RUN(test_regions_same_as_scan);
+	RT_RUN(test_regions_nested);
+	RT_RUN(test_regions_errors);
+	RT_RUN(test_regions_bed);
+	RT_RUN(test_regions_fragment_overlaps);
+
+	rt_load_mini_ref(&ref);
+	RT_RUN(test_regions_filter);
+	rapi_ref_free(&ref);
+
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,109 @@
+/*
+ * test_reorder.c
+ *
+ * Minimizer reordering of the fragments of a batch (reorder_reads).
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#define N_FRAGS 1000
+
+static rapi_ref ref;
+
+static void _align(rapi_batch* batch, int reorder, int batched_seeding)
+{
+	rapi_opts opts;
+	rt_opts_init(&opts, 3);
+	rt_set_param(&opts, "reorder_reads", reorder);
+	rt_set_param(&opts, "batched_seeding", batched_seeding);
+	RT_CHECK_OK(rt_align(&ref, batch, &opts));
+	rapi_opts_free(&opts);
+}
+
+/* Fill `se` with the first reads of the fragments of `pe`. */
+static void _first_reads(rapi_batch* se, const rapi_batch* pe)
+{
+	if (rapi_reads_alloc(se, 1, pe->n_frags) != RAPI_NO_ERROR)
+		exit(2);
+	for (rapi_ssize_t f = 0; f < pe->n_frags; ++f) {
+		const rapi_read* read = rapi_get_read(pe, f, 0);
+		if (rapi_set_read(se, f, 0, read->id, read->seq, read->qual, 33) != RAPI_NO_ERROR)
+			exit(2);
+	}
+}
+
+static void test_reorder_same_alignments_pe(void)
+{
+	rapi_batch plain, reordered;
+	rt_simulated_pairs(&plain, N_FRAGS, 100, 300, 29);
+	rt_copy_batch(&reordered, &plain);
+
+	_align(&plain, 0, 0);
+	_align(&reordered, 1, 0);
+	RT_CHECK(rt_n_mapped(&reordered) == 2 * N_FRAGS);
+	// every fragment still gets its own alignments, in its own slots
+	RT_CHECK(rt_same_batch_alignments(&plain, &reordered));
+
+	rapi_reads_free(&reordered);
+	rapi_reads_free(&plain);
+}
+
+static void test_reorder_same_alignments_se(void)
+{
+	rapi_batch pairs, plain, reordered;
+	rt_simulated_pairs(&pairs, N_FRAGS, 100, 300, 290);
+	_first_reads(&plain, &pairs);
+	_first_reads(&reordered, &pairs);
+
+	_align(&plain, 0, 0);
+	_align(&reordered, 1, 0);
+	RT_CHECK(rt_same_batch_alignments(&plain, &reordered));
+
+	rapi_reads_free(&reordered);
+	rapi_reads_free(&plain);
+	rapi_reads_free(&pairs);
+}
+
+static void test_reorder_with_batched_seeding(void)
+{
+	rapi_batch plain, reordered;
+	rt_simulated_pairs(&plain, N_FRAGS, 100, 300, 2900);
+	rt_copy_batch(&reordered, &plain);
+
+	_align(&plain, 0, 0);
+	_align(&reordered, 1, 1);
+	RT_CHECK(rt_same_batch_alignments(&plain, &reordered));
+
+	rapi_reads_free(&reordered);
+	rapi_reads_free(&plain);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_reorder_same_alignments_pe);
+	RT_RUN(test_reorder_same_alignments_se);
+	RT_RUN(test_reorder_with_batched_seeding);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,214 @@
+/*
+ * test_rescue.c
+ *
+ * Adaptive mate rescue (adaptive_rescue, adaptive_rescue_min_score,
+ * adaptive_rescue_max_sw):  it runs less mate-SW than the plain rescue,
+ * checked with the rescue counters, and places the pairs the same way.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FRAGS 400
+
+static rapi_ref ref;
+
+typedef struct {
+	long attempted, successful, skipped, capped, cells;
+} rescue_stats;
+
+/*
+ * Simulated pairs, a quarter of them discordant (the second reads of pairs f
+ * and f + 4 swapped) and a quarter with a second read that only mate rescue
+ * can place (a mismatch every 12 bases leaves it no seed of BWA's minimum
+ * length, 19).  The others are concordant.
+ */
+static void _mixed_pairs(rapi_batch* batch, unsigned seed)
+{
+	char tmp[100];
+	rt_simulated_pairs(batch, N_FRAGS, 100, 300, seed);
+	for (rapi_ssize_t f = 0; f + 4 < batch->n_frags; f += 8) {
+		rapi_read* a = rapi_get_read(batch, f, 1);
+		rapi_read* b = rapi_get_read(batch, f + 4, 1);
+		memcpy(tmp, a->seq, 100);
+		memcpy(a->seq, b->seq, 100);
+		memcpy(b->seq, tmp, 100);
+	}
+	for (rapi_ssize_t f = 1; f < batch->n_frags; f += 4) {
+		rapi_read* read = rapi_get_read(batch, f, 1);
+		for (unsigned i = 6; i < read->length; i += 12)
+			read->seq[i] = read->seq[i] == 'A' ? 'C' : 'A';
+	}
+}
+
+static int _discordant(rapi_ssize_t f)
+{
+	return f % 4 == 0;
+}
+
+/*
+ * Align `batch` with adaptive_rescue set to `adaptive` (and its other
+ * parameters if positive) and return the rescue counters in `stats`.
+ */
+static void _align(rapi_batch* batch, int adaptive, double min_score, long max_sw, int batched, rescue_stats* stats)
+{
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "adaptive_rescue", adaptive);
+	rt_set_param(&opts, "batched_rescue", batched);
+	if (min_score > 0)
+		rt_set_param_dbl(&opts, "adaptive_rescue_min_score", min_score);
+	if (max_sw >= 0)
+		rt_set_param(&opts, "adaptive_rescue_max_sw", max_sw);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, batch, 0, batch->n_frags, state));
+	stats->attempted = rt_get_stat(state, "rescue_attempted");
+	stats->successful = rt_get_stat(state, "rescue_successful");
+	stats->skipped = rt_get_stat(state, "rescue_skipped");
+	stats->capped = rt_get_stat(state, "rescue_capped");
+	stats->cells = rt_get_stat(state, "rescue_cells");
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+}
+
+/*
+ * Whether `a` and `b` have the same alignments, but for the discordant
+ * pairs, where a plain rescue may add weak hits:  there only the primary
+ * positions must match.
+ */
+static int _same_alignments(const rapi_batch* a, const rapi_batch* b)
+{
+	for (rapi_ssize_t f = 0; f < a->n_frags; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			const rapi_read* ra = rapi_get_read(a, f, r);
+			const rapi_read* rb = rapi_get_read(b, f, r);
+			if (!_discordant(f) && !rt_same_alignments(ra, rb))
+				return 0;
+			if (_discordant(f) && (ra->n_alignments == 0 || rb->n_alignments == 0
+			        || ra->alignments[0].pos != rb->alignments[0].pos
+			        || ra->alignments[0].reverse_strand != rb->alignments[0].reverse_strand))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Adaptive rescue runs less mate-SW than the plain one, and rescues the same mates. */
+static void _check_saves_sw(int batched)
+{
+	rapi_batch plain, adaptive;
+	rescue_stats ps, as;
+	_mixed_pairs(&plain, 26);
+	rt_copy_batch(&adaptive, &plain);
+
+	_align(&plain, 0, 0, -1, batched, &ps);
+	_align(&adaptive, 1, 0, -1, batched, &as);
+	RT_CHECK(ps.attempted > 0 && ps.cells > 0 && ps.successful > 0);
+	RT_CHECK(ps.skipped == 0 && ps.capped == 0);
+	// the discordant pairs have both ends confidently placed
+	RT_CHECK(as.skipped > 0);
+	RT_CHECK(as.attempted < ps.attempted);
+	RT_CHECK(as.cells < ps.cells);
+	RT_CHECK(as.successful == ps.successful);
+	RT_CHECK(rt_n_mapped(&adaptive) == rt_n_mapped(&plain));
+	RT_CHECK(_same_alignments(&plain, &adaptive));
+
+	rapi_reads_free(&adaptive);
+	rapi_reads_free(&plain);
+}
+
+static void test_adaptive_rescue_saves_sw(void)
+{
+	_check_saves_sw(0);
+}
+
+static void test_adaptive_rescue_saves_sw_batched(void)
+{
+	_check_saves_sw(1);
+}
+
+/* The concordant pairs are left as they are. */
+static void test_adaptive_rescue_concordant(void)
+{
+	rapi_batch plain, adaptive;
+	rescue_stats ps, as;
+	rt_simulated_pairs(&plain, N_FRAGS, 100, 300, 260);
+	rt_copy_batch(&adaptive, &plain);
+	_align(&plain, 0, 0, -1, 0, &ps);
+	_align(&adaptive, 1, 0, -1, 0, &as);
+	RT_CHECK(as.attempted <= ps.attempted);
+	RT_CHECK(rt_n_mapped(&adaptive) == 2 * N_FRAGS);
+	RT_CHECK(rt_same_batch_alignments(&plain, &adaptive));
+	rapi_reads_free(&adaptive);
+	rapi_reads_free(&plain);
+}
+
+/* Pairs that aren't confidently placed get at most adaptive_rescue_max_sw mate-SW runs. */
+static void test_adaptive_rescue_max_sw(void)
+{
+	rapi_batch batch;
+	rescue_stats ps, stats;
+	_mixed_pairs(&batch, 2600);
+	_align(&batch, 0, 0, -1, 0, &ps);
+
+	// no read can reach more than its perfect score:  nothing is confidently placed
+	_align(&batch, 1, 1.01, 0, 0, &stats);
+	RT_CHECK(stats.skipped == 0 && stats.capped == 0);
+	RT_CHECK(stats.attempted == ps.attempted && stats.cells == ps.cells);
+
+	// with one run per pair, the discordant pairs can't look for both ends
+	_align(&batch, 1, 1.01, 1, 0, &stats);
+	RT_CHECK(stats.capped > 0 && stats.skipped > 0);
+	RT_CHECK(stats.attempted <= N_FRAGS);
+	RT_CHECK(stats.attempted < ps.attempted);
+	rapi_reads_free(&batch);
+}
+
+static void test_adaptive_rescue_mini_ref(void)
+{
+	rapi_batch plain, adaptive;
+	rescue_stats ps, as;
+	rt_mini_ref_pairs(&plain);
+	rt_copy_batch(&adaptive, &plain);
+	_align(&plain, 0, 0, -1, 0, &ps);
+	_align(&adaptive, 1, 0, -1, 0, &as);
+	RT_CHECK(as.attempted <= ps.attempted);
+	RT_CHECK(rt_n_mapped(&adaptive) == rt_n_mapped(&plain));
+	rapi_reads_free(&adaptive);
+	rapi_reads_free(&plain);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_adaptive_rescue_saves_sw);
+	RT_RUN(test_adaptive_rescue_saves_sw_batched);
+	RT_RUN(test_adaptive_rescue_concordant);
+	RT_RUN(test_adaptive_rescue_max_sw);
+	RT_RUN(test_adaptive_rescue_mini_ref);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
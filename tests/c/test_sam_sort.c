@@ -0,0 +1,165 @@
+/*
+ * test_sam_sort.c
+ *
+ * Coordinate sorting of SAM output (rapi_sam_sorter):  the records come out
+ * in the order of a stable sort of the unsorted output by contig and
+ * position, whether they fit in memory or are spilled to many runs.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_sam_sort.h>
+#include <rapi_utils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FRAGS 6000 // enough records for a parallel in-memory sort
+
+static rapi_ref ref;
+static rapi_batch batch; // aligned
+
+typedef struct {
+	char* line;
+	int contig; // index in ref;  ref.n_contigs for none
+	long pos;
+	size_t order; // in the unsorted output
+} sam_line;
+
+static int _cmp_lines(const void* pa, const void* pb)
+{
+	const sam_line* a = pa;
+	const sam_line* b = pb;
+	if (a->contig != b->contig)
+		return a->contig < b->contig ? -1 : 1;
+	if (a->pos != b->pos)
+		return a->pos < b->pos ? -1 : 1;
+	return a->order < b->order ? -1 : a->order > b->order;
+}
+
+/* The contig and position in columns 3 and 4 of a SAM record. */
+static void _parse_coords(sam_line* l)
+{
+	const char* rname = strchr(l->line, '\t');
+	rname = rname ? strchr(rname + 1, '\t') : NULL;
+	l->contig = ref.n_contigs;
+	l->pos = 0;
+	if (NULL == rname || rname[1] == '*')
+		return;
+	++rname;
+	const size_t len = strcspn(rname, "\t");
+	for (int c = 0; c < ref.n_contigs; ++c) {
+		if (strlen(ref.contigs[c].name) == len && strncmp(ref.contigs[c].name, rname, len) == 0)
+			l->contig = c;
+	}
+	l->pos = atol(rname + len + 1);
+}
+
+/* The records of fragments [0, N_FRAGS) of `batch`, stable-sorted by coordinate;  the lines point into `text`. */
+static sam_line* _expected_order(size_t* n_lines, kstring_t* text)
+{
+	for (rapi_ssize_t f = 0; f < N_FRAGS; ++f) {
+		RT_CHECK_OK(rapi_format_sam_b(&batch, f, text));
+		kputc('\n', text);
+	}
+
+	size_t m = 0;
+	for (size_t i = 0; i < text->l; ++i)
+		m += text->s[i] == '\n';
+	sam_line* lines = calloc(m, sizeof(*lines));
+	*n_lines = 0;
+	for (char* p = strtok(text->s, "\n"); p; p = strtok(NULL, "\n")) {
+		lines[*n_lines].line = p;
+		lines[*n_lines].order = *n_lines;
+		_parse_coords(&lines[*n_lines]);
+		*n_lines += 1;
+	}
+	qsort(lines, *n_lines, sizeof(*lines), _cmp_lines);
+	return lines;
+}
+
+/* Sort the batch, added in slices of `slice` fragments, with `mem_budget` and `n_threads`. */
+static void _check_sort(size_t mem_budget, int n_threads, int slice)
+{
+	rapi_sam_sorter* sorter;
+	RT_CHECK_OK(rapi_sam_sorter_init(&sorter, &ref, mem_budget, NULL, n_threads));
+	for (int f = 0; f < N_FRAGS; f += slice)
+		RT_CHECK_OK(rapi_sam_sorter_add_batch(sorter, &batch, f, f + slice < N_FRAGS ? f + slice : N_FRAGS));
+	FILE* out = tmpfile();
+	RT_CHECK(out != NULL);
+	RT_CHECK_OK(rapi_sam_sorter_finish(sorter, out));
+	RT_CHECK(rapi_sam_sorter_add_batch(sorter, &batch, 0, 1) != RAPI_NO_ERROR); // finished
+	RT_CHECK_OK(rapi_sam_sorter_free(sorter));
+
+	kstring_t text = { 0, 0, NULL };
+	size_t n_expected;
+	sam_line* expected = _expected_order(&n_expected, &text);
+
+	rewind(out);
+	char line[1 << 16];
+	size_t n = 0;
+	int n_wrong = 0;
+	RT_CHECK(fgets(line, sizeof(line), out) && strncmp(line, "@HD", 3) == 0 && strstr(line, "SO:coordinate"));
+	while (fgets(line, sizeof(line), out)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '@' || line[0] == '\0')
+			continue;
+		if (n >= n_expected || strcmp(line, expected[n].line) != 0)
+			n_wrong += 1;
+		n += 1;
+	}
+	RT_CHECK(n == n_expected && n_wrong == 0);
+	fclose(out);
+
+	free(expected);
+	free(text.s);
+}
+
+static void test_sort_in_memory(void)
+{
+	_check_sort(64 << 20, 1, N_FRAGS);
+	_check_sort(64 << 20, 3, 1000);
+}
+
+static void test_sort_spilled(void)
+{
+	_check_sort(1 << 20, 2, 500); // a few runs
+	_check_sort(8 << 10, 2, 25);  // more runs than are kept open
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+	rt_simulated_pairs(&batch, N_FRAGS, 100, 300, 44);
+	rapi_opts opts;
+	rt_opts_init(&opts, 4);
+	if (rt_align(&ref, &batch, &opts) != RAPI_NO_ERROR)
+		return 2;
+	rapi_opts_free(&opts);
+
+	RT_RUN(test_sort_in_memory);
+	RT_RUN(test_sort_spilled);
+
+	rapi_reads_free(&batch);
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,294 @@
+/*
+ * test_scatter.c
+ *
+ * Per-contig SAM output (rapi_scatter):  every record reaches the file of
+ * its read's contig, in order, with more streams than files kept open and
+ * a buffer smaller than the streams' floors;  names that would share a
+ * file are refused.  Uses an in-memory reference with many contigs and
+ * alignments made up by the test, so it needs no index.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "test_utils.h"
+
+#include <rapi_scatter.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define N_CONTIGS 150 // more than the files kept open
+#define N_FRAGS 3000
+#define READ_LEN 50
+#define N_GROUPS 3
+
+static rapi_ref ref;
+static rapi_contig contigs[N_CONTIGS];
+static rapi_batch batch;
+static char* prefix;
+
+static void _init_ref(void)
+{
+	for (int c = 0; c < N_CONTIGS; ++c) {
+		kstring_t name = { 0, 0, NULL };
+		ksprintf(&name, "ctg%d", c);
+		contigs[c].name = name.s;
+		contigs[c].len = 100000;
+	}
+	ref.path = "in-memory";
+	ref.n_contigs = N_CONTIGS;
+	ref.contigs = contigs;
+}
+
+static void _place(rapi_read* read, int contig, int pos)
+{
+	read->alignments = calloc(1, sizeof(rapi_alignment));
+	read->alignments[0].cigar_ops = malloc(sizeof(rapi_cigar));
+	if (NULL == read->alignments || NULL == read->alignments[0].cigar_ops)
+		exit(2);
+	read->n_alignments = 1;
+	rapi_alignment* aln = &read->alignments[0];
+	aln->contig = &contigs[contig];
+	aln->pos = pos;
+	aln->mapq = 60;
+	aln->score = READ_LEN;
+	aln->mapped = aln->paired = 1;
+	aln->cigar_ops[0].op = RAPI_CIG_M;
+	aln->cigar_ops[0].len = READ_LEN;
+	aln->n_cigar_ops = 1;
+}
+
+/*
+ * Every 10th fragment is unmapped, and the second read of every 7th one has
+ * no alignments, so it goes with its mate.
+ */
+static void _init_batch(void)
+{
+	char seq[READ_LEN + 1], qual[READ_LEN + 1], id[32];
+	memset(seq, 'A', READ_LEN);
+	memset(qual, 'I', READ_LEN);
+	seq[READ_LEN] = qual[READ_LEN] = '\0';
+	if (rapi_reads_alloc(&batch, 2, N_FRAGS) != RAPI_NO_ERROR)
+		exit(2);
+	for (int f = 0; f < N_FRAGS; ++f) {
+		snprintf(id, sizeof(id), "frag%d", f);
+		for (int r = 0; r < 2; ++r) {
+			if (rapi_set_read(&batch, f, r, id, seq, qual, 33) != RAPI_NO_ERROR)
+				exit(2);
+		}
+		if (f % 10 == 0)
+			continue;
+		const int contig = (f * 7) % N_CONTIGS;
+		_place(rapi_get_read(&batch, f, 0), contig, 1000 + f);
+		if (f % 7 != 0)
+			_place(rapi_get_read(&batch, f, 1), contig, 1200 + f);
+	}
+}
+
+/* The contig a read's record goes with, or -1 for the unmapped stream. */
+static int _read_contig(rapi_ssize_t f, int r)
+{
+	const rapi_read* read = rapi_get_read(&batch, f, r);
+	const rapi_read* mate = rapi_get_read(&batch, f, 1 - r);
+	if (read->n_alignments > 0)
+		return read->alignments[0].contig - contigs;
+	if (mate->n_alignments > 0)
+		return mate->alignments[0].contig - contigs;
+	return -1;
+}
+
+/*
+ * Check the file of stream `name`:  the header, then `n_expected` records
+ * in fragment order, each of whose contig has `*in_stream` non-zero (or
+ * RNAME "*" for the unmapped stream, if `in_stream` is NULL).
+ */
+static void _check_file(const char* name, const char* in_stream, int n_expected)
+{
+	kstring_t path = { 0, 0, NULL };
+	ksprintf(&path, "%s%s.sam", prefix, name);
+	FILE* f = fopen(path.s, "r");
+	RT_CHECK(f != NULL);
+	if (NULL == f) {
+		free(path.s);
+		return;
+	}
+
+	char line[1024];
+	int n_sq = 0, n_records = 0, n_wrong = 0, last_frag = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '@') {
+			n_sq += strncmp(line, "@SQ", 3) == 0;
+			continue;
+		}
+		int frag;
+		char rname[64];
+		if (sscanf(line, "frag%d\t%*d\t%63s", &frag, rname) != 2) {
+			n_wrong += 1;
+			continue;
+		}
+		int contig = -1;
+		if (strcmp(rname, "*") != 0)
+			sscanf(rname, "ctg%d", &contig);
+		if (frag < last_frag || (in_stream ? contig < 0 || !in_stream[contig] : contig >= 0))
+			n_wrong += 1;
+		last_frag = frag;
+		n_records += 1;
+	}
+	fclose(f);
+	RT_CHECK(n_sq == N_CONTIGS);
+	RT_CHECK(n_records == n_expected && n_wrong == 0);
+	remove(path.s);
+	free(path.s);
+}
+
+typedef struct {
+	int n_done;
+	int n_wrong; // called for a path that doesn't exist
+} done_log;
+
+static void _log_done(const char* name, const char* path, void* user_data)
+{
+	(void)name;
+	done_log* log = user_data;
+	log->n_done += 1;
+	log->n_wrong += access(path, F_OK) != 0;
+}
+
+/* Scatter the batch, added in slices of 100 fragments, with the given grouping. */
+static void _scatter(int n_groups, const int* contig_group, const char* const* group_names, size_t buffer_size)
+{
+	rapi_scatter* scatter;
+	RT_CHECK_OK(rapi_scatter_init(&scatter, &ref, prefix, n_groups, contig_group, group_names, buffer_size));
+	for (int f = 0; f < N_FRAGS; f += 100)
+		RT_CHECK_OK(rapi_scatter_add_batch(scatter, &batch, f, f + 100));
+	done_log log = { 0, 0 };
+	RT_CHECK_OK(rapi_scatter_close(scatter, _log_done, &log));
+	RT_CHECK(log.n_done == (n_groups > 0 ? n_groups : N_CONTIGS) + 1 && log.n_wrong == 0);
+	RT_CHECK(rapi_scatter_add_batch(scatter, &batch, 0, 1) != RAPI_NO_ERROR); // closed
+	RT_CHECK_OK(rapi_scatter_free(scatter));
+}
+
+/* Expected records per contig (the last entry for the unmapped stream). */
+static void _count_records(int* n_records)
+{
+	memset(n_records, 0, (N_CONTIGS + 1) * sizeof(n_records[0]));
+	for (int f = 0; f < N_FRAGS; ++f) {
+		for (int r = 0; r < 2; ++r) {
+			const int c = _read_contig(f, r);
+			n_records[c >= 0 ? c : N_CONTIGS] += 1;
+		}
+	}
+}
+
+static void test_scatter_per_contig(void)
+{
+	int n_records[N_CONTIGS + 1];
+	_count_records(n_records);
+
+	const size_t buffer_sizes[] = { 16 << 20, 64 << 10 }; // then less than 4 kB per stream
+	for (int b = 0; b < 2; ++b) {
+		_scatter(0, NULL, NULL, buffer_sizes[b]);
+		char in_stream[N_CONTIGS];
+		for (int c = 0; c < N_CONTIGS; ++c) {
+			memset(in_stream, 0, sizeof(in_stream));
+			in_stream[c] = 1;
+			_check_file(contigs[c].name, in_stream, n_records[c]);
+		}
+		_check_file("unmapped", NULL, n_records[N_CONTIGS]);
+	}
+}
+
+static void test_scatter_groups(void)
+{
+	int n_records[N_CONTIGS + 1];
+	_count_records(n_records);
+	int contig_group[N_CONTIGS];
+	for (int c = 0; c < N_CONTIGS; ++c)
+		contig_group[c] = c % N_GROUPS;
+	const char* const group_names[N_GROUPS] = { "g0", "g1", "g2" };
+
+	_scatter(N_GROUPS, contig_group, group_names, 32 << 10);
+	for (int g = 0; g < N_GROUPS; ++g) {
+		char in_stream[N_CONTIGS];
+		int n_expected = 0;
+		for (int c = 0; c < N_CONTIGS; ++c) {
+			in_stream[c] = contig_group[c] == g;
+			n_expected += in_stream[c] ? n_records[c] : 0;
+		}
+		_check_file(group_names[g], in_stream, n_expected);
+	}
+	_check_file("unmapped", NULL, n_records[N_CONTIGS]);
+}
+
+/* Without rapi_scatter_close, no files are left behind. */
+static void test_scatter_free_removes_files(void)
+{
+	rapi_scatter* scatter;
+	RT_CHECK_OK(rapi_scatter_init(&scatter, &ref, prefix, 0, NULL, NULL, 64 << 10));
+	RT_CHECK_OK(rapi_scatter_add_batch(scatter, &batch, 0, N_FRAGS));
+	RT_CHECK_OK(rapi_scatter_free(scatter));
+
+	int n_left = 0;
+	for (int c = 0; c < N_CONTIGS; ++c) {
+		kstring_t path = { 0, 0, NULL };
+		ksprintf(&path, "%s%s.sam.tmp", prefix, contigs[c].name);
+		n_left += access(path.s, F_OK) == 0;
+		free(path.s);
+	}
+	RT_CHECK(n_left == 0);
+}
+
+static void test_scatter_colliding_names(void)
+{
+	rapi_scatter* scatter;
+	char* saved[2] = { contigs[0].name, contigs[1].name };
+
+	contigs[0].name = "chrUn/1";
+	contigs[1].name = "chrUn_1";
+	RT_CHECK(rapi_scatter_init(&scatter, &ref, prefix, 0, NULL, NULL, 1 << 20) == RAPI_PARAM_ERROR);
+
+	contigs[1].name = "unmapped";
+	RT_CHECK(rapi_scatter_init(&scatter, &ref, prefix, 0, NULL, NULL, 1 << 20) == RAPI_PARAM_ERROR);
+
+	contigs[0].name = saved[0];
+	contigs[1].name = saved[1];
+	int contig_group[N_CONTIGS] = { 0 };
+	const char* const group_names[2] = { "g", "g" };
+	RT_CHECK(rapi_scatter_init(&scatter, &ref, prefix, 2, contig_group, group_names, 1 << 20) == RAPI_PARAM_ERROR);
+}
+
+int main(void)
+{
+	rt_init();
+	_init_ref();
+	_init_batch();
+	prefix = rt_tmp_path("scatter_");
+
+	RT_RUN(test_scatter_per_contig);
+	RT_RUN(test_scatter_groups);
+	RT_RUN(test_scatter_free_removes_files);
+	RT_RUN(test_scatter_colliding_names);
+
+	free(prefix);
+	rapi_reads_free(&batch);
+	for (int c = 0; c < N_CONTIGS; ++c)
+		free(contigs[c].name);
+	rapi_shutdown();
+	return RT_RESULT();
+}
@@ -0,0 +1,100 @@
+/*
+ * test_seeding.c
+ *
+ * Batched, prefetching seeding (batched_seeding).  Besides checking that it
+ * finds the same alignments as the plain path, this reports the throughput
+ * of both:  the mini reference fits in cache, so the numbers only show the
+ * overhead of the prefetch walk.  Use tools/rapi_align on a large reference
+ * for the speed-up.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_utils.h"
+
+#include <time.h>
+
+#define N_FRAGS 2000
+
+static rapi_ref ref;
+
+/* Align `batch` with batched_seeding set to `batched` and return the reads aligned per second. */
+static double _align(rapi_batch* batch, int batched)
+{
+	rapi_opts opts;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "batched_seeding", batched);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	RT_CHECK_OK(rt_align(&ref, batch, &opts));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	rapi_opts_free(&opts);
+	const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	return seconds > 0 ? batch->n_frags * batch->n_reads_frag / seconds : 0;
+}
+
+static void test_batched_seeding_same_alignments(void)
+{
+	rapi_batch plain, batched;
+	rt_simulated_pairs(&plain, N_FRAGS, 100, 300, 28);
+	rt_copy_batch(&batched, &plain);
+
+	const double plain_rate = _align(&plain, 0);
+	const double batched_rate = _align(&batched, 1);
+	RT_CHECK(rt_n_mapped(&batched) > 0);
+	RT_CHECK(rt_same_batch_alignments(&plain, &batched));
+	fprintf(stderr, "  plain seeding:   %.0f reads/s\n", plain_rate);
+	fprintf(stderr, "  batched seeding: %.0f reads/s\n", batched_rate);
+
+	rapi_reads_free(&batched);
+	rapi_reads_free(&plain);
+}
+
+/* A batch that doesn't fill the last chunk, with reads with Ns. */
+static void test_batched_seeding_partial_chunk(void)
+{
+	rapi_batch plain, batched;
+	rt_simulated_pairs(&plain, 21, 100, 300, 280);
+	rapi_read* read = rapi_get_read(&plain, 3, 0);
+	for (int i = 40; i < 45; ++i)
+		read->seq[i] = 'N';
+	rt_copy_batch(&batched, &plain);
+
+	_align(&plain, 0);
+	_align(&batched, 1);
+	RT_CHECK(rt_same_batch_alignments(&plain, &batched));
+
+	rapi_reads_free(&batched);
+	rapi_reads_free(&plain);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	RT_RUN(test_batched_seeding_same_alignments);
+	RT_RUN(test_batched_seeding_partial_chunk);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
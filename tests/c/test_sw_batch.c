@@ -0,0 +1,269 @@
+/*
+ * test_sw_batch.c
+ *
+ * The batched Smith-Waterman kernels (rapi_sw_batch.c) must give the same
+ * scores with every instruction set, and the same as BWA's ksw_align2;  mate
+ * rescue filtered with them (batched_rescue) must give the same alignments
+ * as the scalar path.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_utils.h"
+#include "rapi_sw_batch.h"
+
+#include <ksw.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_JOBS 300
+#define N_FRAGS 400
+
+static int8_t mat[25];
+static rapi_ref ref;
+
+// BWA's default scoring:  match 1, mismatch -4, N 0 against anything
+static void _fill_mat(int a, int b)
+{
+	for (int i = 0, k = 0; i < 5; ++i)
+		for (int j = 0; j < 5; ++j, ++k)
+			mat[k] = (i == 4 || j == 4) ? -1 : (i == j ? a : -b);
+}
+
+static uint8_t* _random_seq(int len, unsigned* seed)
+{
+	uint8_t* s = malloc(len > 0 ? len : 1);
+	for (int i = 0; i < len; ++i)
+		s[i] = rand_r(seed) % 50 == 0 ? 4 : rand_r(seed) % 4; // some Ns
+	return s;
+}
+
+/*
+ * Problems like mate rescue's:  the query is planted, with a few mutations
+ * and sometimes a gap, in a random target.  Some are unrelated, and sizes
+ * vary so that lane groups need padding.
+ */
+static void _make_jobs(rapi_sw_job* jobs, int n, unsigned seed)
+{
+	for (int k = 0; k < n; ++k) {
+		int qlen = 20 + rand_r(&seed) % 130;
+		int tlen = qlen + rand_r(&seed) % 600;
+		if (k % 11 == 0)
+			tlen = rand_r(&seed) % 10; // shorter than the query, even empty
+		uint8_t* query = _random_seq(qlen, &seed);
+		uint8_t* target = _random_seq(tlen, &seed);
+		if (k % 5 != 0 && tlen >= qlen) {
+			int at = rand_r(&seed) % (tlen - qlen + 1);
+			memcpy(target + at, query, qlen);
+			for (int m = rand_r(&seed) % 4; m > 0; --m)
+				target[at + rand_r(&seed) % qlen] = rand_r(&seed) % 4;
+			if (k % 3 == 0 && qlen > 40) // a deletion from the query
+				memmove(target + at + 20, target + at + 23, qlen - 23);
+		}
+		jobs[k].qlen = qlen;
+		jobs[k].query = query;
+		jobs[k].tlen = tlen;
+		jobs[k].target = target;
+	}
+}
+
+static void _free_jobs(rapi_sw_job* jobs, int n)
+{
+	for (int k = 0; k < n; ++k) {
+		free((uint8_t*)jobs[k].query);
+		free((uint8_t*)jobs[k].target);
+	}
+}
+
+/* Score `jobs` with every supported instruction set and compare with rapi_sw_score1. */
+static void _check_all_isas(const rapi_sw_job* jobs, int n, int o_del, int e_del, int o_ins, int e_ins)
+{
+	int* expected = malloc(n * sizeof(int));
+	int* scores = malloc(n * sizeof(int));
+	for (int k = 0; k < n; ++k)
+		expected[k] = rapi_sw_score1(&jobs[k], mat, o_del, e_del, o_ins, e_ins);
+
+	for (int isa = RAPI_SW_SCALAR; isa <= RAPI_SW_AVX2; ++isa) {
+		memset(scores, 0xff, n * sizeof(int));
+		int result = rapi_sw_batch_score_isa(isa, n, jobs, mat, o_del, e_del, o_ins, e_ins, scores);
+		if (result == -2) { // not in this build or on this CPU
+			RT_CHECK(isa != RAPI_SW_SCALAR);
+			RT_CHECK(isa > rapi_sw_batch_best_isa());
+			continue;
+		}
+		RT_CHECK(result == 0);
+		int n_diff = 0;
+		for (int k = 0; k < n; ++k)
+			n_diff += scores[k] != expected[k];
+		if (n_diff)
+			fprintf(stderr, "instruction set %d: %d of %d scores differ\n", isa, n_diff, n);
+		RT_CHECK(n_diff == 0);
+	}
+
+	memset(scores, 0xff, n * sizeof(int));
+	RT_CHECK(rapi_sw_batch_score(n, jobs, mat, o_del, e_del, o_ins, e_ins, scores) == 0);
+	RT_CHECK(memcmp(scores, expected, n * sizeof(int)) == 0);
+	free(scores);
+	free(expected);
+}
+
+static void test_isas_agree(void)
+{
+	rapi_sw_job jobs[N_JOBS];
+	_fill_mat(1, 4);
+	_make_jobs(jobs, N_JOBS, 27);
+	_check_all_isas(jobs, N_JOBS, 6, 1, 6, 1);
+	// asymmetric gap penalties
+	_check_all_isas(jobs, N_JOBS, 5, 2, 8, 1);
+	_free_jobs(jobs, N_JOBS);
+}
+
+static void test_isas_agree_big_scores(void)
+{
+	rapi_sw_job jobs[40];
+	// with this match score most groups' scores could overflow 16 bits
+	_fill_mat(300, 4);
+	_make_jobs(jobs, 40, 29);
+	_check_all_isas(jobs, 40, 6, 1, 6, 1);
+	_free_jobs(jobs, 40);
+}
+
+static void test_partial_groups(void)
+{
+	rapi_sw_job jobs[N_JOBS];
+	_fill_mat(1, 4);
+	_make_jobs(jobs, N_JOBS, 30);
+	// fewer problems than lanes, and group sizes that leave lanes unused
+	for (int n = 1; n <= 33; ++n)
+		_check_all_isas(jobs, n, 6, 1, 6, 1);
+	_free_jobs(jobs, N_JOBS);
+
+	RT_CHECK(rapi_sw_batch_score(0, NULL, mat, 6, 1, 6, 1, NULL) == 0);
+}
+
+/* The kernel scores are the ones ksw_align2, which mem_matesw calls, finds. */
+static void test_same_as_ksw(void)
+{
+	rapi_sw_job jobs[N_JOBS];
+	int scores[N_JOBS];
+	_fill_mat(1, 4);
+	_make_jobs(jobs, N_JOBS, 32);
+	RT_CHECK(rapi_sw_batch_score(N_JOBS, jobs, mat, 6, 1, 6, 1, scores) == 0);
+	int n_diff = 0, n_checked = 0;
+	for (int k = 0; k < N_JOBS; ++k) {
+		if (jobs[k].tlen == 0)
+			continue;
+		kswr_t r = ksw_align2(jobs[k].qlen, (uint8_t*)jobs[k].query, jobs[k].tlen, (uint8_t*)jobs[k].target,
+				5, mat, 6, 1, 6, 1, 0, NULL);
+		n_diff += r.score != scores[k];
+		n_checked += 1;
+	}
+	if (n_diff)
+		fprintf(stderr, "%d of %d scores differ from ksw_align2's\n", n_diff, n_checked);
+	RT_CHECK(n_diff == 0 && n_checked > N_JOBS / 2);
+	_free_jobs(jobs, N_JOBS);
+}
+
+/*
+ * Simulated pairs, with the second read of every third one given a mismatch
+ * every 12 bases:  it has no seed of BWA's minimum length (19), so only mate
+ * rescue can place it.
+ */
+static void _rescue_pairs(rapi_batch* batch, unsigned seed)
+{
+	rt_simulated_pairs(batch, N_FRAGS, 100, 300, seed);
+	for (rapi_ssize_t f = 0; f < batch->n_frags; f += 3) {
+		rapi_read* read = rapi_get_read(batch, f, 1);
+		for (unsigned i = 6; i < read->length; i += 12)
+			read->seq[i] = read->seq[i] == 'A' ? 'C' : 'A';
+	}
+}
+
+/* Align `batch` with batched_rescue set to `batched`;  return the rescue_filtered counter. */
+static long _align(rapi_batch* batch, int batched, int adaptive, long* n_rescued)
+{
+	rapi_opts opts;
+	rapi_aligner_state* state;
+	rt_opts_init(&opts, 2);
+	rt_set_param(&opts, "batched_rescue", batched);
+	rt_set_param(&opts, "adaptive_rescue", adaptive);
+	RT_CHECK_OK(rapi_aligner_state_init(&state, &opts));
+	RT_CHECK_OK(rapi_align_reads(&ref, batch, 0, batch->n_frags, state));
+	const long filtered = rt_get_stat(state, "rescue_filtered");
+	*n_rescued = rt_get_stat(state, "rescue_successful");
+	rapi_aligner_state_free(state);
+	rapi_opts_free(&opts);
+	return filtered;
+}
+
+/* Mate rescue filtered by the batched scores aligns as the scalar path does. */
+static void _check_batched_rescue(int adaptive)
+{
+	rapi_batch scalar, batched;
+	long scalar_rescued, batched_rescued;
+	_rescue_pairs(&scalar, 270 + adaptive);
+	rt_copy_batch(&batched, &scalar);
+
+	RT_CHECK(_align(&scalar, 0, adaptive, &scalar_rescued) == 0);
+	RT_CHECK(_align(&batched, 1, adaptive, &batched_rescued) > 0);
+	RT_CHECK(scalar_rescued > 0 && batched_rescued == scalar_rescued);
+	RT_CHECK(rt_n_mapped(&batched) == rt_n_mapped(&scalar));
+	RT_CHECK(rt_same_batch_alignments(&scalar, &batched));
+
+	rapi_reads_free(&batched);
+	rapi_reads_free(&scalar);
+}
+
+static void test_batched_rescue_same_alignments(void)
+{
+	_check_batched_rescue(0);
+	_check_batched_rescue(1);
+}
+
+static void test_exact_match_score(void)
+{
+	unsigned seed = 31;
+	_fill_mat(1, 4);
+	uint8_t* seq = _random_seq(100, &seed);
+	for (int i = 0; i < 100; ++i)
+		seq[i] &= 3; // no Ns
+	rapi_sw_job job = { 100, seq, 100, seq };
+	int score = -1;
+	RT_CHECK(rapi_sw_batch_score(1, &job, mat, 6, 1, 6, 1, &score) == 0);
+	RT_CHECK(score == 100);
+	free(seq);
+}
+
+int main(void)
+{
+	rt_init();
+	rt_load_mini_ref(&ref);
+
+	fprintf(stderr, "best instruction set: %d\n", rapi_sw_batch_best_isa());
+	RT_RUN(test_isas_agree);
+	RT_RUN(test_isas_agree_big_scores);
+	RT_RUN(test_partial_groups);
+	RT_RUN(test_exact_match_score);
+	RT_RUN(test_same_as_ksw);
+	RT_RUN(test_batched_rescue_same_alignments);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	return RT_RESULT();
+}
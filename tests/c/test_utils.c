@@ -0,0 +1,293 @@
+/*
+ * test_utils.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_utils.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int rt_n_failures = 0;
+
+void rt_opts_init(rapi_opts* opts, int n_threads)
+{
+	if (rapi_opts_init(opts) != RAPI_NO_ERROR) {
+		fprintf(stderr, "rapi_opts_init failed\n");
+		exit(2);
+	}
+	opts->n_threads = n_threads;
+}
+
+void rt_init(void)
+{
+	rapi_opts opts;
+	rt_opts_init(&opts, 1);
+	if (rapi_init(&opts) != RAPI_NO_ERROR) {
+		fprintf(stderr, "rapi_init failed\n");
+		exit(2);
+	}
+	rapi_opts_free(&opts);
+}
+
+static rapi_param* _new_param(rapi_opts* opts, const char* name)
+{
+	rapi_param* p = kv_pushp(rapi_param, opts->parameters);
+	rapi_param_init(p);
+	rapi_param_set_name(p, name);
+	return p;
+}
+
+void rt_set_param(rapi_opts* opts, const char* name, long value)
+{
+	rapi_param_set_long(_new_param(opts, name), value);
+}
+
+void rt_set_param_dbl(rapi_opts* opts, const char* name, double value)
+{
+	rapi_param_set_dbl(_new_param(opts, name), value);
+}
+
+long rt_get_stat(const rapi_aligner_state* state, const char* name)
+{
+	rapi_param_list stats;
+	kv_init(stats);
+	long value = -1;
+	if (rapi_aligner_state_get_stats(state, &stats) == RAPI_NO_ERROR) {
+		for (int i = 0; i < kv_size(stats); ++i) {
+			if (strcmp(rapi_param_get_name(&kv_A(stats, i)), name) == 0)
+				rapi_param_get_long(&kv_A(stats, i), &value);
+		}
+	}
+	rapi_param_list_free(&stats);
+	return value;
+}
+
+void rt_load_mini_ref(rapi_ref* ref)
+{
+	if (rapi_ref_load(RT_MINI_REF, ref) != RAPI_NO_ERROR) {
+		fprintf(stderr, "Couldn't load %s\n", RT_MINI_REF);
+		exit(2);
+	}
+}
+
+char* rt_mini_ref_seq(int* len)
+{
+	FILE* f = fopen(RT_MINI_REF, "r");
+	if (NULL == f) {
+		fprintf(stderr, "Couldn't open %s\n", RT_MINI_REF);
+		exit(2);
+	}
+	size_t size = 0, cap = 1 << 16;
+	char* seq = malloc(cap);
+	char line[1024];
+	while (seq && fgets(line, sizeof(line), f)) {
+		if (line[0] == '>')
+			continue;
+		for (char* c = line; *c; ++c) {
+			if (isspace((unsigned char)*c))
+				continue;
+			if (size + 1 >= cap)
+				seq = realloc(seq, cap *= 2);
+			if (NULL == seq)
+				break;
+			seq[size++] = toupper((unsigned char)*c);
+		}
+	}
+	fclose(f);
+	if (NULL == seq) {
+		fprintf(stderr, "Out of memory reading %s\n", RT_MINI_REF);
+		exit(2);
+	}
+	seq[size] = '\0';
+	*len = size;
+	return seq;
+}
+
+void rt_mini_ref_pairs(rapi_batch* batch)
+{
+	FILE* f = fopen(RT_MINI_REF_SEQS, "r");
+	if (NULL == f) {
+		fprintf(stderr, "Couldn't open %s\n", RT_MINI_REF_SEQS);
+		exit(2);
+	}
+	char line[2048];
+	int n = 0;
+	while (fgets(line, sizeof(line), f))
+		++n;
+	rewind(f);
+
+	if (rapi_reads_alloc(batch, 2, n) != RAPI_NO_ERROR)
+		exit(2);
+	for (int frag = 0; frag < n && fgets(line, sizeof(line), f); ++frag) {
+		char* fields[5];
+		char* save = NULL;
+		fields[0] = strtok_r(line, "\t\n", &save);
+		for (int k = 1; k < 5; ++k)
+			fields[k] = strtok_r(NULL, "\t\n", &save);
+		if (rapi_set_read(batch, frag, 0, fields[0], fields[1], fields[2], 33) != RAPI_NO_ERROR
+		    || rapi_set_read(batch, frag, 1, fields[0], fields[3], fields[4], 33) != RAPI_NO_ERROR)
+			exit(2);
+	}
+	fclose(f);
+}
+
+static void _rev_comp(const char* src, int len, char* dst)
+{
+	for (int i = 0; i < len; ++i) {
+		char c = src[len - 1 - i];
+		dst[i] = c == 'A' ? 'T' : c == 'C' ? 'G' : c == 'G' ? 'C' : c == 'T' ? 'A' : 'N';
+	}
+	dst[len] = '\0';
+}
+
+static void _mutate(char* read, int len, unsigned* seed)
+{
+	static const char bases[] = "ACGT";
+	if (rand_r(seed) % 4 == 0) // a quarter of the reads are exact
+		return;
+	int pos = rand_r(seed) % len;
+	char c;
+	do
+		c = bases[rand_r(seed) % 4];
+	while (c == read[pos]);
+	read[pos] = c;
+}
+
+void rt_simulated_pairs(rapi_batch* batch, int n_frags, int read_len, int isize, unsigned seed)
+{
+	int ref_len;
+	char* ref = rt_mini_ref_seq(&ref_len);
+	char* r1 = malloc(read_len + 1);
+	char* r2 = malloc(read_len + 1);
+	char* qual = malloc(read_len + 1);
+	if (NULL == r1 || NULL == r2 || NULL == qual || rapi_reads_alloc(batch, 2, n_frags) != RAPI_NO_ERROR)
+		exit(2);
+	memset(qual, 'I', read_len);
+	qual[read_len] = '\0';
+
+	for (int f = 0; f < n_frags; ++f) {
+		int len = isize - isize / 10 + rand_r(&seed) % (isize / 5 + 1);
+		int pos = rand_r(&seed) % (ref_len - len);
+		memcpy(r1, ref + pos, read_len);
+		r1[read_len] = '\0';
+		_rev_comp(ref + pos + len - read_len, read_len, r2);
+		_mutate(r1, read_len, &seed);
+		_mutate(r2, read_len, &seed);
+		char name[32];
+		snprintf(name, sizeof(name), "sim_%06d", f);
+		if (rapi_set_read(batch, f, 0, name, r1, qual, 33) != RAPI_NO_ERROR
+		    || rapi_set_read(batch, f, 1, name, r2, qual, 33) != RAPI_NO_ERROR)
+			exit(2);
+	}
+	free(qual);
+	free(r2);
+	free(r1);
+	free(ref);
+}
+
+void rt_copy_batch(rapi_batch* dst, const rapi_batch* src)
+{
+	if (rapi_reads_alloc(dst, src->n_reads_frag, src->n_frags) != RAPI_NO_ERROR)
+		exit(2);
+	for (rapi_ssize_t f = 0; f < src->n_frags; ++f) {
+		for (int r = 0; r < src->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(src, f, r);
+			if (rapi_set_read(dst, f, r, read->id, read->seq, read->qual, 33) != RAPI_NO_ERROR)
+				exit(2);
+		}
+	}
+}
+
+rapi_error_t rt_align(const rapi_ref* ref, rapi_batch* batch, const rapi_opts* opts)
+{
+	rapi_aligner_state* state;
+	rapi_error_t error = rapi_aligner_state_init(&state, opts);
+	if (error != RAPI_NO_ERROR)
+		return error;
+	error = rapi_align_reads(ref, batch, 0, batch->n_frags, state);
+	rapi_aligner_state_free(state);
+	return error;
+}
+
+int rt_same_alignments(const rapi_read* a, const rapi_read* b)
+{
+	if (a->n_alignments != b->n_alignments)
+		return 0;
+	for (int k = 0; k < a->n_alignments; ++k) {
+		const rapi_alignment* x = &a->alignments[k];
+		const rapi_alignment* y = &b->alignments[k];
+		if (x->mapped != y->mapped || x->paired != y->paired || x->prop_paired != y->prop_paired
+		    || x->reverse_strand != y->reverse_strand || x->secondary_aln != y->secondary_aln
+		    || x->pos != y->pos || x->score != y->score || x->mapq != y->mapq
+		    || x->n_mismatches != y->n_mismatches || x->n_cigar_ops != y->n_cigar_ops)
+			return 0;
+		if ((x->contig == NULL) != (y->contig == NULL)
+		    || (x->contig && strcmp(x->contig->name, y->contig->name) != 0))
+			return 0;
+		for (int c = 0; c < x->n_cigar_ops; ++c) {
+			if (x->cigar_ops[c].op != y->cigar_ops[c].op || x->cigar_ops[c].len != y->cigar_ops[c].len)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+int rt_same_batch_alignments(const rapi_batch* a, const rapi_batch* b)
+{
+	if (a->n_frags != b->n_frags || a->n_reads_frag != b->n_reads_frag)
+		return 0;
+	for (rapi_ssize_t f = 0; f < a->n_frags; ++f) {
+		for (int r = 0; r < a->n_reads_frag; ++r) {
+			if (!rt_same_alignments(rapi_get_read(a, f, r), rapi_get_read(b, f, r))) {
+				fprintf(stderr, "alignments of fragment %lld, read %d differ\n", (long long)f, r);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+int rt_n_mapped(const rapi_batch* batch)
+{
+	int n = 0;
+	for (rapi_ssize_t f = 0; f < batch->n_frags; ++f) {
+		for (int r = 0; r < batch->n_reads_frag; ++r) {
+			const rapi_read* read = rapi_get_read(batch, f, r);
+			n += read->n_alignments > 0 && read->alignments[0].mapped;
+		}
+	}
+	return n;
+}
+
+char* rt_tmp_path(const char* name)
+{
+	const char* dir = getenv("TMPDIR");
+	if (NULL == dir || *dir == '\0')
+		dir = "/tmp";
+	const size_t size = strlen(dir) + strlen(name) + 64;
+	char* path = malloc(size);
+	if (NULL == path)
+		exit(2);
+	snprintf(path, size, "%s/rapi_test_%ld_%s", dir, (long)getpid(), name);
+	return path;
+}
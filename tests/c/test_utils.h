@@ -0,0 +1,116 @@
+/*
+ * test_utils.h
+ *
+ * Helpers shared by the C tests of the rapi_bwa plug-in.  The tests are
+ * run from this directory (make check), so data paths are relative to it.
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifndef __TEST_UTILS_H__
+#define __TEST_UTILS_H__
+
+#include <rapi.h>
+#include <stdio.h>
+
+#define RT_MINI_REF      "../mini_ref/mini_ref.fasta"
+#define RT_MINI_REF_SEQS "../mini_ref/mini_ref_seqs.txt"
+
+extern int rt_n_failures;
+
+#define RT_CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		rt_n_failures += 1; \
+	} \
+} while (0)
+
+#define RT_CHECK_OK(expr) do { \
+	rapi_error_t _rt_error = (expr); \
+	if (_rt_error != RAPI_NO_ERROR) { \
+		fprintf(stderr, "%s:%d: %s returned %s (%d)\n", __FILE__, __LINE__, #expr, rapi_error_name(_rt_error), _rt_error); \
+		rt_n_failures += 1; \
+	} \
+} while (0)
+
+#define RT_RUN(test) do { \
+	const int _rt_before = rt_n_failures; \
+	test(); \
+	fprintf(stderr, "%-50s %s\n", #test, rt_n_failures == _rt_before ? "ok" : "FAILED"); \
+} while (0)
+
+/* Exit status for main:  0 if all the checks passed. */
+#define RT_RESULT() (rt_n_failures == 0 ? 0 : 1)
+
+/* Initialize the library with the default options;  aborts the test program if it can't. */
+void rt_init(void);
+
+/* Initialize `opts` with the defaults and `n_threads`. */
+void rt_opts_init(rapi_opts* opts, int n_threads);
+
+/* Append an INT or REAL plug-in parameter to `opts`. */
+void rt_set_param(rapi_opts* opts, const char* name, long value);
+void rt_set_param_dbl(rapi_opts* opts, const char* name, double value);
+
+/* Value of the statistic `name` of `state`;  -1 if it isn't reported. */
+long rt_get_stat(const rapi_aligner_state* state, const char* name);
+
+/* Load the mini reference;  aborts the test program if it can't. */
+void rt_load_mini_ref(rapi_ref* ref);
+
+/*
+ * The sequence of the (single) contig of the mini reference, in upper case.
+ * The caller owns the string.
+ */
+char* rt_mini_ref_seq(int* len);
+
+/* Fill `batch` with the pairs in RT_MINI_REF_SEQS. */
+void rt_mini_ref_pairs(rapi_batch* batch);
+
+/*
+ * Fill `batch` with `n_frags` FR pairs simulated from the mini reference:
+ * reads of `read_len` bases from fragments of `isize` +/- 10% bases, with
+ * about one mismatch per read.  The same `seed` gives the same pairs.
+ */
+void rt_simulated_pairs(rapi_batch* batch, int n_frags, int read_len, int isize, unsigned seed);
+
+/* Fill `dst` with copies of the reads (not the alignments) of `src`. */
+void rt_copy_batch(rapi_batch* dst, const rapi_batch* src);
+
+/* Align the whole batch with a new aligner state created with `opts`. */
+rapi_error_t rt_align(const rapi_ref* ref, rapi_batch* batch, const rapi_opts* opts);
+
+/*
+ * Whether reads `a` and `b` have the same alignments:  same number, and each
+ * with the same contig, position, strand, flags, score, mapq and cigar.
+ * Tags are not compared.
+ */
+int rt_same_alignments(const rapi_read* a, const rapi_read* b);
+
+/* Whether all the reads of two batches with the same reads have the same alignments. */
+int rt_same_batch_alignments(const rapi_batch* a, const rapi_batch* b);
+
+/* Number of reads of `batch` with a mapped primary alignment. */
+int rt_n_mapped(const rapi_batch* batch);
+
+/*
+ * Path of a temporary file `name` for this test program.  The caller owns
+ * the string.
+ */
+char* rt_tmp_path(const char* name);
+
+#endif
@@ -0,0 +1,525 @@
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * rapi_align:  align FASTQ reads and write SAM to standard output.
+ *
+ *   rapi_align [options] REF FASTQ1 [FASTQ2]
+ *
+ *   -t N_THREADS
+ *   -b N      fragments per batch
+ *   -p NAME=VALUE   aligner-specific parameter
+ *   -i INDEX -c K   align only chunk K of a rapi_fqidx index
+ *   -D        mark duplicates (SAM flag 0x400) as fragments are aligned
+ *   -S        sort the output by coordinate
+ *   -m MB     memory for sorting before spilling to temporary files
+ *   -T DIR    directory for the temporary files
+ *   -O PREFIX write one SAM file per contig, PREFIXcontig.sam, instead
+ *   -G FILE   with -O, group contigs as in FILE's "CONTIG<TAB>GROUP" lines;
+ *             contigs that aren't listed get a file of their own
+ *   -L BED    keep only the fragments with a hit in the regions of BED;  the
+ *             others aren't converted or written
+ *   -U FILE   with -L, write the fragments outside the regions to FILE
+ *   -H FASTA  skip the fragments whose k-mers are mostly from the host genome
+ *             in FASTA (filter cached in FASTA.bloom);  they aren't written
+ *   -F FRAC   with -H, the fraction of host k-mers that makes a host fragment
+ *   -X FILE   with -H, write the host fragments (unaligned) to FILE
+ *   -o FILE   write the SAM output to FILE instead of standard output
+ *   -C FILE   with -o, checkpoint the run to FILE after every batch, and
+ *             resume from it if it exists (rapi_checkpoint.h);  a finished
+ *             run removes it.  The resumed run must use the same inputs and
+ *             batch size.  Not with -D, -S, -O, -U or -X, nor with the
+ *             result_cache_size or batch_deadline_ms parameters:  a resumed
+ *             run couldn't reproduce their output
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi.h>
+#include <rapi_checkpoint.h>
+#include <rapi_dupmark.h>
+#include <rapi_fastq.h>
+#include <rapi_host_filter.h>
+#include <rapi_regions.h>
+#include <rapi_sam_sort.h>
+#include <rapi_scatter.h>
+#include <rapi_utils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BATCH_SIZE 100000
+#define DEFAULT_SORT_MEM_MB 768
+#define SCATTER_BUFFER_MB 64
+#define DUPMARK_MEM_MB 4096
+#define DEFAULT_HOST_FRACTION 0.5
+
+enum { FRAG_OUTPUT, FRAG_OFF_TARGET, FRAG_HOST };
+
+static double elapsed_since(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-t N_THREADS] [-b BATCH_SIZE] [-p NAME=VALUE ...] [-i INDEX -c CHUNK] [-D]\n"
+	                "       %*s [-L BED [-U OFF_TARGET_SAM]] [-H HOST_FASTA [-F HOST_FRACTION] [-X HOST_SAM]]\n"
+	                "       %*s [-S [-m SORT_MEM_MB] [-T TMP_DIR] | -O PREFIX [-G GROUPS]] [-o OUT_SAM [-C CHECKPOINT]]\n"
+	                "       %*s REF FASTQ1 [FASTQ2]\n",
+	        prog, (int)strlen(prog), "", (int)strlen(prog), "", (int)strlen(prog), "");
+	exit(1);
+}
+
+static void add_param(rapi_opts* opts, char* arg, const char* prog)
+{
+	// aligner-specific parameter, e.g. -p batched_rescue=1
+	char* eq = strchr(arg, '=');
+	if (NULL == eq) usage(prog);
+	*eq = '\0';
+	rapi_param* p = kv_pushp(rapi_param, opts->parameters);
+	rapi_param_init(p);
+	rapi_param_set_name(p, arg);
+	char* end;
+	long integer = strtol(eq + 1, &end, 10);
+	if (*end == '\0')
+		rapi_param_set_long(p, integer);
+	else {
+		double real = strtod(eq + 1, &end);
+		if (*end != '\0') usage(prog); // only numeric parameters
+		rapi_param_set_dbl(p, real);
+	}
+}
+
+/* Whether `opts` sets the aligner-specific parameter `name` to a non-zero value. */
+static int param_set(const rapi_opts* opts, const char* name)
+{
+	for (size_t i = 0; i < kv_size(opts->parameters); ++i) {
+		const rapi_param* p = &kv_A(opts->parameters, i);
+		long integer;
+		double real;
+		if (strcmp(rapi_param_get_name(p), name) == 0)
+			return (rapi_param_get_long(p, &integer) == 0 && integer != 0)
+			    || (rapi_param_get_dbl(p, &real) == 0 && real != 0);
+	}
+	return 0;
+}
+
+/*
+ * Resume the run checkpointed in `cp`:  restore the aligner state, cut the
+ * output back to the checkpoint and skip the fragments already aligned.
+ */
+static rapi_error_t resume(const rapi_checkpoint* cp, int batch_size, rapi_aligner_state* state,
+    FILE* output, rapi_fastq_reader* reader, rapi_batch* batch)
+{
+	if (cp->n_inputs != 2 || cp->input_offsets[1] != batch_size) {
+		PERROR("The checkpoint is of a run with another batch size\n");
+		return RAPI_PARAM_ERROR;
+	}
+	rapi_error_t error = rapi_aligner_state_restore(state, cp->state.s, cp->state.l);
+	if (error == RAPI_NO_ERROR)
+		error = rapi_checkpoint_resume_output(cp, output);
+	// the reader can't seek:  read the batches again, cut as before
+	int64_t n_skipped = 0;
+	int n_frags = 1;
+	while (error == RAPI_NO_ERROR && n_skipped < cp->input_offsets[0] && n_frags > 0) {
+		error = rapi_fastq_read_batch(reader, batch, batch_size, &n_frags);
+		n_skipped += n_frags;
+	}
+	if (error == RAPI_NO_ERROR && n_skipped != cp->input_offsets[0]) {
+		PERROR("The input doesn't match the checkpoint\n");
+		error = RAPI_PARAM_ERROR;
+	}
+	if (error == RAPI_NO_ERROR)
+		fprintf(stderr, "Resuming after %lld batches (%lld fragments)\n",
+		        (long long)cp->n_batches, (long long)cp->input_offsets[0]);
+	return error;
+}
+
+/*
+ * Read the contig groups listed in `path`.  Contigs that aren't listed get
+ * a group of their own.
+ */
+static rapi_error_t read_groups(const char* path, const rapi_ref* ref,
+    int* n_groups, int** ret_contig_group, char*** ret_group_names)
+{
+	FILE* f = fopen(path, "r");
+	if (NULL == f) {
+		PERROR("Couldn't open %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+	int* contig_group = malloc((ref->n_contigs > 0 ? ref->n_contigs : 1) * sizeof(contig_group[0]));
+	char** names = calloc(ref->n_contigs > 0 ? ref->n_contigs : 1, sizeof(names[0]));
+	rapi_error_t error = contig_group && names ? RAPI_NO_ERROR : RAPI_MEMORY_ERROR;
+	for (int c = 0; error == RAPI_NO_ERROR && c < ref->n_contigs; ++c)
+		contig_group[c] = -1;
+
+	int n = 0;
+	char* line = NULL;
+	size_t line_size = 0;
+	while (error == RAPI_NO_ERROR && getline(&line, &line_size, f) > 0) {
+		char* contig = strtok(line, "\t\r\n");
+		char* group = strtok(NULL, "\t\r\n");
+		if (NULL == contig || contig[0] == '#')
+			continue;
+		int c = 0;
+		while (c < ref->n_contigs && strcmp(ref->contigs[c].name, contig) != 0)
+			++c;
+		if (NULL == group || c == ref->n_contigs || contig_group[c] >= 0) {
+			PERROR("Bad line for contig %s in %s\n", contig, path);
+			error = RAPI_PARAM_ERROR;
+			break;
+		}
+		int g = 0;
+		while (g < n && strcmp(names[g], group) != 0)
+			++g;
+		if (g == n && NULL == (names[n++] = strdup(group)))
+			error = RAPI_MEMORY_ERROR;
+		contig_group[c] = g;
+	}
+	free(line);
+	fclose(f);
+
+	// each listed group has at least one contig, so there's room for the rest
+	for (int c = 0; error == RAPI_NO_ERROR && c < ref->n_contigs; ++c) {
+		if (contig_group[c] < 0) {
+			contig_group[c] = n;
+			if (NULL == (names[n++] = strdup(ref->contigs[c].name)))
+				error = RAPI_MEMORY_ERROR;
+		}
+	}
+	if (error != RAPI_NO_ERROR) {
+		for (int g = 0; names && g < n; ++g)
+			free(names[g]);
+		free(names);
+		free(contig_group);
+		return error;
+	}
+	*n_groups = n;
+	*ret_contig_group = contig_group;
+	*ret_group_names = names;
+	return RAPI_NO_ERROR;
+}
+
+static rapi_error_t write_sam(const rapi_batch* batch, int start, int end, kstring_t* out, FILE* file)
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (int f = start; f < end && error == RAPI_NO_ERROR; ++f) {
+		out->l = 0;
+		error = rapi_format_sam_b(batch, f, out);
+		if (error == RAPI_NO_ERROR && (kputc('\n', out) < 0 || fputs(out->s, file) == EOF))
+			error = RAPI_GENERIC_ERROR;
+	}
+	return error;
+}
+
+static int fragment_class(const rapi_batch* batch, int frag)
+{
+	const rapi_read* read = rapi_get_read(batch, frag, 0);
+	return read->host ? FRAG_HOST : read->off_target ? FRAG_OFF_TARGET : FRAG_OUTPUT;
+}
+
+/* Open `path` for SAM output, with the header of `ref`;  `out` is scratch space. */
+static rapi_error_t open_sam(const char* path, const rapi_ref* ref, kstring_t* out, FILE** file)
+{
+	*file = fopen(path, "w");
+	out->l = 0;
+	if (NULL == *file) {
+		PERROR("Couldn't open %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+	rapi_error_t error = rapi_format_sam_hdr(ref, out);
+	if (error == RAPI_NO_ERROR && fprintf(*file, "%s\n", out->s) < 0)
+		error = RAPI_GENERIC_ERROR;
+	return error;
+}
+
+static void stream_done(const char* name, const char* path, void* user_data)
+{
+	(void)user_data;
+	fprintf(stderr, "Completed %s (%s)\n", path, name);
+}
+
+int main(int argc, char* argv[])
+{
+	rapi_opts opts;
+	int batch_size = DEFAULT_BATCH_SIZE;
+	const char* index_path = NULL;
+	int64_t chunk = -1;
+	int mark_duplicates = 0;
+	int sort = 0;
+	size_t sort_mem = (size_t)DEFAULT_SORT_MEM_MB << 20;
+	const char* tmp_dir = NULL;
+	const char* scatter_prefix = NULL;
+	const char* groups_path = NULL;
+	const char* bed_path = NULL;
+	const char* off_target_path = NULL;
+	const char* host_path = NULL;
+	double host_fraction = DEFAULT_HOST_FRACTION;
+	const char* host_out_path = NULL;
+	const char* out_path = NULL;
+	const char* checkpoint_path = NULL;
+	int c;
+
+	rapi_opts_init(&opts);
+	while ((c = getopt(argc, argv, "t:b:p:i:c:DSm:T:O:G:L:U:H:F:X:o:C:")) != -1) {
+		switch (c) {
+		case 't': opts.n_threads = atoi(optarg); break;
+		case 'b': batch_size = atoi(optarg); break;
+		case 'p': add_param(&opts, optarg, argv[0]); break;
+		case 'i': index_path = optarg; break;
+		case 'c': chunk = strtoll(optarg, NULL, 10); break;
+		case 'D': mark_duplicates = 1; break;
+		case 'S': sort = 1; break;
+		case 'm': sort_mem = strtoull(optarg, NULL, 10) << 20; break;
+		case 'T': tmp_dir = optarg; break;
+		case 'O': scatter_prefix = optarg; break;
+		case 'G': groups_path = optarg; break;
+		case 'L': bed_path = optarg; break;
+		case 'U': off_target_path = optarg; break;
+		case 'H': host_path = optarg; break;
+		case 'F': host_fraction = atof(optarg); break;
+		case 'X': host_out_path = optarg; break;
+		case 'o': out_path = optarg; break;
+		case 'C': checkpoint_path = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || argc - optind > 3 || batch_size < 1 || (index_path != NULL) != (chunk >= 0)
+	    || (sort && scatter_prefix) || (groups_path && !scatter_prefix) || (off_target_path && !bed_path)
+	    || (host_out_path && !host_path) || !(host_fraction > 0 && host_fraction <= 1)
+	    || (checkpoint_path && !out_path))
+		usage(argv[0]);
+	if (checkpoint_path && (mark_duplicates || sort || scatter_prefix || off_target_path || host_out_path
+	                        || param_set(&opts, "result_cache_size") || param_set(&opts, "batch_deadline_ms"))) {
+		PERROR("-C can't be used with -D, -S, -O, -U, -X, result_cache_size or batch_deadline_ms\n");
+		usage(argv[0]);
+	}
+	const char* ref_path = argv[optind];
+	const char* path1 = argv[optind + 1];
+	const char* path2 = argc - optind == 3 ? argv[optind + 2] : NULL;
+
+	if (rapi_init(&opts) != RAPI_NO_ERROR) {
+		PERROR("Failed to initialize the aligner\n");
+		return 1;
+	}
+
+	rapi_fastq_index* idx = NULL;
+	if (index_path && rapi_fastq_index_load(&idx, index_path) != RAPI_NO_ERROR)
+		return 1;
+	rapi_fastq_reader* reader;
+	if (rapi_fastq_reader_open(&reader, idx, path1, path2, chunk) != RAPI_NO_ERROR) {
+		PERROR("Couldn't open the input\n");
+		return 1;
+	}
+
+	rapi_ref ref;
+	rapi_aligner_state* state;
+	if (rapi_ref_load(ref_path, &ref) != RAPI_NO_ERROR) {
+		PERROR("Couldn't load reference %s\n", ref_path);
+		return 1;
+	}
+	rapi_error_t error = rapi_aligner_state_init(&state, NULL);
+	if (error != RAPI_NO_ERROR) {
+		PERROR("Failed to initialize the aligner state\n");
+		return 1;
+	}
+
+	// a checkpointed run appends to its output, after the checkpoint's end
+	rapi_checkpoint cp;
+	rapi_checkpoint_init(&cp);
+	int resuming = 0;
+	if (checkpoint_path) {
+		error = rapi_checkpoint_read(&cp, checkpoint_path);
+		resuming = error == RAPI_NO_ERROR;
+		if (error == RAPI_PARAM_ERROR) { // no checkpoint:  a fresh run
+			cp.n_inputs = 2;
+			cp.input_offsets[1] = batch_size;
+			error = RAPI_NO_ERROR;
+		}
+	}
+	FILE* out_file = stdout;
+	if (error == RAPI_NO_ERROR && out_path && NULL == (out_file = fopen(out_path, resuming ? "r+" : "w"))) {
+		PERROR("Couldn't open %s\n", out_path);
+		error = RAPI_GENERIC_ERROR;
+	}
+
+	rapi_sam_sorter* sorter = NULL;
+	rapi_scatter* scatter = NULL;
+	kstring_t out = { 0, 0, NULL };
+	if (error == RAPI_NO_ERROR && sort)
+		error = rapi_sam_sorter_init(&sorter, &ref, sort_mem, tmp_dir, opts.n_threads);
+	else if (error == RAPI_NO_ERROR && scatter_prefix) {
+		int n_groups = 0;
+		int* contig_group = NULL;
+		char** group_names = NULL;
+		if (groups_path)
+			error = read_groups(groups_path, &ref, &n_groups, &contig_group, &group_names);
+		if (error == RAPI_NO_ERROR)
+			error = rapi_scatter_init(&scatter, &ref, scatter_prefix, n_groups, contig_group,
+			    (const char* const*)group_names, (size_t)SCATTER_BUFFER_MB << 20);
+		for (int g = 0; g < n_groups; ++g)
+			free(group_names[g]);
+		free(group_names);
+		free(contig_group);
+	}
+	else if (error == RAPI_NO_ERROR && !resuming) {
+		error = rapi_format_sam_hdr(&ref, &out);
+		if (error == RAPI_NO_ERROR && fprintf(out_file, "%s\n", out.s) < 0)
+			error = RAPI_GENERIC_ERROR;
+	}
+
+	rapi_dupmark* dupmark = NULL;
+	if (error == RAPI_NO_ERROR && mark_duplicates)
+		error = rapi_dupmark_init(&dupmark, &ref, (size_t)DUPMARK_MEM_MB << 20, opts.n_threads);
+
+	// with -U the off-target fragments are converted as usual, to be written there
+	rapi_regions* regions = NULL;
+	FILE* off_target_file = NULL;
+	if (error == RAPI_NO_ERROR && bed_path) {
+		error = rapi_regions_init(&regions, &ref);
+		if (error == RAPI_NO_ERROR)
+			error = rapi_regions_load_bed(regions, bed_path);
+		if (error == RAPI_NO_ERROR)
+			error = rapi_regions_index(regions);
+		if (error == RAPI_NO_ERROR)
+			error = rapi_aligner_state_set_regions(state, regions, off_target_path == NULL);
+	}
+	if (error == RAPI_NO_ERROR && off_target_path)
+		error = open_sam(off_target_path, &ref, &out, &off_target_file);
+
+	rapi_host_filter* host_filter = NULL;
+	FILE* host_file = NULL;
+	if (error == RAPI_NO_ERROR && host_path) {
+		error = rapi_host_filter_open(&host_filter, host_path, RAPI_HOST_FILTER_DEFAULT_K, 0, opts.n_threads);
+		if (error == RAPI_NO_ERROR)
+			error = rapi_aligner_state_set_host_filter(state, host_filter, host_fraction);
+	}
+	if (error == RAPI_NO_ERROR && host_out_path)
+		error = open_sam(host_out_path, &ref, &out, &host_file);
+
+	rapi_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	if (error == RAPI_NO_ERROR)
+		error = rapi_reads_alloc(&batch, path2 ? 2 : 1, batch_size);
+	if (error == RAPI_NO_ERROR && resuming)
+		error = resume(&cp, batch_size, state, out_file, reader, &batch);
+	int n_frags = 0;
+	long long n_off_target = 0;
+	long long n_host = 0;
+	long long n_aligned = 0;
+	double align_seconds = 0; // in rapi_align_reads only, without I/O
+	while (error == RAPI_NO_ERROR
+	       && (error = rapi_fastq_read_batch(reader, &batch, batch_size, &n_frags)) == RAPI_NO_ERROR
+	       && n_frags > 0) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		error = rapi_align_reads(&ref, &batch, 0, n_frags, state);
+		align_seconds += elapsed_since(&start);
+		n_aligned += (long long)n_frags * batch.n_reads_frag;
+		// runs of on-target, non-host fragments go to the output;  the others
+		// are dropped or go to -U's or -X's file
+		for (int start = 0, end = 0; error == RAPI_NO_ERROR && start < n_frags; start = end) {
+			const int frag_class = fragment_class(&batch, start);
+			for (end = start + 1; end < n_frags && fragment_class(&batch, end) == frag_class; ++end)
+				;
+			if (frag_class == FRAG_OFF_TARGET) {
+				n_off_target += end - start;
+				if (off_target_file)
+					error = write_sam(&batch, start, end, &out, off_target_file);
+				continue;
+			}
+			if (frag_class == FRAG_HOST) {
+				n_host += end - start;
+				if (host_file)
+					error = write_sam(&batch, start, end, &out, host_file);
+				continue;
+			}
+			if (dupmark)
+				error = rapi_dupmark_batch(dupmark, &batch, start, end);
+			if (error == RAPI_NO_ERROR && sorter)
+				error = rapi_sam_sorter_add_batch(sorter, &batch, start, end);
+			else if (error == RAPI_NO_ERROR && scatter)
+				error = rapi_scatter_add_batch(scatter, &batch, start, end);
+			else if (error == RAPI_NO_ERROR)
+				error = write_sam(&batch, start, end, &out, out_file);
+		}
+		if (error == RAPI_NO_ERROR && checkpoint_path) {
+			cp.n_batches += 1;
+			cp.input_offsets[0] += n_frags;
+			error = rapi_checkpoint_commit(&cp, checkpoint_path, state, out_file);
+		}
+	}
+	if (error == RAPI_NO_ERROR && sorter)
+		error = rapi_sam_sorter_finish(sorter, out_file);
+	if (error == RAPI_NO_ERROR && scatter)
+		error = rapi_scatter_close(scatter, stream_done, NULL);
+	if (error == RAPI_NO_ERROR && fflush(out_file) != 0)
+		error = RAPI_GENERIC_ERROR;
+	if (out_file && out_file != stdout && fclose(out_file) != 0 && error == RAPI_NO_ERROR)
+		error = RAPI_GENERIC_ERROR;
+	if (error == RAPI_NO_ERROR && checkpoint_path)
+		remove(checkpoint_path); // the run is complete
+	if (off_target_file && fclose(off_target_file) != 0 && error == RAPI_NO_ERROR)
+		error = RAPI_GENERIC_ERROR;
+	if (host_file && fclose(host_file) != 0 && error == RAPI_NO_ERROR)
+		error = RAPI_GENERIC_ERROR;
+	if (error == RAPI_NO_ERROR)
+		fprintf(stderr, "Aligned %lld reads in %.2f s (%.0f reads/s)\n",
+		        n_aligned, align_seconds, align_seconds > 0 ? n_aligned / align_seconds : 0.0);
+	if (error == RAPI_NO_ERROR && regions)
+		fprintf(stderr, "Off target: %lld fragments%s\n", n_off_target, off_target_file ? "" : " (dropped)");
+	if (error == RAPI_NO_ERROR && host_filter)
+		fprintf(stderr, "Host: %lld fragments%s\n", n_host, host_file ? "" : " (dropped)");
+	if (error == RAPI_NO_ERROR && dupmark) {
+		rapi_dupmark_stats stats;
+		rapi_dupmark_get_stats(dupmark, &stats);
+		fprintf(stderr, "Duplicates: %llu of %llu pairs, %llu of %llu single ends"
+		        " (%llu kept ahead of a better copy, %llu not tracked)\n",
+		        (unsigned long long)stats.n_pair_duplicates, (unsigned long long)stats.n_pairs,
+		        (unsigned long long)stats.n_fragment_duplicates, (unsigned long long)stats.n_fragments,
+		        (unsigned long long)stats.n_late, (unsigned long long)stats.n_untracked);
+	}
+	if (error != RAPI_NO_ERROR)
+		PERROR("Alignment failed (%s)\n", rapi_error_name(error));
+
+	if (dupmark)
+		rapi_dupmark_free(dupmark);
+	if (regions)
+		rapi_regions_free(regions);
+	if (host_filter)
+		rapi_host_filter_free(host_filter);
+	if (sorter)
+		rapi_sam_sorter_free(sorter);
+	if (scatter)
+		rapi_scatter_free(scatter);
+	rapi_checkpoint_free(&cp);
+	free(out.s);
+	rapi_reads_free(&batch);
+	rapi_fastq_reader_close(reader);
+	if (idx)
+		rapi_fastq_index_free(idx);
+	rapi_aligner_state_free(state);
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	rapi_opts_free(&opts);
+	return error == RAPI_NO_ERROR ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * rapi_fqidx:  index the record-aligned split points of a FASTQ file, or of
+ * a pair of files, so that workers can each read their own chunks (see
+ * rapi_fastq.h).
+ *
+ *   rapi_fqidx [-r RECORDS_PER_CHUNK] [-t N_THREADS] [-s SPAN_MB] INDEX FASTQ1 [FASTQ2]
+ *   rapi_fqidx -l INDEX
+ *
+ * The second form lists the chunks:  number, first record, records and
+ * the uncompressed byte offset in each file.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi.h>
+#include <rapi_fastq.h>
+#include <rapi_utils.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_RECORDS_PER_CHUNK 1000000
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-r RECORDS_PER_CHUNK] [-t N_THREADS] [-s SPAN_MB] INDEX FASTQ1 [FASTQ2]\n", prog);
+	fprintf(stderr, "       %s -l INDEX\n", prog);
+	exit(1);
+}
+
+static int list_chunks(const char* index_path)
+{
+	rapi_fastq_index* idx;
+	if (rapi_fastq_index_load(&idx, index_path) != RAPI_NO_ERROR)
+		return 1;
+
+	const int n_files = rapi_fastq_index_n_files(idx);
+	for (int64_t k = 0; k < rapi_fastq_index_n_chunks(idx); ++k) {
+		int64_t first, n;
+		uint64_t offsets[2];
+		rapi_fastq_index_chunk(idx, k, &first, &n, offsets);
+		printf("%" PRId64 "\t%" PRId64 "\t%" PRId64, k, first, n);
+		for (int i = 0; i < n_files; ++i)
+			printf("\t%" PRIu64, offsets[i]);
+		printf("\n");
+	}
+	rapi_fastq_index_free(idx);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int64_t records_per_chunk = DEFAULT_RECORDS_PER_CHUNK;
+	uint64_t span = 0;
+	int n_threads = 1;
+	int list = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:t:s:l")) != -1) {
+		switch (c) {
+		case 'r':
+			records_per_chunk = strtoll(optarg, NULL, 10);
+			break;
+		case 't':
+			n_threads = atoi(optarg);
+			break;
+		case 's':
+			span = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (list) {
+		if (argc - optind != 1)
+			usage(argv[0]);
+		return list_chunks(argv[optind]);
+	}
+
+	if (argc - optind < 2 || argc - optind > 3 || records_per_chunk < 1)
+		usage(argv[0]);
+	const char* index_path = argv[optind];
+	const char* path1 = argv[optind + 1];
+	const char* path2 = argc - optind == 3 ? argv[optind + 2] : NULL;
+
+	rapi_fastq_index* idx;
+	if (rapi_fastq_index_build(&idx, path1, path2, records_per_chunk, span, n_threads) != RAPI_NO_ERROR) {
+		PERROR("Failed to index %s\n", path1);
+		return 1;
+	}
+	rapi_error_t error = rapi_fastq_index_save(idx, index_path);
+	if (error == RAPI_NO_ERROR)
+		fprintf(stderr, "%" PRId64 " records in %" PRId64 " chunks\n",
+		    rapi_fastq_index_n_records(idx), rapi_fastq_index_n_chunks(idx));
+	rapi_fastq_index_free(idx);
+	return error == RAPI_NO_ERROR ? 0 : 1;
+}